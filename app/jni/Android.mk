@@ -14,20 +14,103 @@
 #
 LOCAL_PATH := $(call my-dir)
 
-include $(CLEAR_VARS)
-
 TCPTESTER_SOURCES := \
-        raw_socket_tester.cpp \
         util.cpp \
+        packet_view.cpp \
         packet_builder.cpp \
         tcp_basic.cpp \
         testsuite.cpp \
-        proxy_testsuite.cpp
+        proxy_testsuite.cpp \
+        packet_capture.cpp \
+        sweep.cpp \
+        packet_meta.cpp \
+        pacer.cpp \
+        timer_wheel.cpp \
+        event_loop.cpp \
+        probe_engine.cpp \
+        port_allocator.cpp \
+        socket_pool.cpp \
+        result_cache.cpp \
+        test_planner.cpp \
+        task_pool.cpp \
+        bulk_transfer.cpp \
+        pmtu_probe.cpp \
+        ttl_locate.cpp \
+        header_diff.cpp \
+        test_fusion.cpp
+
+include $(CLEAR_VARS)
 
 LOCAL_MODULE    	:= tcptester
 LOCAL_CPPFLAGS	 	+= -std=c++11
 LOCAL_C_INCLUDES 	+= frameworks/base/include system/core/include
 LOCAL_LDLIBS 		:= -L$(SYSROOT)/usr/lib -llog -pthread
-LOCAL_SRC_FILES 	:= $(TCPTESTER_SOURCES)
+LOCAL_SRC_FILES 	:= raw_socket_tester.cpp $(TCPTESTER_SOURCES)
+
+include $(BUILD_EXECUTABLE)
+
+# Middlebox simulator, TUN device with the reflector behind configurable rewrites
+include $(CLEAR_VARS)
+
+LOCAL_MODULE    	:= tcptester-mbsim
+LOCAL_CPPFLAGS	 	+= -std=c++11
+LOCAL_C_INCLUDES 	+= frameworks/base/include system/core/include
+LOCAL_LDLIBS 		:= -L$(SYSROOT)/usr/lib -llog
+LOCAL_SRC_FILES 	:= middlebox_sim.cpp middlebox.cpp reflector.cpp util.cpp packet_view.cpp packet_builder.cpp
+
+include $(BUILD_EXECUTABLE)
+
+# Microbenchmarks of the per-packet hot paths, debug logging compiled out
+include $(CLEAR_VARS)
+
+LOCAL_MODULE    	:= tcptester-bench
+LOCAL_CPPFLAGS	 	+= -std=c++11 -O2 -DTCPTESTER_NO_DEBUG_LOG
+LOCAL_C_INCLUDES 	+= frameworks/base/include system/core/include
+LOCAL_LDLIBS 		:= -L$(SYSROOT)/usr/lib -llog -pthread
+LOCAL_SRC_FILES 	:= packet_bench.cpp reflector.cpp $(TCPTESTER_SOURCES)
+
+include $(BUILD_EXECUTABLE)
+
+# End-to-end probes/s benchmark over a veth pair with the reflector behind it
+include $(CLEAR_VARS)
+
+LOCAL_MODULE    	:= tcptester-probebench
+LOCAL_CPPFLAGS	 	+= -std=c++11 -O2 -DTCPTESTER_NO_DEBUG_LOG
+LOCAL_C_INCLUDES 	+= frameworks/base/include system/core/include
+LOCAL_LDLIBS 		:= -L$(SYSROOT)/usr/lib -llog -pthread
+LOCAL_SRC_FILES 	:= probe_bench.cpp reflector.cpp latency_histogram.cpp $(TCPTESTER_SOURCES)
+
+include $(BUILD_EXECUTABLE)
+
+# Offline replay of recorded captures through the current checkers
+include $(CLEAR_VARS)
+
+LOCAL_MODULE    	:= tcptester-replay
+LOCAL_CPPFLAGS	 	+= -std=c++11 -O2 -DTCPTESTER_NO_DEBUG_LOG
+LOCAL_C_INCLUDES 	+= frameworks/base/include system/core/include
+LOCAL_LDLIBS 		:= -L$(SYSROOT)/usr/lib -llog -pthread
+LOCAL_SRC_FILES 	:= replay_tool.cpp replay.cpp $(TCPTESTER_SOURCES)
+
+include $(BUILD_EXECUTABLE)
+
+# Truncated and corrupt captures through the replay reader
+include $(CLEAR_VARS)
+
+LOCAL_MODULE    	:= tcptester-replay-test
+LOCAL_CPPFLAGS	 	+= -std=c++11 -O2 -DTCPTESTER_NO_DEBUG_LOG
+LOCAL_C_INCLUDES 	+= frameworks/base/include system/core/include
+LOCAL_LDLIBS 		:= -L$(SYSROOT)/usr/lib -llog -pthread
+LOCAL_SRC_FILES 	:= replay_test.cpp replay.cpp $(TCPTESTER_SOURCES)
+
+include $(BUILD_EXECUTABLE)
+
+# The testsuite against a simulated network in virtual time
+include $(CLEAR_VARS)
+
+LOCAL_MODULE    	:= tcptester-netsim
+LOCAL_CPPFLAGS	 	+= -std=c++11 -O2 -DTCPTESTER_NO_DEBUG_LOG
+LOCAL_C_INCLUDES 	+= frameworks/base/include system/core/include
+LOCAL_LDLIBS 		:= -L$(SYSROOT)/usr/lib -llog -pthread
+LOCAL_SRC_FILES 	:= net_sim_tool.cpp net_sim.cpp middlebox.cpp reflector.cpp $(TCPTESTER_SOURCES)
 
-include $(BUILD_EXECUTABLE)
\ No newline at end of file
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,549 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <queue>
+
+#include <android/log.h>
+#include "bulk_transfer.hpp"
+#include "probe_engine.hpp"
+#include "port_allocator.hpp"
+#include "packet_view.hpp"
+
+using namespace std::placeholders;
+
+// ca_state of the sender
+enum bulk_ca_state {
+    bulk_ca_open,
+    bulk_ca_recovery,           // fast recovery until high_seq is acknowledged
+    bulk_ca_loss                // slow start again after a timeout
+};
+
+struct bulk_run {
+    struct event_loop loop;
+    struct probe_engine engine;
+    struct bulk_result *result;
+    bulk_direction direction;
+    uint32_t length;
+    struct sockaddr_in src, dst;
+    uint32_t destination;
+    uint16_t dst_port, src_port;
+    // Sender and receiver state, snd_* and rcv_* as in the kernel
+    struct tcp_opt conn;
+    uint16_t mss;
+    uint32_t request_seq;       // own sequence number of the request
+    bool request_acked;
+    uint32_t data_seq;          // sequence number of data byte 0, own or the reflector's
+    uint32_t end_seq;           // after the last data byte
+    uint32_t snd_max;           // highest sequence number sent, snd_nxt goes back on timeouts
+    std::map<uint32_t, uint32_t> rcv_ranges;    // download: received past a hole,
+                                                // start -> end offset from data_seq
+    uint32_t dupacks;
+    uint32_t timed_seq;         // one segment timed at a time, Karn's algorithm
+    uint64_t timed_us;
+    bool timing;
+    uint64_t started_us;
+    uint64_t progress_ms;
+    bool finished;
+    std::vector<char> packet;
+    struct wheel_timer rto_timer;
+};
+
+static inline bool seqBefore(uint32_t a, uint32_t b)
+{
+    return (int32_t) (a - b) < 0;
+}
+
+static uint64_t nowMicros()
+{
+    return monotonicNanos() / 1000;
+}
+
+// Window scale and MSS options, offered on the SYN
+static void addBulkOptions(struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state)
+{
+    char wscale[1] = {BULK_WSCALE};
+    appendTcpOption(TCPOPT_WINDOW, TCPOLEN_WINDOW, wscale, ip, tcp, conn_state);
+    char mss[2] = {(char) (BULK_MSS >> 8), (char) (BULK_MSS & 0xFF)};
+    appendTcpOption(TCPOPT_MAXSEG, TCPOLEN_MAXSEG, mss, ip, tcp, conn_state);
+}
+
+// Take the reflector's window scale and MSS from the SYNACK
+static test_error checkBulkSynAck(struct bulk_run *run, struct iphdr *ip, struct tcphdr *tcp,
+            struct tcp_opt *conn_state)
+{
+    struct packet_view view;
+    struct tcp_option_view option;
+    uint16_t offset = 0;
+    if (!viewPacket(ip, tcp, &view))
+        return invalid_packet;
+    run->mss = 536;
+    while (nextTcpOption(&view, &offset, &option)) {
+        if (option.kind == TCPOPT_WINDOW && option.length == TCPOLEN_WINDOW) {
+            run->conn.wscale_ok = 1;
+            run->conn.snd_wscale = std::min((int) option.data[0], 14);
+        } else if (option.kind == TCPOPT_MAXSEG && option.length == TCPOLEN_MAXSEG) {
+            run->mss = (option.data[0] << 8) | option.data[1];
+        }
+    }
+    run->mss = std::max(std::min(run->mss, (uint16_t) BULK_MSS), (uint16_t) 64);
+    run->result->wscale = run->conn.wscale_ok;
+    return success;
+}
+
+static void finishBulk(struct bulk_run *run, test_error verdict)
+{
+    if (run->finished)
+        return;
+    run->finished = true;
+    struct bulk_result *result = run->result;
+    result->verdict = verdict;
+    result->srtt_us = run->conn.srtt;
+    result->elapsed_us = nowMicros() - run->started_us;
+    if (result->elapsed_us > 0)
+        result->goodput_kbps = result->bytes * 8000 / result->elapsed_us;
+    eventLoopCancel(&run->loop, &run->rto_timer);
+    probeRelease(&run->engine, run->destination, run->dst_port, run->src_port);
+    eventLoopStop(&run->loop);
+}
+
+// Segment with the given part of the stream, the request before data_seq
+static void sendSegment(struct bulk_run *run, uint32_t seq, uint16_t length)
+{
+    struct iphdr *ip = (struct iphdr*) &run->packet[0];
+    struct tcphdr *tcp = (struct tcphdr*) (&run->packet[0] + IPHDRLEN);
+    buildTcpAck(&run->src, &run->dst, ip, tcp, seq, run->conn.rcv_nxt);
+    uint32_t window = run->conn.wscale_ok ? BULK_RCV_WINDOW >> BULK_WSCALE : std::min(BULK_RCV_WINDOW, 0xFFFF);
+    tcp->window = htons(window);
+    char *data = (char*) tcp + tcp->doff * 4;
+    for (uint16_t i = 0; i < length; i++) {
+        uint32_t offset = seq + i - run->request_seq;
+        if (offset < BULK_REQUEST_LEN) {
+            char request[BULK_REQUEST_LEN] = {'B', 'U', 'L', 'K', run->direction == bulk_upload ? 'U' : 'D',
+                (char) (run->length >> 24), (char) (run->length >> 16), (char) (run->length >> 8),
+                (char) run->length};
+            data[i] = request[offset];
+        } else {
+            data[i] = (char) ((offset - BULK_REQUEST_LEN) & 0xFF);
+        }
+    }
+    if (length > 0)
+        tcp->psh = 1;
+    ip->tot_len = htons(ntohs(ip->tot_len) + length);
+    recomputeTcpChecksum(ip, tcp);
+    probeSendSegment(&run->engine, run->destination, run->dst_port, run->src_port, &run->packet[0],
+        ntohs(ip->tot_len));
+}
+
+static void armRto(struct bulk_run *run)
+{
+    eventLoopTimer(&run->loop, &run->rto_timer, run->conn.rto);
+}
+
+// The timer without backoff
+static void resetRto(struct bulk_run *run)
+{
+    struct tcp_opt *conn = &run->conn;
+    uint32_t rto = (conn->srtt + std::max(4 * conn->mdev, (uint32_t) 1000) + 999) / 1000;
+    conn->rto = std::min(std::max(rto, (uint32_t) BULK_MIN_RTO_MS), (uint32_t) BULK_MAX_RTO_MS);
+}
+
+// RFC 6298, srtt and rttvar (in mdev) in microseconds, rto in milliseconds
+static void rttSample(struct bulk_run *run, uint64_t rtt_us)
+{
+    struct tcp_opt *conn = &run->conn;
+    if (conn->srtt == 0) {
+        conn->srtt = rtt_us;
+        conn->mdev = rtt_us / 2;
+    } else {
+        uint32_t delta = conn->srtt > rtt_us ? conn->srtt - rtt_us : rtt_us - conn->srtt;
+        conn->mdev = (3 * (uint64_t) conn->mdev + delta) / 4;
+        conn->srtt = (7 * (uint64_t) conn->srtt + rtt_us) / 8;
+    }
+    resetRto(run);
+}
+
+// Send what the congestion and the receive window allow
+static void sendData(struct bulk_run *run)
+{
+    struct tcp_opt *conn = &run->conn;
+    uint32_t window = std::min((uint64_t) conn->snd_cwnd * run->mss, (uint64_t) conn->snd_wnd);
+    while (seqBefore(conn->snd_nxt, run->end_seq)) {
+        uint32_t in_flight = conn->snd_nxt - conn->snd_una;
+        uint16_t length = std::min((uint32_t) run->mss, run->end_seq - conn->snd_nxt);
+        // Nothing in flight: one segment regardless, as a window probe
+        if (in_flight > 0 && in_flight + length > window)
+            break;
+        if (seqBefore(conn->snd_nxt, run->snd_max)) {
+            run->result->retransmits++;
+        } else if (!run->timing) {
+            run->timing = true;
+            run->timed_seq = conn->snd_nxt + length;
+            run->timed_us = nowMicros();
+        }
+        sendSegment(run, conn->snd_nxt, length);
+        run->result->segments++;
+        conn->snd_nxt += length;
+        if (seqBefore(run->snd_max, conn->snd_nxt))
+            run->snd_max = conn->snd_nxt;
+        if (in_flight == 0)
+            armRto(run);
+    }
+}
+
+static void retransmitFirst(struct bulk_run *run)
+{
+    struct tcp_opt *conn = &run->conn;
+    uint16_t length = std::min((uint32_t) run->mss, run->end_seq - conn->snd_una);
+    if (run->timing && seqBefore(conn->snd_una, run->timed_seq))
+        run->timing = false;
+    sendSegment(run, conn->snd_una, length);
+    run->result->retransmits++;
+}
+
+// NewReno on an ACK of the upload
+static void uploadAck(struct bulk_run *run, struct tcphdr *tcp, uint16_t data_length)
+{
+    struct tcp_opt *conn = &run->conn;
+    struct bulk_result *result = run->result;
+    uint32_t ack = ntohl(tcp->ack_seq);
+    if (seqBefore(run->snd_max, ack))
+        return;
+    bool window_changed = conn->snd_wnd != ((uint32_t) ntohs(tcp->window) << conn->snd_wscale);
+    conn->snd_wnd = (uint32_t) ntohs(tcp->window) << conn->snd_wscale;
+    result->peer_window = std::max(result->peer_window, conn->snd_wnd);
+
+    if (seqBefore(conn->snd_una, ack)) {
+        uint32_t acked = (ack - conn->snd_una + run->mss - 1) / run->mss;
+        conn->snd_una = ack;
+        if (seqBefore(conn->snd_nxt, ack))
+            conn->snd_nxt = ack;
+        if (run->timing && !seqBefore(ack, run->timed_seq)) {
+            rttSample(run, nowMicros() - run->timed_us);
+            run->timing = false;
+        }
+        conn->backoff = 0;
+        run->progress_ms = monotonicMillis();
+        result->bytes = seqBefore(run->data_seq, ack) ? ack - run->data_seq : 0;
+        if (conn->ca_state == bulk_ca_recovery && seqBefore(ack, conn->high_seq)) {
+            // Partial ACK: the next hole, window deflated by what was acknowledged
+            retransmitFirst(run);
+            conn->snd_cwnd = conn->snd_cwnd > acked ? conn->snd_cwnd - acked + 1 : 1;
+        } else {
+            if (conn->ca_state == bulk_ca_recovery) {
+                conn->snd_cwnd = conn->snd_ssthresh;
+                conn->ca_state = bulk_ca_open;
+            } else if (conn->ca_state == bulk_ca_loss && !seqBefore(ack, conn->high_seq)) {
+                conn->ca_state = bulk_ca_open;
+            }
+            run->dupacks = 0;
+            if (conn->snd_cwnd < conn->snd_ssthresh) {
+                // Slow start, appropriate byte counting with L = 2 (RFC 3465)
+                conn->snd_cwnd += std::min(acked, (uint32_t) 2);
+            } else {
+                conn->snd_cwnd_cnt += acked;
+                if (conn->snd_cwnd_cnt >= conn->snd_cwnd) {
+                    conn->snd_cwnd_cnt -= conn->snd_cwnd;
+                    conn->snd_cwnd++;
+                }
+            }
+        }
+        result->max_cwnd = std::max(result->max_cwnd, conn->snd_cwnd);
+        if (conn->snd_una == run->end_seq) {
+            finishBulk(run, success);
+            return;
+        }
+        armRto(run);
+    } else if (ack == conn->snd_una && data_length == 0 && !window_changed && run->snd_max != conn->snd_una) {
+        result->out_of_order++;
+        run->dupacks++;
+        if (conn->ca_state != bulk_ca_recovery && run->dupacks == 3) {
+            uint32_t in_flight = (run->snd_max - conn->snd_una) / run->mss;
+            conn->snd_ssthresh = std::max(in_flight / 2, (uint32_t) 2);
+            conn->high_seq = run->snd_max;
+            conn->ca_state = bulk_ca_recovery;
+            retransmitFirst(run);
+            conn->snd_cwnd = conn->snd_ssthresh + 3;
+        } else if (conn->ca_state == bulk_ca_recovery) {
+            conn->snd_cwnd++;
+        }
+    }
+    sendData(run);
+}
+
+static void sendAck(struct bulk_run *run)
+{
+    sendSegment(run, run->conn.snd_nxt, 0);
+}
+
+// Data up to rcv_nxt is in order, ranges past a hole wait for it
+static void downloadSegment(struct bulk_run *run, struct tcphdr *tcp, uint16_t data_length)
+{
+    struct tcp_opt *conn = &run->conn;
+    struct bulk_result *result = run->result;
+    if (seqBefore(conn->snd_nxt - 1, ntohl(tcp->ack_seq)) || data_length > 0)
+        run->request_acked = true;
+    result->peer_window = std::max(result->peer_window, (uint32_t) ntohs(tcp->window) << conn->snd_wscale);
+    if (data_length == 0)
+        return;
+    uint32_t seq = ntohl(tcp->seq);
+    result->segments++;
+    if (!seqBefore(conn->rcv_nxt, seq + data_length)) {
+        result->retransmits++;
+    } else {
+        if (seqBefore(conn->rcv_nxt, seq))
+            result->out_of_order++;
+        else if (result->bytes == 0 && conn->srtt == 0)
+            rttSample(run, nowMicros() - run->started_us);
+        uint32_t start = seqBefore(seq, conn->rcv_nxt) ? conn->rcv_nxt : seq;
+        uint32_t &end = run->rcv_ranges[start - run->data_seq];
+        end = std::max(end, std::min(seq + data_length - run->data_seq, run->length));
+        uint32_t received = conn->rcv_nxt - run->data_seq;
+        std::map<uint32_t, uint32_t>::iterator range = run->rcv_ranges.begin();
+        while (range != run->rcv_ranges.end() && range->first <= received) {
+            received = std::max(received, range->second);
+            run->rcv_ranges.erase(range++);
+        }
+        if (received != conn->rcv_nxt - run->data_seq) {
+            conn->rcv_nxt = run->data_seq + received;
+            result->bytes = received;
+            run->progress_ms = monotonicMillis();
+            conn->backoff = 0;
+            resetRto(run);
+        }
+    }
+    sendAck(run);
+    if (conn->rcv_nxt == run->end_seq)
+        finishBulk(run, success);
+    else
+        armRto(run);
+}
+
+static void bulkSegment(struct bulk_run *run, struct iphdr *ip, struct tcphdr *tcp,
+            const struct packet_meta *meta)
+{
+    struct packet_view view;
+    if (run->finished || !viewPacket(ip, tcp, &view))
+        return;
+    uint16_t data_length = view.payload_length;
+    if (tcp->syn) {
+        // Our ACK of the SYNACK got lost
+        sendAck(run);
+        return;
+    }
+    if (run->direction == bulk_download) {
+        downloadSegment(run, tcp, data_length);
+        return;
+    }
+    if (!run->request_acked) {
+        if (seqBefore(run->request_seq + BULK_REQUEST_LEN - 1, view.ack_seq)) {
+            run->request_acked = true;
+            run->conn.snd_una = run->conn.snd_nxt = run->snd_max = run->data_seq;
+            run->conn.snd_wnd = (uint32_t) view.window << run->conn.snd_wscale;
+            run->result->peer_window = run->conn.snd_wnd;
+            run->progress_ms = monotonicMillis();
+            if (run->conn.srtt == 0)
+                rttSample(run, nowMicros() - run->started_us);
+            sendData(run);
+        }
+        return;
+    }
+    uploadAck(run, tcp, data_length);
+}
+
+static void bulkTimeout(struct bulk_run *run)
+{
+    struct tcp_opt *conn = &run->conn;
+    struct bulk_result *result = run->result;
+    if (monotonicMillis() - run->progress_ms > BULK_STALL_MS) {
+        LOGE("Bulk transfer stalled at %llu of %u bytes", (unsigned long long) result->bytes, run->length);
+        finishBulk(run, receive_timeout);
+        return;
+    }
+    result->timeouts++;
+    conn->backoff++;
+    conn->rto = std::min(conn->rto * 2, (uint32_t) BULK_MAX_RTO_MS);
+    if (!run->request_acked) {
+        sendSegment(run, run->request_seq, BULK_REQUEST_LEN);
+    } else if (run->direction == bulk_download) {
+        // Duplicate ACKs for the reflector's fast retransmit
+        for (int i = 0; i < 3; i++)
+            sendAck(run);
+    } else {
+        uint32_t in_flight = (run->snd_max - conn->snd_una) / run->mss;
+        conn->snd_ssthresh = std::max(in_flight / 2, (uint32_t) 2);
+        conn->snd_cwnd = 1;
+        conn->snd_cwnd_cnt = 0;
+        conn->ca_state = bulk_ca_loss;
+        conn->high_seq = run->snd_max;
+        conn->snd_nxt = conn->snd_una;
+        run->dupacks = 0;
+        run->timing = false;
+        sendData(run);
+    }
+    armRto(run);
+}
+
+static void bulkEstablished(struct bulk_run *run, test_error result, const struct probe_timing *timing)
+{
+    if (result != success) {
+        run->result->verdict = result;
+        run->finished = true;
+        eventLoopStop(&run->loop);
+        return;
+    }
+    struct tcp_opt *conn = &run->conn;
+    struct tcp_opt established;
+    if (!probeStream(&run->engine, run->destination, run->dst_port, run->src_port,
+                std::bind(bulkSegment, run, _1, _2, _3), &established)) {
+        finishBulk(run, test_failed);
+        return;
+    }
+    if (!conn->wscale_ok)
+        conn->snd_wscale = 0;
+    conn->snd_nxt = established.snd_nxt;
+    conn->rcv_nxt = established.rcv_nxt;
+    conn->rto = BULK_INITIAL_RTO_MS;
+    if (timing != NULL && timing->handshake_rtt_us > 0)
+        rttSample(run, timing->handshake_rtt_us);
+    conn->snd_cwnd = BULK_INITIAL_CWND;
+    conn->snd_ssthresh = 0xFFFFFFFF;
+    conn->ca_state = bulk_ca_open;
+
+    run->request_seq = conn->snd_nxt;
+    if (run->direction == bulk_upload) {
+        run->data_seq = run->request_seq + BULK_REQUEST_LEN;
+        run->end_seq = run->data_seq + run->length;
+    } else {
+        conn->snd_nxt = run->request_seq + BULK_REQUEST_LEN;
+        run->data_seq = conn->rcv_nxt;
+        run->end_seq = run->data_seq + run->length;
+    }
+    run->started_us = nowMicros();
+    run->progress_ms = monotonicMillis();
+    sendSegment(run, run->request_seq, BULK_REQUEST_LEN);
+    armRto(run);
+}
+
+static void bulkReset(struct bulk_run *run)
+{
+    LOGE("Bulk transfer reset after %llu bytes", (unsigned long long) run->result->bytes);
+    run->result->verdict = protocol_error;
+    run->finished = true;
+    eventLoopCancel(&run->loop, &run->rto_timer);
+    eventLoopStop(&run->loop);
+}
+
+test_error runTest_bulk(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port,
+            bulk_direction direction, uint32_t length, struct bulk_result *result)
+{
+    memset(result, 0, sizeof(*result));
+    result->port = dst_port;
+    result->direction = direction;
+    result->verdict = test_failed;
+    if (length == 0)
+        return test_failed;
+
+    struct bulk_run run;
+    memset(&run.conn, 0, sizeof(run.conn));
+    run.result = result;
+    run.direction = direction;
+    run.length = length;
+    run.destination = destination;
+    run.src_port = src_port;
+    run.dst_port = dst_port;
+    run.src.sin_family = run.dst.sin_family = AF_INET;
+    run.src.sin_addr.s_addr = htonl(source);
+    run.src.sin_port = htons(src_port);
+    run.dst.sin_addr.s_addr = htonl(destination);
+    run.dst.sin_port = htons(dst_port);
+    run.mss = 536;
+    run.request_acked = false;
+    run.dupacks = 0;
+    run.timing = false;
+    run.finished = false;
+    run.started_us = nowMicros();
+    run.packet.assign(BUFLEN, 0);
+    if (!eventLoopInit(&run.loop))
+        return test_failed;
+    if (!probeEngineInit(&run.engine, &run.loop)) {
+        eventLoopClose(&run.loop);
+        return test_failed;
+    }
+    timerInit(&run.rto_timer, std::bind(bulkTimeout, &run));
+
+    std::queue<std::pair<packetModifier, packetChecker> > noSteps;
+    test_definition test = makeTestDefinition(std::bind(addBulkOptions, _1, _2, _3),
+        std::bind(checkBulkSynAck, &run, _1, _2, _3), noSteps);
+    if (probeHold(&run.engine, source, src_port, destination, dst_port, test,
+                std::bind(bulkEstablished, &run, _1, _2), std::bind(bulkReset, &run)))
+        eventLoopRun(&run.loop);
+    eventLoopCancel(&run.loop, &run.rto_timer);
+    probeEngineClose(&run.engine);
+    eventLoopClose(&run.loop);
+
+    LOGI("Bulk %s port %u: %s, %llu bytes in %llu ms, %llu kbit/s, %u segments, %u retransmitted,"
+        " %u out of order, %u timeouts, srtt %u us, window scaling %s", direction == bulk_upload ? "upload" : "download",
+        dst_port, result->verdict == success ? "done" : "failed", (unsigned long long) result->bytes,
+        (unsigned long long) result->elapsed_us / 1000, (unsigned long long) result->goodput_kbps,
+        result->segments, result->retransmits, result->out_of_order, result->timeouts, result->srtt_us,
+        result->wscale ? "on" : "off");
+    return result->verdict;
+}
+
+static void flagSlow(std::vector<struct bulk_result> &results, bulk_direction direction)
+{
+    std::vector<uint64_t> goodputs;
+    for (size_t i = 0; i < results.size(); i++)
+        if (results[i].direction == direction && results[i].verdict == success)
+            goodputs.push_back(results[i].goodput_kbps);
+    if (goodputs.size() < 2)
+        return;
+    std::sort(goodputs.begin(), goodputs.end());
+    uint64_t median = goodputs[goodputs.size() / 2];
+    for (size_t i = 0; i < results.size(); i++)
+        if (results[i].direction == direction && results[i].verdict == success
+                && results[i].goodput_kbps < median * BULK_SLOW_SHARE)
+            results[i].slow = true;
+}
+
+test_error runTest_bulkPorts(uint32_t source, uint32_t destination, const std::vector<uint16_t> &ports,
+            bool upload, bool download, uint32_t length, std::vector<struct bulk_result> &results)
+{
+    test_error ret = success;
+    results.clear();
+    for (size_t i = 0; i < ports.size(); i++) {
+        for (int d = 0; d < 2; d++) {
+            bulk_direction direction = d == 0 ? bulk_upload : bulk_download;
+            if ((direction == bulk_upload && !upload) || (direction == bulk_download && !download))
+                continue;
+            struct bulk_result result;
+            uint16_t src_port = allocatePort();
+            if (src_port == 0)
+                return test_failed;
+            if (runTest_bulk(source, src_port, destination, ports[i], direction, length, &result) != success)
+                ret = test_failed;
+            releasePort(src_port);
+            results.push_back(result);
+        }
+    }
+    flagSlow(results, bulk_upload);
+    flagSlow(results, bulk_download);
+    return ret;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <vector>
+
+#include "util.hpp"
+
+#ifndef BULK_TRANSFER_PROBE
+#define BULK_TRANSFER_PROBE
+
+// Bulk transfers to and from the reflector, for middleboxes that throttle,
+// buffer or shape larger flows. The SYN offers window scaling (shift
+// BULK_WSCALE) and an MSS of BULK_MSS. Once connected, a request segment,
+// "BULK", 'U' or 'D' and the length (32 bit), tells the reflector what to do:
+//      - upload: the engine sends with NewReno congestion control (RFC 5681,
+//        RFC 6582) and the RFC 6298 retransmission timer, kept in the
+//        snd_cwnd, snd_ssthresh, srtt, rto, ... fields of tcp_opt; the
+//        reflector acknowledges every segment
+//      - download: the reflector sends, clocked by the ACKs and limited by
+//        the BULK_RCV_WINDOW the engine advertises, and retransmits on
+//        duplicate ACKs; the engine acknowledges every segment, and repeats
+//        its ACK when the flow stalls
+// Byte i of the transferred data is i & 0xFF, both ways.
+
+#define BULK_WSCALE 7
+#define BULK_MSS 1460
+#define BULK_RCV_WINDOW (1 << 20)
+#define BULK_INITIAL_CWND 10
+#define BULK_INITIAL_RTO_MS 1000
+#define BULK_MIN_RTO_MS 200
+#define BULK_MAX_RTO_MS 30000
+// A transfer fails after this long without progress
+#define BULK_STALL_MS 15000
+// Ports below this share of the median goodput of a direction are slow
+#define BULK_SLOW_SHARE 0.5
+
+#define BULK_REQUEST_LEN 9
+
+enum bulk_direction {
+    bulk_upload,
+    bulk_download
+};
+
+struct bulk_result {
+    uint16_t port;
+    bulk_direction direction;
+    test_error verdict;
+    uint64_t bytes;             // delivered in order
+    uint64_t elapsed_us;        // from the request to the last byte delivered
+    uint64_t goodput_kbps;
+    uint32_t segments;          // data segments sent or received
+    uint32_t retransmits;       // segments sent again (upload) or received again (download)
+    uint32_t out_of_order;      // duplicate ACKs (upload), segments past a gap (download)
+    uint32_t timeouts;          // retransmission timeouts, stalls on download
+    uint32_t srtt_us;
+    uint32_t max_cwnd;          // segments, upload only
+    uint32_t peer_window;       // largest window the reflector advertised, scaled
+    bool wscale;                // window scaling negotiated
+    bool slow;                  // see BULK_SLOW_SHARE
+};
+
+// One transfer of length bytes in the given direction
+// return   success once all of it was delivered
+test_error runTest_bulk(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port,
+            bulk_direction direction, uint32_t length, struct bulk_result *result);
+// Transfers in the given directions on every port, one at a time so that
+// they do not compete, from source ports of the allocator. Results are in
+// port order, with the slow ports flagged.
+// return   success if every transfer completed
+test_error runTest_bulkPorts(uint32_t source, uint32_t destination, const std::vector<uint16_t> &ports,
+            bool upload, bool download, uint32_t length, std::vector<struct bulk_result> &results);
+
+#endif
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <sys/epoll.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <android/log.h>
+#include "util.hpp"
+#include "event_loop.hpp"
+#include "packet_meta.hpp"
+
+#define EVENT_LOOP_MAX_EVENTS 64
+
+static loopWait loop_wait = epoll_wait;
+
+void setLoopWait(loopWait fn_wait)
+{
+    loop_wait = fn_wait != NULL ? fn_wait : epoll_wait;
+}
+
+uint64_t monotonicMillis()
+{
+    return monotonicNanos() / 1000000;
+}
+
+bool eventLoopInit(struct event_loop *loop)
+{
+    loop->epoll_fd = epoll_create(EVENT_LOOP_MAX_EVENTS);
+    if (loop->epoll_fd == -1) {
+        LOGE("epoll_create() failed: %s", strerror(errno));
+        return false;
+    }
+    loop->running = false;
+    loop->handlers.clear();
+    timerWheelInit(&loop->wheel, monotonicMillis());
+    return true;
+}
+
+void eventLoopClose(struct event_loop *loop)
+{
+    if (loop->epoll_fd != -1)
+        close(loop->epoll_fd);
+    loop->epoll_fd = -1;
+    loop->handlers.clear();
+}
+
+bool eventLoopAdd(struct event_loop *loop, int fd, uint32_t events, fdHandler fn_handler)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        LOGE("epoll_ctl() failed: %s", strerror(errno));
+        return false;
+    }
+    loop->handlers[fd] = fn_handler;
+    return true;
+}
+
+void eventLoopRemove(struct event_loop *loop, int fd)
+{
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    loop->handlers.erase(fd);
+}
+
+void eventLoopTimer(struct event_loop *loop, struct wheel_timer *timer, uint64_t delay_ms)
+{
+    timerArm(&loop->wheel, timer, loop->wheel.now + delay_ms);
+}
+
+void eventLoopCancel(struct event_loop *loop, struct wheel_timer *timer)
+{
+    timerCancel(&loop->wheel, timer);
+}
+
+void eventLoopRun(struct event_loop *loop)
+{
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    loop->running = true;
+    timerWheelAdvance(&loop->wheel, monotonicMillis());
+    while (loop->running && (!loop->handlers.empty() || loop->wheel.armed > 0)) {
+        int64_t timeout = timerWheelTimeout(&loop->wheel);
+        int ready = loop_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, (int) timeout);
+        if (ready == -1) {
+            if (errno == EINTR)
+                continue;
+            LOGE("epoll_wait() failed: %s", strerror(errno));
+            break;
+        }
+        if (ready == 0 && timeout < 0)
+            break;
+        for (int i = 0; i < ready && loop->running; i++) {
+            std::map<int, fdHandler>::iterator it = loop->handlers.find(events[i].data.fd);
+            // The descriptor may have been removed by an earlier handler
+            if (it == loop->handlers.end())
+                continue;
+            fdHandler fn_handler = it->second;
+            fn_handler(events[i].events);
+        }
+        timerWheelAdvance(&loop->wheel, monotonicMillis());
+    }
+    loop->running = false;
+}
+
+void eventLoopStop(struct event_loop *loop)
+{
+    loop->running = false;
+}
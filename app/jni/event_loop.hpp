@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <functional>
+#include <map>
+
+#include "timer_wheel.hpp"
+
+#ifndef EVENT_LOOP
+#define EVENT_LOOP
+
+// Single threaded event loop: epoll for the sockets and a timer wheel on
+// the monotonic clock, in milliseconds, for everything time based.
+// Handlers and timer functions run on the thread calling eventLoopRun.
+
+typedef std::function< void(uint32_t events) > fdHandler;
+
+// How the loop waits for its descriptors, epoll_wait() unless a simulator
+// has set its own (see net_sim.hpp), which may move the clock on instead
+// of waiting. Returning 0 with timeout_ms -1 means nothing will ever be
+// ready and ends eventLoopRun. NULL restores epoll_wait().
+typedef int (*loopWait)(int epoll_fd, struct epoll_event *events, int max_events, int timeout_ms);
+void setLoopWait(loopWait fn_wait);
+
+struct event_loop {
+    int epoll_fd;
+    bool running;
+    struct timer_wheel wheel;
+    std::map<int, fdHandler> handlers;
+};
+
+// Milliseconds of monotonicNanos(), unaffected by wall clock changes
+uint64_t monotonicMillis();
+
+// return   false if epoll could not be set up
+bool eventLoopInit(struct event_loop *loop);
+void eventLoopClose(struct event_loop *loop);
+
+// Call the handler whenever the descriptor is ready for the given epoll events
+bool eventLoopAdd(struct event_loop *loop, int fd, uint32_t events, fdHandler fn_handler);
+void eventLoopRemove(struct event_loop *loop, int fd);
+
+// Arm the timer delay_ms from now
+void eventLoopTimer(struct event_loop *loop, struct wheel_timer *timer, uint64_t delay_ms);
+void eventLoopCancel(struct event_loop *loop, struct wheel_timer *timer);
+
+// Dispatch events until eventLoopStop is called or there is nothing left
+// to wait for
+void eventLoopRun(struct event_loop *loop);
+void eventLoopStop(struct event_loop *loop);
+
+#endif
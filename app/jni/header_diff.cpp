@@ -0,0 +1,352 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <functional>
+
+#include <android/log.h>
+#include "header_diff.hpp"
+#include "event_loop.hpp"
+#include "probe_engine.hpp"
+#include "port_allocator.hpp"
+#include "packet_view.hpp"
+
+using namespace std::placeholders;
+
+#define ECHO_SYN_MSS 1460
+#define ECHO_SYN_WSCALE 7
+
+static const char *header_field_names[hf_fields] = {
+    "tos", "ip_id", "fragment", "ip_options", "source", "destination", "src_port", "dst_port",
+    "seq", "ack", "reserved", "flags", "window", "checksum", "urg",
+    "option_removed", "option_added", "option_changed", "option_order"
+};
+
+static const char *header_packet_names[] = {"syn", "synack", "request"};
+
+const char *headerFieldName(uint8_t field)
+{
+    return field < hf_fields ? header_field_names[field] : "unknown";
+}
+
+struct echo_probe {
+    uint8_t markers;
+    uint8_t reserved;
+    uint16_t ip_id;
+    std::vector<char> syn;      // IP and TCP header as sent
+    std::vector<char> request;
+    std::vector<char> synack;   // the whole packet as received
+    std::vector<char> echo[3];  // by header_packet, as the reflector saw or sent them
+    test_error result;
+};
+
+static void addChange(struct header_diff *diff, uint8_t packet, uint8_t field, uint8_t option,
+            uint32_t sent, uint32_t seen)
+{
+    struct header_change change = {packet, field, option, sent, seen};
+    diff->changes.push_back(change);
+    diff->changed |= 1 << field;
+    LOGI("Header %s: %s %u changed %08X -> %08X", header_packet_names[packet], headerFieldName(field),
+        option, sent, seen);
+}
+
+static uint32_t readValue(const uint8_t *data, int length)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < length && i < 4; i++)
+        value = value << 8 | data[i];
+    return value;
+}
+
+// Kind and offset of every option but NOPs, up to the end of the list
+static void listOptions(const uint8_t *options, int length, std::vector<std::pair<uint8_t, int> > &list)
+{
+    for (int i = 0; i < length && options[i] != TCPOPT_EOL;) {
+        if (options[i] == TCPOPT_NOP) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= length || options[i + 1] < 2 || i + options[i + 1] > length)
+            break;
+        list.push_back(std::make_pair(options[i], i));
+        i += options[i + 1];
+    }
+}
+
+static void diffOptions(uint8_t packet, const uint8_t *sent, int sent_length,
+            const uint8_t *seen, int seen_length, struct header_diff *diff)
+{
+    std::vector<std::pair<uint8_t, int> > sent_list, seen_list;
+    listOptions(sent, sent_length, sent_list);
+    listOptions(seen, seen_length, seen_list);
+    uint32_t sent_order = 0, seen_order = 0;
+    int common = 0;
+    for (size_t i = 0; i < sent_list.size(); i++) {
+        const uint8_t *a = sent + sent_list[i].second;
+        size_t j = 0;
+        while (j < seen_list.size() && seen_list[j].first != sent_list[i].first)
+            j++;
+        if (j == seen_list.size()) {
+            addChange(diff, packet, hf_option_removed, a[0], readValue(a + 2, a[1] - 2), 0);
+            continue;
+        }
+        const uint8_t *b = seen + seen_list[j].second;
+        if (a[1] != b[1] || memcmp(a + 2, b + 2, a[1] - 2) != 0)
+            addChange(diff, packet, hf_option_changed, a[0], readValue(a + 2, a[1] - 2), readValue(b + 2, b[1] - 2));
+        if (common++ < 4)
+            sent_order = sent_order << 8 | a[0];
+    }
+    common = 0;
+    for (size_t j = 0; j < seen_list.size(); j++) {
+        const uint8_t *b = seen + seen_list[j].second;
+        size_t i = 0;
+        while (i < sent_list.size() && sent_list[i].first != seen_list[j].first)
+            i++;
+        if (i == sent_list.size()) {
+            addChange(diff, packet, hf_option_added, b[0], 0, readValue(b + 2, b[1] - 2));
+            continue;
+        }
+        if (common++ < 4)
+            seen_order = seen_order << 8 | b[0];
+    }
+    if (sent_order != seen_order)
+        addChange(diff, packet, hf_option_order, 0, sent_order, seen_order);
+}
+
+// Whether the TCP checksum of a header matches it with the payload, the
+// IP header only standing in for the pseudo header
+static bool checksumValid(const char *header, size_t length, const char *payload, uint16_t payload_length)
+{
+    const struct iphdr *ip = (const struct iphdr*) header;
+    size_t tcp_length = length - ip->ihl * 4;
+    std::vector<char> packet(IPHDRLEN + tcp_length + payload_length + 1 + PHDRLEN);
+    struct iphdr *copy_ip = (struct iphdr*) &packet[0];
+    struct tcphdr *copy_tcp = (struct tcphdr*) &packet[IPHDRLEN];
+    memcpy(copy_ip, header, IPHDRLEN);
+    copy_ip->ihl = 5;
+    copy_ip->tot_len = htons(IPHDRLEN + tcp_length + payload_length);
+    memcpy(copy_tcp, header + ip->ihl * 4, tcp_length);
+    if (payload_length > 0)
+        memcpy(&packet[IPHDRLEN + tcp_length], payload, payload_length);
+    return tcpChecksum(copy_ip, copy_tcp) == 0;
+}
+
+// Both headers complete: IP header, TCP header of its data offset
+static bool headerComplete(const char *header, size_t length)
+{
+    if (length < IPHDRLEN + TCPHDRLEN)
+        return false;
+    const struct iphdr *ip = (const struct iphdr*) header;
+    if (ip->ihl < 5 || length < ip->ihl * 4 + TCPHDRLEN)
+        return false;
+    const struct tcphdr *tcp = (const struct tcphdr*) (header + ip->ihl * 4);
+    return tcp->doff >= 5 && length >= (size_t) ip->ihl * 4 + tcp->doff * 4;
+}
+
+bool diffHeaders(uint8_t packet, const char *sent, size_t sent_length,
+            const char *seen, size_t seen_length, const char *payload, uint16_t payload_length,
+            struct header_diff *diff, int *hops)
+{
+    if (!headerComplete(sent, sent_length) || !headerComplete(seen, seen_length))
+        return false;
+    const struct iphdr *ip_a = (const struct iphdr*) sent;
+    const struct iphdr *ip_b = (const struct iphdr*) seen;
+    const uint8_t *a = (const uint8_t*) sent + ip_a->ihl * 4;
+    const uint8_t *b = (const uint8_t*) seen + ip_b->ihl * 4;
+    const struct tcphdr *tcp_a = (const struct tcphdr*) a;
+    const struct tcphdr *tcp_b = (const struct tcphdr*) b;
+
+    if (ip_a->tos != ip_b->tos)
+        addChange(diff, packet, hf_tos, 0, ip_a->tos, ip_b->tos);
+    if (ip_a->id != ip_b->id)
+        addChange(diff, packet, hf_ip_id, 0, ntohs(ip_a->id), ntohs(ip_b->id));
+    if (ip_a->frag_off != ip_b->frag_off)
+        addChange(diff, packet, hf_fragment, 0, ntohs(ip_a->frag_off), ntohs(ip_b->frag_off));
+    if (ip_a->ihl != ip_b->ihl)
+        addChange(diff, packet, hf_ip_options, 0, ip_a->ihl * 4, ip_b->ihl * 4);
+    if (ip_a->saddr != ip_b->saddr)
+        addChange(diff, packet, hf_source, 0, ntohl(ip_a->saddr), ntohl(ip_b->saddr));
+    if (ip_a->daddr != ip_b->daddr)
+        addChange(diff, packet, hf_destination, 0, ntohl(ip_a->daddr), ntohl(ip_b->daddr));
+
+    if (tcp_a->source != tcp_b->source)
+        addChange(diff, packet, hf_src_port, 0, ntohs(tcp_a->source), ntohs(tcp_b->source));
+    if (tcp_a->dest != tcp_b->dest)
+        addChange(diff, packet, hf_dst_port, 0, ntohs(tcp_a->dest), ntohs(tcp_b->dest));
+    if (tcp_a->seq != tcp_b->seq)
+        addChange(diff, packet, hf_seq, 0, ntohl(tcp_a->seq), ntohl(tcp_b->seq));
+    if (tcp_a->ack_seq != tcp_b->ack_seq)
+        addChange(diff, packet, hf_ack, 0, ntohl(tcp_a->ack_seq), ntohl(tcp_b->ack_seq));
+    if (tcp_a->res1 != tcp_b->res1)
+        addChange(diff, packet, hf_reserved, 0, tcp_a->res1, tcp_b->res1);
+    if (a[13] != b[13])
+        addChange(diff, packet, hf_flags, 0, a[13], b[13]);
+    if (tcp_a->window != tcp_b->window)
+        addChange(diff, packet, hf_window, 0, ntohs(tcp_a->window), ntohs(tcp_b->window));
+    if (tcp_a->urg_ptr != tcp_b->urg_ptr)
+        addChange(diff, packet, hf_urg, 0, ntohs(tcp_a->urg_ptr), ntohs(tcp_b->urg_ptr));
+    // Rewriting any of the above changes the checksum, only one not
+    // updated along with them is a change of its own
+    if (payload != NULL && !checksumValid(seen, ip_b->ihl * 4 + tcp_b->doff * 4, payload, payload_length))
+        addChange(diff, packet, hf_checksum, 0, ntohs(tcp_a->check), ntohs(tcp_b->check));
+    diffOptions(packet, a + TCPHDRLEN, tcp_a->doff * 4 - TCPHDRLEN, b + TCPHDRLEN, tcp_b->doff * 4 - TCPHDRLEN, diff);
+    *hops = ip_a->ttl - ip_b->ttl;
+    return true;
+}
+
+// Markers and options on the SYN, kept as sent
+static void addEchoSyn(struct echo_probe *probe, struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state)
+{
+    uint8_t markers = probe->markers;
+    addSynExtras(markers & ECHO_ACK ? HEADER_ECHO_ACK : 0, markers & ECHO_URG ? HEADER_ECHO_URG : 0,
+        probe->reserved, ip, tcp, conn_state);
+    // Non-zero, or the kernel picks one
+    ip->id = htons(probe->ip_id);
+    if (markers & ECHO_MSS) {
+        char mss[2] = {(char) (ECHO_SYN_MSS >> 8), (char) (ECHO_SYN_MSS & 0xFF)};
+        appendTcpOption(TCPOPT_MAXSEG, TCPOLEN_MAXSEG, mss, ip, tcp, conn_state);
+    }
+    if (markers & ECHO_SACK_PERMITTED)
+        appendTcpOption(TCPOPT_SACK_PERMITTED, TCPOLEN_SACK_PERMITTED, NULL, ip, tcp, conn_state);
+    if (markers & ECHO_TIMESTAMP) {
+        uint32_t tsval = htonl(monotonicNanos() / 1000000);
+        char timestamp[8] = {0};
+        memcpy(timestamp, &tsval, sizeof(tsval));
+        appendTcpOption(TCPOPT_TIMESTAMP, TCPOLEN_TIMESTAMP, timestamp, ip, tcp, conn_state);
+    }
+    if (markers & ECHO_WSCALE) {
+        char wscale[1] = {ECHO_SYN_WSCALE};
+        appendTcpOption(TCPOPT_WINDOW, TCPOLEN_WINDOW, wscale, ip, tcp, conn_state);
+    }
+    probe->syn.assign((char*) ip, (char*) tcp + tcp->doff * 4);
+}
+
+static test_error recordEchoSynAck(struct echo_probe *probe, struct iphdr *ip, struct tcphdr *tcp,
+            struct tcp_opt *conn_state)
+{
+    struct packet_view view;
+    if (!viewPacket(ip, tcp, &view))
+        return invalid_packet;
+    probe->synack.assign((const char*) view.ip, (const char*) view.ip + view.length);
+    return success;
+}
+
+static char echo_request[] = "GETHDR";
+
+static void makeEchoRequest(struct echo_probe *probe, struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state)
+{
+    ip->id = htons(probe->ip_id + 1);
+    setRes(probe->reserved, ip, tcp, conn_state);
+    appendData(echo_request, strlen(echo_request), ip, tcp);
+    probe->request.assign((char*) ip, (char*) tcp + tcp->doff * 4);
+}
+
+// HDR, then three headers each behind its length
+static test_error readEcho(struct echo_probe *probe, struct iphdr *ip, struct tcphdr *tcp,
+            struct tcp_opt *conn_state)
+{
+    struct packet_view view;
+    if (!viewPacket(ip, tcp, &view))
+        return invalid_packet;
+    uint16_t datalen = view.payload_length;
+    const uint8_t *data = (const uint8_t*) view.payload;
+    if (datalen < 6 || memcmp(data, "HDR", 3) != 0) {
+        LOGE("GETHDR response length %u", datalen);
+        return receive_error_data;
+    }
+    uint16_t offset = 3;
+    for (int h = 0; h < 3; h++) {
+        if (offset >= datalen || offset + 1 + data[offset] > datalen) {
+            LOGE("GETHDR response cut short at %u of %u", offset, datalen);
+            return receive_error_data;
+        }
+        probe->echo[h].assign(data + offset + 1, data + offset + 1 + data[offset]);
+        offset += 1 + data[offset];
+    }
+    return success;
+}
+
+test_error runTest_header_echo(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port,
+            uint8_t reserved, struct header_diff *diff)
+{
+    return runTest_header_echo(source, src_port, destination, dst_port, ECHO_ALL, reserved, true, diff);
+}
+
+test_error runTest_header_echo(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port,
+            uint8_t markers, uint8_t reserved, bool infer, struct header_diff *diff)
+{
+    diff->synack = diff->echoed = false;
+    diff->reserved = markers & ECHO_RESERVED ? reserved & 0xF : 0;
+    diff->hops_up = diff->hops_down = 0;
+    diff->changed = 0;
+    diff->changes.clear();
+
+    struct event_loop loop;
+    struct probe_engine engine;
+    if (!eventLoopInit(&loop))
+        return test_failed;
+    if (!probeEngineInit(&engine, &loop)) {
+        eventLoopClose(&loop);
+        return test_failed;
+    }
+    struct echo_probe probe;
+    probe.markers = markers;
+    probe.reserved = diff->reserved;
+    probe.ip_id = randomIsn() | 1;
+    probe.result = test_failed;
+    uint16_t port = src_port == 0 ? allocatePort() : src_port;
+    packetModifier fn_synExtras = std::bind(addEchoSyn, &probe, _1, _2, _3);
+    packetChecker fn_checkTcpSynAck = std::bind(recordEchoSynAck, &probe, _1, _2, _3);
+    packetModifier fn_makeRequest = std::bind(makeEchoRequest, &probe, _1, _2, _3);
+    packetChecker fn_checkResponse = std::bind(readEcho, &probe, _1, _2, _3);
+    test_definition test = makeTestDefinition(fn_synExtras, fn_checkTcpSynAck, fn_makeRequest, fn_checkResponse);
+    test.infer = infer;
+    if (port != 0 && probeStart(&engine, source, port, destination, dst_port, test, NULL,
+                [&](test_error probe_result, const struct probe_timing *timing) {
+                    probe.result = probe_result;
+                    eventLoopStop(&loop);
+                }))
+        eventLoopRun(&loop);
+    probeEngineClose(&engine);
+    eventLoopClose(&loop);
+    if (src_port == 0 && port != 0)
+        releasePort(port);
+
+    diff->synack = !probe.synack.empty();
+    diff->echoed = !probe.echo[hp_request].empty();
+    struct packet_view view;
+    // A SYNACK that does not view as a packet is taken for one not echoed
+    if (diff->synack && !probe.echo[hp_synack].empty()
+            && viewPacket(&probe.synack[0], probe.synack.size(), &view)) {
+        size_t header_length = view.ip_header_length + view.tcp_header_length;
+        diffHeaders(hp_synack, &probe.echo[hp_synack][0], probe.echo[hp_synack].size(), &probe.synack[0],
+            header_length, &probe.synack[header_length], probe.synack.size() - header_length, diff, &diff->hops_down);
+    }
+    if (diff->echoed) {
+        int hops;
+        diffHeaders(hp_syn, &probe.syn[0], probe.syn.size(), &probe.echo[hp_syn][0], probe.echo[hp_syn].size(),
+            "", 0, diff, &diff->hops_up);
+        diffHeaders(hp_request, &probe.request[0], probe.request.size(), &probe.echo[hp_request][0],
+            probe.echo[hp_request].size(), echo_request, strlen(echo_request), diff, &hops);
+    }
+    LOGI("Header echo: %s, %u changes, %d hops up, %d down", diff->echoed ? "echoed" :
+        diff->synack ? "no echo" : "no SYNACK", (unsigned) diff->changes.size(), diff->hops_up, diff->hops_down);
+
+    if (!diff->echoed)
+        return probe.result == success ? test_failed : probe.result;
+    uint32_t nat = 1 << hf_source | 1 << hf_destination | 1 << hf_src_port | 1 << hf_dst_port;
+    return diff->changed & ~nat ? test_failed : success;
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <vector>
+
+#include "testsuite.hpp"
+
+#ifndef HEADER_DIFF
+#define HEADER_DIFF
+
+// Every rewrite of one connection: the SYN carries a non-zero IP ID and
+// any of the ECHO_* markers, by default the ACK field and URG pointer
+// markers (HEADER_ECHO_ACK/URG), the reserved bits asked for and the MSS,
+// SACK permitted, timestamp and window scale options; the only request is
+// GETHDR. The reflector answers it with the
+// IP and TCP headers of the SYN as it received it, of its SYNACK as it
+// sent it and of the request as it received it, which are compared field
+// by field with what was sent and received: uplink in the handshake and
+// once established, and downlink for the SYNACK. TTLs only count hops.
+
+// Markers on the SYN
+#define ECHO_ACK 0x01
+#define ECHO_URG 0x02
+#define ECHO_RESERVED 0x04      // also set on the request
+#define ECHO_MSS 0x08
+#define ECHO_SACK_PERMITTED 0x10
+#define ECHO_TIMESTAMP 0x20
+#define ECHO_WSCALE 0x40
+#define ECHO_ALL 0x7F
+#define ECHO_MARKERS 7
+
+// What changed, where the header allows naming the value that of the
+// sender and the receiver (host order)
+enum header_field {
+    hf_tos = 0,
+    hf_ip_id,
+    hf_fragment,                // DF, MF and the offset
+    hf_ip_options,              // IP header length
+    hf_source,                  // address
+    hf_destination,
+    hf_src_port,
+    hf_dst_port,
+    hf_seq,
+    hf_ack,                     // the ACK field, also without the ACK flag
+    hf_reserved,
+    hf_flags,
+    hf_window,
+    hf_checksum,                // invalid for the header and payload seen
+    hf_urg,                     // the URG pointer
+    hf_option_removed,          // option: kind, values: the first 4 bytes of its data
+    hf_option_added,
+    hf_option_changed,
+    hf_option_order,            // values: the first 4 kinds in order
+    hf_fields
+};
+
+enum header_packet {
+    hp_syn = 0,                 // uplink, SYN
+    hp_synack,                  // downlink, SYNACK
+    hp_request                  // uplink, established
+};
+
+struct header_change {
+    uint8_t packet;             // header_packet
+    uint8_t field;              // header_field
+    uint8_t option;             // kind, for the option fields
+    uint32_t sent, seen;
+};
+
+struct header_diff {
+    bool synack;                // a SYNACK arrived
+    bool echoed;                // the reflector echoed the headers, hops are set
+    uint8_t reserved;           // bits set on the SYN and the request
+    int hops_up, hops_down;     // TTL decrease, negative if raised on the way
+    uint32_t changed;           // bit per header_field, any packet
+    std::vector<struct header_change> changes;
+};
+
+// Names for the logs and the Java side
+const char *headerFieldName(uint8_t field);
+
+// Compare the IP and TCP headers of a packet as sent and as seen, adding
+// every difference but the TTL and the IP checksum to diff. The TCP
+// checksum is only reported when the one seen does not match the header
+// seen with payload, when given.
+// param hops     set to the TTL sent minus the TTL seen
+// return   false if either header is cut short
+bool diffHeaders(uint8_t packet, const char *sent, size_t sent_length,
+            const char *seen, size_t seen_length, const char *payload, uint16_t payload_length,
+            struct header_diff *diff, int *hops);
+
+// return   success if the headers were echoed and at most the addresses and
+//          ports changed (NAT), test_failed if anything else was rewritten
+//          and the error of the connection if it broke down
+test_error runTest_header_echo(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port,
+            uint8_t reserved, struct header_diff *diff);
+// The same with only some markers. With infer false the SYN is sent even
+// where the test planner takes it for lost (see test_planner.hpp).
+test_error runTest_header_echo(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port,
+            uint8_t markers, uint8_t reserved, bool infer, struct header_diff *diff);
+
+#endif
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <math.h>
+#include <string.h>
+#include "latency_histogram.hpp"
+
+// Position of the highest set bit, value must not be 0
+static int highestBit(uint64_t value)
+{
+    return 63 - __builtin_clzll(value);
+}
+
+// Bucket 0 covers [0, LATENCY_SUB_COUNT) linearly, every next bucket
+// doubles the range and only uses its top half of sub-buckets
+static int countsIndex(uint64_t value)
+{
+    int bucket = 0;
+    if (value >= LATENCY_SUB_COUNT)
+        bucket = highestBit(value) - (LATENCY_SUB_BITS - 1);
+    int sub_bucket = (int) (value >> bucket);
+    return (bucket + 1) * LATENCY_HALF_COUNT + sub_bucket - LATENCY_HALF_COUNT;
+}
+
+// Highest value that falls into the given counts index
+static uint64_t indexValue(int index)
+{
+    int bucket = index / LATENCY_HALF_COUNT - 1;
+    int sub_bucket = index % LATENCY_HALF_COUNT + LATENCY_HALF_COUNT;
+    if (bucket < 0) {
+        bucket = 0;
+        sub_bucket -= LATENCY_HALF_COUNT;
+    }
+    return (((uint64_t) sub_bucket + 1) << bucket) - 1;
+}
+
+void histogramInit(struct latency_histogram *h)
+{
+    memset(h->counts, 0, sizeof(h->counts));
+    h->total = 0;
+    h->min = UINT64_MAX;
+    h->max = 0;
+}
+
+void histogramRecord(struct latency_histogram *h, uint64_t value)
+{
+    h->counts[countsIndex(value)]++;
+    h->total++;
+    if (value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+}
+
+void histogramMerge(struct latency_histogram *h, struct latency_histogram *from)
+{
+    for (int i = 0; i < LATENCY_COUNTS; i++)
+        h->counts[i] += from->counts[i];
+    h->total += from->total;
+    if (from->min < h->min)
+        h->min = from->min;
+    if (from->max > h->max)
+        h->max = from->max;
+}
+
+uint64_t histogramPercentile(struct latency_histogram *h, double percentile)
+{
+    if (h->total == 0)
+        return 0;
+    uint64_t target = (uint64_t) (percentile / 100.0 * h->total + 0.5);
+    if (target < 1)
+        target = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_COUNTS; i++) {
+        seen += h->counts[i];
+        if (seen >= target)
+            return indexValue(i) < h->max ? indexValue(i) : h->max;
+    }
+    return h->max;
+}
+
+void histogramPrint(struct latency_histogram *h, FILE *out, double unit_ratio)
+{
+    fprintf(out, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_COUNTS; i++) {
+        if (h->counts[i] == 0)
+            continue;
+        seen += h->counts[i];
+        double fraction = (double) seen / h->total;
+        uint64_t value = indexValue(i) < h->max ? indexValue(i) : h->max;
+        if (seen < h->total)
+            fprintf(out, "%12.3f %14.12f %10llu %14.2f\n", value / unit_ratio, fraction,
+                (unsigned long long) seen, 1.0 / (1.0 - fraction));
+        else
+            fprintf(out, "%12.3f %14.12f %10llu\n", value / unit_ratio, fraction,
+                (unsigned long long) seen);
+    }
+    // Mean and deviation from the bucket values, as HdrHistogram does
+    double sum = 0, squares = 0;
+    for (int i = 0; i < LATENCY_COUNTS; i++) {
+        double value = indexValue(i) / unit_ratio;
+        sum += value * h->counts[i];
+        squares += value * value * h->counts[i];
+    }
+    double mean = h->total > 0 ? sum / h->total : 0;
+    double variance = h->total > 0 ? squares / h->total - mean * mean : 0;
+    fprintf(out, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean, variance > 0 ? sqrt(variance) : 0);
+    fprintf(out, "#[Max     = %12.3f, Total count    = %12llu]\n", h->max / unit_ratio,
+        (unsigned long long) h->total);
+}
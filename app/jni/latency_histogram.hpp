@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef LATENCY_HISTOGRAM
+#define LATENCY_HISTOGRAM
+
+// HDR (high dynamic range) histogram of latencies: log-linear buckets with
+// LATENCY_SUB_BITS bits of precision for any value, fixed size, recording
+// is a couple of shifts and an increment. Values are in nanoseconds.
+#define LATENCY_SUB_BITS 8
+#define LATENCY_SUB_COUNT (1 << LATENCY_SUB_BITS)
+#define LATENCY_HALF_COUNT (LATENCY_SUB_COUNT / 2)
+#define LATENCY_COUNTS ((64 - LATENCY_SUB_BITS + 2) * LATENCY_HALF_COUNT)
+
+struct latency_histogram {
+    uint64_t counts[LATENCY_COUNTS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+};
+
+void histogramInit(struct latency_histogram *h);
+void histogramRecord(struct latency_histogram *h, uint64_t value);
+// Add all the values recorded in from to h
+void histogramMerge(struct latency_histogram *h, struct latency_histogram *from);
+// Value at the given percentile (0 - 100), within the histogram precision
+uint64_t histogramPercentile(struct latency_histogram *h, double percentile);
+// Percentile distribution in the HdrHistogram text (.hgrm) format,
+// values scaled down by unit_ratio (e.g. 1000.0 for microseconds)
+void histogramPrint(struct latency_histogram *h, FILE *out, double unit_ratio);
+
+#endif
@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <android/log.h>
+#include "middlebox.hpp"
+
+// Sequence number offset of the simulated proxy's own ISN
+#define PROXY_SEQ_DELTA 0x10000000
+
+void middleboxInit(struct middlebox_state *mb, struct middlebox_config *config)
+{
+    mb->config = *config;
+    mb->nat_public.clear();
+    mb->nat_private.clear();
+    mb->nat_next_port = config->nat_port_base;
+    mb->proxy_seq_delta.clear();
+    mb->table.clear();
+    mb->packets[mb_uplink] = mb->packets[mb_downlink] = 0;
+    mb->rewrites[mb_uplink] = mb->rewrites[mb_downlink] = 0;
+}
+
+// Replace the whole TCP options area, moving the payload accordingly.
+// Options are padded with EOL to a multiple of 4 bytes.
+static void replaceTcpOptions(uint8_t *options, int options_length, struct iphdr *ip, struct tcphdr *tcp)
+{
+    int padded = (options_length + 3) & ~3;
+    int old_offset = tcp->doff * 4;
+    int datalen = ntohs(ip->tot_len) - IPHDRLEN - old_offset;
+    char *data = (char*) tcp + old_offset;
+    char *new_data = (char*) tcp + TCPHDRLEN + padded;
+    if (datalen > 0)
+        memmove(new_data, data, datalen);
+    memset((char*) tcp + TCPHDRLEN, TCPOPT_EOL, padded);
+    memcpy((char*) tcp + TCPHDRLEN, options, options_length);
+    tcp->doff = (TCPHDRLEN + padded) / 4;
+    ip->tot_len = htons(IPHDRLEN + TCPHDRLEN + padded + datalen);
+}
+
+// Rewrites TCP options: stripping all but MSS and/or clamping MSS.
+// return   true if the options have been changed
+static bool rewriteTcpOptions(struct middlebox_config *config, struct iphdr *ip, struct tcphdr *tcp)
+{
+    uint8_t *options = (uint8_t*) tcp + TCPHDRLEN;
+    int options_length = tcp->doff * 4 - TCPHDRLEN;
+    uint8_t rewritten[40];
+    int rewritten_length = 0;
+    bool changed = false;
+    bool mss_found = false;
+
+    int offset = 0;
+    while (offset < options_length) {
+        uint8_t kind = options[offset];
+        if (kind == TCPOPT_EOL)
+            break;
+        if (kind == TCPOPT_NOP) {
+            if (!config->strip_options)
+                rewritten[rewritten_length++] = kind;
+            else
+                changed = true;
+            offset++;
+            continue;
+        }
+        if (offset + 1 >= options_length || options[offset + 1] < 2
+                || offset + options[offset + 1] > options_length)
+            break;
+        uint8_t length = options[offset + 1];
+        if (kind == TCPOPT_MAXSEG && length == TCPOLEN_MAXSEG) {
+            mss_found = true;
+            uint16_t mss = (options[offset + 2] << 8) | options[offset + 3];
+            if (config->mss_clamp != 0 && mss > config->mss_clamp) {
+                mss = config->mss_clamp;
+                changed = true;
+            }
+            rewritten[rewritten_length++] = TCPOPT_MAXSEG;
+            rewritten[rewritten_length++] = TCPOLEN_MAXSEG;
+            rewritten[rewritten_length++] = mss >> 8;
+            rewritten[rewritten_length++] = mss & 0xFF;
+        } else if (config->strip_options) {
+            changed = true;
+        } else {
+            memcpy(rewritten + rewritten_length, options + offset, length);
+            rewritten_length += length;
+        }
+        offset += length;
+    }
+    // The proxies seen in the traces announce their own MSS on SYNACKs
+    if (!mss_found && config->mss_clamp != 0 && tcp->syn && tcp->ack
+            && rewritten_length + TCPOLEN_MAXSEG <= (int) sizeof(rewritten)) {
+        rewritten[rewritten_length++] = TCPOPT_MAXSEG;
+        rewritten[rewritten_length++] = TCPOLEN_MAXSEG;
+        rewritten[rewritten_length++] = config->mss_clamp >> 8;
+        rewritten[rewritten_length++] = config->mss_clamp & 0xFF;
+        changed = true;
+    }
+    if (changed)
+        replaceTcpOptions(rewritten, rewritten_length, ip, tcp);
+    return changed;
+}
+
+static bool rewriteNat(struct middlebox_state *mb, middlebox_direction direction,
+            struct iphdr *ip, struct tcphdr *tcp)
+{
+    struct middlebox_config *config = &mb->config;
+    if (config->nat_address == 0)
+        return false;
+    if (direction == mb_uplink) {
+        std::pair<uint32_t, uint16_t> private_id = std::make_pair(ip->saddr, tcp->source);
+        std::map<std::pair<uint32_t, uint16_t>, uint16_t>::iterator it = mb->nat_private.find(private_id);
+        uint16_t public_port;
+        if (it != mb->nat_private.end()) {
+            public_port = it->second;
+        } else {
+            public_port = config->nat_port_base != 0 ? htons(mb->nat_next_port++) : tcp->source;
+            mb->nat_private[private_id] = public_port;
+            middlebox_nat_entry entry = {ip->saddr, tcp->source};
+            mb->nat_public[public_port] = entry;
+        }
+        ip->saddr = config->nat_address;
+        tcp->source = public_port;
+        return true;
+    } else {
+        if (ip->daddr != config->nat_address)
+            return false;
+        std::map<uint16_t, middlebox_nat_entry>::iterator it = mb->nat_public.find(tcp->dest);
+        if (it == mb->nat_public.end())
+            return false;
+        ip->daddr = it->second.address;
+        tcp->dest = it->second.port;
+        return true;
+    }
+}
+
+// Terminating proxy: the middlebox answers with its own sequence space,
+// so translate sequence numbers and drop anything carried on SYNACKs
+static void rewriteProxy(struct middlebox_state *mb, middlebox_direction direction,
+            struct iphdr *ip, struct tcphdr *tcp)
+{
+    std::pair<uint32_t, uint16_t> conn_id = direction == mb_uplink ?
+        std::make_pair(ip->saddr, tcp->source) : std::make_pair(ip->daddr, tcp->dest);
+    if (direction == mb_uplink && tcp->syn && !tcp->ack)
+        mb->proxy_seq_delta[conn_id] = PROXY_SEQ_DELTA + ntohs(tcp->source);
+    std::map<std::pair<uint32_t, uint16_t>, uint32_t>::iterator it = mb->proxy_seq_delta.find(conn_id);
+    if (it == mb->proxy_seq_delta.end())
+        return;
+
+    tcp->res1 = 0;
+    if (!tcp->urg)
+        tcp->urg_ptr = 0;
+    if (direction == mb_uplink) {
+        if (tcp->ack)
+            tcp->ack_seq = htonl(ntohl(tcp->ack_seq) - it->second);
+        else
+            tcp->ack_seq = 0;
+    } else {
+        tcp->seq = htonl(ntohl(tcp->seq) + it->second);
+        if (tcp->syn) {
+            int datalen = ntohs(ip->tot_len) - IPHDRLEN - tcp->doff * 4;
+            if (datalen > 0) {
+                ip->tot_len = htons(ntohs(ip->tot_len) - datalen);
+                it->second -= datalen;
+            }
+        }
+    }
+}
+
+bool middleboxProcess(struct middlebox_state *mb, middlebox_direction direction,
+            struct iphdr *ip, struct tcphdr *tcp)
+{
+    struct middlebox_config *config = &mb->config;
+    mb->packets[direction]++;
+    if (direction == mb_uplink && config->drop_port != 0 && ntohs(tcp->dest) == config->drop_port)
+        return false;
+    if (direction == mb_uplink && config->drop_ack_syn && tcp->syn && !tcp->ack && tcp->ack_seq != 0)
+        return false;
+    if (direction == mb_uplink && config->table_size != 0) {
+        std::pair<uint32_t, uint16_t> conn_id = std::make_pair(ip->saddr, tcp->source);
+        if (tcp->rst || tcp->fin) {
+            mb->table.erase(conn_id);
+        } else if (tcp->syn && !tcp->ack && mb->table.count(conn_id) == 0) {
+            if (mb->table.size() >= config->table_size)
+                return false;
+            mb->table.insert(conn_id);
+        }
+    }
+    // Checksum error of the packet as received, 0 if correct
+    uint16_t checksum_error = ntohs(tcpChecksum(ip, tcp));
+    bool changed = false;
+
+    // NAT sits on the outside, the rest sees private addresses
+    if (direction == mb_downlink)
+        changed = rewriteNat(mb, direction, ip, tcp);
+    if (config->zero_ack && !tcp->ack && tcp->ack_seq != 0) {
+        tcp->ack_seq = 0;
+        changed = true;
+    }
+    if (config->zero_urg && !tcp->urg && tcp->urg_ptr != 0) {
+        tcp->urg_ptr = 0;
+        changed = true;
+    }
+    if (config->clear_reserved && tcp->res1 != 0) {
+        tcp->res1 = 0;
+        changed = true;
+    }
+    if ((config->strip_options || config->mss_clamp != 0 || config->proxy) && tcp->syn) {
+        struct middlebox_config options_config = *config;
+        options_config.strip_options = config->strip_options || config->proxy;
+        changed = rewriteTcpOptions(&options_config, ip, tcp) || changed;
+    }
+    if (config->proxy) {
+        rewriteProxy(mb, direction, ip, tcp);
+        checksum_error = 0;
+        changed = true;
+    }
+    if (direction == mb_uplink)
+        changed = rewriteNat(mb, direction, ip, tcp) || changed;
+
+    if (changed) {
+        mb->rewrites[direction]++;
+        recomputeTcpChecksum(ip, tcp);
+        if (checksum_error != 0)
+            tcp->check = htons(csum_add(ntohs(tcp->check), ~checksum_error));
+    }
+    return true;
+}
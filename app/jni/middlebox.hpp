@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <map>
+#include <set>
+#include <utility>
+
+#include "packet_builder.hpp"
+
+#ifndef MIDDLEBOX
+#define MIDDLEBOX
+
+// Configurable middlebox model, reproducing the rewrites seen on the
+// carrier networks in results/. Every behaviour is off when zeroed.
+struct middlebox_config {
+    uint32_t nat_address;       // public address to NAT clients to (network order), 0 - no NAT
+    uint16_t nat_port_base;     // first public port handed out by the NAT, 0 - keep ports
+    bool zero_ack;              // zero the ACK field when the ACK flag is not set
+    bool zero_urg;              // zero the URG pointer when the URG flag is not set
+    bool clear_reserved;        // clear the 4 reserved bits
+    uint16_t mss_clamp;         // clamp (or add, on SYNACKs) the MSS option, 0 - off
+    bool strip_options;         // drop every TCP option but MSS
+    bool proxy;                 // terminate the connection: scrub markers, regenerate
+                                // checksums and translate sequence numbers
+    uint16_t drop_port;         // firewall: drop everything to this port, 0 - off
+    bool drop_ack_syn;          // drop SYNs with a non-zero ACK field
+    uint32_t table_size;        // connections tracked at most, SYNs of further
+                                // ones are dropped, 0 - unlimited
+    uint32_t latency_ms;        // one-way added latency
+    uint32_t rate_kbps;         // link throughput, 0 - unlimited
+    uint16_t shape_port;        // server port shaped separately, 0 - off
+    uint32_t shape_kbps;        // throughput of the shaped port
+    uint32_t loss_permille;     // random loss of segments carrying data
+    uint16_t path_mtu;          // larger packets are dropped without an ICMP
+                                // error (a PMTU black hole), 0 - off
+};
+
+enum middlebox_direction {
+    mb_uplink,                  // client -> server
+    mb_downlink                 // server -> client
+};
+
+struct middlebox_nat_entry {
+    uint32_t address;
+    uint16_t port;
+};
+
+struct middlebox_state {
+    struct middlebox_config config;
+    // NAT bindings, public port -> private (address, port), all network order
+    std::map<uint16_t, middlebox_nat_entry> nat_public;
+    std::map<std::pair<uint32_t, uint16_t>, uint16_t> nat_private;
+    uint16_t nat_next_port;
+    // Connections tracked, by (client address, client port)
+    std::set<std::pair<uint32_t, uint16_t> > table;
+    // Proxy sequence translation per (client address, client port)
+    std::map<std::pair<uint32_t, uint16_t>, uint32_t> proxy_seq_delta;
+    // Counters
+    uint32_t packets[2];
+    uint32_t rewrites[2];
+};
+
+void middleboxInit(struct middlebox_state *mb, struct middlebox_config *config);
+
+// Apply the configured rewrites to a packet crossing the middlebox.
+// The packet is modified in place, buffer must be BUFLEN long.
+// Checksums are updated the way a NAT would (RFC3022): any error already
+// present in the checksum is preserved, except in proxy mode where the
+// middlebox generates the packets itself and checksums are always correct.
+//
+// param mb         middlebox state
+// param direction  mb_uplink or mb_downlink
+// param ip         IP header
+// param tcp        TCP header
+// return           false if the middlebox drops the packet
+bool middleboxProcess(struct middlebox_state *mb, middlebox_direction direction,
+            struct iphdr *ip, struct tcphdr *tcp);
+
+#endif
@@ -0,0 +1,367 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Standalone middlebox simulator. Creates a TUN device with the local
+// (engine side) address, and answers everything sent to the reflector
+// address behind it with the in-process reflector, passing packets through
+// the configured middlebox rewrites, latency and throughput limits.
+//
+// Point the testsuite at the reflector address, e.g.
+//      tcptester-mbsim -m 1320 -a -u -L 20
+// then run tests from 10.66.0.1 to 10.66.0.2
+
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#include <netinet/ip_icmp.h>
+#include <chrono>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include <android/log.h>
+#include "middlebox.hpp"
+#include "reflector.hpp"
+
+#ifndef TAG
+#define TAG "TCPTester-mbsim"
+#endif
+
+// The host kernel answers the reflector's SYNACKs with RSTs of its own, the
+// app drops them with an iptables rule on RSTs above this TTL
+#define KERNEL_RST_TTL 60
+
+struct sim_event {
+    uint64_t release_us;
+    uint64_t order;
+    middlebox_direction direction;
+    bool router;                // an ICMP error of a router, not rewritten
+    std::vector<char> packet;
+};
+
+struct sim_event_later {
+    bool operator()(const sim_event &a, const sim_event &b) const {
+        if (a.release_us != b.release_us)
+            return a.release_us > b.release_us;
+        return a.order > b.order;
+    }
+};
+
+// One direction of the simulated link: serialisation at the configured
+// rate, then a constant propagation delay
+struct sim_link {
+    uint64_t next_free_us;
+};
+
+// Routers in front of the reflector, for TTL based localization: a packet
+// with a TTL up to hops expires at the router of that hop, which answers
+// with an ICMP time exceeded quoting at most quote bytes past the IP header
+// (RFC 1812: the ICMP message within 576 bytes; RFC 792 routers quote 8).
+// The middlebox sits at middlebox_hop, later routers quote its rewrites.
+struct sim_path {
+    uint8_t hops;               // 0 - the reflector is the next hop
+    uint8_t middlebox_hop;
+    uint16_t quote;
+    uint32_t router_base;       // router of hop n is router_base + n, host order
+};
+
+static volatile sig_atomic_t running = 1;
+
+static void stopSimulator(int signal) {
+    running = 0;
+}
+
+static uint64_t nowMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>
+        (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int openTun(const char *name) {
+    int fd = open("/dev/net/tun", O_RDWR);
+    if (fd == -1)
+        fd = open("/dev/tun", O_RDWR);
+    if (fd == -1) {
+        LOGE("Opening TUN device failed: %s", strerror(errno));
+        return -1;
+    }
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    if (ioctl(fd, TUNSETIFF, &ifr) == -1) {
+        LOGE("TUNSETIFF failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Pick the link a packet crosses: the shaped port has a pair of its own
+static sim_link *linkFor(sim_link *links, struct middlebox_config *config,
+            middlebox_direction direction, char *packet, uint32_t &rate_kbps)
+{
+    struct tcphdr *tcp = (struct tcphdr*) (packet + IPHDRLEN);
+    uint16_t server_port = ntohs(direction == mb_uplink ? tcp->dest : tcp->source);
+    if (config->shape_port != 0 && server_port == config->shape_port) {
+        rate_kbps = config->shape_kbps;
+        return &links[2 + direction];
+    }
+    rate_kbps = config->rate_kbps;
+    return &links[direction];
+}
+
+static void enqueue(std::priority_queue<sim_event, std::vector<sim_event>, sim_event_later> &events,
+            sim_link *links, struct middlebox_config *config, uint64_t &order,
+            middlebox_direction direction, char *packet, int length, uint64_t now)
+{
+    struct iphdr *ip = (struct iphdr*) packet;
+    struct tcphdr *tcp = (struct tcphdr*) (packet + IPHDRLEN);
+    int datalen = ntohs(ip->tot_len) - IPHDRLEN - tcp->doff * 4;
+    if (config->loss_permille > 0 && datalen > 0 && !tcp->syn
+            && (uint32_t) (rand() % 1000) < config->loss_permille)
+        return;
+    if (config->path_mtu > 0 && length > config->path_mtu)
+        return;
+
+    uint32_t rate_kbps;
+    sim_link *link = linkFor(links, config, direction, packet, rate_kbps);
+    uint64_t transmission = 0;
+    if (rate_kbps > 0)
+        transmission = (uint64_t) length * 8 * 1000 / rate_kbps;
+    uint64_t start = link->next_free_us > now ? link->next_free_us : now;
+    link->next_free_us = start + transmission;
+
+    sim_event event;
+    event.release_us = start + transmission + (uint64_t) config->latency_ms * 1000;
+    event.order = order++;
+    event.direction = direction;
+    event.router = false;
+    event.packet.assign(packet, packet + length);
+    events.push(event);
+}
+
+// The packet expires at the router of hop ip->ttl. Packets the middlebox
+// drops are not answered; the packet is rewritten in place.
+static void timeExceeded(std::priority_queue<sim_event, std::vector<sim_event>, sim_event_later> &events,
+            struct middlebox_state *mb, const struct sim_path *path, uint64_t &order,
+            char *packet, uint64_t now)
+{
+    struct iphdr *ip = (struct iphdr*) packet;
+    struct tcphdr *tcp = (struct tcphdr*) (packet + IPHDRLEN);
+    uint8_t hop = ip->ttl;
+    if (hop > path->middlebox_hop && !middleboxProcess(mb, mb_uplink, ip, tcp))
+        return;
+    ip->ttl = 1;
+    int quoted = ntohs(ip->tot_len);
+    if (quoted > (int) IPHDRLEN + path->quote)
+        quoted = IPHDRLEN + path->quote;
+
+    sim_event event;
+    event.packet.assign(IPHDRLEN + ICMP_MINLEN + quoted, 0);
+    struct iphdr *reply_ip = (struct iphdr*) &event.packet[0];
+    uint8_t *icmp = (uint8_t*) &event.packet[IPHDRLEN];
+    reply_ip->version = 4;
+    reply_ip->ihl = 5;
+    reply_ip->tot_len = htons(event.packet.size());
+    reply_ip->ttl = 64 - hop;
+    reply_ip->protocol = IPPROTO_ICMP;
+    reply_ip->saddr = htonl(path->router_base + hop);
+    reply_ip->daddr = ip->saddr;
+    icmp[0] = ICMP_TIME_EXCEEDED;
+    icmp[1] = ICMP_EXC_TTL;
+    memcpy(icmp + ICMP_MINLEN, packet, quoted);
+    uint16_t check = comp_chksum((uint16_t*) icmp, ICMP_MINLEN + quoted);
+    memcpy(icmp + 2, &check, 2);
+
+    // The added latency is all on the last link, routers answer right away
+    event.release_us = now;
+    event.order = order++;
+    event.direction = mb_downlink;
+    event.router = true;
+    events.push(event);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [options]\n"
+        "  -i <name>    TUN device name (mbsim0)\n"
+        "  -l <addr>    engine side address (10.66.0.1)\n"
+        "  -r <addr>    reflector address (10.66.0.2)\n"
+        "  -n <addr>    NAT clients to this address\n"
+        "  -p <port>    first NAT public port (keep client ports)\n"
+        "  -a           zero the ACK field without the ACK flag\n"
+        "  -u           zero the URG pointer without the URG flag\n"
+        "  -R           clear the reserved bits\n"
+        "  -m <mss>     clamp MSS, e.g. 1320\n"
+        "  -s           strip all TCP options but MSS\n"
+        "  -P           terminate connections as a transparent proxy\n"
+        "  -D <port>    drop everything to this port\n"
+        "  -A           drop SYNs with a non-zero ACK field\n"
+        "  -C <n>       track at most n connections, drop SYNs of further ones\n"
+        "  -L <ms>      one-way added latency\n"
+        "  -b <kbps>    link throughput\n"
+        "  -S <port>:<kbps>  shape the traffic of one server port on its own\n"
+        "  -x <permille>     lose segments carrying data at random\n"
+        "  -M <mtu>     drop larger packets silently\n"
+        "  -H <hops>[:<hop>[:<bytes>]]  routers in front of the reflector, answering\n"
+        "               expired packets; the middlebox at hop (the last), quoting\n"
+        "               bytes past the IP header (528)\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    std::string tun_name = "mbsim0";
+    std::string local_address = "10.66.0.1";
+    std::string reflector_address = "10.66.0.2";
+    struct middlebox_config config;
+    memset(&config, 0, sizeof(config));
+    struct sim_path path = {0, 0, 528, 0};
+    int middlebox_hop = -1, quote = -1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:l:r:n:p:auRm:sPD:AC:L:b:S:x:M:H:h")) != -1) {
+        switch (opt) {
+            case 'i': tun_name = optarg; break;
+            case 'l': local_address = optarg; break;
+            case 'r': reflector_address = optarg; break;
+            case 'n': config.nat_address = inet_addr(optarg); break;
+            case 'p': config.nat_port_base = atoi(optarg); break;
+            case 'a': config.zero_ack = true; break;
+            case 'u': config.zero_urg = true; break;
+            case 'R': config.clear_reserved = true; break;
+            case 'm': config.mss_clamp = atoi(optarg); break;
+            case 's': config.strip_options = true; break;
+            case 'P': config.proxy = true; break;
+            case 'D': config.drop_port = atoi(optarg); break;
+            case 'A': config.drop_ack_syn = true; break;
+            case 'C': config.table_size = atoi(optarg); break;
+            case 'L': config.latency_ms = atoi(optarg); break;
+            case 'b': config.rate_kbps = atoi(optarg); break;
+            case 'S':
+                if (sscanf(optarg, "%hu:%u", &config.shape_port, &config.shape_kbps) != 2) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'x': config.loss_permille = atoi(optarg); break;
+            case 'M': config.path_mtu = atoi(optarg); break;
+            case 'H': {
+                int hops = atoi(optarg);
+                sscanf(optarg, "%*d:%d:%d", &middlebox_hop, &quote);
+                if (hops < 1 || hops > 32) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                path.hops = hops;
+                break;
+            }
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    int tun = openTun(tun_name.c_str());
+    if (tun == -1)
+        return 1;
+    char command[256];
+    snprintf(command, sizeof(command), "ip addr add %s/24 dev %s && ip link set %s up",
+        local_address.c_str(), tun_name.c_str(), tun_name.c_str());
+    if (system(command) != 0)
+        LOGE("Configuring %s failed, configure it manually", tun_name.c_str());
+
+    uint32_t reflector = inet_addr(reflector_address.c_str());
+    // Routers at .100 up of the reflector's /24, on the TUN route
+    path.middlebox_hop = middlebox_hop >= 0 && middlebox_hop <= path.hops ? middlebox_hop : path.hops;
+    if (quote >= 8)
+        path.quote = quote;
+    path.router_base = (ntohl(reflector) & 0xFFFFFF00) + 100;
+    struct middlebox_state mb;
+    struct reflector_state refl;
+    middleboxInit(&mb, &config);
+    reflectorInit(&refl);
+
+    signal(SIGINT, stopSimulator);
+    signal(SIGTERM, stopSimulator);
+
+    std::priority_queue<sim_event, std::vector<sim_event>, sim_event_later> events;
+    sim_link links[4] = {{0}, {0}, {0}, {0}};
+    uint64_t order = 0;
+    uint32_t reflected = 0;
+    static char buffer[BUFLEN];
+    static char reply[BUFLEN];
+    struct iphdr *ip = (struct iphdr*) buffer;
+    struct tcphdr *tcp = (struct tcphdr*) (buffer + IPHDRLEN);
+
+    LOGI("Middlebox simulator on %s: %s -> %s", tun_name.c_str(),
+        local_address.c_str(), reflector_address.c_str());
+    while (running) {
+        uint64_t now = nowMicros();
+        int timeout = -1;
+        if (!events.empty())
+            timeout = events.top().release_us > now ? (events.top().release_us - now + 999) / 1000 : 0;
+
+        struct pollfd pfd = {tun, POLLIN, 0};
+        int ready = poll(&pfd, 1, timeout);
+        if (ready == -1 && errno != EINTR) {
+            LOGE("poll() failed: %s", strerror(errno));
+            break;
+        }
+        now = nowMicros();
+        if (ready > 0 && (pfd.revents & POLLIN)) {
+            int length = read(tun, buffer, BUFLEN - PHDRLEN - 1);
+            if (length >= (int) (IPHDRLEN + TCPHDRLEN) && ip->version == 4 && ip->ihl == 5
+                    && ip->protocol == IPPROTO_TCP && ip->daddr == reflector
+                    && !(tcp->rst && ip->ttl > KERNEL_RST_TTL)) {
+                if (ip->ttl <= path.hops)
+                    timeExceeded(events, &mb, &path, order, buffer, now);
+                else
+                    enqueue(events, links, &config, order, mb_uplink, buffer, length, now);
+            }
+        }
+
+        while (!events.empty() && events.top().release_us <= now) {
+            sim_event event = events.top();
+            events.pop();
+            memset(buffer, 0, sizeof(buffer));
+            memcpy(buffer, &event.packet[0], event.packet.size());
+            if (!event.router && !middleboxProcess(&mb, event.direction, ip, tcp))
+                continue;
+            if (event.direction == mb_uplink) {
+                // Bulk transfers can answer one segment with several
+                int reply_length = reflectPacket(&refl, ip, tcp, reply);
+                while (reply_length > 0) {
+                    reflected++;
+                    enqueue(events, links, &config, order, mb_downlink, reply, reply_length, now);
+                    reply_length = reflectorPending(&refl, reply);
+                }
+            } else {
+                ip->check = 0;
+                ip->check = comp_chksum((uint16_t*) ip, ip->ihl * 4);
+                if (write(tun, buffer, ntohs(ip->tot_len)) == -1)
+                    LOGE("TUN write failed: %s", strerror(errno));
+            }
+        }
+    }
+
+    LOGI("Uplink %u packets, %u rewritten; downlink %u packets, %u rewritten; %u replies",
+        mb.packets[mb_uplink], mb.rewrites[mb_uplink],
+        mb.packets[mb_downlink], mb.rewrites[mb_downlink], reflected);
+    close(tun);
+    return 0;
+}
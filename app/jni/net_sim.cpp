@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <android/log.h>
+#include "net_sim.hpp"
+#include "event_loop.hpp"
+#include "packet_meta.hpp"
+#include "packet_view.hpp"
+#include "socket_pool.hpp"
+#include "port_allocator.hpp"
+
+// Room for a burst of packets arriving at the same virtual time before the
+// engine gets to read them
+#define NET_SIM_SOCKET_BUFFER (4 << 20)
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+// The hooks are plain functions, they find the simulator here
+static struct net_sim *attached = NULL;
+
+static void digestPacket(struct net_sim *sim, middlebox_direction direction, const char *packet, size_t length)
+{
+    uint64_t digest = sim->digest ^ direction;
+    digest *= FNV_PRIME;
+    for (size_t i = 0; i < length; i++) {
+        digest ^= (uint8_t) packet[i];
+        digest *= FNV_PRIME;
+    }
+    sim->digest = digest;
+}
+
+static uint32_t nextRandom(struct net_sim *sim)
+{
+    sim->random ^= sim->random >> 12;
+    sim->random ^= sim->random << 25;
+    sim->random ^= sim->random >> 27;
+    return (sim->random * 2685821657736338717ULL) >> 32;
+}
+
+// Onto the link: lost, dropped for its size, or queued behind what is
+// already being sent and then delayed by the latency
+static void enqueue(struct net_sim *sim, middlebox_direction direction, const char *packet, int length)
+{
+    struct middlebox_config *config = &sim->middlebox.config;
+    struct packet_view view;
+    if (!viewPacket(packet, length, &view))
+        return;
+    if (config->loss_permille > 0 && view.payload_length > 0 && !view.tcp->syn
+            && nextRandom(sim) % 1000 < config->loss_permille) {
+        sim->lost++;
+        return;
+    }
+    if (config->path_mtu > 0 && length > config->path_mtu) {
+        sim->lost++;
+        return;
+    }
+    uint64_t transmission = 0;
+    if (config->rate_kbps > 0)
+        transmission = (uint64_t) length * 8 * 1000000 / config->rate_kbps;
+    uint64_t start = sim->link_free_ns[direction] > sim->now_ns ? sim->link_free_ns[direction] : sim->now_ns;
+    sim->link_free_ns[direction] = start + transmission;
+
+    net_sim_event event;
+    event.at_ns = start + transmission + (uint64_t) config->latency_ms * 1000000;
+    event.order = sim->order++;
+    event.direction = direction;
+    event.packet.assign(packet, packet + view.length);
+    sim->events.push(event);
+}
+
+// A packet at the end of the link: through the middlebox, then answered by
+// the reflector or read by every leased socket
+static void deliver(struct net_sim *sim, net_sim_event &event)
+{
+    static char buffer[BUFLEN];
+    static char reply[BUFLEN];
+    struct iphdr *ip = (struct iphdr*) buffer;
+    struct tcphdr *tcp = (struct tcphdr*) (buffer + IPHDRLEN);
+    memset(buffer, 0, sizeof(buffer));
+    memcpy(buffer, &event.packet[0], event.packet.size());
+    if (!middleboxProcess(&sim->middlebox, event.direction, ip, tcp))
+        return;
+    uint16_t length = ntohs(ip->tot_len);
+    digestPacket(sim, event.direction, buffer, length);
+    if (event.direction == mb_uplink) {
+        // Bulk transfers can answer one segment with several
+        int reply_length = reflectPacket(&sim->reflector, ip, tcp, reply);
+        while (reply_length > 0) {
+            sim->packets[mb_downlink]++;
+            enqueue(sim, mb_downlink, reply, reply_length);
+            reply_length = reflectorPending(&sim->reflector, reply);
+        }
+        return;
+    }
+    ip->check = 0;
+    ip->check = comp_chksum((uint16_t*) ip, ip->ihl * 4);
+    for (std::map<int, int>::iterator it = sim->sockets.begin(); it != sim->sockets.end(); ++it) {
+        if (send(it->second, buffer, length, MSG_DONTWAIT) == -1)
+            LOGE("Simulated socket full, packet dropped: %s", strerror(errno));
+    }
+}
+
+static uint64_t simClock()
+{
+    return attached->now_ns;
+}
+
+// Nothing ready: move the clock on to whatever happens first, the next
+// packet arriving or the loop's timeout, and deliver what is due
+static int simWait(int epoll_fd, struct epoll_event *events, int max_events, int timeout_ms)
+{
+    struct net_sim *sim = attached;
+    int ready = epoll_wait(epoll_fd, events, max_events, 0);
+    if (ready != 0)
+        return ready;
+    uint64_t deadline = timeout_ms < 0 ? UINT64_MAX : sim->now_ns + (uint64_t) timeout_ms * 1000000;
+    if (sim->events.empty() || sim->events.top().at_ns > deadline) {
+        if (timeout_ms >= 0)
+            sim->now_ns = deadline;
+        return 0;
+    }
+    if (sim->events.top().at_ns > sim->now_ns)
+        sim->now_ns = sim->events.top().at_ns;
+    while (!sim->events.empty() && sim->events.top().at_ns <= sim->now_ns) {
+        net_sim_event event = sim->events.top();
+        sim->events.pop();
+        sim->events_run++;
+        deliver(sim, event);
+    }
+    return epoll_wait(epoll_fd, events, max_events, 0);
+}
+
+static int simOpen()
+{
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) == -1) {
+        LOGE("socketpair() failed: %s", strerror(errno));
+        return -1;
+    }
+    int size = NET_SIM_SOCKET_BUFFER;
+    setsockopt(pair[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(pair[0], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    attached->sockets[pair[0]] = pair[1];
+    return pair[0];
+}
+
+static void simClose(int sock)
+{
+    std::map<int, int>::iterator it = attached->sockets.find(sock);
+    if (it == attached->sockets.end())
+        return;
+    close(it->second);
+    close(it->first);
+    attached->sockets.erase(it);
+}
+
+static int simSend(int sock, const char *packet, uint16_t length)
+{
+    struct net_sim *sim = attached;
+    sim->packets[mb_uplink]++;
+    enqueue(sim, mb_uplink, packet, length);
+    return length;
+}
+
+static const struct packet_io sim_io = {simOpen, simClose, simSend};
+
+void netSimInit(struct net_sim *sim, struct middlebox_config *config, uint64_t seed)
+{
+    middleboxInit(&sim->middlebox, config);
+    reflectorInit(&sim->reflector);
+    sim->now_ns = NET_SIM_EPOCH_NS;
+    sim->order = 0;
+    sim->events = std::priority_queue<net_sim_event, std::vector<net_sim_event>, net_sim_event_later>();
+    sim->link_free_ns[mb_uplink] = sim->link_free_ns[mb_downlink] = 0;
+    sim->random = seed != 0 ? seed : 1;
+    sim->sockets.clear();
+    sim->packets[mb_uplink] = sim->packets[mb_downlink] = 0;
+    sim->lost = 0;
+    sim->events_run = 0;
+    sim->digest = FNV_OFFSET;
+    seedIsn(seed != 0 ? seed : 1);
+}
+
+void netSimAttach(struct net_sim *sim)
+{
+    attached = sim;
+    // Quarantines are in the old clock, and a fresh range hands out the
+    // same ports on every run
+    portAllocatorInit(PORT_RANGE_FIRST, PORT_RANGE_LAST, PORT_QUARANTINE_MS);
+    setClockSource(simClock);
+    setLoopWait(simWait);
+    setPacketIo(&sim_io);
+}
+
+void netSimDetach(struct net_sim *sim)
+{
+    if (attached != sim)
+        return;
+    setPacketIo(NULL);
+    setLoopWait(NULL);
+    setClockSource(NULL);
+    while (!sim->sockets.empty())
+        simClose(sim->sockets.begin()->first);
+    attached = NULL;
+}
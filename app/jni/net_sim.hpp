@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+
+#include <stdint.h>
+#include <map>
+#include <queue>
+#include <vector>
+
+#include "middlebox.hpp"
+#include "reflector.hpp"
+
+#ifndef NET_SIM
+#define NET_SIM
+
+// Discrete-event simulation of the network the tests run over: the
+// middlebox model and the reflector in process, on a virtual clock. Once
+// attached, the clock (setClockSource), the event loop's waiting
+// (setLoopWait) and the sockets leased for probes (setPacketIo) are the
+// simulator's: packets sent cross the middlebox to the reflector and back
+// with the configured latency, throughput and loss, and whenever the loop
+// would wait, the clock jumps to the next packet arriving or timer
+// expiring. The testsuite runs unchanged, in milliseconds however long
+// its timeouts and delays are, and the same seed gives the same packets.
+//
+// Leased sockets are socket pairs, the simulator writing each packet that
+// comes back to all of them as the kernel would to every raw socket. Only
+// TCP is simulated: no ICMP, so no hop localization, and no routers.
+
+// Virtual time starts here rather than at 0, which means unset to RTTs
+#define NET_SIM_EPOCH_NS 1000000000000ULL
+
+struct net_sim_event {
+    uint64_t at_ns;
+    uint64_t order;
+    middlebox_direction direction;
+    std::vector<char> packet;
+};
+
+struct net_sim_event_later {
+    bool operator()(const net_sim_event &a, const net_sim_event &b) const {
+        if (a.at_ns != b.at_ns)
+            return a.at_ns > b.at_ns;
+        return a.order > b.order;
+    }
+};
+
+struct net_sim {
+    struct middlebox_state middlebox;
+    struct reflector_state reflector;
+    uint64_t now_ns;
+    uint64_t order;
+    std::priority_queue<net_sim_event, std::vector<net_sim_event>, net_sim_event_later> events;
+    // When each direction of the link is free again, for the throughput limit
+    uint64_t link_free_ns[2];
+    uint64_t random;            // xorshift state of the loss
+    // Leased descriptor -> the simulator's end of its pair
+    std::map<int, int> sockets;
+    // Counters
+    uint64_t packets[2];        // by direction, as sent
+    uint64_t lost;
+    uint64_t events_run;
+    // FNV-1a over every packet delivered either way, equal for equal runs
+    uint64_t digest;
+};
+
+// The middlebox config as for tcptester-mbsim; latency_ms, rate_kbps,
+// loss_permille and path_mtu apply to the simulated link. The seed also
+// seeds the ISNs of this thread (seedIsn).
+void netSimInit(struct net_sim *sim, struct middlebox_config *config, uint64_t seed);
+
+// Take over the clock, the event loop and the raw sockets for every test
+// run from now on, until netSimDetach. One simulator at a time, and tests
+// run on one thread only.
+void netSimAttach(struct net_sim *sim);
+void netSimDetach(struct net_sim *sim);
+
+#endif
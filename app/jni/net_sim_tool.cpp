@@ -0,0 +1,373 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+// Runs the testsuite against the simulated network of net_sim.hpp, in
+// virtual time: every test of the table, the proxy, reserved bitmap,
+// header echo and fusion tests and a bulk transfer each way, one after the
+// other on fresh source ports. Needs no root, no network and no reflector.
+//
+//      tcptester-netsim [-S scenario | middlebox options] [-r seed] [-t test] [-k bits] [-c runs]
+//
+// Without options the suite is run behind every scenario of scenarios(),
+// each a middlebox with the verdicts it is expected to cause; -S picks one.
+// Middlebox options as for tcptester-mbsim (-a -u -R -m -s -P -D -A -C -L
+// -b -x -M) instead make a single scenario in which every test has to pass.
+// Prints one CSV line per test:
+//      scenario,run,test,result,expected,verdict,virtual_ms
+// followed by the totals and a digest of every packet on stderr. With -c
+// each scenario is run that many times with the same seed. Fails if any
+// result differs from the expected one or a repeated run saw different packets.
+
+#include <getopt.h>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <android/log.h>
+#include "net_sim.hpp"
+#include "testsuite.hpp"
+#include "proxy_testsuite.hpp"
+#include "header_diff.hpp"
+#include "test_fusion.hpp"
+#include "bulk_transfer.hpp"
+#include "packet_meta.hpp"
+#include "test_planner.hpp"
+
+#ifndef TAG
+#define TAG "TCPTester-netsim"
+#endif
+
+// Addresses only matter to the checksums, the simulator routes everything
+#define NET_SIM_SOURCE 0x0A420001
+#define NET_SIM_DESTINATION 0x0A420002
+#define NET_SIM_PORT 80
+#define NET_SIM_BULK_LENGTH (256 * 1024)
+
+struct sim_test {
+    std::string name;
+    std::function<test_error()> fn_run;
+};
+
+// A test that is expected to fail behind a scenario's middlebox, and how
+struct sim_expectation {
+    std::string test;
+    test_error result;
+};
+
+struct sim_scenario {
+    std::string name;
+    struct middlebox_config config;
+    std::vector<sim_expectation> failures;     // every other test passes
+};
+
+struct sim_totals {
+    uint32_t passed;
+    uint32_t failed;
+    uint32_t unexpected;
+    uint64_t virtual_ns;
+};
+
+static std::vector<sim_test> suite(uint8_t reserved)
+{
+    std::vector<sim_test> tests;
+    size_t count;
+    const struct test_entry *table = allTests(&count);
+    for (size_t i = 0; i < count; i++) {
+        const struct test_entry *entry = &table[i];
+        tests.push_back((sim_test) {entry->name, [entry, reserved]() {
+            return runTest(NET_SIM_SOURCE, 0, NET_SIM_DESTINATION, NET_SIM_PORT, entry->define(reserved));
+        }});
+    }
+    tests.push_back((sim_test) {"proxy_double_syn", []() {
+        return runTest_doubleSyn(NET_SIM_SOURCE, 0, NET_SIM_DESTINATION, NET_SIM_PORT);
+    }});
+    tests.push_back((sim_test) {"reserved_bitmap", []() {
+        struct reserved_bitmap bitmap;
+        return runTest_reserved_bitmap(NET_SIM_SOURCE, 0, NET_SIM_DESTINATION, NET_SIM_PORT,
+            std::vector<uint8_t>(), &bitmap);
+    }});
+    tests.push_back((sim_test) {"header_echo", [reserved]() {
+        struct header_diff diff;
+        return runTest_header_echo(NET_SIM_SOURCE, 0, NET_SIM_DESTINATION, NET_SIM_PORT, reserved, &diff);
+    }});
+    tests.push_back((sim_test) {"fused_syn", [reserved]() {
+        struct fusion_result fusion;
+        return runTest_fusion(NET_SIM_SOURCE, NET_SIM_DESTINATION, NET_SIM_PORT, ECHO_ALL, reserved, &fusion);
+    }});
+    tests.push_back((sim_test) {"bulk_upload", []() {
+        struct bulk_result result;
+        return runTest_bulk(NET_SIM_SOURCE, 0, NET_SIM_DESTINATION, NET_SIM_PORT,
+            bulk_upload, NET_SIM_BULK_LENGTH, &result);
+    }});
+    tests.push_back((sim_test) {"bulk_download", []() {
+        struct bulk_result result;
+        return runTest_bulk(NET_SIM_SOURCE, 0, NET_SIM_DESTINATION, NET_SIM_PORT,
+            bulk_download, NET_SIM_BULK_LENGTH, &result);
+    }});
+    return tests;
+}
+
+static struct sim_scenario scenario(const char *name)
+{
+    struct sim_scenario scenario;
+    scenario.name = name;
+    memset(&scenario.config, 0, sizeof(scenario.config));
+    return scenario;
+}
+
+static void expect(struct sim_scenario &scenario, const char *test, test_error result)
+{
+    scenario.failures.push_back((sim_expectation) {test, result});
+}
+
+// The middleboxes the suite is checked against, with the verdicts of the
+// default reserved bits (-k 5)
+static std::vector<sim_scenario> scenarios()
+{
+    std::vector<sim_scenario> all;
+
+    all.push_back(scenario("clean"));
+
+    // Scrubs the fields the markers are hidden in
+    struct sim_scenario scrub = scenario("scrub_markers");
+    scrub.config.zero_ack = true;
+    scrub.config.zero_urg = true;
+    scrub.config.clear_reserved = true;
+    expect(scrub, "ack_only", receive_error_data_length);
+    expect(scrub, "urg_only", receive_error_data_length);
+    expect(scrub, "ack_urg", synack_error_urg);
+    expect(scrub, "plain_urg", synack_error_urg);
+    expect(scrub, "ack_data", synack_error_data_length);
+    expect(scrub, "ack_checksum_incorrect", synack_error_check);
+    expect(scrub, "ack_checksum_incorrect_seq", synack_error_check);
+    expect(scrub, "ack_checksum", synack_error_check);
+    expect(scrub, "urg_urg", synack_error_urg);
+    expect(scrub, "urg_checksum", synack_error_check);
+    expect(scrub, "urg_checksum_incorrect", synack_error_check);
+    expect(scrub, "reserved_syn", synack_error_res);
+    expect(scrub, "reserved_est", receive_error_res_value);
+    expect(scrub, "header_echo", test_failed);
+    expect(scrub, "fused_syn", test_failed);
+    all.push_back(scrub);
+
+    // Terminates the connection: the markers are scrubbed as above, and SACK
+    // and timestamps are not negotiated end to end
+    struct sim_scenario proxy = scrub;
+    proxy.name = "proxy";
+    memset(&proxy.config, 0, sizeof(proxy.config));
+    proxy.config.proxy = true;
+    expect(proxy, "proxy_sack_gap", option_not_found);
+    expect(proxy, "proxy_timestamping", option_not_found);
+    all.push_back(proxy);
+
+    struct sim_scenario options = scenario("strip_options");
+    options.config.strip_options = true;
+    options.config.mss_clamp = 536;
+    expect(options, "ack_checksum_incorrect", synack_error_check);
+    expect(options, "ack_checksum_incorrect_seq", synack_error_check);
+    expect(options, "ack_checksum", synack_error_check);
+    expect(options, "urg_checksum", synack_error_check);
+    expect(options, "urg_checksum_incorrect", synack_error_check);
+    expect(options, "proxy_sack_gap", option_not_found);
+    expect(options, "proxy_timestamping", option_not_found);
+    expect(options, "header_echo", test_failed);
+    expect(options, "fused_syn", test_failed);
+    all.push_back(options);
+
+    // Full sized segments vanish without an ICMP error
+    struct sim_scenario blackhole = scenario("pmtu_blackhole");
+    blackhole.config.path_mtu = 1200;
+    blackhole.config.latency_ms = 10;
+    expect(blackhole, "bulk_upload", receive_timeout);
+    expect(blackhole, "bulk_download", receive_timeout);
+    all.push_back(blackhole);
+
+    struct sim_scenario firewall = scenario("blocked_port");
+    firewall.config.drop_port = NET_SIM_PORT;
+    std::vector<sim_test> tests = suite(0);
+    for (size_t i = 0; i < tests.size(); i++)
+        expect(firewall, tests[i].name.c_str(), tests[i].name == "proxy_double_syn" ? test_failed : receive_timeout);
+    all.push_back(firewall);
+
+    struct sim_scenario ack_syn = scenario("drop_ack_syn");
+    ack_syn.config.drop_ack_syn = true;
+    expect(ack_syn, "ack_only", receive_timeout);
+    expect(ack_syn, "ack_urg", receive_timeout);
+    expect(ack_syn, "ack_data", receive_timeout);
+    expect(ack_syn, "ack_checksum_incorrect", receive_timeout);
+    expect(ack_syn, "ack_checksum_incorrect_seq", receive_timeout);
+    expect(ack_syn, "ack_checksum", receive_timeout);
+    expect(ack_syn, "header_echo", receive_timeout);
+    expect(ack_syn, "fused_syn", test_failed);
+    all.push_back(ack_syn);
+
+    // Each test's connections are gone from the table before the next one's
+    struct sim_scenario table = scenario("small_table");
+    table.config.table_size = 4;
+    table.config.latency_ms = 5;
+    all.push_back(table);
+
+    // The transfers recover from the losses
+    struct sim_scenario lossy = scenario("lossy_link");
+    lossy.config.loss_permille = 20;
+    lossy.config.latency_ms = 20;
+    lossy.config.rate_kbps = 4000;
+    all.push_back(lossy);
+    return all;
+}
+
+static const struct sim_expectation *expectation(const struct sim_scenario &scenario, const std::string &test)
+{
+    for (size_t i = 0; i < scenario.failures.size(); i++)
+        if (scenario.failures[i].test == test)
+            return &scenario.failures[i];
+    return NULL;
+}
+
+// One run of the suite on a fresh simulator
+// return   digest of the packets of the run
+static uint64_t runSuite(int run, struct sim_scenario &scenario, uint64_t seed,
+            const std::vector<sim_test> &tests, const char *only, struct sim_totals *totals)
+{
+    struct net_sim sim;
+    netSimInit(&sim, &scenario.config, seed);
+    netSimAttach(&sim);
+    for (size_t i = 0; i < tests.size(); i++) {
+        if (only != NULL && tests[i].name != only)
+            continue;
+        uint64_t started = monotonicNanos();
+        test_error result = tests[i].fn_run();
+        uint64_t elapsed = monotonicNanos() - started;
+        bool pass = result == success || result == test_complete;
+        const struct sim_expectation *failure = expectation(scenario, tests[i].name);
+        bool expected = failure == NULL ? pass : result == failure->result;
+        printf("%s,%d,%s,%d,%d,%s,%.3f\n", scenario.name.c_str(), run, tests[i].name.c_str(), result,
+            failure == NULL ? success : failure->result, pass ? "pass" : "fail", elapsed / 1e6);
+        if (pass)
+            totals->passed++;
+        else
+            totals->failed++;
+        if (!expected) {
+            fprintf(stderr, "%s: %s gave %d, expected %s\n", scenario.name.c_str(), tests[i].name.c_str(),
+                result, failure == NULL ? "a pass" : std::to_string(failure->result).c_str());
+            totals->unexpected++;
+        }
+    }
+    totals->virtual_ns += sim.now_ns - NET_SIM_EPOCH_NS;
+    netSimDetach(&sim);
+    fprintf(stderr, "%s run %d: %llu packets up, %llu down, %llu lost, %llu events, digest %016llx\n",
+        scenario.name.c_str(), run,
+        (unsigned long long) sim.packets[mb_uplink], (unsigned long long) sim.packets[mb_downlink],
+        (unsigned long long) sim.lost, (unsigned long long) sim.events_run, (unsigned long long) sim.digest);
+    return sim.digest;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-S scenario] [-a] [-u] [-R] [-m mss] [-s] [-P] [-D port] [-A] [-C n] [-L ms]"
+        " [-b kbps] [-x permille] [-M mtu] [-r seed] [-t test] [-k bits] [-c runs]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    struct sim_scenario custom = scenario("custom");
+    struct middlebox_config &config = custom.config;
+    bool configured = false;
+    const char *picked = NULL;
+    uint64_t seed = 1;
+    const char *only = NULL;
+    uint8_t reserved = 0x5;
+    int runs = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "S:auRm:sPD:AC:L:b:x:M:r:t:k:c:h")) != -1) {
+        switch (opt) {
+            case 'S': picked = optarg; break;
+            case 'a': config.zero_ack = true; configured = true; break;
+            case 'u': config.zero_urg = true; configured = true; break;
+            case 'R': config.clear_reserved = true; configured = true; break;
+            case 'm': config.mss_clamp = atoi(optarg); configured = true; break;
+            case 's': config.strip_options = true; configured = true; break;
+            case 'P': config.proxy = true; configured = true; break;
+            case 'D': config.drop_port = atoi(optarg); configured = true; break;
+            case 'A': config.drop_ack_syn = true; configured = true; break;
+            case 'C': config.table_size = atoi(optarg); configured = true; break;
+            case 'L': config.latency_ms = atoi(optarg); configured = true; break;
+            case 'b': config.rate_kbps = atoi(optarg); configured = true; break;
+            case 'x': config.loss_permille = atoi(optarg); configured = true; break;
+            case 'M': config.path_mtu = atoi(optarg); configured = true; break;
+            case 'r': seed = strtoull(optarg, NULL, 0); break;
+            case 't': only = optarg; break;
+            case 'k': reserved = strtoul(optarg, NULL, 0) & 0xF; break;
+            case 'c': runs = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    std::vector<sim_scenario> selected;
+    if (configured) {
+        if (picked != NULL) {
+            fprintf(stderr, "-S and middlebox options are exclusive\n");
+            return 1;
+        }
+        selected.push_back(custom);
+    } else {
+        std::vector<sim_scenario> all = scenarios();
+        for (size_t i = 0; i < all.size(); i++)
+            if (picked == NULL || all[i].name == picked)
+                selected.push_back(all[i]);
+        if (selected.empty()) {
+            fprintf(stderr, "Unknown scenario %s\n", picked);
+            return 1;
+        }
+    }
+    std::vector<sim_test> tests = suite(reserved);
+    if (only != NULL) {
+        bool known = false;
+        for (size_t i = 0; i < tests.size(); i++)
+            known = known || tests[i].name == only;
+        if (!known) {
+            fprintf(stderr, "Unknown test %s\n", only);
+            return 1;
+        }
+    }
+    // Every test is run, none inferred from another's outcome
+    plannerEnable(false);
+
+    printf("scenario,run,test,result,expected,verdict,virtual_ms\n");
+    struct sim_totals totals = {0, 0, 0, 0};
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    bool repeated = true;
+    for (size_t i = 0; i < selected.size(); i++) {
+        uint64_t first_digest = 0;
+        for (int run = 0; run < runs; run++) {
+            uint64_t digest = runSuite(run, selected[i], seed, tests, only, &totals);
+            if (run == 0) {
+                first_digest = digest;
+            } else if (digest != first_digest) {
+                fprintf(stderr, "%s: runs with the same seed saw different packets\n", selected[i].name.c_str());
+                repeated = false;
+            }
+        }
+    }
+    double wall_ms = std::chrono::duration_cast<std::chrono::microseconds>
+        (std::chrono::steady_clock::now() - started).count() / 1000.0;
+    fprintf(stderr, "%u passed, %u failed, %u unexpected, %.1f s virtual in %.1f ms\n", totals.passed,
+        totals.failed, totals.unexpected, totals.virtual_ns / 1e9, wall_ms);
+    return totals.unexpected == 0 && repeated ? 0 : 1;
+}
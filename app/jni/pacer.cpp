@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <sys/socket.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <linux/net_tstamp.h>
+#include <map>
+#include <utility>
+
+#include <android/log.h>
+#include "util.hpp"
+#include "packet_builder.hpp"
+#include "pacer.hpp"
+#include "packet_meta.hpp"
+
+#ifndef SO_TXTIME
+#define SO_TXTIME 61
+#define SCM_TXTIME SO_TXTIME
+#endif
+
+// Idle buckets are refilled anyway, so they are dropped once this many
+// are kept to bound memory on long sweeps
+#define PACER_MAX_BUCKETS 4096
+
+struct token_bucket {
+    double tokens;
+    uint64_t updated_ns;
+};
+
+struct pacer_state {
+    pthread_mutex_t lock;
+    struct pacer_config config;
+    bool enabled;
+    struct token_bucket global;
+    std::map<uint32_t, struct token_bucket> destinations;
+    std::map<std::pair<uint32_t, uint16_t>, struct token_bucket> ports;
+    struct pacer_stats stats;
+};
+
+static struct pacer_state pacer = {PTHREAD_MUTEX_INITIALIZER};
+
+// Refill the bucket up to now and return the earliest time it holds a token.
+// Tokens go negative when packets are scheduled ahead of the refill
+static uint64_t bucketReady(struct token_bucket *bucket, uint32_t rate, uint64_t now) {
+    if (bucket->updated_ns == 0) {
+        bucket->tokens = pacer.config.burst;
+        bucket->updated_ns = now;
+    }
+    if (now > bucket->updated_ns) {
+        bucket->tokens += (double) (now - bucket->updated_ns) * rate / 1e9;
+        if (bucket->tokens > pacer.config.burst)
+            bucket->tokens = pacer.config.burst;
+        bucket->updated_ns = now;
+    }
+    if (bucket->tokens >= 1)
+        return now;
+    return now + (uint64_t) ((1 - bucket->tokens) * 1e9 / rate);
+}
+
+template <typename K>
+static void pruneBuckets(std::map<K, struct token_bucket> &buckets, uint32_t rate, uint64_t now) {
+    if (buckets.size() < PACER_MAX_BUCKETS)
+        return;
+    uint64_t refill_ns = (uint64_t) (pacer.config.burst * 1e9 / rate);
+    for (typename std::map<K, struct token_bucket>::iterator it = buckets.begin(); it != buckets.end();) {
+        if (it->second.updated_ns + refill_ns < now && it->second.tokens >= 0)
+            buckets.erase(it++);
+        else
+            ++it;
+    }
+}
+
+// Reserve a token in every bucket of the destination
+// return   departure time of the packet
+static uint64_t pacerSchedule(uint32_t daddr, uint16_t dport, uint64_t now) {
+    struct token_bucket *buckets[3];
+    uint32_t rates[3];
+    int count = 0;
+    uint64_t departure = now;
+
+    pthread_mutex_lock(&pacer.lock);
+    struct pacer_config *config = &pacer.config;
+    if (config->global_pps > 0) {
+        rates[count] = config->global_pps;
+        buckets[count++] = &pacer.global;
+    }
+    if (config->destination_pps > 0) {
+        pruneBuckets(pacer.destinations, config->destination_pps, now);
+        rates[count] = config->destination_pps;
+        buckets[count++] = &pacer.destinations[daddr];
+    }
+    if (config->port_pps > 0) {
+        pruneBuckets(pacer.ports, config->port_pps, now);
+        rates[count] = config->port_pps;
+        buckets[count++] = &pacer.ports[std::make_pair(daddr, dport)];
+    }
+    for (int i = 0; i < count; i++) {
+        uint64_t ready = bucketReady(buckets[i], rates[i], now);
+        if (ready > departure)
+            departure = ready;
+    }
+    for (int i = 0; i < count; i++)
+        buckets[i]->tokens -= 1;
+
+    pacer.stats.packets++;
+    if (departure > now)
+        pacer.stats.delayed++;
+    pthread_mutex_unlock(&pacer.lock);
+    return departure;
+}
+
+void pacerConfigure(const struct pacer_config *config) {
+    pthread_mutex_lock(&pacer.lock);
+    pacer.config = *config;
+    if (pacer.config.burst == 0)
+        pacer.config.burst = 1;
+    pacer.enabled = config->global_pps > 0 || config->destination_pps > 0 || config->port_pps > 0;
+    pacer.global.updated_ns = 0;
+    pacer.destinations.clear();
+    pacer.ports.clear();
+    memset(&pacer.stats, 0, sizeof(pacer.stats));
+    pthread_mutex_unlock(&pacer.lock);
+    if (pacer.enabled)
+        LOGI("Pacing at %u pps global, %u per destination, %u per port, burst %u%s",
+            config->global_pps, config->destination_pps, config->port_pps, pacer.config.burst,
+            config->use_txtime ? ", SO_TXTIME" : "");
+}
+
+bool pacerEnabled() {
+    return pacer.enabled;
+}
+
+void pacerSetupSocket(int sock) {
+    if (!pacer.enabled || !pacer.config.use_txtime)
+        return;
+    struct sock_txtime txtime;
+    memset(&txtime, 0, sizeof(txtime));
+    txtime.clockid = CLOCK_MONOTONIC;
+    if (setsockopt(sock, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)) == -1)
+        LOGE("setsockopt SO_TXTIME failed, pacing by sleeping: %s", strerror(errno));
+}
+
+static bool txtimeEnabled(int sock) {
+    struct sock_txtime txtime;
+    socklen_t length = sizeof(txtime);
+    return pacer.config.use_txtime
+        && getsockopt(sock, SOL_SOCKET, SO_TXTIME, &txtime, &length) == 0 && length > 0
+        && txtime.clockid == CLOCK_MONOTONIC;
+}
+
+bool pacerSleeps(int sock) {
+    return pacer.enabled && !txtimeEnabled(sock);
+}
+
+uint64_t pacerReserve(const char *buffer, struct sockaddr_in *dst) {
+    const struct tcphdr *tcp = (const struct tcphdr*) (buffer + IPHDRLEN);
+    return pacerSchedule(dst->sin_addr.s_addr, ntohs(tcp->dest), monotonicNanos());
+}
+
+// Count a packet the socket took, at the time it left
+static void pacerSent(uint64_t sent_ns) {
+    pthread_mutex_lock(&pacer.lock);
+    if (pacer.stats.sent == 0 || sent_ns < pacer.stats.first_ns)
+        pacer.stats.first_ns = sent_ns;
+    if (sent_ns > pacer.stats.last_ns)
+        pacer.stats.last_ns = sent_ns;
+    pacer.stats.sent++;
+    pthread_mutex_unlock(&pacer.lock);
+}
+
+static int sendAt(int sock, const char *buffer, uint16_t len, struct sockaddr_in *dst, uint64_t departure,
+            bool txtime) {
+    int bytes;
+    if (txtime) {
+        struct iovec iov = {(void*) buffer, len};
+        char control[CMSG_SPACE(sizeof(uint64_t))];
+        memset(control, 0, sizeof(control));
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = dst;
+        msg.msg_namelen = sizeof(*dst);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TXTIME;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+        memcpy(CMSG_DATA(cmsg), &departure, sizeof(departure));
+        bytes = sendmsg(sock, &msg, 0);
+    } else {
+        bytes = sendto(sock, buffer, len, 0, (struct sockaddr*) dst, sizeof(*dst));
+    }
+    if (bytes >= 0 && pacer.enabled) {
+        // The qdisc holds SO_TXTIME packets until their departure time
+        uint64_t now = monotonicNanos();
+        pacerSent(txtime && departure > now ? departure : now);
+    }
+    return bytes;
+}
+
+int pacerSendAt(int sock, const char *buffer, uint16_t len, struct sockaddr_in *dst, uint64_t departure) {
+    return sendAt(sock, buffer, len, dst, departure, txtimeEnabled(sock));
+}
+
+int pacedSend(int sock, const char *buffer, uint16_t len, struct sockaddr_in *dst) {
+    // SO_TXTIME departure times are on CLOCK_MONOTONIC
+    uint64_t departure = pacerReserve(buffer, dst);
+    bool txtime = txtimeEnabled(sock);
+    if (!txtime && departure > monotonicNanos()) {
+        struct timespec until;
+        until.tv_sec = departure / 1000000000ULL;
+        until.tv_nsec = departure % 1000000000ULL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR);
+    }
+    return sendAt(sock, buffer, len, dst, departure, txtime);
+}
+
+void pacerGetStats(struct pacer_stats *stats) {
+    pthread_mutex_lock(&pacer.lock);
+    *stats = pacer.stats;
+    pthread_mutex_unlock(&pacer.lock);
+    stats->achieved_pps = 0;
+    if (stats->sent > 1 && stats->last_ns > stats->first_ns)
+        stats->achieved_pps = (stats->sent - 1) * 1e9 / (stats->last_ns - stats->first_ns);
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#ifndef PACER
+#define PACER
+
+// Probe emission pacing in front of sendPacket. Every packet needs a token
+// from three token buckets: the global one, one per destination address and
+// one per destination address and port. A packet without tokens is given a
+// departure time when all three buckets will have refilled, and either held
+// back until then or, with SO_TXTIME, handed to the kernel straight away
+// with that departure time (needs the fq or etf qdisc to be honoured).
+//
+// Buckets are reserved in order of sending, so concurrent probes get their
+// departure times first come first served.
+
+struct pacer_config {
+    uint32_t global_pps;        // packets per second, 0 for unlimited
+    uint32_t destination_pps;
+    uint32_t port_pps;
+    uint32_t burst;             // bucket depth in packets, at least 1
+    bool use_txtime;            // schedule with SO_TXTIME instead of sleeping
+};
+
+struct pacer_stats {
+    uint64_t packets;           // packets given tokens
+    uint64_t delayed;           // packets that had to wait for tokens
+    uint64_t sent;              // packets the socket took
+    uint64_t first_ns;          // when the first and last of them were sent:
+    uint64_t last_ns;           // the send returned, or with SO_TXTIME the
+                                // departure time the qdisc holds it to
+    double achieved_pps;        // over the sends
+};
+
+// Set the rates for the following sends and reset the statistics.
+// Pacing is off while all rates are 0 (the default)
+void pacerConfigure(const struct pacer_config *config);
+// Whether any rate is set
+bool pacerEnabled();
+
+// Enable SO_TXTIME on a raw socket if configured. Falls back to sleeping
+// if the kernel does not support it
+void pacerSetupSocket(int sock);
+
+// Send a complete IP packet through the buckets of its destination.
+// Sleeps until the departure time unless the socket has SO_TXTIME enabled
+// return   bytes sent or -1 as sendto()
+int pacedSend(int sock, const char *buffer, uint16_t len, struct sockaddr_in *dst);
+
+// Whether pacedSend on the socket would sleep: pacing is on and the socket
+// has no SO_TXTIME. Event loops must not, they hold packets themselves:
+// pacerReserve takes the tokens and gives the departure time (on
+// monotonicNanos()), pacerSendAt sends once it has come.
+bool pacerSleeps(int sock);
+uint64_t pacerReserve(const char *buffer, struct sockaddr_in *dst);
+// Send a packet whose tokens are reserved, at departure with SO_TXTIME,
+// right away otherwise
+// return   bytes sent or -1 as sendto()
+int pacerSendAt(int sock, const char *buffer, uint16_t len, struct sockaddr_in *dst, uint64_t departure);
+
+// Emission statistics since the last pacerConfigure
+void pacerGetStats(struct pacer_stats *stats);
+
+#endif
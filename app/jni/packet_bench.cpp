@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Microbenchmarks of the per-packet paths: packet building, options,
+// checksums and the SYNACK/SACK handling, over packets generated by the
+// in-process reflector. Built with debug logging compiled out.
+//
+// Output is one JSON object per line (or CSV with -c):
+//      name, iterations, ns_per_op, allocs_per_op, bytes_per_op, cycles_per_byte
+// cycles_per_byte is -1 where hardware counters are not available.
+
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <android/log.h>
+#include "testsuite.hpp"
+#include "reflector.hpp"
+
+// Every operator new in the process is counted, std::function and
+// container allocations on the measured paths show up as allocs_per_op
+static uint64_t allocations = 0;
+
+void *operator new(size_t size) {
+    allocations++;
+    void *p = malloc(size ? size : 1);
+    if (p == NULL)
+        abort();
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+struct bench_options {
+    bool csv;
+    uint64_t target_ms;
+    std::string filter;
+};
+
+struct bench_packet {
+    std::vector<char> data;
+};
+
+static char work[BUFLEN];
+
+static int openCycleCounter() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t readCycles(int fd) {
+    uint64_t value = 0;
+    if (fd == -1 || read(fd, &value, sizeof(value)) != sizeof(value))
+        return 0;
+    return value;
+}
+
+// Run op(i) for the target time and print the result line.
+// bytes is the number of packet bytes a single op touches
+static void runBench(struct bench_options *options, int cycles_fd, const char *name,
+            size_t bytes, std::function<void(uint64_t)> op)
+{
+    if (!options->filter.empty() && std::string(name).find(options->filter) == std::string::npos)
+        return;
+    // Warm up and calibrate the batch size to roughly 10ms
+    uint64_t batch = 1;
+    while (true) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < batch; i++)
+            op(i);
+        uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        if (elapsed > 10000000 || batch >= (1ULL << 30))
+            break;
+        batch *= 2;
+    }
+
+    uint64_t iterations = 0;
+    uint64_t elapsed = 0;
+    uint64_t allocations_start = allocations;
+    if (cycles_fd != -1) {
+        ioctl(cycles_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(cycles_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (elapsed < options->target_ms * 1000000) {
+        for (uint64_t i = 0; i < batch; i++)
+            op(iterations + i);
+        iterations += batch;
+        elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+    if (cycles_fd != -1)
+        ioctl(cycles_fd, PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t cycles = readCycles(cycles_fd);
+
+    double ns_per_op = (double) elapsed / iterations;
+    double allocs_per_op = (double) (allocations - allocations_start) / iterations;
+    double cycles_per_byte = cycles > 0 && bytes > 0 ? (double) cycles / iterations / bytes : -1;
+    if (options->csv)
+        printf("%s,%llu,%.2f,%.3f,%zu,%.3f\n", name, (unsigned long long) iterations,
+            ns_per_op, allocs_per_op, bytes, cycles_per_byte);
+    else
+        printf("{\"name\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.2f,\"allocs_per_op\":%.3f,"
+            "\"bytes_per_op\":%zu,\"cycles_per_byte\":%.3f}\n", name, (unsigned long long) iterations,
+            ns_per_op, allocs_per_op, bytes, cycles_per_byte);
+    fflush(stdout);
+}
+
+// SYNACKs and data responses of the reflector to the testsuite's SYNs,
+// the same mix of packets the engine receives during a full run
+static void buildResponseMix(struct sockaddr_in *src, struct sockaddr_in *dst,
+            std::vector<bench_packet> &synacks, std::vector<bench_packet> &responses)
+{
+    uint32_t syn_acks[] = {0xbeef0001, 0xbeef0003, 0xbeef0005, 0xbeef0006, 0xbeef000B, 0xbeef000D, 0};
+    struct reflector_state refl;
+    static char packet[BUFLEN];
+    static char reply[BUFLEN];
+    struct iphdr *ip = (struct iphdr*) packet;
+    struct tcphdr *tcp = (struct tcphdr*) (packet + IPHDRLEN);
+    reflectorInit(&refl);
+
+    for (size_t i = 0; i < sizeof(syn_acks) / sizeof(syn_acks[0]); i++) {
+        buildTcpSyn(src, dst, ip, tcp, 1000 * i);
+        addSynExtras(syn_acks[i], 0, 0, ip, tcp, NULL);
+        int length = reflectPacket(&refl, ip, tcp, reply);
+        bench_packet synack;
+        synack.data.assign(reply, reply + length);
+        synacks.push_back(synack);
+
+        char payload[] = "HELLO_0xbeef0001";
+        buildTcpAck(src, dst, ip, tcp, 1000 * i + 1, 12346);
+        appendData(payload, strlen(payload), ip, tcp);
+        length = reflectPacket(&refl, ip, tcp, reply);
+        bench_packet response;
+        response.data.assign(reply, reply + length);
+        responses.push_back(response);
+    }
+}
+
+// Packets carrying the options the engine looks for
+static void buildOptionMix(struct sockaddr_in *src, struct sockaddr_in *dst,
+            std::vector<bench_packet> &packets)
+{
+    struct iphdr *ip = (struct iphdr*) work;
+    struct tcphdr *tcp = (struct tcphdr*) (work + IPHDRLEN);
+    char mss[] = {0x05, 0x28};
+    char timestamp[8] = {0, 0, 0, 1, 0, 0, 0, 0};
+    for (int i = 0; i < 4; i++) {
+        buildTcpSyn(src, dst, ip, tcp, 0);
+        if (i == 1)
+            appendTcpOption(TCPOPT_MAXSEG, TCPOLEN_MAXSEG, mss, ip, tcp, NULL);
+        if (i >= 2)
+            appendTcpOption(TCPOPT_SACK_PERMITTED, TCPOLEN_SACK_PERMITTED, NULL, ip, tcp, NULL);
+        if (i == 3)
+            appendTcpOption(TCPOPT_TIMESTAMP, TCPOLEN_TIMESTAMP, timestamp, ip, tcp, NULL);
+        bench_packet packet;
+        packet.data.assign(work, work + ntohs(ip->tot_len));
+        packets.push_back(packet);
+    }
+}
+
+static inline void loadPacket(const bench_packet &packet) {
+    memcpy(work, &packet.data[0], packet.data.size());
+}
+
+static size_t averageLength(const std::vector<bench_packet> &packets) {
+    size_t total = 0;
+    for (size_t i = 0; i < packets.size(); i++)
+        total += packets[i].data.size();
+    return total / packets.size();
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_options options;
+    options.csv = false;
+    options.target_ms = 200;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "ct:b:h")) != -1) {
+        switch (opt) {
+            case 'c': options.csv = true; break;
+            case 't': options.target_ms = atoi(optarg); break;
+            case 'b': options.filter = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-c] [-t ms per benchmark] [-b name filter]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    struct sockaddr_in src, dst;
+    src.sin_family = AF_INET;
+    src.sin_port = htons(40000);
+    src.sin_addr.s_addr = inet_addr("10.66.187.126");
+    dst.sin_family = AF_INET;
+    dst.sin_port = htons(6969);
+    dst.sin_addr.s_addr = inet_addr("192.95.61.160");
+
+    std::vector<bench_packet> synacks, responses, optioned;
+    buildResponseMix(&src, &dst, synacks, responses);
+    buildOptionMix(&src, &dst, optioned);
+
+    struct iphdr *ip = (struct iphdr*) work;
+    struct tcphdr *tcp = (struct tcphdr*) (work + IPHDRLEN);
+    struct tcp_opt state;
+    memset(&state, 0, sizeof(state));
+    int cycles_fd = openCycleCounter();
+    if (options.csv)
+        printf("name,iterations,ns_per_op,allocs_per_op,bytes_per_op,cycles_per_byte\n");
+
+    runBench(&options, cycles_fd, "buildTcpSyn", IPHDRLEN + TCPHDRLEN, [&](uint64_t i) {
+        buildTcpSyn(&src, &dst, ip, tcp, (uint32_t) i);
+    });
+    runBench(&options, cycles_fd, "buildTcpAck", IPHDRLEN + TCPHDRLEN, [&](uint64_t i) {
+        buildTcpAck(&src, &dst, ip, tcp, (uint32_t) i, 12346);
+    });
+
+    char payload[] = "HELLO_0xbeef0001";
+    char gap_payload[0xBE];
+    memset(gap_payload, 'a', sizeof(gap_payload));
+    runBench(&options, cycles_fd, "appendData/16B", IPHDRLEN + TCPHDRLEN + 16, [&](uint64_t i) {
+        buildTcpAck(&src, &dst, ip, tcp, (uint32_t) i, 12346);
+        appendData(payload, 16, ip, tcp);
+    });
+    runBench(&options, cycles_fd, "appendData/190B", IPHDRLEN + TCPHDRLEN + sizeof(gap_payload), [&](uint64_t i) {
+        buildTcpAck(&src, &dst, ip, tcp, (uint32_t) i, 12346);
+        appendData(gap_payload, sizeof(gap_payload), ip, tcp);
+    });
+
+    char timestamp[8] = {0, 0, 0, 1, 0, 0, 0, 0};
+    runBench(&options, cycles_fd, "appendTcpOption/sackok+ts", IPHDRLEN + TCPHDRLEN + 16, [&](uint64_t i) {
+        buildTcpSyn(&src, &dst, ip, tcp, (uint32_t) i);
+        appendTcpOption(TCPOPT_SACK_PERMITTED, TCPOLEN_SACK_PERMITTED, NULL, ip, tcp, &state);
+        appendTcpOption(TCPOPT_TIMESTAMP, TCPOLEN_TIMESTAMP, timestamp, ip, tcp, &state);
+    });
+
+    runBench(&options, cycles_fd, "hasTcpOption/mix", averageLength(optioned), [&](uint64_t i) {
+        loadPacket(optioned[i % optioned.size()]);
+        hasTcpOption(TCPOPT_TIMESTAMP, ip, tcp, &state);
+        hasTcpOption(TCPOPT_SACK_PERMITTED, ip, tcp, &state);
+    });
+
+    runBench(&options, cycles_fd, "comp_chksum/40B", IPHDRLEN + TCPHDRLEN, [&](uint64_t i) {
+        work[0] = (char) i;
+        volatile uint16_t check = comp_chksum((uint16_t*) work, IPHDRLEN + TCPHDRLEN);
+        (void) check;
+    });
+    runBench(&options, cycles_fd, "comp_chksum/1500B", 1500, [&](uint64_t i) {
+        work[0] = (char) i;
+        volatile uint16_t check = comp_chksum((uint16_t*) work, 1500);
+        (void) check;
+    });
+
+    runBench(&options, cycles_fd, "undo_natting/synack", averageLength(synacks), [&](uint64_t i) {
+        loadPacket(synacks[i % synacks.size()]);
+        volatile uint16_t check = undo_natting(ip, tcp);
+        volatile uint16_t check_seq = undo_natting_seq(ip, tcp);
+        (void) check;
+        (void) check_seq;
+    });
+
+    // Expected values matching each SYNACK of the mix, so that every
+    // check passes and the failure logging stays off the measured path
+    char synack_payload[] = "0B";
+    std::vector<packetChecker> synack_checkers;
+    uint16_t expect_urg[] = {0, 0xbe03, 0, 0, 0, 0, 0xbe04};
+    uint16_t expect_check[] = {0, 0, 0xbeef, 0xbeef, 0, 0xbeee, 0};
+    for (size_t i = 0; i < synacks.size(); i++) {
+        uint16_t length = i == 4 ? 2 : 0;
+        synack_checkers.push_back(std::bind(checkTcpSynAck, expect_urg[i], expect_check[i], 0,
+            synack_payload, length, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+    }
+    runBench(&options, cycles_fd, "checkTcpSynAck/synack", averageLength(synacks), [&](uint64_t i) {
+        size_t n = i % synacks.size();
+        loadPacket(synacks[n]);
+        volatile test_error ret = checkTcpSynAck(expect_urg[n], expect_check[n], 0,
+            synack_payload, n == 4 ? 2 : 0, ip, tcp, &state);
+        (void) ret;
+    });
+    runBench(&options, cycles_fd, "checkTcpSynAck/packetChecker", averageLength(synacks), [&](uint64_t i) {
+        size_t n = i % synacks.size();
+        loadPacket(synacks[n]);
+        volatile test_error ret = synack_checkers[n](ip, tcp, &state);
+        (void) ret;
+    });
+
+    // Out of order arrival of 4 segments, reset every sequence
+    std::vector<bench_packet> segments;
+    uint32_t order[] = {2, 0, 3, 1};
+    for (int i = 0; i < 4; i++) {
+        buildTcpAck(&dst, &src, ip, tcp, 12346 + order[i] * 100, 1);
+        char data[100];
+        memset(data, 'b', sizeof(data));
+        appendData(data, sizeof(data), ip, tcp);
+        bench_packet segment;
+        segment.data.assign(work, work + ntohs(ip->tot_len));
+        segments.push_back(segment);
+    }
+    runBench(&options, cycles_fd, "sackResponseHandler/reorder", averageLength(segments), [&](uint64_t i) {
+        if (i % segments.size() == 0) {
+            state.sack_ok = 1;
+            state.num_sacks = 0;
+            state.rcv_nxt = 12346;
+            memset(state.selective_acks, 0, sizeof(state.selective_acks));
+        }
+        loadPacket(segments[i % segments.size()]);
+        sackResponseHandler(ip, tcp, &state);
+    });
+
+    if (cycles_fd != -1)
+        close(cycles_fd);
+    return 0;
+}
@@ -14,8 +14,10 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
  
+#include <time.h>
 #include <android/log.h>
 #include "packet_builder.hpp"
+#include "packet_view.hpp"
 
 void concatPacketModifiers(packetModifier a, packetModifier b, 
             struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state)
@@ -83,6 +85,59 @@ void recomputeTcpChecksum(struct iphdr *ip, struct tcphdr *tcp) {
     tcp->check = tcpChecksum(ip, tcp);
 }
 
+// 16 bit one's complement sum in memory order, not folded
+static uint32_t partialSum(const char *data, int length, uint32_t sum)
+{
+    uint16_t word;
+    for (; length > 1; data += 2, length -= 2) {
+        memcpy(&word, data, 2);
+        sum += word;
+    }
+    if (length > 0) {
+        word = 0;
+        memcpy(&word, data, 1);
+        sum += word;
+    }
+    return sum;
+}
+
+void buildSegment(const struct iphdr *ip, const struct tcphdr *tcp, uint32_t seq,
+            const char *payload, uint16_t length, struct tcp_segment *segment)
+{
+    uint16_t tcphdrlen = tcp->doff * 4;
+    segment->header_length = IPHDRLEN + tcphdrlen;
+    memcpy(segment->header, ip, IPHDRLEN);
+    memcpy(segment->header + IPHDRLEN, tcp, tcphdrlen);
+    segment->payload = payload;
+    segment->payload_length = length;
+
+    struct iphdr *seg_ip = (struct iphdr*) segment->header;
+    struct tcphdr *seg_tcp = (struct tcphdr*) (segment->header + IPHDRLEN);
+    seg_ip->tot_len = htons(segment->header_length + length);
+    seg_tcp->seq = htonl(seq);
+    seg_tcp->check = 0;
+    struct pseudohdr pseudoheader = {seg_ip->saddr, seg_ip->daddr, 0, seg_ip->protocol,
+        htons(tcphdrlen + length)};
+    uint32_t sum = partialSum((const char*) &pseudoheader, PHDRLEN, 0);
+    sum = partialSum((const char*) seg_tcp, tcphdrlen, sum);
+    sum = partialSum(payload, length, sum);
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    seg_tcp->check = ~sum;
+}
+
+void segmentPayload(const struct iphdr *ip, const struct tcphdr *tcp, const char *payload,
+            uint32_t length, uint16_t mss, std::vector<struct tcp_segment> &segments)
+{
+    uint32_t seq = ntohl(tcp->seq);
+    size_t first = segments.size();
+    segments.resize(first + (length + mss - 1) / mss);
+    for (uint32_t offset = 0; offset < length; offset += mss) {
+        uint16_t chunk = length - offset < mss ? length - offset : mss;
+        buildSegment(ip, tcp, seq + offset, payload + offset, chunk, &segments[first + offset / mss]);
+    }
+}
+
 void appendData(char data[], uint16_t datalen, struct iphdr *ip, struct tcphdr *tcp) {
     LOGD("Appending %d bytes of TCP data", datalen);
     char *dataStart = (char*) ip + IPHDRLEN + (tcp->doff * 4);
@@ -114,13 +169,37 @@ void tcpDefaultFields(struct tcphdr *tcp, uint16_t source, uint16_t dest, uint32
     tcp->urg_ptr    = 0;
 }
 
+// xorshift64* state, seeded per thread on first use
+static __thread uint64_t isn_state = 0;
+
+uint32_t randomIsn()
+{
+    if (isn_state == 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        isn_state = ((uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec)
+            ^ ((uint64_t) (uintptr_t) &isn_state << 16) ^ getpid();
+        if (isn_state == 0)
+            isn_state = 1;
+    }
+    isn_state ^= isn_state >> 12;
+    isn_state ^= isn_state << 25;
+    isn_state ^= isn_state >> 27;
+    return (isn_state * 2685821657736338717ULL) >> 32;
+}
+
+void seedIsn(uint64_t seed)
+{
+    isn_state = seed;
+}
+
 // Build a TCP/IP SYN packet with the given
 // ACK number, URG pointer and reserved field values
 // Packet is pass-by-reference, new values stored there
 void buildTcpSyn(struct sockaddr_in *src, struct sockaddr_in *dst,
             struct iphdr *ip, struct tcphdr *tcp) 
 {
-    uint32_t initial_seq = htonl(random() % 65535);
+    uint32_t initial_seq = htonl(randomIsn());
     buildTcpSyn(src, dst, ip, tcp, initial_seq);
 }
 void buildTcpSyn(struct sockaddr_in *src, struct sockaddr_in *dst,
@@ -236,39 +315,21 @@ void appendTcpOption(uint8_t option_kind, uint8_t option_length, char option_dat
 }
 
 test_error hasTcpOption(uint8_t option_kind, struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state) {
-    uint8_t *currentOption = (uint8_t*) ip + IPHDRLEN + TCPHDRLEN;
-    uint8_t optionOffset = 0;
-    bool optionFound = false;
-    uint8_t optionsLength = tcp->doff * 4 - TCPHDRLEN;
-    // Iterate through all the options, looking for the current one
-    while (optionOffset < optionsLength) {
-        uint8_t c_option_kind = *(currentOption + optionOffset);
-        // End of Option List
-        if (c_option_kind == 0)
-            break;
-        // NOP
-        if (c_option_kind == 1) {
-            optionOffset++;
-            continue;
-        }
-        if (c_option_kind == option_kind) {
-            optionFound = true;
-            break;
-        }
-        uint8_t c_optionOffset = *(currentOption + optionOffset + 1);
-        optionOffset = optionOffset + c_optionOffset + 1;
-    }
+    struct packet_view view;
+    struct tcp_option_view option;
+    bool optionFound = viewPacket(ip, tcp, &view) && findTcpOption(&view, option_kind, &option);
     if (optionFound) {
         if (option_kind == TCPOPT_SACK)
             conn_state->sack_ok = true;
-        if (option_kind == TCPOPT_TIMESTAMP) {
+        if (option_kind == TCPOPT_TIMESTAMP && option.length == TCPOLEN_TIMESTAMP) {
             conn_state->tstamp_ok = true;
             uint32_t TSval = 0;
-            TSval = ntohl(*(uint32_t *) (currentOption + optionOffset + 1 + 1));
+            memcpy(&TSval, option.data, sizeof(TSval));
+            TSval = ntohl(TSval);
             // FIXME: rcv_nxt not completely correct
             // should be SEG.TSval >= TS.Recent and SEG.SEQ <= Last.ACK.sent
-            LOGD("Check for timestamp: %u, seq %u", TSval, ntohl(tcp->seq));
-            if ((TSval >= conn_state->ts_recent && ntohl(tcp->seq) <= conn_state->rcv_nxt-1) || tcp->syn) {
+            LOGD("Check for timestamp: %u, seq %u", TSval, view.seq);
+            if ((TSval >= conn_state->ts_recent && view.seq <= conn_state->rcv_nxt-1) || tcp->syn) {
                 conn_state->ts_recent = TSval;
                 LOGD("New ts_recent %u", conn_state->ts_recent);
             }
@@ -284,6 +345,24 @@ test_error hasTcpOption(uint8_t option_kind, struct iphdr *ip, struct tcphdr *tc
     }
 }
 
+bool readAddressEcho(struct iphdr *ip, struct tcphdr *tcp, uint32_t *address, uint16_t *port)
+{
+    struct packet_view view;
+    struct tcp_option_view option;
+    uint16_t offset = 0;
+    if (!viewPacket(ip, tcp, &view))
+        return false;
+    while (nextTcpOption(&view, &offset, &option)) {
+        if (option.kind == TCPOPT_ADDRESS_ECHO && option.length == TCPOLEN_ADDRESS_ECHO
+                && ((option.data[0] << 8) | option.data[1]) == ADDRESS_ECHO_EXID) {
+            memcpy(address, option.data + 2, sizeof(*address));
+            memcpy(port, option.data + 6, sizeof(*port));
+            return true;
+        }
+    }
+    return false;
+}
+
 void setRes(uint8_t res, struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state) {
     tcp->res1 = (res & 0xF);
     recomputeTcpChecksum(ip, tcp);
@@ -318,7 +397,7 @@ void appendTimestamp(struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_
 
 void removeSackBlock(int block, struct tcp_opt *conn_state) {
     // Remove this element by shifting others
-    for (int j = block+1; j < conn_state->num_sacks; block++) {
+    for (int j = block+1; j < conn_state->num_sacks; j++) {
         conn_state->selective_acks[j-1].start_seq = conn_state->selective_acks[j].start_seq;
         conn_state->selective_acks[j-1].end_seq = conn_state->selective_acks[j].end_seq;
     }
@@ -338,11 +417,12 @@ void insertSackBlock(tcp_sack_block block, struct tcp_opt *conn_state) {
         while (block.start_seq > conn_state->selective_acks[pos].start_seq && pos < conn_state->num_sacks) {
             pos++;
         }
-        for (int i = pos; i < arrlen - 1; i++) {
+        for (int i = arrlen - 2; i >= pos; i--) {
             conn_state->selective_acks[i+1].start_seq = conn_state->selective_acks[i].start_seq;
             conn_state->selective_acks[i+1].end_seq = conn_state->selective_acks[i].end_seq;
         }
         conn_state->selective_acks[pos].start_seq = block.start_seq;
         conn_state->selective_acks[pos].end_seq = block.end_seq;
+        conn_state->num_sacks++;
     }
 }
\ No newline at end of file
@@ -14,6 +14,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
  
+#ifndef PACKET_BUILDER
+#define PACKET_BUILDER
 
 #include <sys/types.h>
 #include <stdio.h>
@@ -28,6 +30,7 @@
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 #include <functional>
+#include <vector>
 
 #include "tcp_opt.h"
 #include "util.hpp"
@@ -61,6 +64,19 @@
 
 #define TCPOPT_TSTAMP_HDR (TCPOPT_NOP<<24|TCPOPT_NOP<<16|TCPOPT_TIMESTAMP<<8|TCPOLEN_TIMESTAMP)
 
+// Address echo on the reflector's SYNACKs: the client address and port as
+// seen by the server, in an experimental option (RFC 6994):
+//      253, 10, ExID(2), address(4), port(2)
+#define TCPOPT_ADDRESS_ECHO 253
+#define TCPOLEN_ADDRESS_ECHO 10
+#define ADDRESS_ECHO_EXID 0x5450
+
+// Header echo: SYN markers of a connection the reflector answers GETHDR on
+// (see header_diff.hpp), and the largest IP plus TCP header it echoes
+#define HEADER_ECHO_ACK 0xbeef0010
+#define HEADER_ECHO_URG 0xbe10
+#define HEADER_ECHO_MAX (60 + 60)
+
 
 struct pseudohdr {
     uint32_t src_addr;
@@ -75,6 +91,12 @@ typedef std::function< void(struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt
 void concatPacketModifiers(packetModifier a, packetModifier b, struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state);
 test_error concatPacketCheckers(packetChecker a, packetChecker b, struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state);
 
+// Random 32 bit initial sequence number, from a per thread generator
+uint32_t randomIsn();
+// Restart this thread's generator from a seed (0 - from the clock again),
+// for runs that have to repeat exactly
+void seedIsn(uint64_t seed);
+
 void buildTcpSyn(struct sockaddr_in *src, struct sockaddr_in *dst,
             struct iphdr *ip, struct tcphdr *tcp);
 
@@ -89,8 +111,36 @@ void appendTcpOption(uint8_t option_kind, uint8_t option_length, char option_dat
 
 test_error hasTcpOption(uint8_t option_kind, struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state);
 
+// Address and port (network byte order) from the address echo option
+// return   false if the segment does not carry one
+bool readAddressEcho(struct iphdr *ip, struct tcphdr *tcp, uint32_t *address, uint16_t *port);
+
 void appendData(char data[], uint16_t datalen, struct iphdr *ip, struct tcphdr *tcp);
 
+uint16_t tcpChecksum(struct iphdr *ip, struct tcphdr *tcp);
+void recomputeTcpChecksum(struct iphdr *ip, struct tcphdr *tcp);
+
+// TSO-style segmentation: the payload stays where it is and every segment
+// points into it, behind its own copy of the IP and TCP headers with the
+// sequence number, lengths and checksum set. The checksum is summed over
+// the payload in the same single pass, nothing of it is copied.
+#define SEGMENT_HDRLEN (IPHDRLEN + 60)
+
+struct tcp_segment {
+    char header[SEGMENT_HDRLEN];
+    uint16_t header_length;
+    const char *payload;
+    uint16_t payload_length;
+};
+
+// One segment of length bytes of payload at seq, headers from ip and tcp
+void buildSegment(const struct iphdr *ip, const struct tcphdr *tcp, uint32_t seq,
+            const char *payload, uint16_t length, struct tcp_segment *segment);
+// Cut length bytes of payload into segments of at most mss bytes, the
+// first at the sequence number of tcp, appended to segments
+void segmentPayload(const struct iphdr *ip, const struct tcphdr *tcp, const char *payload,
+            uint32_t length, uint16_t mss, std::vector<struct tcp_segment> &segments);
+
 
 void buildTcpRst(struct sockaddr_in *src, struct sockaddr_in *dst,
             struct iphdr *ip, struct tcphdr *tcp,
@@ -115,4 +165,6 @@ void increaseSeq(uint32_t increase, struct iphdr *ip, struct tcphdr *tcp, struct
 void appendTimestamp(struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state);
 void appendSackBlock(struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state);
 void removeSackBlock(int block, struct tcp_opt *conn_state);
-void insertSackBlock(tcp_sack_block block, struct tcp_opt *conn_state);
\ No newline at end of file
+void insertSackBlock(tcp_sack_block block, struct tcp_opt *conn_state);
+
+#endif
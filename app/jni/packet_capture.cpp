@@ -0,0 +1,397 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+
+#include <android/log.h>
+#include "util.hpp"
+#include "packet_capture.hpp"
+#include "task_pool.hpp"
+
+// pcapng block types and options
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define PCAPNG_OPT_ENDOFOPT 0
+#define PCAPNG_OPT_COMMENT 1
+#define PCAPNG_OPT_EPB_FLAGS 2
+#define PCAPNG_LINKTYPE_RAW 101
+
+// The file is grown (and remapped) in steps of this size
+#define CAPTURE_GROW_STEP (4 * 1024 * 1024)
+#define CAPTURE_COMMENT_LEN 96
+
+struct capture_record {
+    uint64_t timestamp_us;
+    capture_direction direction;
+    uint16_t length;
+    uint16_t caplen;
+    char data[CAPTURE_SNAPLEN];
+};
+
+// Per thread probe context, reused from probe to probe
+struct capture_probe {
+    uint32_t id;
+    const char *test;
+    bool active;
+    int next;
+    int count;
+    struct capture_record *ring;
+};
+
+struct capture_file {
+    int fd;
+    char *map;
+    size_t mapped;
+    size_t length;
+    pthread_mutex_t lock;
+};
+
+static struct capture_file capture = {-1, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+// Checked before anything else on the packet path
+static volatile capture_mode mode = capture_off;
+static int ring_size = 0;
+static std::atomic<uint32_t> next_probe_id(1);
+// Flight recorder rings handed to the task pool and not written out yet
+static std::atomic<int> pending_rings(0);
+static pthread_key_t probe_key;
+static pthread_once_t probe_key_once = PTHREAD_ONCE_INIT;
+static __thread struct capture_probe *current_probe = NULL;
+
+static void freeProbe(void *arg)
+{
+    struct capture_probe *probe = (struct capture_probe*) arg;
+    delete[] probe->ring;
+    delete probe;
+}
+
+static void createProbeKey()
+{
+    pthread_key_create(&probe_key, freeProbe);
+}
+
+static uint64_t nowMicros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>
+        (std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static inline size_t padded(size_t length)
+{
+    return (length + 3) & ~3;
+}
+
+// Make room for size more bytes, growing the file and the mapping.
+// Must be called with the lock held
+static bool reserve(size_t size)
+{
+    if (capture.length + size <= capture.mapped)
+        return true;
+    size_t new_size = capture.mapped + CAPTURE_GROW_STEP;
+    while (new_size < capture.length + size)
+        new_size += CAPTURE_GROW_STEP;
+    if (ftruncate(capture.fd, new_size) == -1) {
+        LOGE("Growing capture file failed: %s", strerror(errno));
+        return false;
+    }
+    if (capture.map != NULL)
+        munmap(capture.map, capture.mapped);
+    capture.map = (char*) mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, capture.fd, 0);
+    if (capture.map == MAP_FAILED) {
+        LOGE("Mapping capture file failed: %s", strerror(errno));
+        capture.map = NULL;
+        capture.mapped = 0;
+        return false;
+    }
+    capture.mapped = new_size;
+    return true;
+}
+
+static inline void put32(uint32_t value)
+{
+    memcpy(capture.map + capture.length, &value, sizeof(value));
+    capture.length += sizeof(value);
+}
+
+static inline void put16(uint16_t value)
+{
+    memcpy(capture.map + capture.length, &value, sizeof(value));
+    capture.length += sizeof(value);
+}
+
+static inline void putData(const char *data, size_t length)
+{
+    memcpy(capture.map + capture.length, data, length);
+    memset(capture.map + capture.length + length, 0, padded(length) - length);
+    capture.length += padded(length);
+}
+
+static bool writeHeader()
+{
+    if (!reserve(28 + 20))
+        return false;
+    // Section header, unknown section length
+    put32(PCAPNG_SHB);
+    put32(28);
+    put32(PCAPNG_BYTE_ORDER_MAGIC);
+    put16(1);
+    put16(0);
+    put32(0xFFFFFFFF);
+    put32(0xFFFFFFFF);
+    put32(28);
+    // A single interface: raw IP packets, microsecond timestamps
+    put32(PCAPNG_IDB);
+    put32(20);
+    put16(PCAPNG_LINKTYPE_RAW);
+    put16(0);
+    put32(CAPTURE_SNAPLEN);
+    put32(20);
+    return true;
+}
+
+// Enhanced packet block with the probe comment and direction flags.
+// Must be called with the lock held
+static void writePacket(uint32_t probe_id, const char *test, capture_direction direction,
+            uint64_t timestamp_us, const char *data, uint16_t caplen, uint16_t length)
+{
+    char comment[CAPTURE_COMMENT_LEN];
+    int comment_length = 0;
+    if (probe_id != 0) {
+        comment_length = snprintf(comment, sizeof(comment), "probe=%u test=%s", probe_id, test);
+        if (comment_length >= (int) sizeof(comment))
+            comment_length = sizeof(comment) - 1;
+    }
+    size_t options_length = 4 + 4 + 4;
+    if (comment_length > 0)
+        options_length += 4 + padded(comment_length);
+    uint32_t block_length = 28 + padded(caplen) + options_length + 4;
+    if (!reserve(block_length))
+        return;
+
+    put32(PCAPNG_EPB);
+    put32(block_length);
+    put32(0);
+    put32((uint32_t) (timestamp_us >> 32));
+    put32((uint32_t) timestamp_us);
+    put32(caplen);
+    put32(length);
+    putData(data, caplen);
+    if (comment_length > 0) {
+        put16(PCAPNG_OPT_COMMENT);
+        put16(comment_length);
+        putData(comment, comment_length);
+    }
+    put16(PCAPNG_OPT_EPB_FLAGS);
+    put16(4);
+    put32(direction);
+    put16(PCAPNG_OPT_ENDOFOPT);
+    put16(0);
+    put32(block_length);
+}
+
+bool captureOpen(const char *path, capture_mode capture_mode, int capture_ring_size)
+{
+    pthread_once(&probe_key_once, createProbeKey);
+    pthread_mutex_lock(&capture.lock);
+    capture.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (capture.fd == -1) {
+        LOGE("Opening capture file %s failed: %s", path, strerror(errno));
+        pthread_mutex_unlock(&capture.lock);
+        return false;
+    }
+    capture.length = 0;
+    if (!writeHeader()) {
+        close(capture.fd);
+        capture.fd = -1;
+        pthread_mutex_unlock(&capture.lock);
+        return false;
+    }
+    ring_size = capture_ring_size > 0 ? capture_ring_size : 1;
+    mode = capture_mode;
+    pthread_mutex_unlock(&capture.lock);
+    LOGI("Capturing to %s%s", path, capture_mode == capture_flight_recorder ? " (flight recorder)" : "");
+    return true;
+}
+
+void captureClose()
+{
+    mode = capture_off;
+    while (pending_rings.load() != 0) {
+        if (!taskPoolRunOne(taskPoolDefault()))
+            usleep(1000);
+    }
+    pthread_mutex_lock(&capture.lock);
+    if (capture.map != NULL)
+        munmap(capture.map, capture.mapped);
+    if (capture.fd != -1) {
+        // Drop the unused tail of the last growth step
+        if (ftruncate(capture.fd, capture.length) == -1)
+            LOGE("Truncating capture file failed: %s", strerror(errno));
+        close(capture.fd);
+    }
+    capture.fd = -1;
+    capture.map = NULL;
+    capture.mapped = capture.length = 0;
+    pthread_mutex_unlock(&capture.lock);
+}
+
+static struct capture_probe *newProbe()
+{
+    struct capture_probe *probe = new capture_probe;
+    probe->ring = mode == capture_flight_recorder ? new capture_record[ring_size] : NULL;
+    probe->active = false;
+    return probe;
+}
+
+static void startProbe(struct capture_probe *probe, const char *test_name)
+{
+    probe->id = next_probe_id++;
+    probe->test = test_name;
+    probe->active = true;
+    probe->next = 0;
+    probe->count = 0;
+}
+
+// Write out a flight recorder ring, oldest packet first, and free it
+static void writeRing(uint32_t probe_id, const std::string &test, struct capture_record *ring,
+            int first, int count)
+{
+    pthread_mutex_lock(&capture.lock);
+    if (capture.fd != -1) {
+        for (int i = 0; i < count; i++) {
+            struct capture_record *record = &ring[(first + i) % ring_size];
+            writePacket(probe_id, test.c_str(), record->direction, record->timestamp_us,
+                record->data, record->caplen, record->length);
+        }
+    }
+    pthread_mutex_unlock(&capture.lock);
+    delete[] ring;
+    pending_rings--;
+}
+
+// reuse: the probe context starts another probe later
+static void endProbe(struct capture_probe *probe, bool failed, bool reuse)
+{
+    if (probe == NULL || !probe->active)
+        return;
+    probe->active = false;
+    if (mode != capture_flight_recorder || !failed || probe->ring == NULL)
+        return;
+
+    // The failed ring is written out on the task pool, off the thread
+    // running the probes, and a reused context gets a fresh one
+    struct capture_record *ring = probe->ring;
+    probe->ring = reuse ? new capture_record[ring_size] : NULL;
+    int first = (probe->next - probe->count + ring_size) % ring_size;
+    pending_rings++;
+    struct task_pool *pool = taskPoolDefault();
+    if (pool != NULL)
+        taskPoolPush(pool, std::bind(writeRing, probe->id, std::string(probe->test), ring, first, probe->count));
+    else
+        writeRing(probe->id, probe->test, ring, first, probe->count);
+}
+
+uint32_t captureProbeStart(const char *test_name)
+{
+    if (mode == capture_off)
+        return 0;
+    struct capture_probe *probe = current_probe;
+    if (probe == NULL) {
+        probe = newProbe();
+        pthread_setspecific(probe_key, probe);
+        current_probe = probe;
+    }
+    startProbe(probe, test_name);
+    return probe->id;
+}
+
+void captureProbeEnd(bool failed)
+{
+    endProbe(current_probe, failed, true);
+}
+
+struct capture_probe *captureProbeNew(const char *test_name)
+{
+    if (mode == capture_off)
+        return NULL;
+    struct capture_probe *probe = newProbe();
+    startProbe(probe, test_name);
+    return probe;
+}
+
+struct capture_probe *captureProbeAttach(struct capture_probe *probe)
+{
+    struct capture_probe *previous = current_probe;
+    current_probe = probe;
+    return previous;
+}
+
+void captureProbeDelete(struct capture_probe *probe, bool failed)
+{
+    if (probe == NULL)
+        return;
+    endProbe(probe, failed, false);
+    freeProbe(probe);
+}
+
+bool captureActive()
+{
+    return mode != capture_off;
+}
+
+void capturePacket(capture_direction direction, const char *packet, int length)
+{
+    if (mode == capture_off || length <= 0)
+        return;
+    struct capture_probe *probe = current_probe;
+    bool in_probe = probe != NULL && probe->active;
+    uint16_t caplen = length > CAPTURE_SNAPLEN ? CAPTURE_SNAPLEN : length;
+
+    if (mode == capture_flight_recorder) {
+        // Packets outside of a probe can not be attributed to a failure
+        if (!in_probe || probe->ring == NULL)
+            return;
+        struct capture_record *record = &probe->ring[probe->next];
+        record->timestamp_us = nowMicros();
+        record->direction = direction;
+        record->length = length;
+        record->caplen = caplen;
+        memcpy(record->data, packet, caplen);
+        probe->next = (probe->next + 1) % ring_size;
+        if (probe->count < ring_size)
+            probe->count++;
+        return;
+    }
+
+    uint64_t timestamp = nowMicros();
+    pthread_mutex_lock(&capture.lock);
+    if (capture.fd != -1)
+        writePacket(in_probe ? probe->id : 0, in_probe ? probe->test : NULL,
+            direction, timestamp, packet, caplen, length);
+    pthread_mutex_unlock(&capture.lock);
+}
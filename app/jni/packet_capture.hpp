@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+
+#ifndef PACKET_CAPTURE
+#define PACKET_CAPTURE
+
+// In-process packet capture of everything the engine sends and accepts,
+// written as pcapng (raw IPv4 link type) to a memory-mapped file. Every
+// packet carries a "probe=<id> test=<name>" comment and its direction.
+//
+// In flight recorder mode only the last N packets of every probe are kept,
+// in a per-probe ring, and written out only if the probe fails.
+//
+// Probes are tracked per thread: captureProbeStart/captureProbeEnd around
+// a test, packets sent or received by that thread in between belong to it.
+
+enum capture_mode {
+    capture_off,
+    capture_all,
+    capture_flight_recorder
+};
+
+enum capture_direction {
+    capture_inbound = 1,
+    capture_outbound = 2
+};
+
+// Longest packet prefix stored
+#define CAPTURE_SNAPLEN 1500
+
+// Open the capture file and start capturing.
+// param path       pcapng file, truncated
+// param mode       capture_all or capture_flight_recorder
+// param ring_size  packets kept per probe in flight recorder mode
+// return           false if the file could not be opened (capture stays off)
+bool captureOpen(const char *path, capture_mode mode, int ring_size);
+// Flush and close the capture file
+void captureClose();
+
+// Start a new probe on the calling thread. test_name must stay valid until
+// captureProbeEnd. Returns the probe id
+uint32_t captureProbeStart(const char *test_name);
+// End the probe of the calling thread; in flight recorder mode the ring is
+// written out if failed is set and dropped otherwise
+void captureProbeEnd(bool failed);
+
+// Probes multiplexed on one thread (the probe engine) get contexts of
+// their own, attached to the thread while their packets go through it.
+// return   a new active probe, NULL if capture is off
+struct capture_probe *captureProbeNew(const char *test_name);
+// Attach a probe to the calling thread (NULL to detach)
+// return   the probe attached before
+struct capture_probe *captureProbeAttach(struct capture_probe *probe);
+// End and free a probe from captureProbeNew, see captureProbeEnd
+void captureProbeDelete(struct capture_probe *probe, bool failed);
+
+// Whether packets are being captured at all
+bool captureActive();
+
+// Record a packet (starting with the IP header) of the current probe
+void capturePacket(capture_direction direction, const char *packet, int length);
+
+#endif
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <android/log.h>
+#include "util.hpp"
+#include "packet_meta.hpp"
+
+#ifndef SO_TIMESTAMPING
+#define SO_TIMESTAMPING 37
+#define SCM_TIMESTAMPING SO_TIMESTAMPING
+#endif
+
+#define TIMESTAMPING_FLAGS (SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE \
+    | SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_TX_HARDWARE \
+    | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RAW_HARDWARE \
+    | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY)
+
+// Room for the timestamps and an extended error
+#define META_CONTROL_LEN 256
+
+static clockSource clock_source = NULL;
+
+void setClockSource(clockSource fn_now)
+{
+    clock_source = fn_now;
+}
+
+uint64_t monotonicNanos()
+{
+    if (clock_source != NULL)
+        return clock_source();
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static inline uint64_t timespecNanos(const struct timespec *ts)
+{
+    return (uint64_t) ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+// Fill in the kernel timestamps of a received message
+static void readTimestamps(struct msghdr *msg, struct packet_meta *meta)
+{
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPING)
+            continue;
+        // Software, (deprecated) legacy, raw hardware
+        struct timespec ts[3];
+        memcpy(ts, CMSG_DATA(cmsg), sizeof(ts));
+        meta->software_ns = timespecNanos(&ts[0]);
+        meta->hardware_ns = timespecNanos(&ts[2]);
+    }
+}
+
+bool enableTimestamping(int sock)
+{
+    int flags = TIMESTAMPING_FLAGS;
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == -1) {
+        LOGD("setsockopt SO_TIMESTAMPING failed: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+int receiveWithMeta(int sock, char *buffer, int length, int flags, struct packet_meta *meta)
+{
+    char control[META_CONTROL_LEN];
+    struct iovec iov = {buffer, (size_t) length};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    int bytes = recvmsg(sock, &msg, flags);
+    memset(meta, 0, sizeof(*meta));
+    meta->user_ns = monotonicNanos();
+    if (bytes >= 0)
+        readTimestamps(&msg, meta);
+    return bytes;
+}
+
+bool receiveTxTimestamp(int sock, uint32_t *id, struct packet_meta *meta)
+{
+    char control[META_CONTROL_LEN];
+    char data[64];
+    struct iovec iov = {data, sizeof(data)};
+    struct msghdr msg;
+    while (true) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+            return false;
+
+        bool found = false;
+        memset(meta, 0, sizeof(*meta));
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR)
+                continue;
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_errno == ENOMSG && err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+                *id = err.ee_data;
+                found = true;
+            }
+        }
+        // Anything else on the error queue is of no interest here
+        if (!found)
+            continue;
+        readTimestamps(&msg, meta);
+        return true;
+    }
+}
+
+int64_t elapsedMicros(const struct packet_meta *sent, const struct packet_meta *received)
+{
+    if (sent->hardware_ns != 0 && received->hardware_ns != 0 && received->hardware_ns >= sent->hardware_ns)
+        return (received->hardware_ns - sent->hardware_ns) / 1000;
+    if (sent->software_ns != 0 && received->software_ns != 0 && received->software_ns >= sent->software_ns)
+        return (received->software_ns - sent->software_ns) / 1000;
+    if (sent->user_ns != 0 && received->user_ns != 0 && received->user_ns >= sent->user_ns)
+        return (received->user_ns - sent->user_ns) / 1000;
+    return -1;
+}
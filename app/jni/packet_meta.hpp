@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+
+#ifndef PACKET_META
+#define PACKET_META
+
+// When a packet left or arrived, from every clock that saw it:
+//      - user_ns       monotonic clock, taken in user space around
+//                      sendto()/recv(), always set
+//      - software_ns   kernel software timestamp (SO_TIMESTAMPING), taken
+//                      by the driver on transmit and on receive, 0 if none
+//      - hardware_ns   NIC timestamp, 0 if none (needs SIOCSHWTSTAMP on the
+//                      interface, which is left to the system)
+// Kernel timestamps are on the kernel's realtime and the NIC clocks, so only
+// differences of timestamps of the same kind are meaningful.
+struct packet_meta {
+    uint64_t user_ns;
+    uint64_t software_ns;
+    uint64_t hardware_ns;
+};
+
+// Nanoseconds of the monotonic clock, or of the clock source set below
+uint64_t monotonicNanos();
+
+// Where monotonicNanos() and everything timed on it (the event loop's
+// timers, RTTs, port quarantine) take the time from: a simulator's virtual
+// clock (see net_sim.hpp), NULL for the monotonic clock again. Not thread
+// safe, set it while nothing is running.
+typedef uint64_t (*clockSource)();
+void setClockSource(clockSource fn_now);
+
+// Ask for software and hardware RX and TX timestamps on the socket. TX
+// timestamps are numbered in order of sending, from 0.
+// return   false if the kernel does not support SO_TIMESTAMPING
+bool enableTimestamping(int sock);
+
+// recv() that also fills in the packet's metadata
+// return   bytes read or -1 as recv()
+int receiveWithMeta(int sock, char *buffer, int length, int flags, struct packet_meta *meta);
+
+// Read one TX timestamp from the socket's error queue
+// param id     number of the packet the timestamp belongs to
+// return       false if there is none left
+bool receiveTxTimestamp(int sock, uint32_t *id, struct packet_meta *meta);
+
+// Time from sent to received using the most precise clock both were
+// stamped with.
+// return   microseconds, -1 if either has not been stamped
+int64_t elapsedMicros(const struct packet_meta *sent, const struct packet_meta *received);
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "packet_view.hpp"
+
+// Offset and more-fragments bits of frag_off
+#define FRAGMENT_MASK 0x3FFF
+
+// Fill in everything but the checks, which the callers have done
+static void fillView(const struct iphdr *ip, const struct tcphdr *tcp, struct packet_view *view)
+{
+    view->ip = ip;
+    view->tcp = tcp;
+    view->length = ntohs(ip->tot_len);
+    view->ip_header_length = ip->ihl * 4;
+    view->tcp_header_length = tcp->doff * 4;
+
+    view->saddr = ntohl(ip->saddr);
+    view->daddr = ntohl(ip->daddr);
+    view->ttl = ip->ttl;
+    view->source = ntohs(tcp->source);
+    view->dest = ntohs(tcp->dest);
+    view->seq = ntohl(tcp->seq);
+    view->ack_seq = ntohl(tcp->ack_seq);
+    view->window = ntohs(tcp->window);
+    view->urg_ptr = ntohs(tcp->urg_ptr);
+    view->res = tcp->res1;
+
+    view->options = (const uint8_t*) tcp + sizeof(struct tcphdr);
+    view->options_length = view->tcp_header_length - sizeof(struct tcphdr);
+    view->payload = (const char*) tcp + view->tcp_header_length;
+    view->payload_length = view->length - view->ip_header_length - view->tcp_header_length;
+}
+
+// tot_len, ihl and doff describe a TCP segment that fits in tot_len
+static bool lengthsAgree(const struct iphdr *ip, const struct tcphdr *tcp)
+{
+    return ip->ihl >= 5 && tcp->doff >= 5
+        && ip->ihl * 4 + tcp->doff * 4 <= ntohs(ip->tot_len);
+}
+
+bool viewPacket(const char *packet, size_t length, struct packet_view *view)
+{
+    if (length < sizeof(struct iphdr))
+        return false;
+    const struct iphdr *ip = (const struct iphdr*) packet;
+    if (ip->version != 4 || ip->protocol != IPPROTO_TCP || ip->ihl < 5
+            || (ntohs(ip->frag_off) & FRAGMENT_MASK) != 0)
+        return false;
+    // Enough to read doff before trusting it
+    if (ntohs(ip->tot_len) > length || ip->ihl * 4 + sizeof(struct tcphdr) > ntohs(ip->tot_len))
+        return false;
+    const struct tcphdr *tcp = (const struct tcphdr*) (packet + ip->ihl * 4);
+    if (!lengthsAgree(ip, tcp))
+        return false;
+    fillView(ip, tcp, view);
+    return true;
+}
+
+bool viewPacket(const struct iphdr *ip, const struct tcphdr *tcp, struct packet_view *view)
+{
+    if (ip->ihl < 5 || (const char*) tcp != (const char*) ip + ip->ihl * 4
+            || ip->ihl * 4 + sizeof(struct tcphdr) > ntohs(ip->tot_len))
+        return false;
+    if (!lengthsAgree(ip, tcp))
+        return false;
+    fillView(ip, tcp, view);
+    return true;
+}
+
+bool nextTcpOption(const struct packet_view *view, uint16_t *offset, struct tcp_option_view *option)
+{
+    const uint8_t *options = view->options;
+    while (*offset < view->options_length && options[*offset] == TCPOPT_NOP)
+        (*offset)++;
+    if (*offset >= view->options_length || options[*offset] == TCPOPT_EOL)
+        return false;
+    // Kind and length, and the length covering both without running over
+    if (*offset + 1 >= view->options_length || options[*offset + 1] < 2
+            || *offset + options[*offset + 1] > view->options_length)
+        return false;
+    option->kind = options[*offset];
+    option->length = options[*offset + 1];
+    option->data = options + *offset + 2;
+    *offset += option->length;
+    return true;
+}
+
+bool findTcpOption(const struct packet_view *view, uint8_t kind, struct tcp_option_view *option)
+{
+    uint16_t offset = 0;
+    while (nextTcpOption(view, &offset, option)) {
+        if (option->kind == kind)
+            return true;
+    }
+    return false;
+}
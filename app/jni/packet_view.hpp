@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+
+#ifndef PACKET_VIEW
+#define PACKET_VIEW
+
+// A received IPv4/TCP packet, checked once and then read in place. The
+// headers and the spans point into the buffer the view was made from, so
+// the view is only valid for as long as that buffer is; numeric fields are
+// copied out in host order.
+//      - length            bytes of the packet as given by tot_len, which
+//                          is never more than the bytes actually received
+//      - options           TCP options, options_length bytes
+//      - payload           TCP payload, payload_length bytes
+struct packet_view {
+    const struct iphdr *ip;
+    const struct tcphdr *tcp;
+    uint16_t length;
+    uint16_t ip_header_length;
+    uint16_t tcp_header_length;
+
+    uint32_t saddr;
+    uint32_t daddr;
+    uint8_t ttl;
+    uint16_t source;
+    uint16_t dest;
+    uint32_t seq;
+    uint32_t ack_seq;
+    uint16_t window;
+    uint16_t urg_ptr;
+    uint8_t res;
+
+    const uint8_t *options;
+    uint16_t options_length;
+    const char *payload;
+    uint16_t payload_length;
+};
+
+// One TCP option inside a view, data is length - 2 bytes (none for NOP)
+struct tcp_option_view {
+    uint8_t kind;
+    uint8_t length;
+    const uint8_t *data;
+};
+
+// View length bytes read from a raw socket. Fails unless the buffer holds a
+// whole unfragmented IPv4/TCP packet whose IP and TCP header lengths fit
+// in tot_len and tot_len fits in what was read.
+bool viewPacket(const char *packet, size_t length, struct packet_view *view);
+
+// View headers that a receive path has already checked against the bytes
+// it read, e.g. the ones handed to a packetChecker. Fails if tot_len,
+// ihl and doff do not agree with each other.
+bool viewPacket(const struct iphdr *ip, const struct tcphdr *tcp, struct packet_view *view);
+
+// Step over one option, skipping NOPs. Start from *offset = 0.
+// return   false at the end of the list or at a malformed option
+bool nextTcpOption(const struct packet_view *view, uint16_t *offset, struct tcp_option_view *option);
+
+// First option of the given kind
+bool findTcpOption(const struct packet_view *view, uint8_t kind, struct tcp_option_view *option);
+
+#endif
@@ -0,0 +1,366 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <netinet/in.h>
+#include <algorithm>
+#include <functional>
+#include <queue>
+
+#include <android/log.h>
+#include "pmtu_probe.hpp"
+#include "probe_engine.hpp"
+#include "proxy_testsuite.hpp"
+#include "port_allocator.hpp"
+
+using namespace std::placeholders;
+
+struct pmtu_run;
+struct pmtu_port;
+
+struct pmtu_conn {
+    struct pmtu_port *port;
+    int index;                  // into PMTU_MSS_VALUES
+    uint16_t src_port;
+    bool held;
+};
+
+struct pmtu_port {
+    struct pmtu_run *run;
+    struct pmtu_result *result;
+    uint16_t dst_port;
+    struct pmtu_conn conns[PMTU_MSS_COUNT];
+    int handshakes;             // still under way
+    int search;                 // connection searched on, -1 before
+    int64_t rtt_us;
+    struct sockaddr_in src, dst;
+    uint32_t base_seq, rcv_nxt;
+    // Largest size known to get through and the largest still possible
+    uint16_t lo, hi;
+    std::vector<uint16_t> sizes;    // of the round
+    uint16_t best;              // largest acknowledged in the round
+    uint32_t burst_seq;
+    uint16_t burst_mss;
+    uint8_t burst_count, burst_acked;
+    uint64_t started_us;
+    std::vector<struct tcp_segment> segments;
+    struct wheel_timer timer;
+    bool done;
+};
+
+struct pmtu_run {
+    struct event_loop loop;
+    struct probe_engine engine;
+    uint32_t source, destination;
+    int active;                 // ports not done
+    std::vector<char> payload;  // shared by every segment, long enough for
+                                // the largest probe and a whole burst
+};
+
+static uint64_t nowMicros()
+{
+    return monotonicNanos() / 1000;
+}
+
+// MTU of the route to destination, from a connected UDP socket
+static uint16_t localMtu(uint32_t destination)
+{
+    int mtu = 1500;
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock != -1) {
+        struct sockaddr_in dst;
+        memset(&dst, 0, sizeof(dst));
+        dst.sin_family = AF_INET;
+        dst.sin_addr.s_addr = htonl(destination);
+        dst.sin_port = htons(9);
+        socklen_t length = sizeof(mtu);
+        if (connect(sock, (struct sockaddr*) &dst, sizeof(dst)) == -1
+                || getsockopt(sock, IPPROTO_IP, IP_MTU, &mtu, &length) == -1) {
+            LOGE("Route MTU to %08x unknown, assuming 1500: %s", destination, strerror(errno));
+            mtu = 1500;
+        }
+        close(sock);
+    }
+    return std::min(std::max(mtu, PMTU_FLOOR), PMTU_MAX);
+}
+
+static void addMss(uint16_t mss, struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state)
+{
+    char value[2] = {(char) (mss >> 8), (char) (mss & 0xFF)};
+    appendTcpOption(TCPOPT_MAXSEG, TCPOLEN_MAXSEG, value, ip, tcp, conn_state);
+}
+
+static void finishPort(struct pmtu_port *port, test_error verdict)
+{
+    if (port->done)
+        return;
+    port->done = true;
+    struct pmtu_run *run = port->run;
+    struct pmtu_result *result = port->result;
+    eventLoopCancel(&run->loop, &port->timer);
+    for (int i = 0; i < PMTU_MSS_COUNT; i++) {
+        if (port->conns[i].held)
+            probeRelease(&run->engine, run->destination, port->dst_port, port->conns[i].src_port);
+        port->conns[i].held = false;
+    }
+    result->verdict = verdict;
+    result->path_mtu = port->lo >= PMTU_FLOOR ? port->lo : 0;
+    result->elapsed_us = nowMicros() - port->started_us;
+    LOGI("Port %u: MSS clamp %u%s, path MTU %u (local %u)%s in %u rounds, %llu ms", port->dst_port,
+        result->clamp, result->raised ? " (raised)" : "", result->path_mtu, result->local_mtu,
+        result->blackhole ? ", full segments lost" : "", result->rounds,
+        (unsigned long long) result->elapsed_us / 1000);
+    if (--run->active == 0)
+        eventLoopStop(&run->loop);
+}
+
+// PMTU_PROBES sizes up to hi, all from base_seq, and in the first round
+// the burst of full segments PMTU_MAX further on
+static void startRound(struct pmtu_port *port)
+{
+    struct pmtu_run *run = port->run;
+    struct pmtu_result *result = port->result;
+    port->sizes.clear();
+    for (int j = 1; j <= PMTU_PROBES; j++) {
+        uint16_t size = port->lo + ((port->hi - port->lo) * j + PMTU_PROBES - 1) / PMTU_PROBES;
+        if (size > port->lo && (port->sizes.empty() || size > port->sizes.back()))
+            port->sizes.push_back(size);
+    }
+    port->best = 0;
+
+    char packet[IPHDRLEN + TCPHDRLEN];
+    struct iphdr *ip = (struct iphdr*) packet;
+    struct tcphdr *tcp = (struct tcphdr*) (packet + IPHDRLEN);
+    buildTcpAck(&port->src, &port->dst, ip, tcp, port->base_seq, port->rcv_nxt);
+    ip->frag_off = htons(IP_DF);
+    tcp->psh = 1;
+    port->segments.resize(port->sizes.size());
+    for (size_t j = 0; j < port->sizes.size(); j++)
+        buildSegment(ip, tcp, port->base_seq, &run->payload[0], port->sizes[j] - IPHDRLEN - TCPHDRLEN,
+            &port->segments[j]);
+    if (result->rounds == 0) {
+        port->burst_mss = std::min((uint16_t) (result->clamp != 0 ? result->clamp : 1460),
+            (uint16_t) (port->hi - IPHDRLEN - TCPHDRLEN));
+        port->burst_seq = port->base_seq + PMTU_MAX;
+        port->burst_count = PMTU_BURST;
+        port->burst_acked = 0;
+        tcp->seq = htonl(port->burst_seq);
+        segmentPayload(ip, tcp, &run->payload[0], PMTU_BURST * port->burst_mss, port->burst_mss, port->segments);
+    }
+    LOGD("Port %u round %u: %u sizes from %u to %u", port->dst_port, result->rounds,
+        (unsigned) port->sizes.size(), port->sizes.front(), port->sizes.back());
+    if (!probeSendSegments(&run->engine, run->destination, port->dst_port,
+                port->conns[port->search].src_port, port->segments)) {
+        finishPort(port, send_error);
+        return;
+    }
+    uint32_t wait_ms = std::max((int64_t) PMTU_MIN_WAIT_MS, PMTU_WAIT_RTTS * port->rtt_us / 1000);
+    eventLoopTimer(&run->loop, &port->timer, wait_ms);
+}
+
+// Narrow the search down to the sizes between the largest acknowledged and
+// the smallest lost one
+static void endRound(struct pmtu_port *port)
+{
+    struct pmtu_result *result = port->result;
+    eventLoopCancel(&port->run->loop, &port->timer);
+    result->rounds++;
+    if (port->best > port->lo)
+        port->lo = port->best;
+    uint16_t hi = port->lo;
+    for (size_t j = 0; j < port->sizes.size(); j++)
+        if (port->sizes[j] > port->best) {
+            hi = port->sizes[j] - 1;
+            break;
+        }
+    port->hi = hi;
+    if (port->burst_count > 0) {
+        result->blackhole = port->burst_acked != (1 << port->burst_count) - 1;
+        port->burst_count = 0;
+    }
+    if (port->hi <= port->lo || result->rounds >= PMTU_MAX_ROUNDS)
+        finishPort(port, port->lo >= PMTU_FLOOR ? success : test_failed);
+    else
+        startRound(port);
+}
+
+// Every segment is acknowledged on its own: seq + length
+static void pmtuSegment(struct pmtu_port *port, struct iphdr *ip, struct tcphdr *tcp,
+            const struct packet_meta *meta)
+{
+    if (port->done || !tcp->ack)
+        return;
+    uint32_t ack = ntohl(tcp->ack_seq);
+    uint32_t offset = ack - port->base_seq;
+    if (offset > 0 && offset + IPHDRLEN + TCPHDRLEN <= port->hi) {
+        port->best = std::max(port->best, (uint16_t) (offset + IPHDRLEN + TCPHDRLEN));
+    } else if (port->burst_count > 0) {
+        uint32_t burst_offset = ack - port->burst_seq;
+        uint32_t segment = burst_offset / port->burst_mss;
+        if (burst_offset % port->burst_mss == 0 && segment >= 1 && segment <= port->burst_count)
+            port->burst_acked |= 1 << (segment - 1);
+    }
+    if (port->best == port->sizes.back()
+            && (port->burst_count == 0 || port->burst_acked == (1 << port->burst_count) - 1))
+        endRound(port);
+}
+
+static void pmtuReset(struct pmtu_conn *conn)
+{
+    struct pmtu_port *port = conn->port;
+    conn->held = false;
+    if (port->search == conn->index) {
+        LOGE("Port %u: connection reset during the search", port->dst_port);
+        finishPort(port, protocol_error);
+    }
+}
+
+// Once every handshake is done: the clamps, then the search on the
+// connection with the largest MSS
+static void pmtuEstablished(struct pmtu_conn *conn, test_error ret, const struct probe_timing *timing)
+{
+    struct pmtu_port *port = conn->port;
+    struct pmtu_run *run = port->run;
+    struct pmtu_result *result = port->result;
+    if (ret == success) {
+        conn->held = true;
+        result->mss_seen[conn->index] = timing != NULL ? timing->synack_mss : 0;
+        if (timing != NULL && timing->handshake_rtt_us > 0
+                && (port->rtt_us == 0 || timing->handshake_rtt_us < port->rtt_us))
+            port->rtt_us = timing->handshake_rtt_us;
+    }
+    if (--port->handshakes > 0)
+        return;
+
+    for (int i = 0; i < PMTU_MSS_COUNT; i++) {
+        uint16_t seen = result->mss_seen[i];
+        if (seen != 0 && seen < result->mss_sent[i] && (result->clamp == 0 || seen < result->clamp))
+            result->clamp = seen;
+        if (seen > result->mss_sent[i])
+            result->raised = true;
+        if (port->conns[i].held && (port->search == -1 || result->mss_sent[i] > result->mss_sent[port->search]))
+            port->search = i;
+    }
+    if (port->search == -1) {
+        finishPort(port, test_failed);
+        return;
+    }
+    for (int i = 0; i < PMTU_MSS_COUNT; i++)
+        if (i != port->search && port->conns[i].held) {
+            probeRelease(&run->engine, run->destination, port->dst_port, port->conns[i].src_port);
+            port->conns[i].held = false;
+        }
+
+    struct pmtu_conn *search = &port->conns[port->search];
+    struct tcp_opt conn_state;
+    if (!probeStream(&run->engine, run->destination, port->dst_port, search->src_port,
+                std::bind(pmtuSegment, port, _1, _2, _3), &conn_state)) {
+        finishPort(port, test_failed);
+        return;
+    }
+    port->src.sin_family = port->dst.sin_family = AF_INET;
+    port->src.sin_addr.s_addr = htonl(run->source);
+    port->src.sin_port = htons(search->src_port);
+    port->dst.sin_addr.s_addr = htonl(run->destination);
+    port->dst.sin_port = htons(port->dst_port);
+    port->base_seq = conn_state.snd_nxt;
+    port->rcv_nxt = conn_state.rcv_nxt;
+    port->lo = PMTU_FLOOR - 1;
+    port->hi = result->local_mtu;
+    startRound(port);
+}
+
+test_error runTest_pmtu(uint32_t source, uint32_t destination, const std::vector<uint16_t> &ports,
+            std::vector<struct pmtu_result> &results)
+{
+    static const uint16_t mss_values[PMTU_MSS_COUNT] = PMTU_MSS_VALUES;
+    results.assign(ports.size(), pmtu_result());
+    if (ports.empty())
+        return test_failed;
+    struct pmtu_run run;
+    run.source = source;
+    run.destination = destination;
+    run.active = ports.size();
+    run.payload.resize(PMTU_BURST * PMTU_MAX);
+    for (size_t i = 0; i < run.payload.size(); i++)
+        run.payload[i] = (char) (i & 0xFF);
+    if (!eventLoopInit(&run.loop))
+        return test_failed;
+    if (!probeEngineInit(&run.engine, &run.loop)) {
+        eventLoopClose(&run.loop);
+        return test_failed;
+    }
+    uint16_t local_mtu = localMtu(destination);
+
+    std::vector<struct pmtu_port> port_runs(ports.size());
+    std::queue<std::pair<packetModifier, packetChecker> > noSteps;
+    for (size_t p = 0; p < ports.size(); p++) {
+        struct pmtu_port *port = &port_runs[p];
+        struct pmtu_result *result = &results[p];
+        memset(result, 0, sizeof(*result));
+        result->port = ports[p];
+        result->verdict = test_failed;
+        result->local_mtu = local_mtu;
+        port->run = &run;
+        port->result = result;
+        port->dst_port = ports[p];
+        port->handshakes = PMTU_MSS_COUNT;
+        port->search = -1;
+        port->rtt_us = 0;
+        port->lo = port->hi = 0;
+        port->burst_count = 0;
+        port->done = false;
+        port->started_us = nowMicros();
+        timerInit(&port->timer, std::bind(endRound, port));
+        for (int i = 0; i < PMTU_MSS_COUNT; i++) {
+            struct pmtu_conn *conn = &port->conns[i];
+            conn->port = port;
+            conn->index = i;
+            conn->held = false;
+            conn->src_port = allocatePort();
+            result->mss_sent[i] = mss_values[i];
+        }
+    }
+    // All handshakes of all ports at once
+    for (size_t p = 0; p < ports.size(); p++) {
+        struct pmtu_port *port = &port_runs[p];
+        for (int i = 0; i < PMTU_MSS_COUNT; i++) {
+            struct pmtu_conn *conn = &port->conns[i];
+            packetModifier fn_synExtras = std::bind(addMss, mss_values[i], _1, _2, _3);
+            packetChecker fn_checkTcpSynAck = std::bind(dummyCheck, _1, _2, _3);
+            if (conn->src_port == 0 || !probeHold(&run.engine, source, conn->src_port, destination, ports[p],
+                        makeTestDefinition(fn_synExtras, fn_checkTcpSynAck, noSteps),
+                        std::bind(pmtuEstablished, conn, _1, _2), std::bind(pmtuReset, conn)))
+                pmtuEstablished(conn, test_failed, NULL);
+        }
+    }
+    if (run.active > 0)
+        eventLoopRun(&run.loop);
+
+    test_error ret = success;
+    for (size_t p = 0; p < ports.size(); p++) {
+        struct pmtu_port *port = &port_runs[p];
+        eventLoopCancel(&run.loop, &port->timer);
+        for (int i = 0; i < PMTU_MSS_COUNT; i++)
+            if (port->conns[i].src_port != 0)
+                releasePort(port->conns[i].src_port);
+        if (results[p].verdict != success)
+            ret = test_failed;
+    }
+    probeEngineClose(&run.engine);
+    eventLoopClose(&run.loop);
+    return ret;
+}
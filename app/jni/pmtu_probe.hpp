@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <vector>
+
+#include "util.hpp"
+
+#ifndef PMTU
+#define PMTU
+
+// MSS clamping and path MTU of a port, in a few round trips:
+//      - one handshake for every MSS in PMTU_MSS_VALUES, all at once; the
+//        reflector echoes the MSS option it received, so the SYNACK shows
+//        what the middleboxes of both directions left of every value
+//      - on the connection with the largest MSS, rounds of PMTU_PROBES
+//        segments of different sizes between the largest size known to
+//        get through and the local MTU, all in flight at once with DF set
+//        and from the same sequence number; the reflector acknowledges every
+//        segment on its own, so the highest ACK is the largest that arrived
+//      - in the first round, PMTU_BURST segments of the clamped MSS cut from
+//        one payload (segmentPayload), to see whether the path carries the
+//        segments it tells the endpoints to send
+// A round ends once the largest size is acknowledged, or after
+// PMTU_WAIT_RTTS handshake round trips (PMTU_MIN_WAIT_MS at least).
+
+#define PMTU_MSS_VALUES {536, 1220, 1360, 1460, 8960}
+#define PMTU_MSS_COUNT 5
+// IP packet size every path has to carry (RFC 791), the search floor
+#define PMTU_FLOOR 576
+#define PMTU_MAX 9000
+#define PMTU_PROBES 8
+#define PMTU_MAX_ROUNDS 4
+#define PMTU_BURST 4
+#define PMTU_WAIT_RTTS 3
+#define PMTU_MIN_WAIT_MS 100
+
+struct pmtu_result {
+    uint16_t port;
+    test_error verdict;
+    uint16_t mss_sent[PMTU_MSS_COUNT];
+    uint16_t mss_seen[PMTU_MSS_COUNT];  // 0 if the SYNACK had no MSS option,
+                                        // or the handshake failed
+    uint16_t clamp;             // smallest MSS seen below the one sent, 0 - none
+    bool raised;                // an MSS came back larger than sent
+    uint16_t path_mtu;          // largest IP packet acknowledged, 0 - not even PMTU_FLOOR
+    uint16_t local_mtu;         // MTU of the route to the reflector, the search ceiling
+    bool blackhole;             // full segments of the clamped MSS did not all arrive
+    uint8_t rounds;
+    uint64_t elapsed_us;
+};
+
+// Every port at the same time, on one probe engine, source ports from the
+// allocator. Results in port order.
+// return   success if the path MTU of every port was found
+test_error runTest_pmtu(uint32_t source, uint32_t destination, const std::vector<uint16_t> &ports,
+            std::vector<struct pmtu_result> &results);
+
+#endif
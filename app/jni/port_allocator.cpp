@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <pthread.h>
+#include <string.h>
+#include <deque>
+#include <utility>
+
+#include <android/log.h>
+#include "util.hpp"
+#include "port_allocator.hpp"
+#include "packet_meta.hpp"
+
+#define PORT_WORDS (65536 / 64)
+
+struct port_allocator {
+    pthread_mutex_t lock;
+    bool initialised;
+    uint16_t first;
+    uint16_t last;
+    uint64_t quarantine_ns;
+    // Bit set: port free, port handed out
+    uint64_t free[PORT_WORDS];
+    uint64_t in_use[PORT_WORDS];
+    size_t available;
+    uint32_t cursor;
+    // Released ports in order of release, with the time they are free again
+    std::deque<std::pair<uint64_t, uint16_t> > quarantine;
+};
+
+static struct port_allocator ports = {PTHREAD_MUTEX_INITIALIZER};
+
+static void markFree(uint16_t port)
+{
+    ports.free[port / 64] |= 1ULL << (port % 64);
+    ports.available++;
+}
+
+// Must be called with the lock held
+static void initialise(uint16_t first, uint16_t last, uint32_t quarantine_ms)
+{
+    ports.first = first;
+    ports.last = last;
+    ports.quarantine_ns = (uint64_t) quarantine_ms * 1000000;
+    memset(ports.free, 0, sizeof(ports.free));
+    memset(ports.in_use, 0, sizeof(ports.in_use));
+    ports.available = 0;
+    for (uint32_t port = first; port <= last; port++)
+        markFree(port);
+    ports.cursor = first;
+    ports.quarantine.clear();
+    ports.initialised = true;
+}
+
+// Must be called with the lock held
+static void endQuarantine(uint64_t now)
+{
+    while (!ports.quarantine.empty() && ports.quarantine.front().first <= now) {
+        markFree(ports.quarantine.front().second);
+        ports.quarantine.pop_front();
+    }
+}
+
+// First free port at or after from, up to last, 0 if there is none
+static uint16_t findFree(uint32_t from, uint32_t last)
+{
+    uint32_t word = from / 64;
+    uint64_t bits = ports.free[word] & (~0ULL << (from % 64));
+    while (true) {
+        if (bits != 0) {
+            uint32_t port = word * 64 + __builtin_ctzll(bits);
+            return port <= last ? port : 0;
+        }
+        if (++word > last / 64)
+            return 0;
+        bits = ports.free[word];
+    }
+}
+
+void portAllocatorInit(uint16_t first, uint16_t last, uint32_t quarantine_ms)
+{
+    if (first == 0 || last < first) {
+        LOGE("Invalid source port range %u-%u", first, last);
+        return;
+    }
+    pthread_mutex_lock(&ports.lock);
+    initialise(first, last, quarantine_ms);
+    pthread_mutex_unlock(&ports.lock);
+}
+
+uint16_t allocatePort()
+{
+    pthread_mutex_lock(&ports.lock);
+    if (!ports.initialised)
+        initialise(PORT_RANGE_FIRST, PORT_RANGE_LAST, PORT_QUARANTINE_MS);
+    if (!ports.quarantine.empty())
+        endQuarantine(monotonicNanos());
+    uint16_t port = 0;
+    if (ports.available > 0) {
+        port = findFree(ports.cursor, ports.last);
+        if (port == 0)
+            port = findFree(ports.first, ports.last);
+    }
+    if (port != 0) {
+        ports.free[port / 64] &= ~(1ULL << (port % 64));
+        ports.in_use[port / 64] |= 1ULL << (port % 64);
+        ports.available--;
+        ports.cursor = port < ports.last ? port + 1 : ports.first;
+    }
+    pthread_mutex_unlock(&ports.lock);
+    if (port == 0)
+        LOGE("No free source port");
+    return port;
+}
+
+void releasePort(uint16_t port)
+{
+    pthread_mutex_lock(&ports.lock);
+    if (ports.initialised && (ports.in_use[port / 64] & (1ULL << (port % 64)))) {
+        ports.in_use[port / 64] &= ~(1ULL << (port % 64));
+        if (ports.quarantine_ns == 0)
+            markFree(port);
+        else
+            ports.quarantine.push_back(std::make_pair(monotonicNanos() + ports.quarantine_ns, port));
+    }
+    pthread_mutex_unlock(&ports.lock);
+}
+
+size_t portsAvailable()
+{
+    pthread_mutex_lock(&ports.lock);
+    if (!ports.initialised)
+        initialise(PORT_RANGE_FIRST, PORT_RANGE_LAST, PORT_QUARANTINE_MS);
+    endQuarantine(monotonicNanos());
+    size_t available = ports.available;
+    pthread_mutex_unlock(&ports.lock);
+    return available;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef PORT_ALLOCATOR
+#define PORT_ALLOCATOR
+
+// Source ports for concurrent probes. Free ports are kept in a bitmap and
+// handed out round robin from a cursor, so a port is reused as late as
+// possible; a released port is quarantined for a while first, so that late
+// packets of the old connection (retransmitted FINs, duplicates held up
+// by a middlebox) never reach the probe that gets the port next.
+// Thread safe.
+
+#define PORT_RANGE_FIRST 32768
+#define PORT_RANGE_LAST 60999
+#define PORT_QUARANTINE_MS 30000
+
+// Set the range and the quarantine time, all ports are free afterwards.
+// Not needed for the defaults above
+void portAllocatorInit(uint16_t first, uint16_t last, uint32_t quarantine_ms);
+
+// return   a port not in use and out of quarantine, 0 if there is none
+uint16_t allocatePort();
+void releasePort(uint16_t port);
+// Ports that allocatePort can hand out right now
+size_t portsAvailable();
+
+#endif
@@ -0,0 +1,437 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+// End-to-end benchmark of the full runTest path: a veth pair with the
+// in-process reflector answering on the far end, probes run by a sweep of
+// concurrent workers. Every probe does the handshake (SACK permitted and
+// timestamp options), a data step, a timestamped data step, a data step
+// with a sequence gap (SACK) and the FIN exchange.
+//
+// For every concurrency level prints one JSON line (or CSV with -c):
+//      concurrency, probes, failures, probes_per_sec, cpu_us_per_probe,
+//      max_rss_kb, p50_us, p99_us, p999_us
+// and with -H <prefix> the full latency distribution as <prefix>-<N>.hgrm
+//
+// The reflector runs in a child process, so CPU per probe only covers the
+// engine side. Needs root (raw sockets, veth setup):
+//      tcptester-probebench -l 1,2,4,8,16,32 -d 10
+// With -w/-f the packet capture is on, to measure its overhead
+
+#include <getopt.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <string>
+#include <vector>
+
+#include <android/log.h>
+#include "testsuite.hpp"
+#include "proxy_testsuite.hpp"
+#include "reflector.hpp"
+#include "latency_histogram.hpp"
+#include "packet_capture.hpp"
+#include "task_pool.hpp"
+
+#ifndef TAG
+#define TAG "TCPTester-probebench"
+#endif
+
+// Every worker cycles through its own block of source ports
+#define PROBE_PORT_BASE 20000
+#define PROBE_PORTS_PER_WORKER 256
+#define PROBE_MAX_CONCURRENCY 160
+
+using namespace std::placeholders;
+
+struct probe_options {
+    std::string interface;
+    std::string local_address;
+    std::string reflector_address;
+    uint16_t dst_port;
+    std::vector<int> levels;
+    int duration_s;
+    bool csv;
+    bool setup;
+    std::string hgrm_prefix;
+    std::string capture_path;
+    int flight_recorder;
+};
+
+struct probe_worker {
+    int id;
+    uint32_t source;
+    uint32_t destination;
+    uint16_t dst_port;
+    std::atomic<bool> *stop;
+    uint64_t probes;
+    uint64_t failures;
+    struct latency_histogram latency;
+};
+
+static int runCommand(const char *format, const char *a, const char *b = "", const char *c = "")
+{
+    char command[512];
+    snprintf(command, sizeof(command), format, a, b, c);
+    return system(command);
+}
+
+static bool interfaceMac(const char *name, unsigned char *mac)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    bool ok = sock != -1 && ioctl(sock, SIOCGIFHWADDR, &ifr) != -1;
+    if (ok)
+        memcpy(mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+    if (sock != -1)
+        close(sock);
+    return ok;
+}
+
+// veth pair: <if>a carries the local address and has a permanent neighbour
+// entry for the reflector address, <if>b has no address so the kernel
+// ignores the probes and only the reflector answers them
+static bool setupVeth(struct probe_options *options)
+{
+    std::string local_if = options->interface + "a";
+    std::string remote_if = options->interface + "b";
+    if (runCommand("ip link add %s type veth peer name %s", local_if.c_str(), remote_if.c_str()) != 0
+            || runCommand("ip addr add %s/24 dev %s", options->local_address.c_str(), local_if.c_str()) != 0
+            || runCommand("ip link set %s up && ip link set %s up", local_if.c_str(), remote_if.c_str()) != 0) {
+        LOGE("veth setup failed");
+        return false;
+    }
+    unsigned char mac[ETH_ALEN];
+    if (!interfaceMac(remote_if.c_str(), mac)) {
+        LOGE("Reading %s address failed: %s", remote_if.c_str(), strerror(errno));
+        return false;
+    }
+    char lladdr[32];
+    snprintf(lladdr, sizeof(lladdr), "%02x:%02x:%02x:%02x:%02x:%02x",
+        mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    if (runCommand("ip neigh replace %s lladdr %s dev %s nud permanent",
+            options->reflector_address.c_str(), lladdr, local_if.c_str()) != 0) {
+        LOGE("Neighbour entry for the reflector failed");
+        return false;
+    }
+    // The local stack resets the connections it does not know about,
+    // keep that noise off the link if iptables is around
+    runCommand("iptables -A OUTPUT -o %s -p tcp --tcp-flags RST RST -j DROP 2>/dev/null", local_if.c_str());
+    return true;
+}
+
+static void teardownVeth(struct probe_options *options)
+{
+    std::string local_if = options->interface + "a";
+    runCommand("iptables -D OUTPUT -o %s -p tcp --tcp-flags RST RST -j DROP 2>/dev/null", local_if.c_str());
+    runCommand("ip link del %s", local_if.c_str());
+}
+
+// Reflector loop on the far end of the veth pair, never returns.
+// Writes a byte to ready once it is receiving
+static void runReflector(const char *interface, uint32_t address, int ready)
+{
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    int sock = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_IP));
+    if (sock == -1) {
+        LOGE("Reflector socket failed: %s", strerror(errno));
+        _exit(1);
+    }
+    struct sockaddr_ll addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_IP);
+    addr.sll_ifindex = if_nametoindex(interface);
+    if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        LOGE("Reflector bind to %s failed: %s", interface, strerror(errno));
+        _exit(1);
+    }
+    if (write(ready, "R", 1) != 1)
+        _exit(1);
+    close(ready);
+
+    struct reflector_state refl;
+    reflectorInit(&refl);
+    static char frame[ETH_HLEN + BUFLEN];
+    static char reply[ETH_HLEN + BUFLEN];
+    struct ethhdr *eth = (struct ethhdr*) frame;
+    struct iphdr *ip = (struct iphdr*) (frame + ETH_HLEN);
+    struct ethhdr *reply_eth = (struct ethhdr*) reply;
+    struct iphdr *reply_ip = (struct iphdr*) (reply + ETH_HLEN);
+    while (true) {
+        int length = recv(sock, frame, sizeof(frame), 0);
+        if (length < (int) (ETH_HLEN + IPHDRLEN + TCPHDRLEN))
+            continue;
+        if (ip->version != 4 || ip->ihl != 5 || ip->protocol != IPPROTO_TCP || ip->daddr != address)
+            continue;
+        struct tcphdr *tcp = (struct tcphdr*) ((char*) ip + IPHDRLEN);
+        memset(reply_ip, 0, IPHDRLEN + TCPHDRLEN);
+        int reply_length = reflectPacket(&refl, ip, tcp, (char*) reply_ip);
+        while (reply_length > 0) {
+            reply_ip->check = 0;
+            reply_ip->check = comp_chksum((uint16_t*) reply_ip, reply_ip->ihl * 4);
+            memcpy(reply_eth->h_dest, eth->h_source, ETH_ALEN);
+            memcpy(reply_eth->h_source, eth->h_dest, ETH_ALEN);
+            reply_eth->h_proto = htons(ETH_P_IP);
+            if (send(sock, reply, ETH_HLEN + reply_length, 0) == -1)
+                LOGE("Reflector send failed: %s", strerror(errno));
+            reply_length = reflectorPending(&refl, (char*) reply_ip);
+        }
+    }
+}
+
+// The probe: handshake with SACK permitted and timestamps, plain data,
+// timestamped data, data after a sequence gap, then FIN
+static test_error runProbe(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+{
+    char send_payload[] = "HELLO";
+    int send_length = strlen(send_payload);
+    char expect_payload[] = "OLLEH";
+    int expect_length = strlen(expect_payload);
+
+    packetModifier fn_synFields = std::bind(addSynExtras, 0, 0, 0, _1, _2, _3);
+    packetModifier fn_sackOption = std::bind(appendTcpOption, TCPOPT_SACK_PERMITTED, TCPOLEN_SACK_PERMITTED, (char*) NULL, _1, _2, _3);
+    packetModifier fn_options = std::bind(concatPacketModifiers, fn_sackOption, addTimestampOption, _1, _2, _3);
+    packetModifier fn_synExtras = std::bind(concatPacketModifiers, fn_synFields, fn_options, _1, _2, _3);
+    packetChecker fn_checkTcpSynAck = std::bind(checkTcpSynAck_np, 0xbe04, 0, 0, _1, _2, _3);
+
+    packetModifier fn_appendData = std::bind(appendData, send_payload, send_length, _1, _2);
+    packetChecker fn_checkData = std::bind(checkData, expect_payload, expect_length, _1, _2, _3);
+    packetModifier fn_timestamped = std::bind(concatPacketModifiers, fn_appendData, addTimestampOption, _1, _2, _3);
+    packetModifier fn_changeSeq = std::bind(increaseSeq, 0xbe, _1, _2, _3);
+    packetModifier fn_gap = std::bind(concatPacketModifiers, fn_appendData, fn_changeSeq, _1, _2, _3);
+
+    std::queue<std::pair<packetModifier, packetChecker> > stepSequence;
+    stepSequence.push(std::make_pair(fn_appendData, fn_checkData));
+    stepSequence.push(std::make_pair(fn_timestamped, fn_checkData));
+    stepSequence.push(std::make_pair(fn_gap, packetChecker(dummyCheck)));
+    return runTest(source, src_port, destination, dst_port, fn_synExtras, fn_checkTcpSynAck, stepSequence);
+}
+
+static void probeWorker(struct probe_worker *worker)
+{
+    uint16_t first_port = PROBE_PORT_BASE + worker->id * PROBE_PORTS_PER_WORKER;
+    for (uint64_t n = 0; !worker->stop->load(); n++) {
+        uint16_t src_port = first_port + n % PROBE_PORTS_PER_WORKER;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        captureProbeStart("probebench");
+        test_error ret = runProbe(worker->source, src_port, worker->destination, worker->dst_port);
+        captureProbeEnd(ret != success);
+        uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        worker->probes++;
+        if (ret != success)
+            worker->failures++;
+        else
+            histogramRecord(&worker->latency, elapsed);
+    }
+}
+
+static uint64_t cpuMicros(struct rusage *usage)
+{
+    return (uint64_t) (usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1000000
+        + usage->ru_utime.tv_usec + usage->ru_stime.tv_usec;
+}
+
+static void runLevel(struct probe_options *options, int concurrency)
+{
+    std::atomic<bool> stop(false);
+    std::vector<probe_worker*> workers;
+    std::vector<std::future<void> > running;
+    // Every closed loop client keeps one worker busy for the whole level
+    struct task_pool *pool = taskPoolCreate(concurrency);
+    if (pool == NULL)
+        return;
+    struct rusage usage_start, usage_end;
+    getrusage(RUSAGE_SELF, &usage_start);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < concurrency; i++) {
+        struct probe_worker *worker = new probe_worker;
+        worker->id = i;
+        worker->source = ntohl(inet_addr(options->local_address.c_str()));
+        worker->destination = ntohl(inet_addr(options->reflector_address.c_str()));
+        worker->dst_port = options->dst_port;
+        worker->stop = &stop;
+        worker->probes = worker->failures = 0;
+        histogramInit(&worker->latency);
+        running.push_back(taskSubmit(pool, std::bind(probeWorker, worker), i));
+        workers.push_back(worker);
+    }
+    sleep(options->duration_s);
+    stop = true;
+
+    static struct latency_histogram latency;
+    histogramInit(&latency);
+    uint64_t probes = 0, failures = 0;
+    for (size_t i = 0; i < workers.size(); i++) {
+        running[i].wait();
+        probes += workers[i]->probes;
+        failures += workers[i]->failures;
+        histogramMerge(&latency, &workers[i]->latency);
+        delete workers[i];
+    }
+    taskPoolDestroy(pool);
+    double elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count() / 1000000.0;
+    getrusage(RUSAGE_SELF, &usage_end);
+
+    double probes_per_sec = probes / elapsed;
+    double cpu_per_probe = probes > 0 ? (double) (cpuMicros(&usage_end) - cpuMicros(&usage_start)) / probes : 0;
+    double p50 = histogramPercentile(&latency, 50) / 1000.0;
+    double p99 = histogramPercentile(&latency, 99) / 1000.0;
+    double p999 = histogramPercentile(&latency, 99.9) / 1000.0;
+    if (options->csv)
+        printf("%d,%llu,%llu,%.1f,%.1f,%ld,%.1f,%.1f,%.1f\n", concurrency,
+            (unsigned long long) probes, (unsigned long long) failures, probes_per_sec,
+            cpu_per_probe, usage_end.ru_maxrss, p50, p99, p999);
+    else
+        printf("{\"concurrency\":%d,\"probes\":%llu,\"failures\":%llu,\"probes_per_sec\":%.1f,"
+            "\"cpu_us_per_probe\":%.1f,\"max_rss_kb\":%ld,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f}\n",
+            concurrency, (unsigned long long) probes, (unsigned long long) failures, probes_per_sec,
+            cpu_per_probe, usage_end.ru_maxrss, p50, p99, p999);
+    fflush(stdout);
+
+    if (!options->hgrm_prefix.empty()) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s-%d.hgrm", options->hgrm_prefix.c_str(), concurrency);
+        FILE *out = fopen(path, "w");
+        if (out == NULL) {
+            LOGE("Opening %s failed: %s", path, strerror(errno));
+            return;
+        }
+        histogramPrint(&latency, out, 1000.0);
+        fclose(out);
+    }
+}
+
+static void parseLevels(const char *list, std::vector<int> &levels)
+{
+    levels.clear();
+    std::string value;
+    for (const char *c = list; ; c++) {
+        if (*c == ',' || *c == '\0') {
+            int level = atoi(value.c_str());
+            if (level > 0 && level <= PROBE_MAX_CONCURRENCY)
+                levels.push_back(level);
+            value.clear();
+            if (*c == '\0')
+                break;
+        } else {
+            value += *c;
+        }
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options]\n"
+        "  -i <name>    veth pair name, <name>a and <name>b (tcpb0)\n"
+        "  -a <addr>    local address (10.77.0.1)\n"
+        "  -r <addr>    reflector address (10.77.0.2)\n"
+        "  -p <port>    destination port (80)\n"
+        "  -l <list>    concurrency levels (1,2,4,8,16)\n"
+        "  -d <sec>     duration of every level (5)\n"
+        "  -H <prefix>  write latency distributions to <prefix>-<level>.hgrm\n"
+        "  -w <file>    capture packets to a pcapng file\n"
+        "  -f <N>       flight recorder, last N packets of failed probes\n"
+        "  -n           use an existing veth pair\n"
+        "  -c           CSV output\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    struct probe_options options;
+    options.interface = "tcpb0";
+    options.local_address = "10.77.0.1";
+    options.reflector_address = "10.77.0.2";
+    options.dst_port = 80;
+    options.duration_s = 5;
+    options.csv = false;
+    options.setup = true;
+    options.flight_recorder = 0;
+    parseLevels("1,2,4,8,16", options.levels);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:a:r:p:l:d:H:w:f:nch")) != -1) {
+        switch (opt) {
+            case 'i': options.interface = optarg; break;
+            case 'a': options.local_address = optarg; break;
+            case 'r': options.reflector_address = optarg; break;
+            case 'p': options.dst_port = atoi(optarg); break;
+            case 'l': parseLevels(optarg, options.levels); break;
+            case 'd': options.duration_s = atoi(optarg); break;
+            case 'H': options.hgrm_prefix = optarg; break;
+            case 'w': options.capture_path = optarg; break;
+            case 'f': options.flight_recorder = atoi(optarg); break;
+            case 'n': options.setup = false; break;
+            case 'c': options.csv = true; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (options.setup && !setupVeth(&options)) {
+        teardownVeth(&options);
+        return 1;
+    }
+    int ready[2];
+    pid_t reflector = pipe(ready) == 0 ? fork() : -1;
+    if (reflector == 0) {
+        close(ready[0]);
+        runReflector((options.interface + "b").c_str(), inet_addr(options.reflector_address.c_str()), ready[1]);
+    }
+    char ready_byte;
+    if (reflector != -1) {
+        close(ready[1]);
+        if (read(ready[0], &ready_byte, 1) != 1) {
+            waitpid(reflector, NULL, 0);
+            reflector = -1;
+        }
+        close(ready[0]);
+    }
+    if (reflector == -1) {
+        LOGE("Starting the reflector failed: %s", strerror(errno));
+        if (options.setup)
+            teardownVeth(&options);
+        return 1;
+    }
+
+    if (!options.capture_path.empty())
+        captureOpen(options.capture_path.c_str(), options.flight_recorder > 0 ?
+            capture_flight_recorder : capture_all, options.flight_recorder);
+    if (options.csv)
+        printf("concurrency,probes,failures,probes_per_sec,cpu_us_per_probe,max_rss_kb,p50_us,p99_us,p999_us\n");
+    for (size_t i = 0; i < options.levels.size(); i++)
+        runLevel(&options, options.levels[i]);
+
+    captureClose();
+    kill(reflector, SIGTERM);
+    waitpid(reflector, NULL, 0);
+    if (options.setup)
+        teardownVeth(&options);
+    return 0;
+}
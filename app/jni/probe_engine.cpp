@@ -0,0 +1,834 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <sys/epoll.h>
+#include <errno.h>
+#include <unistd.h>
+#include <chrono>
+
+#include <android/log.h>
+#include "probe_engine.hpp"
+#include "packet_capture.hpp"
+#include "test_planner.hpp"
+#include "packet_view.hpp"
+#include "socket_pool.hpp"
+#include "pacer.hpp"
+
+#define PROBE_TIMEOUT_MS (std::chrono::duration_cast<std::chrono::milliseconds>(sock_receive_timeout_sec).count())
+
+enum probe_state {
+    probe_syn_sent,
+    probe_step_delay,
+    probe_step_wait,
+    probe_fin_wait,
+    probe_held                  // established and kept open, see probeHold
+};
+
+struct probe {
+    struct probe_engine *engine;
+    uint64_t key;
+    struct sockaddr_in src, dst;
+    test_definition test;
+    probeCallback fn_done;
+    probeCallback fn_reset;     // held probes only
+    bool hold;
+    probeSegmentHandler fn_segment; // streamed held probes only
+    struct capture_probe *capture;
+    struct capture_probe *detached;
+    probe_state state;
+    struct tcp_opt conn_state;
+    // Last packet built or accepted, as runTest's buffer
+    char buffer[BUFLEN];
+    struct iphdr *ip;
+    struct tcphdr *tcp;
+    // SYN kept for retransmission, request kept while it is delayed
+    std::vector<char> syn;
+    std::vector<char> request;
+    std::vector<std::vector<char> > backlog;
+    int syn_retries;
+    uint16_t syn_features;      // see test_planner.hpp
+    bool inferred;              // not sent, the planner knows it will be lost
+    uint32_t defer_ms;
+    // Packets held by the pacer and the departure time of the last of them
+    uint32_t paced_held;
+    uint64_t paced_until;
+    // For the RTTs
+    struct packet_meta syn_sent;
+    struct packet_meta synack_received;
+    struct packet_meta request_sent;
+    struct packet_meta response_received;
+    uint8_t synack_ttl;
+    uint16_t synack_mss;
+    bool anything_received;
+    int step;
+    struct wheel_timer timeout;
+    struct wheel_timer retransmit;
+    struct wheel_timer deferred;
+};
+
+// Probe whose request is being built on this thread, for probeDeferRequest
+static __thread struct probe *building_probe = NULL;
+
+static uint64_t probeKey(uint32_t remote_address, uint16_t remote_port, uint16_t local_port)
+{
+    return ((uint64_t) remote_address << 32) | ((uint32_t) remote_port << 16) | local_port;
+}
+
+// Attach the probe's capture context for the duration of a loop callback
+static void enterProbe(struct probe *probe)
+{
+    if (probe->capture != NULL)
+        probe->detached = captureProbeAttach(probe->capture);
+}
+
+static void leaveProbe(struct probe *probe)
+{
+    if (probe->capture != NULL)
+        captureProbeAttach(probe->detached);
+}
+
+// A packet of the probe has been sent, stamp it into meta if given
+static void probeSent(struct probe *probe, struct packet_meta *meta)
+{
+    struct probe_engine *engine = probe->engine;
+    if (meta != NULL) {
+        memset(meta, 0, sizeof(*meta));
+        meta->user_ns = monotonicNanos();
+        if (engine->timestamping)
+            engine->tx_pending[engine->tx_next] = std::make_pair(probe->key, meta);
+    }
+    if (engine->timestamping)
+        engine->tx_next++;
+}
+
+// Wake up for the next held packet
+static void armPacing(struct probe_engine *engine, uint64_t now)
+{
+    if (engine->paced.empty())
+        return;
+    uint64_t departure = engine->paced.begin()->first.first;
+    uint64_t wait_ns = departure > now ? departure - now : 0;
+    eventLoopTimer(engine->loop, &engine->pacing, (wait_ns + 999999) / 1000000);
+}
+
+// Send the held packets whose departure time has come, in order, and wait
+// for the next one
+static void sendPaced(struct probe_engine *engine)
+{
+    uint64_t now = monotonicNanos();
+    while (!engine->paced.empty() && engine->paced.begin()->first.first <= now) {
+        uint64_t departure = engine->paced.begin()->first.first;
+        struct paced_packet held;
+        held.key = engine->paced.begin()->second.key;
+        held.packet.swap(engine->paced.begin()->second.packet);
+        held.meta = engine->paced.begin()->second.meta;
+        engine->paced.erase(engine->paced.begin());
+        std::map<uint64_t, struct probe*>::iterator it = engine->probes.find(held.key);
+        if (it == engine->probes.end())
+            continue;
+        struct probe *probe = it->second;
+        probe->paced_held--;
+        enterProbe(probe);
+        // A lost packet is retransmitted or times out like one lost on the way
+        if (sendPacketAt(engine->sock, &held.packet[0], &probe->dst, held.packet.size(), departure) == success)
+            probeSent(probe, held.meta);
+        leaveProbe(probe);
+    }
+    armPacing(engine, now);
+}
+
+// Send a packet of the probe, stamping it into meta if given
+static test_error probeSend(struct probe *probe, const char *packet, uint16_t length, struct packet_meta *meta)
+{
+    struct probe_engine *engine = probe->engine;
+    if (packetIo() != NULL || !pacerSleeps(engine->sock)) {
+        test_error ret = sendPacket(engine->sock, (char*) packet, &probe->dst, length);
+        if (ret == success)
+            probeSent(probe, meta);
+        return ret;
+    }
+    // Sleeping for tokens would hold up every probe of the loop, those of
+    // destinations and ports with full buckets too
+    uint64_t departure = pacerReserve(packet, &probe->dst);
+    if (departure <= monotonicNanos() && engine->paced.empty()) {
+        test_error ret = sendPacketAt(engine->sock, (char*) packet, &probe->dst, length, departure);
+        if (ret == success)
+            probeSent(probe, meta);
+        return ret;
+    }
+    if (meta != NULL)
+        memset(meta, 0, sizeof(*meta));
+    struct paced_packet &held = engine->paced[std::make_pair(departure, engine->paced_order++)];
+    held.key = probe->key;
+    held.packet.assign(packet, packet + length);
+    held.meta = meta;
+    probe->paced_held++;
+    if (departure > probe->paced_until)
+        probe->paced_until = departure;
+    // Sent from the loop even when due, after those held before it
+    armPacing(engine, monotonicNanos());
+    return success;
+}
+
+static void sendBuffer(struct probe *probe)
+{
+    probeSend(probe, probe->buffer, ntohs(probe->ip->tot_len), NULL);
+}
+
+static int64_t probeRtt(const struct packet_meta *sent, const struct packet_meta *received)
+{
+    if (sent->user_ns == 0 || received->user_ns == 0)
+        return -1;
+    return elapsedMicros(sent, received);
+}
+
+static void probeTiming(const struct probe *probe, struct probe_timing *timing)
+{
+    // Karn: no RTT from a retransmitted SYN
+    timing->handshake_rtt_us = probe->syn_retries == 0 ? probeRtt(&probe->syn_sent, &probe->synack_received) : -1;
+    timing->data_rtt_us = probeRtt(&probe->request_sent, &probe->response_received);
+    timing->synack_ttl = probe->synack_ttl;
+    timing->synack_mss = probe->synack_mss;
+}
+
+// Done: report the result and free the probe. Nothing may touch the probe
+// after this
+static void finishProbe(struct probe *probe, test_error result)
+{
+    struct probe_engine *engine = probe->engine;
+    eventLoopCancel(engine->loop, &probe->timeout);
+    eventLoopCancel(engine->loop, &probe->retransmit);
+    eventLoopCancel(engine->loop, &probe->deferred);
+    engine->probes.erase(probe->key);
+    for (std::map<uint32_t, std::pair<uint64_t, struct packet_meta*> >::iterator it = engine->tx_pending.begin();
+                it != engine->tx_pending.end();) {
+        if (it->second.first == probe->key)
+            engine->tx_pending.erase(it++);
+        else
+            ++it;
+    }
+    for (std::map<std::pair<uint64_t, uint64_t>, struct paced_packet>::iterator it = engine->paced.begin();
+                it != engine->paced.end();) {
+        if (it->second.key == probe->key)
+            engine->paced.erase(it++);
+        else
+            ++it;
+    }
+    leaveProbe(probe);
+    captureProbeDelete(probe->capture, result != success && result != test_complete);
+
+    struct probe_timing timing;
+    probeTiming(probe, &timing);
+    probeCallback fn_done = probe->fn_done;
+    delete probe;
+    if (fn_done)
+        fn_done(result, &timing);
+}
+
+// Keep the established connection open: report the handshake, and from
+// now on only resets, which are reported to fn_reset
+static void holdProbe(struct probe *probe)
+{
+    struct probe_timing timing;
+    probeTiming(probe, &timing);
+    probe->state = probe_held;
+    eventLoopTimer(probe->engine->loop, &probe->timeout, PROBE_KEEPALIVE_MS);
+    probeCallback fn_established = probe->fn_done;
+    probe->fn_done = probe->fn_reset;
+    fn_established(success, &timing);
+}
+
+// Keepalive, RFC 1122: an ACK one byte behind, for the middleboxes on the
+// way to refresh their state
+static void sendKeepalive(struct probe *probe)
+{
+    buildTcpAck(&probe->src, &probe->dst, probe->ip, probe->tcp,
+        probe->conn_state.snd_nxt - 1, probe->conn_state.rcv_nxt);
+    sendBuffer(probe);
+    eventLoopTimer(probe->engine->loop, &probe->timeout, PROBE_KEEPALIVE_MS);
+}
+
+static void startShutdown(struct probe *probe)
+{
+    buildTcpFin(&probe->src, &probe->dst, probe->ip, probe->tcp,
+        probe->conn_state.snd_nxt, probe->conn_state.rcv_nxt);
+    sendBuffer(probe);
+    probe->state = probe_fin_wait;
+    eventLoopTimer(probe->engine->loop, &probe->timeout, PROBE_TIMEOUT_MS);
+}
+
+static void probeReceive(struct probe *probe, const char *packet, int length, const struct packet_meta *meta);
+
+static void sendRequest(struct probe *probe)
+{
+    LOGD("STEP %d: Send request", probe->step);
+    probeSend(probe, &probe->request[0], probe->request.size(), probe->step == 0 ? &probe->request_sent : NULL);
+    probe->anything_received = false;
+    probe->state = probe_step_wait;
+    eventLoopTimer(probe->engine->loop, &probe->timeout, PROBE_TIMEOUT_MS);
+    // Packets that arrived while the request was held back are taken as
+    // responses, as they would have been read after a blocking delay
+    std::vector<std::vector<char> > backlog;
+    backlog.swap(probe->backlog);
+    struct packet_meta unknown;
+    memset(&unknown, 0, sizeof(unknown));
+    for (size_t i = 0; i < backlog.size(); i++) {
+        uint64_t key = probe->key;
+        probeReceive(probe, &backlog[i][0], backlog[i].size(), &unknown);
+        // Stop if that finished the probe
+        if (probe->engine->probes.count(key) == 0)
+            return;
+    }
+}
+
+// Build the request of the next step, or shut down after the last one
+static void startStep(struct probe *probe)
+{
+    if (probe->test.stepSequence.empty()) {
+        startShutdown(probe);
+        return;
+    }
+    struct tcp_opt *conn_state = &probe->conn_state;
+    buildTcpAck(&probe->src, &probe->dst, probe->ip, probe->tcp, conn_state->snd_nxt, conn_state->rcv_nxt);
+    conn_state->rcv_tsval = monotonicNanos() / 1000000;
+    appendTimestamp(probe->ip, probe->tcp, conn_state);
+    probe->defer_ms = 0;
+    building_probe = probe;
+    probe->test.stepSequence.front().first(probe->ip, probe->tcp, conn_state);
+    building_probe = NULL;
+    probe->request.assign(probe->buffer, probe->buffer + ntohs(probe->ip->tot_len));
+
+    if (probe->defer_ms > 0) {
+        probe->state = probe_step_delay;
+        eventLoopTimer(probe->engine->loop, &probe->deferred, probe->defer_ms);
+    } else {
+        sendRequest(probe);
+    }
+}
+
+// Check the response (the last packet accepted), ACK its data and move on
+static void completeStep(struct probe *probe)
+{
+    struct tcp_opt *conn_state = &probe->conn_state;
+    struct iphdr *ip = probe->ip;
+    struct tcphdr *tcp = probe->tcp;
+    struct packet_view view;
+    viewPacket(ip, tcp, &view);
+    uint16_t data_length = view.payload_length;
+
+    // Continuous block received and adds new data
+    if (view.seq <= conn_state->rcv_nxt && conn_state->rcv_nxt < view.seq + data_length + 1)
+        conn_state->rcv_nxt = view.seq + data_length;
+
+    LOGD("STEP %d: Check response", probe->step);
+    test_error ret = probe->test.stepSequence.front().second(ip, tcp, conn_state);
+    sackResponseHandler(ip, tcp, conn_state);
+    if (ret != success && ret != response_acceptable) {
+        LOGD("STEP %d: Test failed, response not acceptable", probe->step);
+        finishProbe(probe, ret);
+        return;
+    }
+
+    if (data_length > 0) {
+        LOGD("STEP %d: Acknowledging data", probe->step);
+        buildTcpAck(&probe->src, &probe->dst, ip, tcp, conn_state->snd_nxt, conn_state->rcv_nxt);
+        appendSackBlock(ip, tcp, conn_state);
+        appendTimestamp(ip, tcp, conn_state);
+        sendBuffer(probe);
+    }
+    probe->test.stepSequence.pop();
+    probe->step++;
+    startStep(probe);
+}
+
+// MSS option value of a SYNACK, 0 if there is none
+static uint16_t synackMss(const struct packet_view *view)
+{
+    struct tcp_option_view option;
+    if (!findTcpOption(view, TCPOPT_MAXSEG, &option) || option.length != TCPOLEN_MAXSEG)
+        return 0;
+    return (option.data[0] << 8) | option.data[1];
+}
+
+static void receiveSynAck(struct probe *probe)
+{
+    struct tcp_opt *conn_state = &probe->conn_state;
+    test_error ret = success;
+    struct packet_view view;
+    viewPacket(probe->ip, probe->tcp, &view);
+    eventLoopCancel(probe->engine->loop, &probe->retransmit);
+    probe->synack_ttl = view.ttl;
+    probe->synack_mss = synackMss(&view);
+    uint32_t echo_address;
+    uint16_t echo_port;
+    if (readAddressEcho(probe->ip, probe->tcp, &echo_address, &echo_port))
+        learnGlobalAddress(ntohl(echo_address));
+    if (probe->tcp->syn && probe->tcp->ack)
+        plannerSynAnswered(ntohl(probe->dst.sin_addr.s_addr), ntohs(probe->dst.sin_port), probe->syn_features);
+    if (!probe->tcp->syn || !probe->tcp->ack) {
+        LOGE("Not a SYNACK packet");
+        ret = protocol_error;
+    } else if (conn_state->snd_nxt != view.ack_seq) {
+        LOGE("SYNACK packet unexpected ACK number: %u, %u", conn_state->snd_nxt, view.ack_seq);
+        ret = sequence_error;
+    } else {
+        ret = probe->test.fn_checkTcpSynAck(probe->ip, probe->tcp, conn_state);
+    }
+    if (ret != success) {
+        // A SYNACK can also be all a test needs
+        if (ret != test_complete)
+            LOGE("TCP SYNACK packet failure: %d", ret);
+        finishProbe(probe, ret);
+        return;
+    }
+
+    conn_state->rcv_nxt = view.seq + 1 + view.payload_length;
+    buildTcpAck(&probe->src, &probe->dst, probe->ip, probe->tcp, conn_state->snd_nxt, conn_state->rcv_nxt);
+    appendTimestamp(probe->ip, probe->tcp, conn_state);
+    sendBuffer(probe);
+    LOGD("TCP handshake successful");
+
+    conn_state->sack_ok = 0;
+    if (probe->hold)
+        holdProbe(probe);
+    else
+        startStep(probe);
+}
+
+static void probeReceive(struct probe *probe, const char *packet, int length, const struct packet_meta *meta)
+{
+    if (probe->inferred)
+        return;
+    if (probe->state == probe_step_delay) {
+        probe->backlog.push_back(std::vector<char>(packet, packet + length));
+        return;
+    }
+    memcpy(probe->buffer, packet, length);
+    struct tcp_opt *conn_state = &probe->conn_state;
+    struct tcphdr *tcp = probe->tcp;
+    struct packet_view view;
+    viewPacket(probe->ip, tcp, &view);
+
+    switch (probe->state) {
+        case probe_syn_sent:
+            probe->synack_received = *meta;
+            receiveSynAck(probe);
+            break;
+        case probe_step_wait: {
+            uint16_t data_length = view.payload_length;
+            if (probe->step == 0 && !probe->anything_received)
+                probe->response_received = *meta;
+            probe->anything_received = true;
+            hasTcpOption(TCPOPT_TIMESTAMP, probe->ip, tcp, conn_state);
+            // Advance own acknowledged data
+            if (view.ack_seq > conn_state->snd_nxt)
+                conn_state->snd_nxt = view.ack_seq;
+            if (data_length > 0)
+                completeStep(probe);
+            else
+                eventLoopTimer(probe->engine->loop, &probe->timeout, PROBE_TIMEOUT_MS);
+            break;
+        }
+        case probe_held:
+            if (tcp->rst) {
+                LOGD("Held connection reset");
+                finishProbe(probe, protocol_error);
+            } else if (probe->fn_segment) {
+                probe->fn_segment(probe->ip, tcp, meta);
+            } else if (tcp->syn && tcp->ack) {
+                // Our ACK got lost, the SYNACK is retransmitted
+                buildTcpAck(&probe->src, &probe->dst, probe->ip, tcp, conn_state->snd_nxt, conn_state->rcv_nxt);
+                sendBuffer(probe);
+            }
+            break;
+        case probe_fin_wait:
+            // runTest never failed a test on the shutdown, neither does this
+            if (tcp->fin) {
+                conn_state->rcv_nxt = view.seq + view.payload_length + 1;
+                buildTcpAck(&probe->src, &probe->dst, probe->ip, tcp, conn_state->snd_nxt, conn_state->rcv_nxt);
+                sendBuffer(probe);
+            }
+            finishProbe(probe, success);
+            break;
+        default:
+            break;
+    }
+}
+
+// Timeouts count from when what they wait for has been sent, not from when
+// the pacer took it: with packets still held, the timer is put off until
+// the last of them is due
+// return   true if the timer has been put off
+static bool postponeForPacing(struct probe *probe, struct wheel_timer *timer, uint64_t interval_ms)
+{
+    if (probe->paced_held == 0)
+        return false;
+    uint64_t now = monotonicNanos();
+    uint64_t wait_ns = probe->paced_until > now ? probe->paced_until - now : 0;
+    eventLoopTimer(probe->engine->loop, timer, (wait_ns + 999999) / 1000000 + interval_ms);
+    return true;
+}
+
+static void probeTimeout(struct probe *probe)
+{
+    if (postponeForPacing(probe, &probe->timeout, probe->state == probe_held ? PROBE_KEEPALIVE_MS : PROBE_TIMEOUT_MS))
+        return;
+    enterProbe(probe);
+    switch (probe->state) {
+        case probe_syn_sent:
+            if (probe->inferred) {
+                finishProbe(probe, test_inferred);
+                return;
+            }
+            LOGD("SYNACK timed out");
+            if (!probe->hold)
+                plannerSynLost(ntohl(probe->dst.sin_addr.s_addr), ntohs(probe->dst.sin_port), probe->syn_features);
+            finishProbe(probe, receive_timeout);
+            return;
+        case probe_step_wait:
+            if (!probe->anything_received) {
+                LOGD("STEP %d: Failure receiving any response", probe->step);
+                finishProbe(probe, receive_timeout);
+                return;
+            }
+            // An ACK, but no data - fail softly
+            LOGD("STEP %d: Received an empty response", probe->step);
+            completeStep(probe);
+            break;
+        case probe_fin_wait:
+            finishProbe(probe, success);
+            return;
+        case probe_held:
+            if (!probe->fn_segment)
+                sendKeepalive(probe);
+            break;
+        default:
+            break;
+    }
+    if (probe->engine->probes.count(probe->key) > 0)
+        leaveProbe(probe);
+}
+
+static void probeRetransmit(struct probe *probe)
+{
+    if (probe->state != probe_syn_sent || probe->syn_retries >= PROBE_SYN_RETRIES)
+        return;
+    if (postponeForPacing(probe, &probe->retransmit, PROBE_SYN_RTO_MS << probe->syn_retries))
+        return;
+    enterProbe(probe);
+    probe->syn_retries++;
+    LOGD("Retransmitting SYN (%d)", probe->syn_retries);
+    probeSend(probe, &probe->syn[0], probe->syn.size(), NULL);
+    eventLoopTimer(probe->engine->loop, &probe->retransmit, PROBE_SYN_RTO_MS << probe->syn_retries);
+    leaveProbe(probe);
+}
+
+static void probeDeferred(struct probe *probe)
+{
+    enterProbe(probe);
+    uint64_t key = probe->key;
+    sendRequest(probe);
+    if (probe->engine->probes.count(key) > 0)
+        leaveProbe(probe);
+}
+
+// Read everything queued on the raw socket and hand it to the probes
+static void engineReceive(struct probe_engine *engine)
+{
+    char *buffer = &engine->buffer[0];
+    struct packet_view view;
+    struct packet_meta meta;
+    while (true) {
+        int length = receiveWithMeta(engine->sock, buffer, BUFLEN, MSG_DONTWAIT, &meta);
+        if (length == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                LOGE("recv() failed: %s", strerror(errno));
+            if (errno != EINTR)
+                return;
+            continue;
+        }
+        // Probes keep the TCP header right after a bare IP header
+        if (!viewPacket(buffer, length, &view) || view.ip_header_length != IPHDRLEN)
+            continue;
+        std::map<uint64_t, struct probe*>::iterator it =
+            engine->probes.find(probeKey(view.ip->saddr, view.tcp->source, view.tcp->dest));
+        if (it == engine->probes.end() || it->second->src.sin_addr.s_addr != view.ip->daddr)
+            continue;
+        struct probe *probe = it->second;
+        uint64_t key = probe->key;
+        enterProbe(probe);
+        capturePacket(capture_inbound, buffer, view.length);
+        probeReceive(probe, buffer, view.length, &meta);
+        if (engine->probes.count(key) > 0)
+            leaveProbe(probe);
+    }
+}
+
+// TX timestamps of the packets sent, in order
+static void engineTxTimestamps(struct probe_engine *engine)
+{
+    uint32_t id;
+    struct packet_meta meta;
+    while (receiveTxTimestamp(engine->sock, &id, &meta)) {
+        std::map<uint32_t, std::pair<uint64_t, struct packet_meta*> >::iterator it = engine->tx_pending.find(id);
+        if (it == engine->tx_pending.end())
+            continue;
+        if (meta.software_ns != 0)
+            it->second.second->software_ns = meta.software_ns;
+        if (meta.hardware_ns != 0)
+            it->second.second->hardware_ns = meta.hardware_ns;
+        engine->tx_pending.erase(it);
+    }
+}
+
+static void engineEvents(struct probe_engine *engine, uint32_t events)
+{
+    if (events & EPOLLERR)
+        engineTxTimestamps(engine);
+    if (events & EPOLLIN)
+        engineReceive(engine);
+}
+
+bool probeEngineInit(struct probe_engine *engine, struct event_loop *loop)
+{
+    engine->loop = loop;
+    engine->probes.clear();
+    engine->buffer.assign(BUFLEN, 0);
+    engine->tx_next = 0;
+    engine->tx_pending.clear();
+    engine->paced.clear();
+    engine->paced_order = 0;
+    timerInit(&engine->pacing, std::bind(sendPaced, engine));
+    engine->sock = leaseSocket();
+    if (engine->sock == -1) {
+        LOGE("Socket setup failed: %s", strerror(errno));
+        return false;
+    }
+    engine->timestamping = enableTimestamping(engine->sock);
+    if (!eventLoopAdd(loop, engine->sock, EPOLLIN, std::bind(engineEvents, engine, std::placeholders::_1))) {
+        returnSocket(engine->sock);
+        return false;
+    }
+    return true;
+}
+
+void probeEngineClose(struct probe_engine *engine)
+{
+    for (std::map<uint64_t, struct probe*>::iterator it = engine->probes.begin(); it != engine->probes.end(); ++it) {
+        struct probe *probe = it->second;
+        eventLoopCancel(engine->loop, &probe->timeout);
+        eventLoopCancel(engine->loop, &probe->retransmit);
+        eventLoopCancel(engine->loop, &probe->deferred);
+        captureProbeDelete(probe->capture, true);
+        delete probe;
+    }
+    engine->probes.clear();
+    engine->tx_pending.clear();
+    eventLoopCancel(engine->loop, &engine->pacing);
+    engine->paced.clear();
+    eventLoopRemove(engine->loop, engine->sock);
+    returnSocket(engine->sock);
+}
+
+static bool startProbe(struct probe_engine *engine, uint32_t source, uint16_t src_port,
+            uint32_t destination, uint16_t dst_port, test_definition test,
+            const char *name, probeCallback fn_done, probeCallback fn_reset)
+{
+    uint64_t key = probeKey(htonl(destination), htons(dst_port), htons(src_port));
+    if (engine->probes.count(key) > 0) {
+        LOGE("Probe %u -> %u already in flight", src_port, dst_port);
+        return false;
+    }
+
+    struct probe *probe = new struct probe;
+    probe->engine = engine;
+    probe->key = key;
+    probe->src.sin_family = AF_INET;
+    probe->src.sin_port = htons(src_port);
+    probe->src.sin_addr.s_addr = htonl(source);
+    probe->dst.sin_family = AF_INET;
+    probe->dst.sin_port = htons(dst_port);
+    probe->dst.sin_addr.s_addr = htonl(destination);
+    probe->test = test;
+    probe->fn_done = fn_done;
+    probe->fn_reset = fn_reset;
+    probe->hold = fn_reset != NULL;
+    probe->capture = name != NULL ? captureProbeNew(name) : NULL;
+    probe->detached = NULL;
+    probe->state = probe_syn_sent;
+    memset(&probe->conn_state, 0, sizeof(probe->conn_state));
+    memset(probe->buffer, 0, sizeof(probe->buffer));
+    probe->ip = (struct iphdr*) probe->buffer;
+    probe->tcp = (struct tcphdr*) (probe->buffer + IPHDRLEN);
+    probe->syn_retries = 0;
+    probe->inferred = false;
+    probe->defer_ms = 0;
+    probe->paced_held = 0;
+    probe->paced_until = 0;
+    probe->anything_received = false;
+    probe->synack_ttl = 0;
+    probe->synack_mss = 0;
+    probe->step = 0;
+    memset(&probe->syn_sent, 0, sizeof(probe->syn_sent));
+    memset(&probe->synack_received, 0, sizeof(probe->synack_received));
+    memset(&probe->request_sent, 0, sizeof(probe->request_sent));
+    memset(&probe->response_received, 0, sizeof(probe->response_received));
+    timerInit(&probe->timeout, std::bind(probeTimeout, probe));
+    timerInit(&probe->retransmit, std::bind(probeRetransmit, probe));
+    timerInit(&probe->deferred, std::bind(probeDeferred, probe));
+    engine->probes[key] = probe;
+
+    enterProbe(probe);
+    buildTcpSyn(&probe->src, &probe->dst, probe->ip, probe->tcp);
+    probe->test.fn_synExtras(probe->ip, probe->tcp, &probe->conn_state);
+    probe->syn.assign(probe->buffer, probe->buffer + ntohs(probe->ip->tot_len));
+    probe->conn_state.snd_nxt = ntohl(probe->tcp->seq) + 1;
+    probe->syn_features = synFeatures(probe->ip, probe->tcp);
+    // Held connections find the limits of state tables, a SYN lost to a
+    // full table says nothing about the port
+    if (!probe->hold && probe->test.infer && plannerInferLost(destination, dst_port, probe->syn_features)) {
+        // Reported from the loop like any other result, not from in here
+        LOGD("SYN 0x%04x to port %u inferred lost, not sent", probe->syn_features, dst_port);
+        probe->inferred = true;
+        eventLoopTimer(engine->loop, &probe->timeout, 0);
+        leaveProbe(probe);
+        return true;
+    }
+    if (probeSend(probe, probe->buffer, ntohs(probe->ip->tot_len), &probe->syn_sent) != success) {
+        LOGE("TCP SYN packet failure: %s", strerror(errno));
+        finishProbe(probe, syn_error);
+        return true;
+    }
+    eventLoopTimer(engine->loop, &probe->timeout, PROBE_TIMEOUT_MS);
+    eventLoopTimer(engine->loop, &probe->retransmit, PROBE_SYN_RTO_MS);
+    leaveProbe(probe);
+    return true;
+}
+
+bool probeStart(struct probe_engine *engine, uint32_t source, uint16_t src_port,
+            uint32_t destination, uint16_t dst_port, test_definition test,
+            const char *name, probeCallback fn_done)
+{
+    return startProbe(engine, source, src_port, destination, dst_port, test, name, fn_done, NULL);
+}
+
+bool probeHold(struct probe_engine *engine, uint32_t source, uint16_t src_port,
+            uint32_t destination, uint16_t dst_port, test_definition test,
+            probeCallback fn_established, probeCallback fn_reset)
+{
+    return startProbe(engine, source, src_port, destination, dst_port, test, NULL, fn_established, fn_reset);
+}
+
+static struct probe *heldProbe(struct probe_engine *engine, uint32_t destination, uint16_t dst_port,
+            uint16_t src_port)
+{
+    std::map<uint64_t, struct probe*>::iterator it =
+        engine->probes.find(probeKey(htonl(destination), htons(dst_port), htons(src_port)));
+    if (it == engine->probes.end() || it->second->state != probe_held)
+        return NULL;
+    return it->second;
+}
+
+bool probeRelease(struct probe_engine *engine, uint32_t destination, uint16_t dst_port, uint16_t src_port)
+{
+    struct probe *probe = heldProbe(engine, destination, dst_port, src_port);
+    if (probe == NULL)
+        return false;
+    enterProbe(probe);
+    buildTcpRst(&probe->src, &probe->dst, probe->ip, probe->tcp, probe->conn_state.snd_nxt, 0, 0, 0);
+    sendBuffer(probe);
+    probe->fn_done = probeCallback();
+    finishProbe(probe, success);
+    return true;
+}
+
+bool probeStream(struct probe_engine *engine, uint32_t destination, uint16_t dst_port, uint16_t src_port,
+            probeSegmentHandler fn_segment, struct tcp_opt *conn_state)
+{
+    struct probe *probe = heldProbe(engine, destination, dst_port, src_port);
+    if (probe == NULL)
+        return false;
+    eventLoopCancel(engine->loop, &probe->timeout);
+    probe->fn_segment = fn_segment;
+    *conn_state = probe->conn_state;
+    return true;
+}
+
+bool probeSendSegment(struct probe_engine *engine, uint32_t destination, uint16_t dst_port, uint16_t src_port,
+            const char *packet, uint16_t length)
+{
+    struct probe *probe = heldProbe(engine, destination, dst_port, src_port);
+    if (probe == NULL)
+        return false;
+    // Sequence space used, for the RST of probeRelease
+    const struct iphdr *ip = (const struct iphdr*) packet;
+    const struct tcphdr *tcp = (const struct tcphdr*) (packet + ip->ihl * 4);
+    uint32_t end = ntohl(tcp->seq) + ntohs(ip->tot_len) - ip->ihl * 4 - tcp->doff * 4 + tcp->fin;
+    if ((int32_t) (end - probe->conn_state.snd_nxt) > 0)
+        probe->conn_state.snd_nxt = end;
+    enterProbe(probe);
+    test_error ret = probeSend(probe, packet, length, NULL);
+    leaveProbe(probe);
+    return ret == success;
+}
+
+bool probeSendSegments(struct probe_engine *engine, uint32_t destination, uint16_t dst_port, uint16_t src_port,
+            const std::vector<struct tcp_segment> &segments)
+{
+    struct probe *probe = heldProbe(engine, destination, dst_port, src_port);
+    if (probe == NULL || segments.empty())
+        return probe != NULL;
+    for (size_t i = 0; i < segments.size(); i++) {
+        const struct tcphdr *tcp = (const struct tcphdr*) (segments[i].header + IPHDRLEN);
+        uint32_t end = ntohl(tcp->seq) + segments[i].payload_length + tcp->fin;
+        if ((int32_t) (end - probe->conn_state.snd_nxt) > 0)
+            probe->conn_state.snd_nxt = end;
+    }
+    enterProbe(probe);
+    size_t sent;
+    test_error ret = success;
+    if (packetIo() == NULL && pacerSleeps(engine->sock)) {
+        // One by one through the pacing of probeSend, which counts them
+        char packet[SEGMENT_HDRLEN + BUFLEN];
+        for (size_t i = 0; i < segments.size() && ret == success; i++) {
+            memcpy(packet, segments[i].header, segments[i].header_length);
+            memcpy(packet + segments[i].header_length, segments[i].payload, segments[i].payload_length);
+            ret = probeSend(probe, packet, segments[i].header_length + segments[i].payload_length, NULL);
+        }
+        leaveProbe(probe);
+        return ret == success;
+    }
+    ret = sendSegments(engine->sock, &segments[0], segments.size(), &probe->dst, &sent);
+    leaveProbe(probe);
+    // No TX timestamps are kept for these, the counter has to follow
+    if (engine->timestamping)
+        engine->tx_next += sent;
+    return ret == success;
+}
+
+size_t probesInFlight(const struct probe_engine *engine)
+{
+    return engine->probes.size();
+}
+
+bool probeDeferRequest(uint32_t delay_ms)
+{
+    if (building_probe == NULL)
+        return false;
+    building_probe->defer_ms += delay_ms;
+    return true;
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <vector>
+
+#include "testsuite.hpp"
+#include "event_loop.hpp"
+#include "packet_meta.hpp"
+
+#ifndef PROBE_ENGINE
+#define PROBE_ENGINE
+
+// Event driven test runner: any number of probes in flight on one raw
+// socket and one event loop. Every probe goes through the same handshake,
+// request/response steps and shutdown as runTest always did, with its
+// timeouts on the loop's timer wheel instead of blocking receives:
+//      - handshake: sock_receive_timeout_sec for the SYNACK, the SYN
+//        retransmitted after PROBE_SYN_RTO_MS, doubling, PROBE_SYN_RETRIES times
+//      - step: sock_receive_timeout_sec for the first response to a request,
+//        then as an idle timeout between response packets
+//      - shutdown: sock_receive_timeout_sec for the FIN
+// Incoming packets are matched to their probe by address and ports. The
+// socket has SO_TIMESTAMPING enabled where supported, for the RTTs.
+// A SYN the test planner knows will be lost is not sent at all, the probe
+// finishes with test_inferred instead (see test_planner.hpp).
+
+#define PROBE_SYN_RTO_MS 1000
+#define PROBE_SYN_RETRIES 3
+// Keepalives on held connections
+#define PROBE_KEEPALIVE_MS 30000
+
+// Round trip times of a probe, from kernel timestamps where the socket
+// has them (see packet_meta.hpp), -1 if not measured, and what the SYNACK
+// looked like, 0 if none arrived
+struct probe_timing {
+    int64_t handshake_rtt_us;   // SYN to SYNACK, unless the SYN was retransmitted
+    int64_t data_rtt_us;        // first request to the first packet after it
+    uint8_t synack_ttl;
+    uint16_t synack_mss;        // 0 also without an MSS option
+};
+
+typedef std::function< void(test_error result, const struct probe_timing *timing) > probeCallback;
+
+struct probe;
+
+// Packet the pacer has no tokens for yet, see probe_engine.pacing
+struct paced_packet {
+    uint64_t key;               // of its probe
+    std::vector<char> packet;
+    struct packet_meta *meta;
+};
+
+struct probe_engine {
+    struct event_loop *loop;
+    int sock;
+    // Remote address, remote port, local port (network byte order) -> probe
+    std::map<uint64_t, struct probe*> probes;
+    std::vector<char> buffer;
+    // SO_TIMESTAMPING: number of the next packet sent, and the packets
+    // still waiting for their TX timestamp
+    bool timestamping;
+    uint32_t tx_next;
+    std::map<uint32_t, std::pair<uint64_t, struct packet_meta*> > tx_pending;
+    // Paced without SO_TXTIME, packets wait for their departure time here
+    // rather than the loop sleeping for them: (departure, order) -> packet
+    std::map<std::pair<uint64_t, uint64_t>, struct paced_packet> paced;
+    uint64_t paced_order;
+    struct wheel_timer pacing;
+};
+
+// Open the raw socket and register it with the loop
+bool probeEngineInit(struct probe_engine *engine, struct event_loop *loop);
+// Abort probes still in flight (their callbacks are not called) and close the socket
+void probeEngineClose(struct probe_engine *engine);
+
+// Start a test, fn_done is called from the loop with the result once the
+// connection is closed or the test has failed. Packets are captured as a
+// probe of their own if name is set, and as part of the caller's probe
+// otherwise (see packet_capture.hpp).
+// return   false if a probe with the same addresses and ports is in flight
+bool probeStart(struct probe_engine *engine, uint32_t source, uint16_t src_port,
+            uint32_t destination, uint16_t dst_port, test_definition test,
+            const char *name, probeCallback fn_done);
+// Handshake only, for connection table tests: once the SYNACK has been
+// checked and acknowledged, fn_established is called with success and the
+// connection is held open, with a keepalive every PROBE_KEEPALIVE_MS, until
+// probeRelease. fn_reset is called if the path resets it in the meantime.
+// A failed handshake is reported to fn_established like probeStart does.
+// The test planner is left out of held connections.
+bool probeHold(struct probe_engine *engine, uint32_t source, uint16_t src_port,
+            uint32_t destination, uint16_t dst_port, test_definition test,
+            probeCallback fn_established, probeCallback fn_reset);
+// Reset a held connection and drop it, no callback
+// return   false if there is no such connection held
+bool probeRelease(struct probe_engine *engine, uint32_t destination, uint16_t dst_port, uint16_t src_port);
+// Segments of a streamed connection as they arrive, RSTs excepted
+typedef std::function< void(struct iphdr *ip, struct tcphdr *tcp, const struct packet_meta *meta) > probeSegmentHandler;
+// Take over a held connection, for transfers the engine has no steps for:
+// keepalives stop, every segment but a RST (still reported to fn_reset)
+// goes to fn_segment, and the caller sends with probeSendSegment.
+// param conn_state     set to the connection's state after the handshake
+// return   false if there is no such connection held
+bool probeStream(struct probe_engine *engine, uint32_t destination, uint16_t dst_port, uint16_t src_port,
+            probeSegmentHandler fn_segment, struct tcp_opt *conn_state);
+// Send an IP packet built by the caller on a streamed connection, through
+// the pacer and the capture like the engine's own
+bool probeSendSegment(struct probe_engine *engine, uint32_t destination, uint16_t dst_port, uint16_t src_port,
+            const char *packet, uint16_t length);
+// Send segments from segmentPayload or buildSegment on a streamed
+// connection in one go, see sendSegments
+bool probeSendSegments(struct probe_engine *engine, uint32_t destination, uint16_t dst_port, uint16_t src_port,
+            const std::vector<struct tcp_segment> &segments);
+size_t probesInFlight(const struct probe_engine *engine);
+
+// Called from a step's request modifier: send the request delay_ms later
+// instead of right away, without blocking the loop.
+// return   false if the calling thread is not building a request on the engine
+bool probeDeferRequest(uint32_t delay_ms);
+
+#endif
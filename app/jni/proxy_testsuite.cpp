@@ -17,169 +17,208 @@
 #include <android/log.h>
 #include "testsuite.hpp"
 #include "proxy_testsuite.hpp"
-#include <pthread.h>
+#include "probe_engine.hpp"
+#include "port_allocator.hpp"
+#include <algorithm>
+#include <string>
+#include <vector>
 
 using namespace std::placeholders;
 
-struct handshake_thread_data{
-    int thread_id;
-    int sock;
-    char *buffer;
-    struct sockaddr_in src, dst;
-    uint32_t seq_local, seq_remote;
-    packetModifier fn_synExtras;
-    packetChecker fn_checkTcpSynAck;
+// One run of concurrent handshakes, see runTest_handshakes
+struct handshake_run {
+    struct event_loop loop;
+    struct probe_engine engine;
+    const struct handshake_config *config;
+    struct handshake_result *result;
+    uint32_t source, destination;
+    uint16_t src_port, dst_port;
+    std::vector<uint16_t> ports;        // by connection, 0 if never opened
+    std::vector<bool> held;
+    uint32_t next;                      // connection to open next
+    uint32_t in_flight;                 // handshakes under way
+    uint32_t held_now;
+    uint32_t failures;                  // in a row
+    bool stopped;                       // no more connections opened
+    bool releasing;
+    std::vector<int64_t> rtts;          // of the first connections, for the baseline
+    uint64_t started_ms, last_established_ms;
+    struct wheel_timer hold_timer;
 };
 
-void *threadedHandshake(void *threadarg) {
-    struct handshake_thread_data *d;
-    d = (struct handshake_thread_data *) threadarg;
+static void openConnections(struct handshake_run *run);
 
-    int sock = d->sock;
-    char *buffer = d->buffer;
-    struct iphdr *ip = (struct iphdr*) buffer;
-    struct tcphdr *tcp = (struct tcphdr*) (buffer + IPHDRLEN);;
-    struct sockaddr_in src = d->src;
-    struct sockaddr_in dst = d->dst;
-    uint32_t seq_local = d->seq_local;
-    uint32_t seq_remote = d->seq_remote;
-    packetModifier fn_synExtras = d->fn_synExtras;
-    packetChecker fn_checkTcpSynAck = d->fn_checkTcpSynAck;
-
-    struct tcp_opt state;
-    struct tcp_opt *conn_state = &state;
-
-    LOGD("Thread %d of the parallel handshake threads", d->thread_id);
-    test_error result = handshake(sock, ip, tcp, conn_state, &src, &dst, fn_synExtras, fn_checkTcpSynAck);
-    LOGD("Thread %d handshake result: %d", d->thread_id, result);
-    pthread_exit((void*) result);
+static void releaseConnections(struct handshake_run *run)
+{
+    for (size_t i = 0; i < run->held.size(); i++)
+        if (run->held[i])
+            probeRelease(&run->engine, run->destination, run->dst_port, run->ports[i]);
+    eventLoopStop(&run->loop);
 }
 
-test_error runTest_doubleSyn(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+static void handshakeEstablished(struct handshake_run *run, uint32_t connection, test_error probe_result,
+            const struct probe_timing *timing)
 {
-    // Packet fields
-    uint32_t syn_ack = 0;
-    uint16_t syn_urg = 0;
-    uint8_t syn_res = 0;
-    uint16_t synack_urg = 0;
-    uint16_t synack_check = 0;
-    uint8_t synack_res = 0;
-    uint8_t data_out_res = 0;
-    uint8_t data_in_res = 0;    
-    char send_payload[] = "";
-    int send_length = 0;
-    char expect_payload[] = "";
-    int expect_length = 0;
-    char synack_payload[] = "";
-    int synack_length = 0;
-
-    packetModifier fn_synExtras = std::bind(addSynExtras, syn_ack, syn_urg, syn_res, _1, _2, _3);
-    packetChecker fn_checkTcpSynAck = std::bind(checkTcpSynAck_np, synack_urg, synack_check, synack_res, _1, _2, _3);
-
-    // Socket data initialisation
-    int sock;
-    char buffer_1[BUFLEN] = {0};
-    char buffer_2[BUFLEN] = {0};
-    char buffer_3[BUFLEN] = {0};
-    struct iphdr *ip_1, *ip_2;
-    struct tcphdr *tcp_1, *tcp_2;
-    struct sockaddr_in src, dst, src2;
-    uint32_t seq_local_1, seq_remote_1, seq_local_2, seq_remote_2;
-    ip_1 = (struct iphdr*) buffer_1;
-    ip_2 = (struct iphdr*) buffer_2;
-    tcp_1 = (struct tcphdr*) (buffer_1 + IPHDRLEN);
-    tcp_2 = (struct tcphdr*) (buffer_2 + IPHDRLEN);
-    char *data_1 = buffer_1 + IPHDRLEN + TCPHDRLEN;
-    char *data_2 = buffer_2 + IPHDRLEN + TCPHDRLEN;
-
-    src.sin_family = AF_INET;
-    src.sin_port = htons(src_port);
-    src.sin_addr.s_addr = htonl(source);
-    dst.sin_family = AF_INET;
-    dst.sin_port = htons(dst_port);
-    dst.sin_addr.s_addr = htonl(destination);
-    src2.sin_family = AF_INET;
-    src2.sin_port = htons(src_port+1);
-    src2.sin_addr.s_addr = htonl(source);
-
-    // Socket setup
-    if (setupSocket(sock) != success) {
-        LOGE("Socket setup failed: %s", strerror(errno));
-        return test_failed;
+    struct handshake_result *result = run->result;
+    const struct handshake_config *config = run->config;
+    run->in_flight--;
+    if (probe_result == success) {
+        run->held[connection] = true;
+        run->held_now++;
+        result->established++;
+        if (run->held_now > result->max_held)
+            result->max_held = run->held_now;
+        run->failures = 0;
+        run->last_established_ms = monotonicMillis();
+        int64_t rtt = timing != NULL ? timing->handshake_rtt_us : -1;
+        if (rtt >= 0 && run->rtts.size() < HANDSHAKE_BASELINE) {
+            run->rtts.push_back(rtt);
+            if (run->rtts.size() == HANDSHAKE_BASELINE) {
+                std::vector<int64_t> sorted(run->rtts);
+                std::sort(sorted.begin(), sorted.end());
+                result->baseline_rtt_us = sorted[sorted.size() / 2];
+            }
+        } else if (rtt >= 0 && result->baseline_rtt_us >= 0 && rtt > config->delay_factor * result->baseline_rtt_us
+                && rtt > result->baseline_rtt_us + HANDSHAKE_DELAY_MIN_US) {
+            result->delayed++;
+            if (result->delayed_from == 0) {
+                LOGI("Handshakes delayed from %u connections on: %lld us", run->held_now, (long long) rtt);
+                result->delayed_from = run->held_now;
+            }
+        }
     } else {
-        LOGD("Socket setup, initialising data");
+        if (probe_result == receive_timeout)
+            result->timed_out++;
+        else
+            result->refused++;
+        if (result->capacity == 0) {
+            LOGI("Handshakes failing from %u connections on: %d", run->held_now, probe_result);
+            result->capacity = run->held_now;
+        }
+        if (++run->failures >= config->max_failures)
+            run->stopped = true;
     }
+    openConnections(run);
+}
 
-    // Setting up data structure to pass info to thread
-    struct handshake_thread_data data_hs1, data_hs2, data_hs3;
-    data_hs1.thread_id = 1;
-    data_hs1.sock = sock;
-    data_hs1.buffer = &buffer_1[0];
-    data_hs1.src = src;
-    data_hs1.dst = dst;
-    data_hs1.seq_local = seq_local_1;
-    data_hs1.seq_remote = seq_remote_1;
-    data_hs1.fn_synExtras = fn_synExtras;
-    data_hs1.fn_checkTcpSynAck = fn_checkTcpSynAck;
+static void handshakeReset(struct handshake_run *run, uint32_t connection)
+{
+    struct handshake_result *result = run->result;
+    run->held[connection] = false;
+    result->reset++;
+    if (result->capacity == 0) {
+        LOGI("Held connections reset from %u on", run->held_now);
+        result->capacity = run->held_now;
+    }
+    run->held_now--;
+}
 
-    data_hs2 = data_hs1;
-    data_hs2.thread_id = 2;
-    data_hs2.buffer = &buffer_2[0];
-    data_hs2.src = src2;
-    data_hs1.seq_local = seq_local_2;
-    data_hs1.seq_remote = seq_remote_2;
+// Keep config->in_flight handshakes under way until every connection has
+// been tried or too many failed in a row, then hold them and release
+static void openConnections(struct handshake_run *run)
+{
+    const struct handshake_config *config = run->config;
+    while (!run->stopped && run->next < config->connections && run->in_flight < config->in_flight) {
+        uint32_t connection = run->next++;
+        uint16_t port = connection == 0 && run->src_port != 0 ? run->src_port : allocatePort();
+        if (port == 0) {
+            LOGE("No source port left after %u connections", connection);
+            run->stopped = true;
+            break;
+        }
+        run->ports[connection] = port;
+        run->in_flight++;
+        packetModifier fn_synExtras = std::bind(addSynExtras, 0, 0, 0, _1, _2, _3);
+        packetChecker fn_checkTcpSynAck = std::bind(dummyCheck, _1, _2, _3);
+        std::queue<std::pair<packetModifier, packetChecker> > noSteps;
+        if (!probeHold(&run->engine, run->source, port, run->destination, run->dst_port,
+                    makeTestDefinition(fn_synExtras, fn_checkTcpSynAck, noSteps),
+                    std::bind(handshakeEstablished, run, connection, _1, _2),
+                    std::bind(handshakeReset, run, connection)))
+            handshakeEstablished(run, connection, test_failed, NULL);
+    }
+    if (run->in_flight > 0 || run->releasing)
+        return;
+    run->releasing = true;
+    struct handshake_result *result = run->result;
+    uint64_t elapsed_ms = run->last_established_ms - run->started_ms;
+    result->setup_rate = elapsed_ms > 0 ? result->established * 1000.0 / elapsed_ms : 0;
+    LOGD("%u of %u connections established, %u held", result->established, config->connections, run->held_now);
+    if (config->hold_ms > 0)
+        eventLoopTimer(&run->loop, &run->hold_timer, config->hold_ms);
+    else
+        releaseConnections(run);
+}
 
-    LOGD("Starting handshake threads");
-    pthread_t thread_hs1, thread_hs2, thread_hs3;
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-    int rc_hs1 = pthread_create(&thread_hs1, &attr, threadedHandshake, (void *) &data_hs1);
-    int rc_hs2 = pthread_create(&thread_hs2, &attr, threadedHandshake, (void *) &data_hs2);
+test_error runTest_handshakes(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port,
+            const struct handshake_config *config, struct handshake_result *result)
+{
+    memset(result, 0, sizeof(*result));
+    result->baseline_rtt_us = -1;
+    if (config->connections == 0)
+        return test_failed;
 
-    pthread_attr_destroy(&attr);
-    void *status;
-    LOGD("Waiting for both handshakes");
-    rc_hs1 = pthread_join(thread_hs1, &status);
-    rc_hs2 = pthread_join(thread_hs2, &status);
+    struct handshake_run run;
+    run.config = config;
+    run.result = result;
+    run.source = source;
+    run.src_port = src_port;
+    run.destination = destination;
+    run.dst_port = dst_port;
+    run.ports.assign(config->connections, 0);
+    run.held.assign(config->connections, false);
+    run.next = run.in_flight = run.held_now = run.failures = 0;
+    run.stopped = run.releasing = false;
+    if (!eventLoopInit(&run.loop))
+        return test_failed;
+    if (!probeEngineInit(&run.engine, &run.loop)) {
+        eventLoopClose(&run.loop);
+        return test_failed;
+    }
+    timerInit(&run.hold_timer, std::bind(releaseConnections, &run));
+    run.started_ms = run.last_established_ms = monotonicMillis();
 
-    test_error result = success;
-    LOGD("Sleeping, then RSTing middle connection");
-    sleep(10);
-    LOGD("Build TCP RST");
+    openConnections(&run);
+    eventLoopRun(&run.loop);
+    eventLoopCancel(&run.loop, &run.hold_timer);
+    probeEngineClose(&run.engine);
+    eventLoopClose(&run.loop);
+    for (uint32_t i = 0; i < config->connections; i++)
+        if (run.ports[i] != 0 && (i > 0 || src_port == 0))
+            releasePort(run.ports[i]);
 
-    buildTcpAck(&src, &dst, ip_1, tcp_1, tcp_1->seq, tcp_1->ack_seq);
-    tcp_1->window = 0;
-    if (sendPacket(sock, buffer_1, &dst, ntohs(ip_1->tot_len)) != success) {
-        LOGE("TCP handshake ACK failure: %s", strerror(errno));
-        result = ack_error;
-    }
+    LOGI("Handshakes: %u established (%u at once), %u refused, %u timed out, %u reset, %u delayed,"
+        " capacity %u, %.1f/s", result->established, result->max_held, result->refused, result->timed_out,
+        result->reset, result->delayed, result->capacity, result->setup_rate);
+    if (result->established < config->connections || result->reset > 0)
+        return test_failed;
+    return success;
+}
 
-    // char send_payload_rst[] = "CONNECTION_RESET_BY_PEER";
-    // int send_length_rst = strlen(send_payload_rst);
-    // buildTcpRst_data(&src2, &dst, ip_2, tcp_2, ntohl(tcp_2->seq), ntohl(tcp_2->ack_seq), 0, 0)
-    // appendData(send_payload_rst, send_length_rst, ip, tcp);
-    // LOGD("Send TCP RST");
-    // if (sendPacket(sock, buffer_2, &dst, ntohs(ip_2->tot_len)) != success) {
-    //     LOGE("TCP doubleSYN RST failure: %s", strerror(errno));
-    //     result = rst_send_error;
-    // }
-    LOGD("Cycle done");
-    sleep(5);
-    LOGD("Testing finished, returning");
-    return result;
+// Two connections through the same path at once, both must get through
+test_error runTest_doubleSyn(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+{
+    struct handshake_config config;
+    config.connections = 2;
+    config.in_flight = 2;
+    config.hold_ms = 0;
+    config.max_failures = 2;
+    config.delay_factor = HANDSHAKE_DELAY_FACTOR;
+    struct handshake_result result;
+    return runTest_handshakes(source, src_port, destination, dst_port, &config, &result);
 }
 
 test_error dummyCheck(struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state) {
     return success;
 }
+// Hold the request back; on the probe engine without blocking its loop
 void delay(int delay, struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state) {
-    sleep(delay);
+    if (!probeDeferRequest(delay * 1000))
+        sleep(delay);
 }
 
 void addTimestampOption(struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state) {
-    uint32_t milliseconds_since_epoch = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-    conn_state->rcv_tsval = milliseconds_since_epoch;
+    conn_state->rcv_tsval = monotonicNanos() / 1000000;
     conn_state->ts_recent = 0;
     char optionData[8];
     memcpy(optionData, &conn_state->rcv_tsval, sizeof(conn_state->rcv_tsval));
@@ -187,7 +226,7 @@ void addTimestampOption(struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *co
     appendTcpOption(TCPOPT_TIMESTAMP, TCPOLEN_TIMESTAMP, optionData, ip, tcp, conn_state);
 }
 
-test_error runTest_sackGap(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port) {
+test_definition defineTest_sackGap(uint8_t reserved) {
     uint32_t syn_ack = 0;
     uint16_t syn_urg = 0;
     uint8_t syn_res = 0;
@@ -195,9 +234,9 @@ test_error runTest_sackGap(uint32_t source, uint16_t src_port, uint32_t destinat
     uint16_t synack_check = 0;
     uint8_t synack_res = 0;
     
-    char send_payload[] = "HELLO_ACK_GAP";
+    static char send_payload[] = "HELLO_ACK_GAP";
     int send_length = strlen(send_payload);
-    char expect_payload[] = "OLLEH";
+    static char expect_payload[] = "OLLEH";
     int expect_length = strlen(expect_payload);
     
     // SYN with all the fields set and SACK OK option
@@ -216,17 +255,15 @@ test_error runTest_sackGap(uint32_t source, uint16_t src_port, uint32_t destinat
     // Check if reply indicates recognised gap
     packetChecker fn_checkResponseDummy = std::bind(dummyCheck, _1, _2, _3);
 
-    char send_payload2[0xBE];
-    memset(send_payload2, 'a', 0xBE);
+    static std::string send_payload2(0xBE, 'a');
     int send_length2 = 0xBE;
-    packetModifier fn_appendData2   = std::bind(appendData, send_payload2, send_length2, _1, _2);
+    packetModifier fn_appendData2   = std::bind(appendData, &send_payload2[0], send_length2, _1, _2);
     packetModifier fn_changeSeq2    = std::bind(increaseSeq, 0x02, _1, _2, _3);
     packetModifier fn_sendData      = std::bind(concatPacketModifiers, fn_appendData2, fn_changeSeq2, _1, _2, _3);
     packetModifier fn_sleeper       = std::bind(delay, 5, _1, _2, _3);
     packetModifier fn_makeRequest2  = std::bind(concatPacketModifiers, fn_sendData, fn_sleeper, _1, _2, _3);
 
-    char send_payload3[0x02];
-    memset(send_payload3, 'b', 0x02);
+    static char send_payload3[] = "bb";
     int send_length3 = 0x02;
     packetModifier fn_appendData3   = std::bind(appendData, send_payload3, send_length3, _1, _2);
     packetChecker fn_checkResponse3 = std::bind(checkData, expect_payload, expect_length, _1, _2, _3);
@@ -236,11 +273,14 @@ test_error runTest_sackGap(uint32_t source, uint16_t src_port, uint32_t destinat
     stepSequence.push(std::make_pair(fn_makeRequest2, fn_checkResponseDummy));
     stepSequence.push(std::make_pair(fn_appendData3, fn_checkResponse3));
     
-    return runTest(source, src_port, destination, dst_port,
-        fn_synExtras, fn_checkTcpSynAck, stepSequence);
+    return makeTestDefinition(fn_synExtras, fn_checkTcpSynAck, stepSequence);
 }
 
-test_error runTest_timestamping(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port) {
+test_error runTest_sackGap(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port) {
+    return runTest(source, src_port, destination, dst_port, defineTest_sackGap(0));
+}
+
+test_definition defineTest_timestamping(uint8_t reserved) {
     uint32_t syn_ack = 0;
     uint16_t syn_urg = 0;
     uint8_t syn_res = 0;
@@ -248,9 +288,9 @@ test_error runTest_timestamping(uint32_t source, uint16_t src_port, uint32_t des
     uint16_t synack_check = 0;
     uint8_t synack_res = 0;
     
-    char send_payload[] = "HELLO_timestamp";
+    static char send_payload[] = "HELLO_timestamp";
     int send_length = strlen(send_payload);
-    char expect_payload[] = "OLLEH";
+    static char expect_payload[] = "OLLEH";
     int expect_length = strlen(expect_payload);
     
     // SYN with all the fields set and SACK OK option
@@ -271,9 +311,8 @@ test_error runTest_timestamping(uint32_t source, uint16_t src_port, uint32_t des
     packetChecker fn_checkResponseDummy = std::bind(dummyCheck, _1, _2, _3);
 
     int send_length2 = 0xBE;
-    char send_payload2[0xBE] = {0};
-    memset(send_payload2, 'a', send_length2);
-    packetModifier fn_appendData2   = std::bind(appendData, send_payload2, send_length2, _1, _2);
+    static std::string send_payload2(send_length2, 'a');
+    packetModifier fn_appendData2   = std::bind(appendData, &send_payload2[0], send_length2, _1, _2);
     packetModifier fn_sleeper       = std::bind(delay, 5, _1, _2, _3);
     packetModifier fn_makeRequest2  = std::bind(concatPacketModifiers, fn_appendData2, fn_sleeper, _1, _2, _3);
 
@@ -281,6 +320,9 @@ test_error runTest_timestamping(uint32_t source, uint16_t src_port, uint32_t des
     stepSequence.push(std::make_pair(fn_makeRequest, fn_checkResponseDummy));
     stepSequence.push(std::make_pair(fn_makeRequest2, fn_checkResponseDummy));
     
-    return runTest(source, src_port, destination, dst_port,
-        fn_synExtras, fn_checkTcpSynAck, stepSequence);
+    return makeTestDefinition(fn_synExtras, fn_checkTcpSynAck, stepSequence);
+}
+
+test_error runTest_timestamping(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port) {
+    return runTest(source, src_port, destination, dst_port, defineTest_timestamping(0));
 }
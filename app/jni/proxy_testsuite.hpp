@@ -14,6 +14,51 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+test_definition defineTest_sackGap(uint8_t reserved);
+test_definition defineTest_timestamping(uint8_t reserved);
+
+// Concurrent handshakes, for the connection table of a proxy or NAT on the
+// path: up to config.connections plain handshakes, in_flight at a time, each
+// connection held open once established (see probeHold) until all have been
+// tried, then for hold_ms more, then reset. Opening stops after
+// max_failures failed handshakes in a row. The first HANDSHAKE_BASELINE
+// handshake RTTs give the baseline; later ones slower than delay_factor
+// times that, and by at least HANDSHAKE_DELAY_MIN_US, count as delayed.
+// Everything is event driven on one engine.
+#define HANDSHAKE_BASELINE 16
+#define HANDSHAKE_DELAY_FACTOR 3.0
+#define HANDSHAKE_DELAY_MIN_US 2000
+
+struct handshake_config {
+    uint32_t connections;
+    uint32_t in_flight;
+    uint32_t hold_ms;
+    uint32_t max_failures;
+    double delay_factor;
+};
+
+struct handshake_result {
+    uint32_t established;       // handshakes completed
+    uint32_t max_held;          // connections open at once, at most
+    uint32_t refused;           // handshakes failed other than by timing out
+    uint32_t timed_out;
+    uint32_t reset;             // held connections reset by the path
+    uint32_t delayed;
+    uint32_t capacity;          // connections held when the first handshake failed or
+                                // a held one was reset, 0 if neither happened
+    uint32_t delayed_from;      // connections held when the first one was delayed, 0 if none
+    int64_t baseline_rtt_us;    // -1 if not measured
+    double setup_rate;          // handshakes completed per second
+};
+
+// return   success if every connection was established and none reset
+test_error runTest_handshakes(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port,
+            const struct handshake_config *config, struct handshake_result *result);
+// runTest_handshakes with two connections
 test_error runTest_doubleSyn(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port);
 test_error runTest_sackGap(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port);
-test_error runTest_timestamping(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port);
\ No newline at end of file
+test_error runTest_timestamping(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port);
+
+test_error dummyCheck(struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state);
+void delay(int delay, struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state);
+void addTimestampOption(struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state);
@@ -21,12 +21,25 @@
 #include <sys/un.h>
 #include <errno.h>
 #include <unistd.h>
+#include <getopt.h>
 
 #include <android/log.h>
 
 #include "testsuite.hpp"
 #include "proxy_testsuite.hpp"
 #include "util.hpp"
+#include "packet_capture.hpp"
+#include "sweep.hpp"
+#include "pacer.hpp"
+#include "port_allocator.hpp"
+#include "result_cache.hpp"
+#include "test_planner.hpp"
+#include "bulk_transfer.hpp"
+#include "pmtu_probe.hpp"
+#include "ttl_locate.hpp"
+#include "header_diff.hpp"
+#include "test_fusion.hpp"
+#include "socket_pool.hpp"
 
 #ifndef TAG
 #define TAG "TCPTester-bin"
@@ -57,12 +70,35 @@ enum opcode_t : uint8_t {
     ACK_CHECKSUM_INCORRECT_SEQ = 13,
     ACK_CHECKSUM_SEQ = 14,
     ACK_DATA = 15,
+    RESERVED_BITMAP = 16,
+    RET_RESERVED_BITMAP = 17,
+    HEADER_ECHO = 18,
+    RET_HEADER_CHANGE = 19,
+    RET_HEADER_ECHO = 20,
     GET_GLOBAL_IP = 21,
     RET_GLOBAL_IP = 22,
+    LOCATE_HOPS = 23,
+    RET_LOCATE_HOP = 24,
+    RET_LOCATE = 25,
+    FUSED_SYN = 26,
+    RET_FUSED_PROBE = 27,
+    RET_FUSED = 28,
     PROXY_DOUBLE_SYN = 41,
     PROXY_SACK_GAP = 42,
     PROXY_TIMESTAMPING = 43,
+    PROXY_HANDSHAKES = 44,
+    RET_PROXY_HANDSHAKES = 45,
+    BULK_TRANSFER = 46,
+    RET_BULK_TRANSFER = 47,
+    PMTU_PROBE = 48,
+    RET_PMTU = 49,
     RESULT_NOT_IMPLEMENTED = 51,
+    RESULT_INFERRED = 52,       // failed without being run, see test_planner.hpp
+    PORT_SWEEP = 61,
+    SWEEP_RESULT = 62,
+    SWEEP_DONE = 63,
+    PATH_SWEEP = 64,
+    PATH_DIFF = 65,
 };
 
 // IPC message header, LTV-encoded (Length, Type, Value)
@@ -71,8 +107,355 @@ struct ipcmsg {
     opcode_t opcode;
 };
 
-int main() {
+// Test names used in the packet capture comments
+const char *opcodeName(opcode_t opcode) {
+    switch (opcode) {
+        case ACK_ONLY: return "ack_only";
+        case URG_ONLY: return "urg_only";
+        case ACK_URG: return "ack_urg";
+        case PLAIN_URG: return "plain_urg";
+        case ACK_CHECKSUM_INCORRECT: return "ack_checksum_incorrect";
+        case ACK_CHECKSUM: return "ack_checksum";
+        case URG_URG: return "urg_urg";
+        case URG_CHECKSUM: return "urg_checksum";
+        case URG_CHECKSUM_INCORRECT: return "urg_checksum_incorrect";
+        case RESERVED_SYN: return "reserved_syn";
+        case RESERVED_EST: return "reserved_est";
+        case ACK_CHECKSUM_INCORRECT_SEQ: return "ack_checksum_incorrect_seq";
+        case ACK_CHECKSUM_SEQ: return "ack_checksum_seq";
+        case ACK_DATA: return "ack_data";
+        case RESERVED_BITMAP: return "reserved_bitmap";
+        case HEADER_ECHO: return "header_echo";
+        case GET_GLOBAL_IP: return "get_global_ip";
+        case LOCATE_HOPS: return "locate_hops";
+        case FUSED_SYN: return "fused_syn";
+        case PROXY_DOUBLE_SYN: return "proxy_double_syn";
+        case PROXY_SACK_GAP: return "proxy_sack_gap";
+        case PROXY_TIMESTAMPING: return "proxy_timestamping";
+        case PROXY_HANDSHAKES: return "proxy_handshakes";
+        case BULK_TRANSFER: return "bulk_transfer";
+        case PMTU_PROBE: return "pmtu_probe";
+        default: return "unknown";
+    }
+}
+
+opcode_t resultOpcode(test_error result) {
+    if (result == success || result == test_complete)
+        return RESULT_SUCCESS;
+    if (result == test_not_implemented)
+        return RESULT_NOT_IMPLEMENTED;
+    if (result == test_inferred)
+        return RESULT_INFERRED;
+    return RESULT_FAIL;
+}
+
+static void putRtt(char *message, int64_t rtt_us) {
+    uint32_t value = rtt_us < 0 || rtt_us > 0xFFFFFFFE ? 0xFFFFFFFF : (uint32_t) rtt_us;
+    message[0] = value >> 24;
+    message[1] = value >> 16;
+    message[2] = value >> 8;
+    message[3] = value;
+}
+
+// Flags of a sweep result
+#define SWEEP_RESULT_CACHED 0x01
+
+void sendSweepResult(int s, uint8_t destination, uint16_t dst_port, uint8_t test, opcode_t verdict,
+            int64_t handshake_rtt_us, int64_t data_rtt_us, uint8_t flags) {
+    char message[16] = {16, SWEEP_RESULT, (char) (dst_port >> 8), (char) (dst_port & 0xFF), (char) test, (char) verdict};
+    putRtt(message + 6, handshake_rtt_us);
+    putRtt(message + 10, data_rtt_us);
+    message[14] = destination;
+    message[15] = flags;
+    if (write(s, message, sizeof(message)) != sizeof(message))
+        LOGE("Writing sweep result failed: %s", strerror(errno));
+}
+
+void sendPathDiff(int s, const struct sweep_comparison &comparison, uint8_t test) {
+    char message[BUFLEN];
+    int length = 5 + comparison.results.size();
+    message[0] = length;
+    message[1] = PATH_DIFF;
+    message[2] = comparison.dst_port >> 8;
+    message[3] = comparison.dst_port & 0xFF;
+    message[4] = test;
+    for (size_t d = 0; d < comparison.results.size(); d++)
+        message[5 + d] = resultOpcode(comparison.results[d]);
+    if (write(s, message, length) != length)
+        LOGE("Writing path difference failed: %s", strerror(errno));
+}
+
+// Flags of a bulk transfer result
+#define BULK_RESULT_WSCALE 0x01
+#define BULK_RESULT_SLOW 0x02
+
+static void putValue(char *message, uint64_t value, int bytes) {
+    uint64_t max = (1ULL << (8 * bytes)) - 1;
+    if (value > max)
+        value = max;
+    for (int b = 0; b < bytes; b++)
+        message[b] = (value >> (8 * (bytes - 1 - b))) & 0xFF;
+}
+
+// One message per port and direction of a BULK_TRANSFER:
+//      39, RET_BULK_TRANSFER, dst port(2), direction(1, 0 upload, 1 download),
+//          result opcode(1), goodput kbit/s(4), bytes(4), segments(4),
+//          retransmits(4), out of order(4), timeouts(2), smoothed RTT us(4),
+//          largest cwnd(2), largest peer window(4), flags(1)
+// Values in network byte order, saturated; flag 0x01 marks window scaling
+// negotiated, 0x02 a port below half the median goodput of its direction.
+void sendBulkResult(int s, const struct bulk_result &result) {
+    char message[39] = {39, RET_BULK_TRANSFER};
+    putValue(message + 2, result.port, 2);
+    message[4] = result.direction == bulk_upload ? 0 : 1;
+    message[5] = resultOpcode(result.verdict);
+    putValue(message + 6, result.goodput_kbps, 4);
+    putValue(message + 10, result.bytes, 4);
+    putValue(message + 14, result.segments, 4);
+    putValue(message + 18, result.retransmits, 4);
+    putValue(message + 22, result.out_of_order, 4);
+    putValue(message + 26, result.timeouts, 2);
+    putValue(message + 28, result.srtt_us, 4);
+    putValue(message + 32, result.max_cwnd, 2);
+    putValue(message + 34, result.peer_window, 4);
+    message[38] = (result.wscale ? BULK_RESULT_WSCALE : 0) | (result.slow ? BULK_RESULT_SLOW : 0);
+    if (write(s, message, sizeof(message)) != sizeof(message))
+        LOGE("Writing bulk transfer result failed: %s", strerror(errno));
+}
+
+// Flags of a path MTU result
+#define PMTU_RESULT_RAISED 0x01
+#define PMTU_RESULT_BLACKHOLE 0x02
+
+// One message per port of a PMTU_PROBE:
+//      17 + 4 * PMTU_MSS_COUNT, RET_PMTU, dst port(2), result opcode(1),
+//          MSS clamp(2, 0 for none), path MTU(2), local MTU(2), flags(1),
+//          rounds(1), elapsed us(4), MSS sent(2) and seen(2) for every value
+// Flag 0x01 marks an MSS raised on the way, 0x02 full segments of the
+// clamped MSS lost (the path does not carry what it advertises).
+void sendPmtuResult(int s, const struct pmtu_result &result) {
+    char message[17 + 4 * PMTU_MSS_COUNT] = {(char) sizeof(message), RET_PMTU};
+    putValue(message + 2, result.port, 2);
+    message[4] = resultOpcode(result.verdict);
+    putValue(message + 5, result.clamp, 2);
+    putValue(message + 7, result.path_mtu, 2);
+    putValue(message + 9, result.local_mtu, 2);
+    message[11] = (result.raised ? PMTU_RESULT_RAISED : 0) | (result.blackhole ? PMTU_RESULT_BLACKHOLE : 0);
+    message[12] = result.rounds;
+    putValue(message + 13, result.elapsed_us, 4);
+    for (int i = 0; i < PMTU_MSS_COUNT; i++) {
+        putValue(message + 17 + 4 * i, result.mss_sent[i], 2);
+        putValue(message + 19 + 4 * i, result.mss_seen[i], 2);
+    }
+    if (write(s, message, sizeof(message)) != sizeof(message))
+        LOGE("Writing path MTU result failed: %s", strerror(errno));
+}
+
+// Flags of a hop
+#define LOCATE_HOP_REFLECTOR 0x01
+
+// One message per TTL of a LOCATE_HOPS:
+//      18, RET_LOCATE_HOP, TTL(1), router address(4, 0 if none answered),
+//          ICMP type(1), code(1), TCP bytes quoted(2), fields tested(1),
+//          fields changed(1), flags(1), RTT us(4, 0xFFFFFFFF none)
+// and once all are sent
+//      10 + 6 * LOCATE_FIELDS, RET_LOCATE, result opcode(1), path length(1),
+//          hops answering(1), fields changed(1), elapsed us(4), then by
+//          field: first TTL changed(1), last TTL intact(1), router(4)
+// Fields are the LOCATE_* bits, flag 0x01 marks a TTL that reached the reflector.
+void sendLocateHop(int s, const struct locate_hop &hop) {
+    char message[18] = {18, RET_LOCATE_HOP, (char) hop.ttl};
+    putValue(message + 3, hop.address, 4);
+    message[7] = hop.icmp_type;
+    message[8] = hop.icmp_code;
+    putValue(message + 9, hop.quoted, 2);
+    message[11] = hop.tested;
+    message[12] = hop.changed;
+    message[13] = hop.reflector ? LOCATE_HOP_REFLECTOR : 0;
+    putRtt(message + 14, hop.rtt_us);
+    if (write(s, message, sizeof(message)) != sizeof(message))
+        LOGE("Writing hop failed: %s", strerror(errno));
+}
+
+// Flags of a header echo
+#define HEADER_ECHO_SYNACK 0x01
+#define HEADER_ECHO_ECHOED 0x02
+
+// One message per field changed in a HEADER_ECHO:
+//      13, RET_HEADER_CHANGE, packet(1), field(1), option kind(1), sent(4), seen(4)
+// and once all are sent
+//      12, RET_HEADER_ECHO, result opcode(1), flags(1), hops up(1), hops down(1),
+//          changes(2), fields changed(4)
+// Packets and fields as in header_diff.hpp, hops signed.
+void sendHeaderChange(int s, const struct header_change &change) {
+    char message[13] = {13, RET_HEADER_CHANGE, (char) change.packet, (char) change.field, (char) change.option};
+    putValue(message + 5, change.sent, 4);
+    putValue(message + 9, change.seen, 4);
+    if (write(s, message, sizeof(message)) != sizeof(message))
+        LOGE("Writing header change failed: %s", strerror(errno));
+}
+
+// One message per SYN of a FUSED_SYN:
+//      5, RET_FUSED_PROBE, markers(1), result opcode(1), echoed(1)
+// and once all are sent
+//      15, RET_FUSED, result opcode(1), markers(1), intact(1), changed(1),
+//          blocked(1), inferred(1), down tested(1), down changed(1),
+//          connections(1), elapsed us(4)
+// Markers are the ECHO_* bits of header_diff.hpp.
+void sendFusedProbe(int s, const struct fusion_probe &probe) {
+    char message[5] = {5, RET_FUSED_PROBE, (char) probe.markers, (char) resultOpcode(probe.result),
+        (char) probe.echoed};
+    if (write(s, message, sizeof(message)) != sizeof(message))
+        LOGE("Writing fused SYN failed: %s", strerror(errno));
+}
+
+void logPacerStats() {
+    if (!pacerEnabled())
+        return;
+    struct pacer_stats stats;
+    pacerGetStats(&stats);
+    LOGI("Paced %llu packets (%llu delayed), %llu sent at %.1f pps", (unsigned long long) stats.packets,
+        (unsigned long long) stats.delayed, (unsigned long long) stats.sent, stats.achieved_pps);
+}
+
+static uint32_t readAddress(uint8_t *message) {
+    return (message[0] << 24) | (message[1] << 16) | (message[2] << 8) | message[3];
+}
+
+// Port sweep request:
+//      length(1), PORT_SWEEP(1), src ip(4), src port base(2, 0 for any), dst ip(4),
+//      max concurrent probes(1), reserved bits(1), test opcode bitmap(8),
+//      port ranges: first(2), last(2), ...
+// or, to run it against several destinations at once and compare them,
+//      length(1), PATH_SWEEP(1), src ip(4), src port base(2),
+//      max concurrent probes per destination(1), reserved bits(1),
+//      test opcode bitmap(8), number of destinations(1), dst ips(4 each),
+//      port ranges: first(2), last(2), ...
+// Every port x test verdict is streamed back as soon as it is known:
+//      16, SWEEP_RESULT, dst port(2), test opcode(1), result opcode(1),
+//          handshake RTT(4), data RTT(4), destination index(1), flags(1)
+// RTTs in microseconds, 0xFFFFFFFF if not measured; flag 0x01 marks a
+// verdict taken from the result cache (-c). Where the
+// destinations of a PATH_SWEEP disagree on a port x test, once all of
+// them have finished it
+//      5 + destinations, PATH_DIFF, dst port(2), test opcode(1),
+//          result opcode(1) by destination
+// and the sweep ends with
+//      6, SWEEP_DONE, number of results(4)
+// All multi-byte values in network byte order, bitmap bit N is opcode N.
+void runPortSweep(int s, char *buffer, int length) {
+    uint8_t *message = (uint8_t*) buffer;
+    struct sweep_request request;
+    uint32_t results = 0;
+    int bitmap = -1;
+    int ranges = length;
+    if (message[1] == PORT_SWEEP && length >= 22) {
+        request.source = readAddress(message + 2);
+        request.src_port_base = (message[6] << 8) | message[7];
+        request.destinations.push_back(readAddress(message + 8));
+        request.max_per_destination = message[12] > 0 ? message[12] : 16;
+        request.reserved = message[13];
+        bitmap = 14;
+        ranges = 22;
+    } else if (message[1] == PATH_SWEEP && length >= 19 && length >= 19 + 4 * message[18]) {
+        request.source = readAddress(message + 2);
+        request.src_port_base = (message[6] << 8) | message[7];
+        request.max_per_destination = message[8] > 0 ? message[8] : 16;
+        request.reserved = message[9];
+        bitmap = 10;
+        for (int d = 0; d < message[18]; d++)
+            request.destinations.push_back(readAddress(message + 19 + 4 * d));
+        ranges = 19 + 4 * message[18];
+    }
+    for (int r = ranges; r + 4 <= length; r += 4) {
+        uint16_t first = (message[r] << 8) | message[r + 1];
+        uint16_t last = (message[r + 2] << 8) | message[r + 3];
+        for (uint32_t port = first; port <= last; port++)
+            request.ports.push_back(port);
+    }
+
+    std::vector<uint8_t> opcodes;
+    for (int opcode = 0; opcode < 64 && bitmap != -1; opcode++) {
+        if (!(message[bitmap + 7 - opcode / 8] & (1 << (opcode % 8))))
+            continue;
+        const struct test_entry *entry = findTest(opcodeName((opcode_t) opcode));
+        if (entry != NULL) {
+            request.tests.push_back(entry);
+            opcodes.push_back(opcode);
+            continue;
+        }
+        for (size_t d = 0; d < request.destinations.size(); d++)
+            for (size_t i = 0; i < request.ports.size(); i++, results++)
+                sendSweepResult(s, d, request.ports[i], opcode, RESULT_NOT_IMPLEMENTED, -1, -1, 0);
+    }
+
+    LOGI("Port sweep: %zu ports, %zu tests, %zu destinations", request.ports.size(), request.tests.size(),
+        request.destinations.size());
+    results += runCachedSweep(&request, [&](const struct sweep_result &result) {
+        sendSweepResult(s, result.destination, result.dst_port, opcodes[result.test], resultOpcode(result.result),
+            result.handshake_rtt_us, result.data_rtt_us, result.cached ? SWEEP_RESULT_CACHED : 0);
+    }, [&](const struct sweep_comparison &comparison) {
+        if (comparison.differ)
+            sendPathDiff(s, comparison, opcodes[comparison.test]);
+    });
+    logPacerStats();
+
+    char done[6] = {6, SWEEP_DONE, (char) (results >> 24), (char) (results >> 16), (char) (results >> 8), (char) results};
+    if (write(s, done, sizeof(done)) != sizeof(done))
+        LOGE("Writing sweep end failed: %s", strerror(errno));
+}
+
+// Options:
+//      -w <file>   capture every packet sent and accepted to a pcapng file
+//      -f <N>      flight recorder: only keep the last N packets of every
+//                  test and write them out if the test fails
+//      -g <pps>    pace all probe packets to this rate
+//      -d <pps>    pace packets to every destination address to this rate
+//      -p <pps>    pace packets to every destination port to this rate
+//      -b <N>      pacing burst, packets sent back to back (1)
+//      -t          hand departure times to the kernel with SO_TXTIME
+//      -q <ms>     quarantine of released source ports (30000)
+//      -c <file>   keep sweep verdicts in this cache, revalidating them
+//                  with sentinel probes on later runs
+//      -e <s>      expiry of cached verdicts (86400)
+//      -I          run every test, even where the planner can infer the result
+int main(int argc, char *argv[]) {
     LOGI("Starting TCPTester service v%d", 8);
+    const char *capture_path = NULL;
+    int flight_recorder = 0;
+    struct pacer_config pacing;
+    memset(&pacing, 0, sizeof(pacing));
+    int opt;
+    int port_quarantine = PORT_QUARANTINE_MS;
+    const char *cache_path = NULL;
+    int cache_expiry = CACHE_EXPIRY_S;
+    while ((opt = getopt(argc, argv, "w:f:g:d:p:b:tq:c:e:I")) != -1) {
+        switch (opt) {
+            case 'w': capture_path = optarg; break;
+            case 'f': flight_recorder = atoi(optarg); break;
+            case 'g': pacing.global_pps = atoi(optarg); break;
+            case 'd': pacing.destination_pps = atoi(optarg); break;
+            case 'p': pacing.port_pps = atoi(optarg); break;
+            case 'b': pacing.burst = atoi(optarg); break;
+            case 't': pacing.use_txtime = true; break;
+            case 'q': port_quarantine = atoi(optarg); break;
+            case 'c': cache_path = optarg; break;
+            case 'e': cache_expiry = atoi(optarg); break;
+            case 'I': plannerEnable(false); break;
+            default:
+                LOGE("Usage: %s [-w capture.pcapng [-f packets]] [-g|-d|-p pps [-b burst] [-t]] [-q ms]"
+                    " [-c cache [-e s]] [-I]", argv[0]);
+                exit(1);
+        }
+    }
+    pacerConfigure(&pacing);
+    portAllocatorInit(PORT_RANGE_FIRST, PORT_RANGE_LAST, port_quarantine);
+    socketPoolInit(SOCKET_POOL_SIZE);
+    if (cache_path != NULL)
+        resultCacheOpen(cache_path, cache_expiry);
+    if (capture_path != NULL)
+        captureOpen(capture_path, flight_recorder > 0 ? capture_flight_recorder : capture_all, flight_recorder);
+
     int s, t, len;
     struct sockaddr_un local;
     char buffer[BUFLEN];
@@ -118,13 +501,24 @@ int main() {
         }
         
         // IPC message read completely
-        if (n >= ipc->length) {
+        if (n >= ipc->length && (ipc->opcode == PORT_SWEEP || ipc->opcode == PATH_SWEEP)) {
+            runPortSweep(s, buffer, ipc->length);
+            memset(buffer, 0, BUFLEN);
+        } else if (n >= ipc->length) {
             LOGD("Payload: ");
             printBufferHex(buffer, ipc->length);
             // TODO: parse and process the message
 
             test_error result = test_failed;    // by default
             int result_code = 0;
+            uint32_t global_ip = 0;
+            struct reserved_bitmap reserved_bits = {0, 0};
+            struct handshake_result handshakes;
+            memset(&handshakes, 0, sizeof(handshakes));
+            struct locate_result locate;
+            memset(&locate, 0, sizeof(locate));
+            struct header_diff header_diff;
+            struct fusion_result fusion;
             opcode_t currentTest = ipc->opcode;
             if ( currentTest >= ACK_ONLY && currentTest <= RESULT_NOT_IMPLEMENTED ) {
                 uint32_t source = 0, destination = 0;
@@ -137,13 +531,79 @@ int main() {
                     src_port |= ( (buffer[2 + 4 + b]) & (char)0xFF ) << (8 * (1-b));
                     dst_port |= ( (buffer[2 + 4 + 2 + 4 + b]) & (char)0xFF ) << (8 * (1-b));
                 }
+                // Source port 0: the tester picks a free one
+                bool allocated = false;
+                if (src_port == 0) {
+                    src_port = allocatePort();
+                    allocated = src_port != 0;
+                }
                 LOGD("Read src port %d", src_port);
                 LOGD("Read dst port %d", dst_port);
                 uint8_t reserved = 0;
-                if ((currentTest == RESERVED_SYN || currentTest == RESERVED_EST) && n > 2+4+2+4+2) {
+                if ((currentTest == RESERVED_SYN || currentTest == RESERVED_EST || currentTest == HEADER_ECHO)
+                        && n > 2+4+2+4+2) {
                     reserved = buffer[2+4+2+4+2];
                 }
+                // Reserved bitmap: any further bytes are combinations to probe
+                std::vector<uint8_t> combinations;
+                if (currentTest == RESERVED_BITMAP)
+                    for (int b = 2+4+2+4+2; b < ipc->length; b++)
+                        combinations.push_back(buffer[b]);
+                // Concurrent handshakes: connections(2), in flight(1), hold seconds(1)
+                struct handshake_config handshake_config = {0, 64, 0, 8, HANDSHAKE_DELAY_FACTOR};
+                if (currentTest == PROXY_HANDSHAKES && ipc->length >= 2+4+2+4+2+4) {
+                    uint8_t *parameters = (uint8_t*) buffer + 2+4+2+4+2;
+                    handshake_config.connections = (parameters[0] << 8) | parameters[1];
+                    if (parameters[2] != 0)
+                        handshake_config.in_flight = parameters[2];
+                    handshake_config.hold_ms = parameters[3] * 1000;
+                }
+                // Bulk transfer: directions(1, 0x01 upload, 0x02 download, 0 both),
+                // KB each(2), further dst ports(2 each)
+                std::vector<uint16_t> bulk_ports(1, dst_port);
+                bool bulk_up = true, bulk_down = true;
+                uint32_t bulk_length = 1024 * 1024;
+                if (currentTest == BULK_TRANSFER && ipc->length >= 2+4+2+4+2+3) {
+                    uint8_t *parameters = (uint8_t*) buffer + 2+4+2+4+2;
+                    if (parameters[0] != 0) {
+                        bulk_up = parameters[0] & 0x01;
+                        bulk_down = parameters[0] & 0x02;
+                    }
+                    uint16_t kbytes = (parameters[1] << 8) | parameters[2];
+                    if (kbytes != 0)
+                        bulk_length = kbytes * 1024;
+                    for (int b = 2+4+2+4+2+3; b + 1 < ipc->length; b += 2)
+                        bulk_ports.push_back((parameters[b - (2+4+2+4+2)] << 8)
+                            | parameters[b - (2+4+2+4+2) + 1]);
+                }
+                std::vector<struct bulk_result> bulk_results;
+                // Path MTU: further dst ports(2 each)
+                std::vector<uint16_t> pmtu_ports(1, dst_port);
+                if (currentTest == PMTU_PROBE)
+                    for (int b = 2+4+2+4+2; b + 1 < ipc->length; b += 2)
+                        pmtu_ports.push_back(((uint8_t) buffer[b] << 8) | (uint8_t) buffer[b + 1]);
+                std::vector<struct pmtu_result> pmtu_results;
+                // Localization: test opcode(1), reserved bits(1), largest TTL(1, 0 for
+                // LOCATE_MAX_TTL); the test's SYN is the one sent
+                const struct test_entry *locate_test = findTest(opcodeName(ACK_ONLY));
+                std::vector<struct locate_hop> locate_hops;
+                uint8_t locate_reserved = 0, locate_ttl = 0;
+                if (currentTest == LOCATE_HOPS && ipc->length >= 2+4+2+4+2+3) {
+                    uint8_t *parameters = (uint8_t*) buffer + 2+4+2+4+2;
+                    locate_test = findTest(opcodeName((opcode_t) parameters[0]));
+                    locate_reserved = parameters[1];
+                    locate_ttl = parameters[2];
+                }
+                // Fusion: markers(1, 0 for all), reserved bits(1, 0 for all four)
+                uint8_t fusion_markers = ECHO_ALL, fusion_reserved = 0;
+                if (currentTest == FUSED_SYN && ipc->length >= 2+4+2+4+2+2) {
+                    uint8_t *parameters = (uint8_t*) buffer + 2+4+2+4+2;
+                    if (parameters[0] != 0)
+                        fusion_markers = parameters[0];
+                    fusion_reserved = parameters[1];
+                }
                 LOGD("Selecting test for opcode %d", currentTest);
+                captureProbeStart(opcodeName(currentTest));
                 switch (currentTest) {
                     case ACK_ONLY:
                         result = runTest_ack_only(source, src_port, destination, dst_port);
@@ -181,32 +641,148 @@ int main() {
                     case RESERVED_EST:
                         result = runTest_reserved_est(source, src_port, destination, dst_port, reserved);
                         break;
+                    case RESERVED_BITMAP:
+                        result = runTest_reserved_bitmap(source, src_port, destination, dst_port,
+                            combinations, &reserved_bits);
+                        break;
                     case ACK_CHECKSUM_INCORRECT_SEQ:
                         result = runTest_ack_checksum_incorrect_seq(source, src_port, destination, dst_port);
                         break;
+                    case HEADER_ECHO:
+                        result = runTest_header_echo(source, src_port, destination, dst_port, reserved, &header_diff);
+                        for (size_t c = 0; c < header_diff.changes.size(); c++)
+                            sendHeaderChange(s, header_diff.changes[c]);
+                        break;
                     case PROXY_DOUBLE_SYN:
                         result = runTest_doubleSyn(source, src_port, destination, dst_port);
+                        break;
                     case PROXY_SACK_GAP:
                         result = runTest_sackGap(source, src_port, destination, dst_port);
+                        break;
                     case PROXY_TIMESTAMPING:
                         result = runTest_timestamping(source, src_port, destination, dst_port);
+                        break;
+                    case PROXY_HANDSHAKES:
+                        result = runTest_handshakes(source, src_port, destination, dst_port,
+                            &handshake_config, &handshakes);
+                        break;
+                    case BULK_TRANSFER:
+                        // Source ports of the allocator, one per transfer
+                        result = runTest_bulkPorts(source, destination, bulk_ports,
+                            bulk_up, bulk_down, bulk_length, bulk_results);
+                        for (size_t r = 0; r < bulk_results.size(); r++)
+                            sendBulkResult(s, bulk_results[r]);
+                        break;
+                    case PMTU_PROBE:
+                        // All ports at once, source ports of the allocator
+                        result = runTest_pmtu(source, destination, pmtu_ports, pmtu_results);
+                        for (size_t r = 0; r < pmtu_results.size(); r++)
+                            sendPmtuResult(s, pmtu_results[r]);
+                        break;
+                    case LOCATE_HOPS:
+                        // Every TTL at once, source ports of the allocator
+                        if (locate_test != NULL)
+                            result = runTest_locate(source, destination, dst_port, locate_test,
+                                locate_reserved, locate_ttl, &locate, locate_hops);
+                        else
+                            result = test_not_implemented;
+                        for (size_t h = 0; h < locate_hops.size(); h++)
+                            sendLocateHop(s, locate_hops[h]);
+                        break;
+                    case FUSED_SYN:
+                        // One SYN after the other, source ports of the allocator
+                        result = runTest_fusion(source, destination, dst_port, fusion_markers,
+                            fusion_reserved, &fusion);
+                        for (size_t p = 0; p < fusion.probes.size(); p++)
+                            sendFusedProbe(s, fusion.probes[p]);
+                        break;
+                    case GET_GLOBAL_IP:
+                        // Usually known from an earlier test already
+                        global_ip = getOwnIp(source, src_port, destination, dst_port);
+                        result = global_ip != 0 ? success : test_failed;
+                        break;
                     default:
                         result = test_not_implemented;
                         break;
                 }
-                
+                captureProbeEnd(result != success && result != test_complete);
+                if (allocated)
+                    releasePort(src_port);
+
             }
             memset(buffer, 0, BUFLEN);
 
             ipc->length = 1+1;
-            if (result == test_complete) {
-                ipc->opcode = RESULT_SUCCESS;
-            } else if (currentTest == GET_GLOBAL_IP) {
+            if (currentTest == GET_GLOBAL_IP) {
                 LOGD("Responding with the global address");
                 ipc->opcode = RET_GLOBAL_IP;
                 ipc->length = 1 + 1 + 4;
+                // 0.0.0.0 if not found
+                for (int b = 0; b < 4; b++)
+                    buffer[2 + b] = (global_ip >> (8 * (3 - b))) & 0xFF;
+            } else if (currentTest == PROXY_HANDSHAKES) {
+                // established, at once, refused, timed out, reset, capacity,
+                // delayed from, setup rate per second, 2 bytes each
+                LOGD("Responding with the connection table results");
+                ipc->opcode = RET_PROXY_HANDSHAKES;
+                uint32_t values[] = {handshakes.established, handshakes.max_held, handshakes.refused,
+                    handshakes.timed_out, handshakes.reset, handshakes.capacity, handshakes.delayed_from,
+                    (uint32_t) handshakes.setup_rate};
+                ipc->length = 1 + 1 + 2 * (sizeof(values) / sizeof(values[0]));
+                for (size_t v = 0; v < sizeof(values) / sizeof(values[0]); v++) {
+                    uint16_t value = values[v] > 0xFFFF ? 0xFFFF : values[v];
+                    buffer[2 + 2 * v] = value >> 8;
+                    buffer[3 + 2 * v] = value & 0xFF;
+                }
+            } else if (currentTest == LOCATE_HOPS) {
+                LOGD("Responding with the hops that rewrite the SYN");
+                ipc->opcode = RET_LOCATE;
+                ipc->length = 10 + 6 * LOCATE_FIELDS;
+                buffer[2] = resultOpcode(result);
+                buffer[3] = locate.path_length;
+                buffer[4] = locate.answered;
+                buffer[5] = locate.changed;
+                putValue(buffer + 6, locate.elapsed_us, 4);
+                for (int f = 0; f < LOCATE_FIELDS; f++) {
+                    buffer[10 + 6 * f] = locate.first_changed[f];
+                    buffer[11 + 6 * f] = locate.last_intact[f];
+                    putValue(buffer + 12 + 6 * f, locate.changed_at[f], 4);
+                }
+            } else if (currentTest == FUSED_SYN) {
+                LOGD("Responding with the fused SYN markers");
+                ipc->opcode = RET_FUSED;
+                ipc->length = 15;
+                buffer[2] = resultOpcode(result);
+                buffer[3] = fusion.markers;
+                buffer[4] = fusion.intact;
+                buffer[5] = fusion.changed;
+                buffer[6] = fusion.blocked;
+                buffer[7] = fusion.inferred;
+                buffer[8] = fusion.down_tested;
+                buffer[9] = fusion.down_changed;
+                buffer[10] = fusion.connections;
+                putValue(buffer + 11, fusion.elapsed_us, 4);
+            } else if (currentTest == HEADER_ECHO) {
+                LOGD("Responding with the header changes");
+                ipc->opcode = RET_HEADER_ECHO;
+                ipc->length = 12;
+                buffer[2] = resultOpcode(result);
+                buffer[3] = (header_diff.synack ? HEADER_ECHO_SYNACK : 0)
+                    | (header_diff.echoed ? HEADER_ECHO_ECHOED : 0);
+                buffer[4] = (int8_t) header_diff.hops_up;
+                buffer[5] = (int8_t) header_diff.hops_down;
+                putValue(buffer + 6, header_diff.changes.size(), 2);
+                putValue(buffer + 8, header_diff.changed, 4);
+            } else if (currentTest == RESERVED_BITMAP) {
+                LOGD("Responding with the reserved bitmap");
+                ipc->opcode = RET_RESERVED_BITMAP;
+                ipc->length = 1 + 1 + 2 + 2;
+                buffer[2] = reserved_bits.survived >> 8;
+                buffer[3] = reserved_bits.survived & 0xFF;
+                buffer[4] = reserved_bits.tested >> 8;
+                buffer[5] = reserved_bits.tested & 0xFF;
             } else
-                ipc->opcode = RESULT_FAIL;
+                ipc->opcode = resultOpcode(result);
 
             LOGD("Sending message to the socket, opcode %d", ipc->opcode);
             int ret = write(s, buffer, ipc->length);
@@ -219,6 +795,10 @@ int main() {
     }
 
     close(s);
+    socketPoolClose();
+    logPacerStats();
+    resultCacheClose();
+    captureClose();
 
 }
 
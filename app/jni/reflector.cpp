@@ -0,0 +1,411 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+
+#include <android/log.h>
+#include "reflector.hpp"
+#include "bulk_transfer.hpp"
+
+// Same ISN as the python server, SYNACKs are easy to spot in dumps
+#define REFLECTOR_ISN 12345
+
+void reflectorInit(struct reflector_state *state)
+{
+    state->connections.clear();
+    state->server_isn = REFLECTOR_ISN;
+    state->pending.clear();
+}
+
+static inline bool seqBefore(uint32_t a, uint32_t b)
+{
+    return (int32_t) (a - b) < 0;
+}
+
+// Window scale (0xFF if absent), MSS (0 if absent), SACK and timestamps
+// offered on a SYN
+static void synOptions(struct tcphdr *tcp, uint8_t *wscale, uint16_t *mss,
+            bool *sack_ok, bool *ts_ok, uint32_t *tsval)
+{
+    uint8_t *options = (uint8_t*) tcp + TCPHDRLEN;
+    int length = tcp->doff * 4 - TCPHDRLEN;
+    *wscale = 0xFF;
+    *mss = 0;
+    *sack_ok = false;
+    *ts_ok = false;
+    for (int i = 0; i < length && options[i] != TCPOPT_EOL;) {
+        if (options[i] == TCPOPT_NOP) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= length || options[i + 1] < 2 || i + options[i + 1] > length)
+            break;
+        if (options[i] == TCPOPT_WINDOW && options[i + 1] == TCPOLEN_WINDOW)
+            *wscale = std::min((int) options[i + 2], 14);
+        else if (options[i] == TCPOPT_MAXSEG && options[i + 1] == TCPOLEN_MAXSEG)
+            *mss = (options[i + 2] << 8) | options[i + 3];
+        else if (options[i] == TCPOPT_SACK_PERMITTED && options[i + 1] == TCPOLEN_SACK_PERMITTED)
+            *sack_ok = true;
+        else if (options[i] == TCPOPT_TIMESTAMP && options[i + 1] == TCPOLEN_TIMESTAMP) {
+            *ts_ok = true;
+            memcpy(tsval, options + i + 2, sizeof(*tsval));
+        }
+        i += options[i + 1];
+    }
+}
+
+// Subtract the client (destination of the reply) address and port from the
+// target checksum, so that the client can add them back in undo_natting
+static uint16_t natTarget(uint16_t target, struct iphdr *reply_ip, struct tcphdr *reply_tcp)
+{
+    uint16_t checksum = target;
+    checksum = csum_sub(checksum, ntohs(reply_ip->daddr & 0xFFFF));
+    checksum = csum_sub(checksum, ntohs((reply_ip->daddr >> 16) & 0xFFFF));
+    checksum = csum_sub(checksum, ntohs(reply_tcp->dest));
+    return checksum;
+}
+
+// Reply skeleton: addresses and ports swapped, ACK flag set
+static void buildReply(struct iphdr *ip, struct tcphdr *tcp,
+            struct iphdr *reply_ip, struct tcphdr *reply_tcp,
+            uint32_t seq, uint32_t ack_seq)
+{
+    struct sockaddr_in src, dst;
+    src.sin_addr.s_addr = ip->daddr;
+    src.sin_port = tcp->dest;
+    dst.sin_addr.s_addr = ip->saddr;
+    dst.sin_port = tcp->source;
+    buildTcpAck(&src, &dst, reply_ip, reply_tcp, seq, ack_seq);
+    reply_ip->ttl = 64;
+    reply_tcp->window = htons(8192);
+}
+
+static int reflectSyn(struct reflector_state *state, struct reflector_conn &conn,
+            struct iphdr *ip, struct tcphdr *tcp, char *reply)
+{
+    struct iphdr *reply_ip = (struct iphdr*) reply;
+    struct tcphdr *reply_tcp = (struct tcphdr*) (reply + IPHDRLEN);
+    uint32_t syn_ack = ntohl(tcp->ack_seq);
+    uint16_t syn_urg = ntohs(tcp->urg_ptr);
+
+    conn.state = refl_syn_received;
+    conn.test = 0;
+    conn.syn_res = tcp->res1;
+    conn.syn_header.assign((char*) ip, (char*) tcp + tcp->doff * 4);
+    conn.bulk = 0;
+    conn.rcv_ranges.clear();
+    uint16_t syn_mss;
+    synOptions(tcp, &conn.wscale, &syn_mss, &conn.sack_ok, &conn.ts_ok, &conn.ts_recent);
+    conn.mss = syn_mss == 0 ? 536 : std::max(std::min(syn_mss, (uint16_t) REFLECTOR_MSS), (uint16_t) 64);
+    buildReply(ip, tcp, reply_ip, reply_tcp, state->server_isn, ntohl(tcp->seq) + 1);
+    reply_tcp->syn = 1;
+    // The client's address and port as seen here, for its global address
+    char echo[TCPOLEN_ADDRESS_ECHO - 2] = {(char) (ADDRESS_ECHO_EXID >> 8), (char) (ADDRESS_ECHO_EXID & 0xFF)};
+    memcpy(echo + 2, &ip->saddr, sizeof(ip->saddr));
+    memcpy(echo + 6, &tcp->source, sizeof(tcp->source));
+    appendTcpOption(TCPOPT_ADDRESS_ECHO, TCPOLEN_ADDRESS_ECHO, echo, reply_ip, reply_tcp, NULL);
+    // Window scaling only where the client offers it (RFC 7323)
+    if (conn.wscale != 0xFF) {
+        char wscale[1] = {REFLECTOR_WSCALE};
+        appendTcpOption(TCPOPT_WINDOW, TCPOLEN_WINDOW, wscale, reply_ip, reply_tcp, NULL);
+    }
+    // The MSS as it arrived, so the client sees the clamps of both directions
+    if (syn_mss != 0) {
+        char mss[2] = {(char) (syn_mss >> 8), (char) (syn_mss & 0xFF)};
+        appendTcpOption(TCPOPT_MAXSEG, TCPOLEN_MAXSEG, mss, reply_ip, reply_tcp, NULL);
+    }
+    if (conn.sack_ok)
+        appendTcpOption(TCPOPT_SACK_PERMITTED, TCPOLEN_SACK_PERMITTED, NULL, reply_ip, reply_tcp, NULL);
+    if (conn.ts_ok) {
+        // TSecr is the SYN's TSval, left in the byte order it arrived in
+        char timestamp[TCPOLEN_TIMESTAMP - 2];
+        uint32_t tsval = htonl(REFLECTOR_TSVAL);
+        memcpy(timestamp, &tsval, sizeof(tsval));
+        memcpy(timestamp + sizeof(tsval), &conn.ts_recent, sizeof(conn.ts_recent));
+        appendTcpOption(TCPOPT_TIMESTAMP, TCPOLEN_TIMESTAMP, timestamp, reply_ip, reply_tcp, NULL);
+    }
+
+    if (syn_ack == 0xbeef0001) {
+        conn.test = 1;
+    } else if (syn_urg == 0xbe02) {
+        conn.test = 2;
+    } else if (syn_ack == 0xbeef0003) {
+        conn.test = 3;
+        reply_tcp->urg_ptr = htons(0xbe03);
+    } else if (syn_ack == 0xbeef0005 || syn_urg == 0xbe09) {
+        // Deliberately incorrect checksum, 0xbeef once NATting is undone
+        conn.test = 9;
+        reply_tcp->check = htons(natTarget(0xbeef, reply_ip, reply_tcp));
+        return ntohs(reply_ip->tot_len);
+    } else if (syn_ack == 0xbeef000D) {
+        // As above, but also covering the sequence numbers
+        conn.test = 8;
+        uint16_t checksum = natTarget(0xbeee, reply_ip, reply_tcp);
+        checksum = csum_sub(checksum, ntohs(reply_tcp->seq & 0xFFFF));
+        checksum = csum_sub(checksum, ntohs((reply_tcp->seq >> 16) & 0xFFFF));
+        checksum = csum_sub(checksum, ntohs(reply_tcp->ack_seq & 0xFFFF));
+        checksum = csum_sub(checksum, ntohs((reply_tcp->ack_seq >> 16) & 0xFFFF));
+        reply_tcp->check = htons(checksum);
+        return ntohs(reply_ip->tot_len);
+    } else if (syn_ack == 0xbeef0006 || syn_urg == 0xbe08) {
+        // Correct checksum equal to the target: two bytes of payload
+        // compensate for the difference
+        conn.test = 6;
+        uint16_t target = natTarget(0xbeef, reply_ip, reply_tcp);
+        char payload[2] = {0, 0};
+        appendData(payload, sizeof(payload), reply_ip, reply_tcp);
+        reply_tcp->psh = 0;
+        recomputeTcpChecksum(reply_ip, reply_tcp);
+        uint16_t compensation = csum_add(ntohs(reply_tcp->check), ~target);
+        payload[0] = (char) (compensation >> 8);
+        payload[1] = (char) (compensation & 0xFF);
+        memcpy((char*) reply_tcp + reply_tcp->doff * 4, payload, sizeof(payload));
+        recomputeTcpChecksum(reply_ip, reply_tcp);
+        return ntohs(reply_ip->tot_len);
+    } else if (syn_urg == 0xbe07) {
+        conn.test = 7;
+        reply_tcp->urg_ptr = htons(0xbe07);
+    } else if (syn_ack == HEADER_ECHO_ACK || syn_urg == HEADER_ECHO_URG) {
+        // Markers on the SYNACK too, the client compares it with GETHDR's copy
+        conn.test = 16;
+        reply_tcp->urg_ptr = htons(HEADER_ECHO_URG);
+        reply_tcp->res1 = tcp->res1;
+    } else if (syn_ack == 0xbeef000B) {
+        conn.test = 11;
+        char payload[] = "0B";
+        appendData(payload, 2, reply_ip, reply_tcp);
+        reply_tcp->psh = 0;
+    } else if (tcp->res1 > 0) {
+        reply_tcp->res1 = tcp->res1;
+    } else {
+        reply_tcp->urg_ptr = htons(0xbe04);
+    }
+    recomputeTcpChecksum(reply_ip, reply_tcp);
+    return ntohs(reply_ip->tot_len);
+}
+
+static int reflectData(struct reflector_conn &conn, struct iphdr *ip, struct tcphdr *tcp,
+            char *data, uint16_t datalen, char *reply)
+{
+    struct iphdr *reply_ip = (struct iphdr*) reply;
+    struct tcphdr *reply_tcp = (struct tcphdr*) (reply + IPHDRLEN);
+    char payload[3 + 3 * (1 + HEADER_ECHO_MAX)];
+    uint16_t payload_length;
+
+    if (conn.state != refl_established)
+        LOGD("Reflector: packet with payload but no connection");
+    if (datalen == 6 && memcmp(data, "GETHDR", 6) == 0) {
+        // HDR, then the SYN as received, the SYNACK as sent and this request
+        // as received, IP and TCP headers each behind their length
+        std::vector<char> request((char*) ip, (char*) tcp + tcp->doff * 4);
+        const std::vector<char> *headers[] = {&conn.syn_header, &conn.synack_header, &request};
+        memcpy(payload, "HDR", 3);
+        payload_length = 3;
+        for (int h = 0; h < 3; h++) {
+            uint8_t length = std::min(headers[h]->size(), (size_t) HEADER_ECHO_MAX);
+            payload[payload_length++] = length;
+            if (length > 0)
+                memcpy(payload + payload_length, &(*headers[h])[0], length);
+            payload_length += length;
+        }
+    } else if (conn.test == 1) {
+        uint32_t value = htonl(0xbeef0001);
+        memcpy(payload, &value, sizeof(value));
+        payload_length = sizeof(value);
+    } else if (conn.test == 2) {
+        uint16_t value = htons(0xbe02);
+        memcpy(payload, &value, sizeof(value));
+        payload_length = sizeof(value);
+    } else if (datalen == 7 && memcmp(data, "GETMYIP", 7) == 0) {
+        memcpy(payload, &ip->saddr, sizeof(ip->saddr));
+        payload_length = sizeof(ip->saddr);
+    } else if (datalen == 7 && memcmp(data, "GETRES", 6) == 0) {
+        memcpy(payload, "RES", 3);
+        payload[3] = conn.syn_res;
+        payload[4] = tcp->res1;
+        payload_length = 5;
+    } else {
+        memcpy(payload, "OLLEH", 5);
+        payload_length = 5;
+    }
+
+    buildReply(ip, tcp, reply_ip, reply_tcp, ntohl(tcp->ack_seq), ntohl(tcp->seq) + datalen);
+    // GETRES names the bits to set on the reply, so the downlink is tested on its own
+    if (datalen == 7 && memcmp(data, "GETRES", 6) == 0)
+        reply_tcp->res1 = data[6] & 0xF;
+    else
+        reply_tcp->res1 = tcp->res1;
+    appendData(payload, payload_length, reply_ip, reply_tcp);
+    return ntohs(reply_ip->tot_len);
+}
+
+// Queue a download segment, byte i of the transfer is i & 0xFF
+static void queueBulkSegment(struct reflector_state *state, struct reflector_conn &conn,
+            struct iphdr *ip, struct tcphdr *tcp, uint32_t seq, char *reply)
+{
+    struct iphdr *reply_ip = (struct iphdr*) reply;
+    struct tcphdr *reply_tcp = (struct tcphdr*) (reply + IPHDRLEN);
+    buildReply(ip, tcp, reply_ip, reply_tcp, seq, conn.rcv_nxt);
+    uint16_t length = std::min((uint32_t) conn.mss, conn.snd_end - seq);
+    char *data = (char*) reply_tcp + reply_tcp->doff * 4;
+    for (uint16_t i = 0; i < length; i++)
+        data[i] = (char) ((seq + i - conn.snd_base) & 0xFF);
+    reply_ip->tot_len = htons(ntohs(reply_ip->tot_len) + length);
+    reply_tcp->psh = 1;
+    recomputeTcpChecksum(reply_ip, reply_tcp);
+    state->pending.push_back(std::vector<char>(reply, reply + ntohs(reply_ip->tot_len)));
+}
+
+// Download: new segments clocked by the ACKs, two per ACK within the
+// client's window, the first unacknowledged one again on every third
+// duplicate ACK and on partial ACKs after that
+static void sendBulk(struct reflector_state *state, struct reflector_conn &conn,
+            struct iphdr *ip, struct tcphdr *tcp, char *reply)
+{
+    uint32_t ack = ntohl(tcp->ack_seq);
+    if (seqBefore(conn.snd_una, ack) && !seqBefore(conn.snd_nxt, ack)) {
+        conn.snd_una = ack;
+        conn.dupacks = 0;
+        if (seqBefore(ack, conn.recover))
+            queueBulkSegment(state, conn, ip, tcp, ack, reply);
+    } else if (ack == conn.snd_una && conn.snd_una != conn.snd_nxt) {
+        if (++conn.dupacks % 3 == 0) {
+            conn.recover = conn.snd_nxt;
+            queueBulkSegment(state, conn, ip, tcp, conn.snd_una, reply);
+        }
+        return;
+    }
+    int budget = conn.snd_nxt == conn.snd_base ? REFLECTOR_BULK_IW : 2;
+    for (int i = 0; i < budget && seqBefore(conn.snd_nxt, conn.snd_end); i++) {
+        uint32_t length = std::min((uint32_t) conn.mss, conn.snd_end - conn.snd_nxt);
+        if (conn.snd_nxt - conn.snd_una + length > conn.peer_window)
+            break;
+        queueBulkSegment(state, conn, ip, tcp, conn.snd_nxt, reply);
+        conn.snd_nxt += length;
+    }
+}
+
+// Bulk transfers, see bulk_transfer.hpp
+static int reflectBulk(struct reflector_state *state, struct reflector_conn &conn,
+            struct iphdr *ip, struct tcphdr *tcp, char *data, int datalen, char *reply)
+{
+    struct iphdr *reply_ip = (struct iphdr*) reply;
+    struct tcphdr *reply_tcp = (struct tcphdr*) (reply + IPHDRLEN);
+    uint32_t seq = ntohl(tcp->seq);
+    uint8_t wscale = conn.wscale != 0xFF ? conn.wscale : 0;
+    conn.peer_window = (uint32_t) ntohs(tcp->window) << wscale;
+
+    if (conn.bulk == 0) {
+        conn.bulk = data[4];
+        uint32_t length = ((uint8_t) data[5] << 24) | ((uint8_t) data[6] << 16) | ((uint8_t) data[7] << 8)
+            | (uint8_t) data[8];
+        conn.rcv_nxt = conn.rcv_base = seq + datalen;
+        LOGD("Reflector: bulk %s of %u bytes", conn.bulk == 'D' ? "download" : "upload", length);
+        if (conn.bulk == 'D') {
+            conn.snd_base = conn.snd_una = conn.snd_nxt = conn.recover = ntohl(tcp->ack_seq);
+            conn.snd_end = conn.snd_base + length;
+            conn.dupacks = 0;
+        }
+    } else if (conn.bulk == 'D' && datalen > 0 && conn.snd_una == conn.snd_base) {
+        // The request again, nothing of the data arrived
+        conn.snd_nxt = conn.snd_base;
+    }
+
+    if (conn.bulk == 'D') {
+        sendBulk(state, conn, ip, tcp, reply);
+        return reflectorPending(state, reply);
+    }
+    // Upload: every segment acknowledged, cumulatively, with what arrived
+    // past a hole kept so that only the lost segments are needed again
+    if (datalen == 0)
+        return 0;
+    if (seqBefore(conn.rcv_nxt, seq + datalen)) {
+        uint32_t start = seqBefore(seq, conn.rcv_nxt) ? conn.rcv_nxt : seq;
+        uint32_t &end = conn.rcv_ranges[start - conn.rcv_base];
+        end = std::max(end, seq + datalen - conn.rcv_base);
+        std::map<uint32_t, uint32_t>::iterator range = conn.rcv_ranges.begin();
+        while (range != conn.rcv_ranges.end() && range->first <= conn.rcv_nxt - conn.rcv_base) {
+            if (range->second > conn.rcv_nxt - conn.rcv_base)
+                conn.rcv_nxt = conn.rcv_base + range->second;
+            conn.rcv_ranges.erase(range++);
+        }
+    }
+    buildReply(ip, tcp, reply_ip, reply_tcp, ntohl(tcp->ack_seq), conn.rcv_nxt);
+    recomputeTcpChecksum(reply_ip, reply_tcp);
+    return ntohs(reply_ip->tot_len);
+}
+
+int reflectorPending(struct reflector_state *state, char *reply)
+{
+    if (state->pending.empty())
+        return 0;
+    std::vector<char> &packet = state->pending.front();
+    int length = packet.size();
+    memcpy(reply, &packet[0], length);
+    state->pending.pop_front();
+    return length;
+}
+
+int reflectPacket(struct reflector_state *state, struct iphdr *ip, struct tcphdr *tcp, char *reply)
+{
+    std::pair<uint32_t, uint16_t> conn_id = std::make_pair(ip->saddr, tcp->source);
+    std::map<std::pair<uint32_t, uint16_t>, reflector_conn>::iterator it = state->connections.find(conn_id);
+    reflector_conn_state conn_status = it == state->connections.end() ? refl_closed : it->second.state;
+    int datalen = ntohs(ip->tot_len) - IPHDRLEN - tcp->doff * 4;
+    char *data = (char*) tcp + tcp->doff * 4;
+
+    // Pure SYN
+    if (tcp->syn && !tcp->ack && !tcp->fin && !tcp->rst && !tcp->psh && !tcp->urg) {
+        if (conn_status != refl_closed)
+            LOGD("Reflector: connection already exists");
+        struct reflector_conn &conn = state->connections[conn_id];
+        int length = reflectSyn(state, conn, ip, tcp, reply);
+        struct tcphdr *reply_tcp = (struct tcphdr*) (reply + IPHDRLEN);
+        conn.synack_header.assign(reply, (char*) reply_tcp + reply_tcp->doff * 4);
+        return length;
+    }
+    if (tcp->rst) {
+        if (it != state->connections.end())
+            state->connections.erase(it);
+        return 0;
+    }
+    if (tcp->fin) {
+        struct iphdr *reply_ip = (struct iphdr*) reply;
+        struct tcphdr *reply_tcp = (struct tcphdr*) (reply + IPHDRLEN);
+        state->connections[conn_id].state = refl_last_ack;
+        buildReply(ip, tcp, reply_ip, reply_tcp, ntohl(tcp->ack_seq), ntohl(tcp->seq) + 1);
+        reply_tcp->fin = 1;
+        recomputeTcpChecksum(reply_ip, reply_tcp);
+        return ntohs(reply_ip->tot_len);
+    }
+    if (it != state->connections.end() && (it->second.bulk != 0
+                || (datalen >= BULK_REQUEST_LEN && memcmp(data, "BULK", 4) == 0)))
+        return reflectBulk(state, it->second, ip, tcp, data, datalen, reply);
+    if (datalen <= 0) {
+        if (tcp->ack && !tcp->syn && !tcp->rst && !tcp->psh && !tcp->urg) {
+            if (conn_status == refl_syn_received)
+                it->second.state = refl_established;
+            else if (conn_status == refl_last_ack)
+                state->connections.erase(it);
+        }
+        return 0;
+    }
+    if (it == state->connections.end()) {
+        reflector_conn conn = {refl_closed, 0};
+        return reflectData(conn, ip, tcp, data, datalen, reply);
+    }
+    return reflectData(it->second, ip, tcp, data, datalen, reply);
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <deque>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "packet_builder.hpp"
+
+#ifndef REFLECTOR
+#define REFLECTOR
+
+// In-process model of the test server (server/server.py), answering the
+// testsuite's marked SYNs and data segments exactly like the real reflector
+// does. Used wherever a deterministic server is needed without a network.
+
+// TCP connection states as tracked by the server
+enum reflector_conn_state {
+    refl_closed,
+    refl_syn_received,
+    refl_established,
+    refl_last_ack
+};
+
+// Window scale offered on SYNACKs to SYNs offering one. The MSS option of
+// a SYN is echoed on the SYNACK as received; bulk downloads are sent in
+// segments of at most REFLECTOR_MSS. SACK and timestamps are granted to SYNs
+// asking for them, the SYNACK's timestamp echoing the SYN's
+#define REFLECTOR_WSCALE 7
+#define REFLECTOR_TSVAL 12345
+#define REFLECTOR_MSS 1460
+// Segments sent at once on a bulk download request
+#define REFLECTOR_BULK_IW 10
+
+struct reflector_conn {
+    reflector_conn_state state;
+    int test;
+    uint8_t syn_res;            // reserved bits of the SYN, for GETRES
+    // IP and TCP headers of the SYN as received and the SYNACK as sent, for GETHDR
+    std::vector<char> syn_header, synack_header;
+    // From the SYN options, wscale 0xFF if not offered
+    uint8_t wscale;
+    uint16_t mss;
+    bool sack_ok, ts_ok;
+    uint32_t ts_recent;
+    // Bulk transfer, see bulk_transfer.hpp: 0, 'U' or 'D'
+    char bulk;
+    uint32_t rcv_nxt;           // upload: in order data received up to here
+    uint32_t rcv_base;          // upload: sequence number of data byte 0
+    std::map<uint32_t, uint32_t> rcv_ranges;    // upload: received past a hole,
+                                                // start -> end offset from rcv_base
+    uint32_t snd_base;          // download: sequence number of data byte 0
+    uint32_t snd_una, snd_nxt, snd_end;
+    uint32_t recover;           // snd_nxt at the last fast retransmit
+    uint32_t dupacks;
+    uint32_t peer_window;       // scaled
+};
+
+struct reflector_state {
+    // Keyed by client (address, port), both in network byte order
+    std::map<std::pair<uint32_t, uint16_t>, reflector_conn> connections;
+    uint32_t server_isn;
+    // Replies beyond the first one, see reflectorPending
+    std::deque<std::vector<char> > pending;
+};
+
+void reflectorInit(struct reflector_state *state);
+
+// Process a single packet received by the server.
+//
+// param state      reflector connection table
+// param ip         IP header of the received packet
+// param tcp        TCP header of the received packet
+// param reply      buffer (BUFLEN) for the response packet
+// return           length of the response written to reply, 0 if none
+int reflectPacket(struct reflector_state *state, struct iphdr *ip, struct tcphdr *tcp, char *reply);
+// Further replies to the last packet (bulk downloads send several), to be
+// sent after the one reflectPacket returned
+// return   length of the reply written to reply, 0 if there is none left
+int reflectorPending(struct reflector_state *state, char *reply);
+
+#endif
@@ -0,0 +1,419 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <map>
+#include <utility>
+
+#include <android/log.h>
+#include "replay.hpp"
+#include "packet_view.hpp"
+
+#define PCAP_MAGIC 0xA1B2C3D4
+#define PCAP_MAGIC_NS 0xA1B23C4D
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_SPB 0x00000003
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define PCAPNG_OPT_COMMENT 1
+
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW_BSD 12
+#define LINKTYPE_RAW_OPENBSD 14
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_LINUX_SLL2 276
+
+typedef std::pair<std::pair<uint32_t, uint16_t>, std::pair<uint32_t, uint16_t> > replay_key;
+
+// Capture file contents and the sessions being reconstructed
+struct replay_reader {
+    const unsigned char *data;
+    size_t length;
+    bool swapped;
+    std::vector<replay_session> *sessions;
+    std::map<replay_key, size_t> open_sessions;
+};
+
+static inline uint16_t read16(const unsigned char *p, bool swapped)
+{
+    uint16_t value;
+    memcpy(&value, p, sizeof(value));
+    return swapped ? __builtin_bswap16(value) : value;
+}
+
+static inline uint32_t read32(const unsigned char *p, bool swapped)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return swapped ? __builtin_bswap32(value) : value;
+}
+
+// Offset of the IPv4 header in a frame of the given link type, -1 if the
+// frame does not carry IPv4
+static int ipOffset(int linktype, const unsigned char *frame, uint32_t length)
+{
+    switch (linktype) {
+        case LINKTYPE_RAW:
+        case LINKTYPE_RAW_BSD:
+        case LINKTYPE_RAW_OPENBSD:
+        case LINKTYPE_IPV4:
+            return 0;
+        case LINKTYPE_NULL:
+            // Address family in the capturing host's byte order
+            if (length < 4 || (read32(frame, false) != 2 && read32(frame, true) != 2))
+                return -1;
+            return 4;
+        case LINKTYPE_ETHERNET: {
+            int offset = 12;
+            while (length >= (uint32_t) offset + 2 && (read16(frame + offset, false) == htons(0x8100)
+                    || read16(frame + offset, false) == htons(0x88A8)))
+                offset += 4;
+            if (length < (uint32_t) offset + 2 || read16(frame + offset, false) != htons(0x0800))
+                return -1;
+            return offset + 2;
+        }
+        case LINKTYPE_LINUX_SLL:
+            if (length < 16 || read16(frame + 14, false) != htons(0x0800))
+                return -1;
+            return 16;
+        case LINKTYPE_LINUX_SLL2:
+            if (length < 20 || read16(frame, false) != htons(0x0800))
+                return -1;
+            return 20;
+        default:
+            return -1;
+    }
+}
+
+// Assign one captured frame to its session
+static void addFrame(struct replay_reader *reader, int linktype, const unsigned char *frame,
+            uint32_t caplen, const char *comment, int comment_length)
+{
+    int offset = ipOffset(linktype, frame, caplen);
+    struct packet_view view;
+    // Fragments and truncated packets can not be checked
+    if (offset < 0 || !viewPacket((const char*) frame + offset, caplen - offset, &view))
+        return;
+    const struct iphdr *ip = view.ip;
+    const struct tcphdr *tcp = view.tcp;
+
+    replay_key outbound = std::make_pair(std::make_pair(ip->saddr, tcp->source), std::make_pair(ip->daddr, tcp->dest));
+    replay_key inbound = std::make_pair(outbound.second, outbound.first);
+    std::vector<replay_session> &sessions = *reader->sessions;
+    size_t index;
+    bool from_client;
+    if (tcp->syn && !tcp->ack) {
+        replay_session session;
+        session.client = ip->saddr;
+        session.client_port = tcp->source;
+        session.server = ip->daddr;
+        session.server_port = tcp->dest;
+        sessions.push_back(session);
+        index = sessions.size() - 1;
+        reader->open_sessions[outbound] = index;
+        from_client = true;
+    } else {
+        std::map<replay_key, size_t>::iterator it = reader->open_sessions.find(outbound);
+        from_client = it != reader->open_sessions.end();
+        if (!from_client)
+            it = reader->open_sessions.find(inbound);
+        if (it == reader->open_sessions.end())
+            return;
+        index = it->second;
+    }
+
+    replay_session &session = sessions[index];
+    if (session.test.empty() && comment != NULL) {
+        std::string text(comment, comment_length);
+        size_t start = text.find("test=");
+        if (start != std::string::npos) {
+            size_t end = text.find(' ', start);
+            session.test = text.substr(start + 5, end == std::string::npos ? std::string::npos : end - start - 5);
+        }
+    }
+    replay_packet packet;
+    packet.from_client = from_client;
+    // Packets are normalised to a 20 byte IP header, as the checkers expect
+    packet.data.assign((const char*) ip, (const char*) ip + IPHDRLEN);
+    packet.data.insert(packet.data.end(), (const char*) tcp, (const char*) ip + view.length);
+    struct iphdr *copy = (struct iphdr*) &packet.data[0];
+    copy->ihl = 5;
+    copy->tot_len = htons(packet.data.size());
+    session.packets.push_back(packet);
+}
+
+static bool readPcap(struct replay_reader *reader)
+{
+    if (reader->length < 24)
+        return false;
+    uint32_t magic = read32(reader->data, false);
+    reader->swapped = magic == __builtin_bswap32(PCAP_MAGIC) || magic == __builtin_bswap32(PCAP_MAGIC_NS);
+    int linktype = read32(reader->data + 20, reader->swapped) & 0xFFFF;
+    size_t offset = 24;
+    while (offset + 16 <= reader->length) {
+        uint32_t caplen = read32(reader->data + offset + 8, reader->swapped);
+        // The loop keeps offset + 16 within the file, so this cannot wrap
+        if (caplen > reader->length - offset - 16)
+            break;
+        addFrame(reader, linktype, reader->data + offset + 16, caplen, NULL, 0);
+        offset += 16 + caplen;
+    }
+    return true;
+}
+
+static bool readPcapng(struct replay_reader *reader)
+{
+    std::vector<int> linktypes;
+    uint32_t snaplen = 0;
+    size_t offset = 0;
+    while (offset + 12 <= reader->length) {
+        const unsigned char *block = reader->data + offset;
+        uint32_t type = read32(block, false);
+        if (type == PCAPNG_SHB) {
+            // Every section has its own byte order and interfaces
+            reader->swapped = read32(block + 8, false) != PCAPNG_BYTE_ORDER_MAGIC;
+            linktypes.clear();
+        }
+        uint32_t block_length = read32(block + 4, reader->swapped);
+        if (block_length < 12 || block_length % 4 != 0 || block_length > reader->length - offset) {
+            LOGE("Corrupted pcapng block at offset %zu", offset);
+            return false;
+        }
+        type = read32(block, reader->swapped);
+        if (type == PCAPNG_IDB && block_length >= 20) {
+            linktypes.push_back(read16(block + 8, reader->swapped));
+            snaplen = read32(block + 12, reader->swapped);
+        } else if (type == PCAPNG_EPB && block_length >= 32) {
+            uint32_t interface = read32(block + 8, reader->swapped);
+            uint32_t caplen = read32(block + 20, reader->swapped);
+            if (interface < linktypes.size() && caplen <= block_length - 32) {
+                // Look for a comment among the options
+                const char *comment = NULL;
+                int comment_length = 0;
+                size_t option = 28 + ((caplen + 3) & ~3);
+                while (option + 4 <= block_length - 4) {
+                    uint16_t code = read16(block + option, reader->swapped);
+                    uint16_t length = read16(block + option + 2, reader->swapped);
+                    if (code == 0 || option + 4 + length > block_length - 4)
+                        break;
+                    if (code == PCAPNG_OPT_COMMENT) {
+                        comment = (const char*) block + option + 4;
+                        comment_length = length;
+                    }
+                    option += 4 + ((length + 3) & ~3);
+                }
+                addFrame(reader, linktypes[interface], block + 28, caplen, comment, comment_length);
+            }
+        } else if (type == PCAPNG_SPB && block_length >= 16 && !linktypes.empty()) {
+            uint32_t caplen = read32(block + 8, reader->swapped);
+            if (snaplen != 0 && caplen > snaplen)
+                caplen = snaplen;
+            if (caplen > block_length - 16)
+                caplen = block_length - 16;
+            addFrame(reader, linktypes[0], block + 12, caplen, NULL, 0);
+        }
+        offset += block_length;
+    }
+    return true;
+}
+
+bool readCapture(const char *path, std::vector<replay_session> &sessions)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        LOGE("Opening %s failed: %s", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < 4) {
+        LOGE("%s is not a capture", path);
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOGE("Mapping %s failed: %s", path, strerror(errno));
+        return false;
+    }
+
+    struct replay_reader reader;
+    reader.data = (const unsigned char*) map;
+    reader.length = st.st_size;
+    reader.swapped = false;
+    reader.sessions = &sessions;
+    uint32_t magic = read32(reader.data, false);
+    bool ok;
+    if (magic == PCAPNG_SHB) {
+        ok = readPcapng(&reader);
+    } else if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NS
+            || magic == __builtin_bswap32(PCAP_MAGIC) || magic == __builtin_bswap32(PCAP_MAGIC_NS)) {
+        ok = readPcap(&reader);
+    } else {
+        LOGE("%s: unknown capture format", path);
+        ok = false;
+    }
+    munmap(map, st.st_size);
+    return ok;
+}
+
+// First request of the session, NULL without one
+static const struct replay_packet *firstRequest(replay_session &session, struct packet_view *view)
+{
+    for (size_t i = 1; i < session.packets.size(); i++) {
+        if (!session.packets[i].from_client)
+            continue;
+        if (!viewPacket(&session.packets[i].data[0], session.packets[i].data.size(), view)
+                || view->payload_length == 0)
+            continue;
+        return &session.packets[i];
+    }
+    return NULL;
+}
+
+const struct test_entry *identifyTest(replay_session &session, uint8_t &reserved)
+{
+    reserved = 0;
+    if (session.packets.empty())
+        return NULL;
+
+    // Markers the SYN was sent with (addSynExtras)
+    struct iphdr *ip = (struct iphdr*) &session.packets[0].data[0];
+    struct tcphdr *tcp = (struct tcphdr*) ((char*) ip + IPHDRLEN);
+    struct packet_view view;
+    if (!session.test.empty() && findTest(session.test.c_str()) != NULL) {
+        // The comment names the test but not the reserved bits it was
+        // defined with: those the SYN or else the request was sent with
+        reserved = tcp->res1;
+        if (reserved == 0 && firstRequest(session, &view) != NULL)
+            reserved = view.res;
+        return findTest(session.test.c_str());
+    }
+    uint32_t syn_ack = ntohl(tcp->ack_seq);
+    uint16_t syn_urg = ntohs(tcp->urg_ptr);
+    switch (syn_ack) {
+        case 0xbeef0001: return findTest("ack_only");
+        case 0xbeef0003: return findTest("ack_urg");
+        case 0xbeef0005: return findTest("ack_checksum_incorrect");
+        case 0xbeef0006: return findTest("ack_checksum");
+        case 0xbeef000B: return findTest("ack_data");
+        case 0xbeef000D: return findTest("ack_checksum_incorrect_seq");
+    }
+    switch (syn_urg) {
+        case 0xbe02: return findTest("urg_only");
+        case 0xbe07: return findTest("urg_urg");
+        case 0xbe08: return findTest("urg_checksum");
+        case 0xbe09: return findTest("urg_checksum_incorrect");
+    }
+    if (tcp->res1 != 0) {
+        reserved = tcp->res1;
+        return findTest("reserved_syn");
+    }
+    struct tcp_opt state;
+    memset(&state, 0, sizeof(state));
+    if (hasTcpOption(TCPOPT_SACK_PERMITTED, ip, tcp, &state) == success)
+        return findTest("proxy_sack_gap");
+    if (hasTcpOption(TCPOPT_TIMESTAMP, ip, tcp, &state) == success)
+        return findTest("proxy_timestamping");
+
+    // Plain SYN, the first request tells the rest apart
+    if (firstRequest(session, &view) != NULL
+            && std::string(view.payload, view.payload_length) == "HELLO_reserved_EST") {
+        reserved = view.res;
+        return findTest("reserved_est");
+    }
+    return findTest("plain_urg");
+}
+
+// Next packet from the server, copied to buffer the way receivePacket reads it
+static bool nextServerPacket(replay_session &session, size_t &position, char *buffer)
+{
+    for (; position < session.packets.size(); position++) {
+        replay_packet &packet = session.packets[position];
+        if (packet.from_client)
+            continue;
+        memcpy(buffer, &packet.data[0], packet.data.size());
+        position++;
+        return true;
+    }
+    return false;
+}
+
+test_error replaySession(replay_session &session, test_definition &test)
+{
+    char buffer[BUFLEN];
+    struct iphdr *ip = (struct iphdr*) buffer;
+    struct tcphdr *tcp = (struct tcphdr*) (buffer + IPHDRLEN);
+    struct tcp_opt state;
+    struct tcp_opt *conn_state = &state;
+    memset(&state, 0, sizeof(state));
+    if (session.packets.empty())
+        return test_failed;
+
+    // Handshake: the first packet from the server must be the SYNACK
+    struct tcphdr *syn = (struct tcphdr*) (&session.packets[0].data[0] + IPHDRLEN);
+    conn_state->snd_nxt = ntohl(syn->seq) + 1;
+    conn_state->rcv_nxt = 0;
+    size_t position = 1;
+    if (!nextServerPacket(session, position, buffer))
+        return receive_error;
+    if (!tcp->syn || !tcp->ack)
+        return protocol_error;
+    if (conn_state->snd_nxt != ntohl(tcp->ack_seq))
+        return sequence_error;
+    test_error ret = test.fn_checkTcpSynAck(ip, tcp, conn_state);
+    if (ret != success)
+        return ret;
+    struct packet_view view;
+    viewPacket(ip, tcp, &view);
+    conn_state->rcv_nxt = view.seq + 1 + view.payload_length;
+
+    // Steps: each consumes server packets up to the first one with data
+    conn_state->sack_ok = 0;
+    while (!test.stepSequence.empty()) {
+        packetChecker f_checkResponse = test.stepSequence.front().second;
+        uint16_t receiveDataLength = 0;
+        bool anythingReceived = false;
+        while (receiveDataLength == 0) {
+            if (!nextServerPacket(session, position, buffer)) {
+                if (!anythingReceived)
+                    return receive_error;
+                break;
+            }
+            viewPacket(ip, tcp, &view);
+            receiveDataLength = view.payload_length;
+            anythingReceived = true;
+            hasTcpOption(TCPOPT_TIMESTAMP, ip, tcp, conn_state);
+            if (view.ack_seq > conn_state->snd_nxt)
+                conn_state->snd_nxt = view.ack_seq;
+        }
+        if (view.seq <= conn_state->rcv_nxt && conn_state->rcv_nxt < view.seq + receiveDataLength + 1)
+            conn_state->rcv_nxt = view.seq + receiveDataLength;
+        ret = f_checkResponse(ip, tcp, conn_state);
+        sackResponseHandler(ip, tcp, conn_state);
+        if (ret != success && ret != response_acceptable)
+            return ret;
+        test.stepSequence.pop();
+    }
+    return success;
+}
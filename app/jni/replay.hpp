@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <string>
+#include <vector>
+
+#include "testsuite.hpp"
+
+#ifndef REPLAY
+#define REPLAY
+
+// Offline re-evaluation of recorded tests: packets are read from pcap or
+// pcapng captures, grouped into sessions by 4-tuple and fed through the
+// same packetChecker chains runTest uses, without any sockets.
+
+struct replay_packet {
+    bool from_client;
+    std::vector<char> data;     // starting with the IP header
+};
+
+struct replay_session {
+    // Client is the sender of the SYN, all in network byte order
+    uint32_t client;
+    uint16_t client_port;
+    uint32_t server;
+    uint16_t server_port;
+    // Test name from the capture comments (see packet_capture.hpp), if any
+    std::string test;
+    std::vector<replay_packet> packets;
+};
+
+// Read a pcap or pcapng capture (raw IP, Ethernet, Linux cooked or BSD
+// loopback link types) and reconstruct the TCP sessions in it. A SYN
+// starts a new session, packets before any SYN of their 4-tuple are ignored.
+//
+// param path       capture file
+// param sessions   sessions found, in order of their SYN
+// return           false if the file could not be read or parsed
+bool readCapture(const char *path, std::vector<replay_session> &sessions);
+
+// Work out which test a session belongs to: the capture comment if there
+// is one, otherwise the markers in the SYN and the first request payload.
+//
+// param reserved   reserved bits the test was run with (reserved tests)
+// return           the test, NULL if the session is not one of ours
+const struct test_entry *identifyTest(replay_session &session, uint8_t &reserved);
+
+// Re-run the checks of a test against the recorded packets, the way
+// handshake() and runTest() consume them from the socket.
+//
+// return           the verdict runTest would have returned
+test_error replaySession(replay_session &session, test_definition &test);
+
+#endif
@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+// Feeds truncated and corrupt captures to readCapture: every one has to be
+// rejected or read without touching bytes past its end, and the frames that
+// are complete still have to come out.
+//
+//      tcptester-replay-test [-d directory]
+//
+// Prints one line per capture and exits non-zero if any of them failed.
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include <android/log.h>
+#include "replay.hpp"
+
+#ifndef TAG
+#define TAG "TCPTester-replay-test"
+#endif
+
+#define PCAP_MAGIC 0xA1B2C3D4
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_SPB 0x00000003
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define LINKTYPE_RAW 101
+
+struct capture_case {
+    const char *name;
+    std::string data;
+    bool readable;          // readCapture is expected to return true
+    size_t sessions;        // and find this many sessions
+};
+
+static void put16(std::string &data, uint16_t value)
+{
+    data.append((const char*) &value, sizeof(value));
+}
+
+static void put32(std::string &data, uint32_t value)
+{
+    data.append((const char*) &value, sizeof(value));
+}
+
+// A bare SYN, raw IPv4
+static std::string synFrame()
+{
+    std::string frame(40, '\0');
+    struct iphdr *ip = (struct iphdr*) &frame[0];
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->tot_len = htons(40);
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_TCP;
+    ip->saddr = htonl(0x0A000001);
+    ip->daddr = htonl(0x0A000002);
+    struct tcphdr *tcp = (struct tcphdr*) &frame[20];
+    tcp->source = htons(40000);
+    tcp->dest = htons(80);
+    tcp->seq = htonl(1);
+    tcp->doff = 5;
+    tcp->syn = 1;
+    tcp->window = htons(65535);
+    return frame;
+}
+
+static std::string pcapHeader()
+{
+    std::string data;
+    put32(data, PCAP_MAGIC);
+    put16(data, 2);
+    put16(data, 4);
+    put32(data, 0);
+    put32(data, 0);
+    put32(data, 65535);
+    put32(data, LINKTYPE_RAW);
+    return data;
+}
+
+static std::string pcapRecord(const std::string &frame, uint32_t caplen)
+{
+    std::string data;
+    put32(data, 0);
+    put32(data, 0);
+    put32(data, caplen);
+    put32(data, frame.size());
+    return data + frame;
+}
+
+static std::string pcapngSection()
+{
+    std::string data;
+    put32(data, PCAPNG_SHB);
+    put32(data, 28);
+    put32(data, PCAPNG_BYTE_ORDER_MAGIC);
+    put16(data, 1);
+    put16(data, 0);
+    put32(data, 0xFFFFFFFF);
+    put32(data, 0xFFFFFFFF);
+    put32(data, 28);
+    put32(data, PCAPNG_IDB);
+    put32(data, 20);
+    put16(data, LINKTYPE_RAW);
+    put16(data, 0);
+    put32(data, 65535);
+    put32(data, 20);
+    return data;
+}
+
+// Enhanced packet block, the length fields can be given explicitly to
+// corrupt them
+static std::string pcapngEpb(const std::string &frame, uint32_t caplen, uint32_t block_length)
+{
+    std::string data;
+    put32(data, PCAPNG_EPB);
+    put32(data, block_length);
+    put32(data, 0);
+    put32(data, 0);
+    put32(data, 0);
+    put32(data, caplen);
+    put32(data, frame.size());
+    data += frame;
+    data.append((4 - frame.size() % 4) % 4, '\0');
+    put32(data, block_length);
+    return data;
+}
+
+static std::string pcapngEpb(const std::string &frame)
+{
+    uint32_t block_length = 32 + ((frame.size() + 3) & ~3);
+    return pcapngEpb(frame, frame.size(), block_length);
+}
+
+static std::vector<capture_case> cases()
+{
+    std::string syn = synFrame();
+    std::string pcap = pcapHeader();
+    std::string pcapng = pcapngSection();
+    std::vector<capture_case> all;
+
+    all.push_back((capture_case) {"pcap_valid", pcap + pcapRecord(syn, syn.size()), true, 1});
+    all.push_back((capture_case) {"pcap_short_header", pcap.substr(0, 20), false, 0});
+    all.push_back((capture_case) {"pcap_truncated_record",
+            pcap + pcapRecord(syn, syn.size()) + pcapRecord(syn, syn.size()).substr(0, 30), true, 1});
+    all.push_back((capture_case) {"pcap_truncated_record_header",
+            pcap + pcapRecord(syn, syn.size()) + pcapRecord(syn, syn.size()).substr(0, 10), true, 1});
+    // Would wrap offset + 16 + caplen on 32 bit size_t
+    all.push_back((capture_case) {"pcap_huge_caplen",
+            pcap + pcapRecord(syn, syn.size()) + pcapRecord(syn, 0xFFFFFFF0), true, 1});
+    all.push_back((capture_case) {"pcap_caplen_past_end", pcap + pcapRecord(syn, syn.size() + 1), true, 0});
+    all.push_back((capture_case) {"pcap_caplen_short", pcap + pcapRecord(syn, 30), true, 0});
+
+    all.push_back((capture_case) {"pcapng_valid", pcapng + pcapngEpb(syn), true, 1});
+    all.push_back((capture_case) {"pcapng_short_section", pcapng.substr(0, 10), true, 0});
+    all.push_back((capture_case) {"pcapng_truncated_block", pcapng + pcapngEpb(syn).substr(0, 50), false, 0});
+    // caplen + 28 wraps to a length that fits the block
+    all.push_back((capture_case) {"pcapng_huge_caplen",
+            pcapng + pcapngEpb(syn, 0xFFFFFFF8, 72) + pcapngEpb(syn), true, 1});
+    all.push_back((capture_case) {"pcapng_caplen_past_block",
+            pcapng + pcapngEpb(syn, syn.size() + 1, 72), true, 0});
+    all.push_back((capture_case) {"pcapng_huge_block_length",
+            pcapng + pcapngEpb(syn, syn.size(), 0xFFFFFFFC), false, 0});
+    all.push_back((capture_case) {"pcapng_short_block_length",
+            pcapng + pcapngEpb(syn, syn.size(), 8), false, 0});
+    all.push_back((capture_case) {"pcapng_unaligned_block_length",
+            pcapng + pcapngEpb(syn, syn.size(), 74), false, 0});
+    all.push_back((capture_case) {"pcapng_no_interface",
+            pcapng.substr(0, 28) + pcapngEpb(syn), true, 0});
+
+    // Simple packet block claiming more than the block holds
+    std::string spb;
+    put32(spb, PCAPNG_SPB);
+    put32(spb, 16 + syn.size());
+    put32(spb, 0xFFFFFFFF);
+    spb += syn;
+    put32(spb, 16 + syn.size());
+    all.push_back((capture_case) {"pcapng_spb_huge_length", pcapng + spb, true, 1});
+    return all;
+}
+
+static bool runCase(const char *directory, const capture_case &test)
+{
+    std::string path = std::string(directory) + "/replay_test_XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd == -1) {
+        LOGE("Creating %s failed: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    bool written = write(fd, test.data.data(), test.data.size()) == (ssize_t) test.data.size();
+    close(fd);
+    std::vector<replay_session> sessions;
+    bool readable = written && readCapture(path.c_str(), sessions);
+    unlink(path.c_str());
+    if (!written) {
+        LOGE("Writing %s failed", path.c_str());
+        return false;
+    }
+    return readable == test.readable && sessions.size() == test.sessions;
+}
+
+int main(int argc, char **argv)
+{
+    const char *directory = getenv("TMPDIR");
+    if (directory == NULL)
+        directory = "/data/local/tmp";
+    int c;
+    while ((c = getopt(argc, argv, "d:h")) != -1) {
+        switch (c) {
+            case 'd':
+                directory = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-d directory]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    std::vector<capture_case> all = cases();
+    int failed = 0;
+    for (size_t i = 0; i < all.size(); i++) {
+        bool ok = runCase(directory, all[i]);
+        printf("%s %s\n", ok ? "ok  " : "FAIL", all[i].name);
+        if (!ok)
+            failed++;
+    }
+    printf("%zu captures, %d failed\n", all.size(), failed);
+    return failed == 0 ? 0 : 1;
+}
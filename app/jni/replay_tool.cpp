@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+// Re-scores recorded tests offline: every session in the given pcap/pcapng
+// captures is matched to its test and run through the current checkers.
+//
+//      tcptester-replay [-j threads] [-t test] capture.pcapng ...
+//
+// Prints one CSV line per session, in capture and session order:
+//      capture,client,client_port,server,server_port,test,result,verdict
+// followed by a pass/fail summary per test on stderr.
+
+#include <getopt.h>
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <android/log.h>
+#include "replay.hpp"
+#include "task_pool.hpp"
+
+#ifndef TAG
+#define TAG "TCPTester-replay"
+#endif
+
+// Sessions scored per task, so that one large capture spreads over the pool
+#define REPLAY_CHUNK 64
+
+struct replay_job {
+    const char *path;
+    std::vector<std::string> lines;
+    std::map<std::string, std::pair<uint32_t, uint32_t> > summary;
+};
+
+struct replay_verdict {
+    const struct test_entry *entry;
+    test_error result;
+};
+
+static std::string sessionLine(replay_job *job, replay_session &session,
+            const char *test_name, test_error result)
+{
+    char client[INET_ADDRSTRLEN], server[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &session.client, client, sizeof(client));
+    inet_ntop(AF_INET, &session.server, server, sizeof(server));
+    char line[512];
+    snprintf(line, sizeof(line), "%s,%s,%u,%s,%u,%s,%d,%s", job->path, client, ntohs(session.client_port),
+        server, ntohs(session.server_port), test_name, result,
+        result == success || result == test_complete ? "pass" : "fail");
+    return line;
+}
+
+static void scoreSessions(std::vector<replay_session> *sessions, size_t first, size_t last,
+            const char *forced_test, std::vector<replay_verdict> *verdicts)
+{
+    for (size_t i = first; i < last; i++) {
+        uint8_t reserved = 0;
+        const struct test_entry *entry;
+        if (forced_test != NULL) {
+            entry = findTest(forced_test);
+            identifyTest((*sessions)[i], reserved);
+        } else {
+            entry = identifyTest((*sessions)[i], reserved);
+        }
+        (*verdicts)[i].entry = entry;
+        if (entry == NULL) {
+            (*verdicts)[i].result = test_not_implemented;
+            continue;
+        }
+        test_definition test = entry->define(reserved);
+        (*verdicts)[i].result = replaySession((*sessions)[i], test);
+    }
+}
+
+static void replayCapture(struct task_pool *pool, replay_job *job, const char *forced_test)
+{
+    std::vector<replay_session> sessions;
+    if (!readCapture(job->path, sessions))
+        return;
+    // Chunks stay on this worker unless others are idle and steal them
+    std::vector<replay_verdict> verdicts(sessions.size());
+    std::vector<std::future<void> > chunks;
+    int worker = taskPoolCurrentWorker(pool);
+    for (size_t first = 0; first < sessions.size(); first += REPLAY_CHUNK) {
+        size_t last = std::min(first + REPLAY_CHUNK, sessions.size());
+        chunks.push_back(taskSubmit(pool, std::bind(scoreSessions, &sessions, first, last,
+            forced_test, &verdicts), worker));
+    }
+    for (size_t i = 0; i < chunks.size(); i++)
+        taskWait(pool, chunks[i]);
+
+    for (size_t i = 0; i < sessions.size(); i++) {
+        if (verdicts[i].entry == NULL) {
+            job->lines.push_back(sessionLine(job, sessions[i], "unknown", test_not_implemented));
+            continue;
+        }
+        test_error result = verdicts[i].result;
+        job->lines.push_back(sessionLine(job, sessions[i], verdicts[i].entry->name, result));
+        std::pair<uint32_t, uint32_t> &counts = job->summary[verdicts[i].entry->name];
+        if (result == success || result == test_complete)
+            counts.first++;
+        else
+            counts.second++;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *forced_test = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:t:h")) != -1) {
+        switch (opt) {
+            case 'j': threads = atoi(optarg); break;
+            case 't': forced_test = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-j threads] [-t test] capture...\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-j threads] [-t test] capture...\n", argv[0]);
+        return 1;
+    }
+    if (forced_test != NULL && findTest(forced_test) == NULL) {
+        fprintf(stderr, "Unknown test %s\n", forced_test);
+        return 1;
+    }
+
+    std::vector<replay_job> jobs(argc - optind);
+    for (int i = optind; i < argc; i++)
+        jobs[i - optind].path = argv[i];
+    if (threads < 1)
+        threads = 1;
+
+    struct task_pool *pool = taskPoolCreate(threads);
+    if (pool == NULL)
+        return 1;
+    std::vector<std::future<void> > done;
+    for (size_t i = 0; i < jobs.size(); i++)
+        done.push_back(taskSubmit(pool, std::bind(replayCapture, pool, &jobs[i], forced_test)));
+    for (size_t i = 0; i < done.size(); i++)
+        done[i].wait();
+    taskPoolDestroy(pool);
+
+    printf("capture,client,client_port,server,server_port,test,result,verdict\n");
+    std::map<std::string, std::pair<uint32_t, uint32_t> > summary;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        for (size_t j = 0; j < jobs[i].lines.size(); j++)
+            printf("%s\n", jobs[i].lines[j].c_str());
+        std::map<std::string, std::pair<uint32_t, uint32_t> >::iterator it;
+        for (it = jobs[i].summary.begin(); it != jobs[i].summary.end(); it++) {
+            summary[it->first].first += it->second.first;
+            summary[it->first].second += it->second.second;
+        }
+    }
+    std::map<std::string, std::pair<uint32_t, uint32_t> >::iterator it;
+    for (it = summary.begin(); it != summary.end(); it++)
+        fprintf(stderr, "%-28s pass %6u fail %6u\n", it->first.c_str(), it->second.first, it->second.second);
+    return 0;
+}
@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <map>
+#include <string>
+
+#include <android/log.h>
+#include "result_cache.hpp"
+
+#ifndef TAG
+#define TAG "TCPTester-cache"
+#endif
+
+struct cache_key {
+    uint64_t fingerprint;
+    uint32_t destination;
+    uint16_t port;
+    std::string test;
+    uint8_t reserved;
+
+    bool operator<(const cache_key &other) const {
+        if (fingerprint != other.fingerprint)
+            return fingerprint < other.fingerprint;
+        if (destination != other.destination)
+            return destination < other.destination;
+        if (port != other.port)
+            return port < other.port;
+        if (test != other.test)
+            return test < other.test;
+        return reserved < other.reserved;
+    }
+};
+
+struct cache_entry {
+    test_error result;
+    time_t stored;
+};
+
+struct result_cache {
+    pthread_mutex_t lock;
+    bool open;
+    bool dirty;
+    std::string path;
+    uint32_t expiry_s;
+    std::map<cache_key, cache_entry> entries;
+};
+
+static struct result_cache cache = {PTHREAD_MUTEX_INITIALIZER};
+
+// Interface and gateway of the first default route, from /proc/net/route
+// (the gateway in network byte order)
+static bool defaultGateway(char *interface, size_t interface_size, uint32_t *gateway)
+{
+    FILE *routes = fopen("/proc/net/route", "r");
+    if (routes == NULL)
+        return false;
+    char line[256];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), routes) != NULL) {
+        char name[64];
+        unsigned int destination, route_gateway, flags;
+        if (sscanf(line, "%63s %x %x %x", name, &destination, &route_gateway, &flags) != 4)
+            continue;
+        // Default route through a gateway (RTF_UP | RTF_GATEWAY)
+        if (destination == 0 && (flags & 0x3) == 0x3) {
+            snprintf(interface, interface_size, "%s", name);
+            *gateway = route_gateway;
+            found = true;
+        }
+    }
+    fclose(routes);
+    return found;
+}
+
+// MAC address of a neighbour, from /proc/net/arp
+static bool neighbourMac(const char *interface, uint32_t address, uint8_t *mac)
+{
+    FILE *arp = fopen("/proc/net/arp", "r");
+    if (arp == NULL)
+        return false;
+    struct in_addr in;
+    in.s_addr = address;
+    char address_string[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &in, address_string, sizeof(address_string));
+    char line[256];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), arp) != NULL) {
+        char ip[64], hw_type[16], flags[16], hw[32], mask[16], device[64];
+        unsigned int m[6];
+        if (sscanf(line, "%63s %15s %15s %31s %15s %63s", ip, hw_type, flags, hw, mask, device) != 6)
+            continue;
+        if (strcmp(ip, address_string) != 0 || strcmp(device, interface) != 0)
+            continue;
+        if (sscanf(hw, "%x:%x:%x:%x:%x:%x", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) != 6)
+            continue;
+        for (int i = 0; i < 6; i++)
+            mac[i] = m[i];
+        found = true;
+    }
+    fclose(arp);
+    return found;
+}
+
+void networkFingerprint(struct network_fingerprint *fingerprint, uint32_t local_address)
+{
+    memset(fingerprint, 0, sizeof(*fingerprint));
+    fingerprint->local_address = local_address;
+    fingerprint->global_prefix = globalAddress() & 0xFFFFFF00;
+    char interface[64];
+    uint32_t gateway;
+    if (defaultGateway(interface, sizeof(interface), &gateway))
+        neighbourMac(interface, gateway, fingerprint->gateway_mac);
+}
+
+// FNV-1a over the fields, independent of the struct layout
+static void fnvAdd(uint64_t *hash, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++) {
+        *hash ^= (value >> (8 * i)) & 0xFF;
+        *hash *= 0x100000001b3ULL;
+    }
+}
+
+uint64_t fingerprintKey(const struct network_fingerprint *fingerprint)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    fnvAdd(&hash, fingerprint->local_address, 4);
+    fnvAdd(&hash, fingerprint->global_prefix, 4);
+    for (int i = 0; i < 6; i++)
+        fnvAdd(&hash, fingerprint->gateway_mac[i], 1);
+    fnvAdd(&hash, fingerprint->synack_ttl, 1);
+    fnvAdd(&hash, fingerprint->synack_mss, 2);
+    return hash;
+}
+
+static bool expired(const struct cache_entry &entry, time_t now)
+{
+    return entry.stored > now || now - entry.stored >= (time_t) cache.expiry_s;
+}
+
+bool resultCacheOpen(const char *path, uint32_t expiry_s)
+{
+    pthread_mutex_lock(&cache.lock);
+    cache.path = path;
+    cache.expiry_s = expiry_s;
+    cache.entries.clear();
+    cache.open = true;
+    cache.dirty = false;
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        pthread_mutex_unlock(&cache.lock);
+        if (errno == ENOENT)
+            return true;
+        LOGE("Opening result cache %s failed: %s", path, strerror(errno));
+        return false;
+    }
+    char line[256];
+    time_t now = time(NULL);
+    size_t dropped = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        unsigned long long fingerprint;
+        unsigned int destination, port, reserved;
+        int result;
+        long long stored;
+        char test[64];
+        if (sscanf(line, "%llx %x %u %63s %x %d %lld", &fingerprint, &destination, &port, test, &reserved,
+                &result, &stored) != 7)
+            continue;
+        struct cache_key key = {fingerprint, destination, (uint16_t) port, test, (uint8_t) reserved};
+        struct cache_entry entry = {(test_error) result, (time_t) stored};
+        if (expired(entry, now)) {
+            dropped++;
+            cache.dirty = true;
+            continue;
+        }
+        cache.entries[key] = entry;
+    }
+    fclose(file);
+    LOGI("Result cache %s: %zu verdicts, %zu expired", path, cache.entries.size(), dropped);
+    pthread_mutex_unlock(&cache.lock);
+    return true;
+}
+
+bool resultCacheEnabled()
+{
+    pthread_mutex_lock(&cache.lock);
+    bool open = cache.open;
+    pthread_mutex_unlock(&cache.lock);
+    return open;
+}
+
+bool resultCacheLookup(uint64_t fingerprint, uint32_t destination, uint16_t port, const char *test,
+            uint8_t reserved, test_error *result)
+{
+    struct cache_key key = {fingerprint, destination, port, test, reserved};
+    bool found = false;
+    pthread_mutex_lock(&cache.lock);
+    std::map<cache_key, cache_entry>::iterator it = cache.entries.find(key);
+    if (cache.open && it != cache.entries.end() && !expired(it->second, time(NULL))) {
+        *result = it->second.result;
+        found = true;
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return found;
+}
+
+void resultCacheStore(uint64_t fingerprint, uint32_t destination, uint16_t port, const char *test,
+            uint8_t reserved, test_error result)
+{
+    struct cache_key key = {fingerprint, destination, port, test, reserved};
+    struct cache_entry entry = {result, time(NULL)};
+    pthread_mutex_lock(&cache.lock);
+    if (cache.open) {
+        cache.entries[key] = entry;
+        cache.dirty = true;
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+bool resultCacheSave()
+{
+    pthread_mutex_lock(&cache.lock);
+    if (!cache.open || !cache.dirty) {
+        pthread_mutex_unlock(&cache.lock);
+        return true;
+    }
+    std::string temporary = cache.path + ".tmp";
+    FILE *file = fopen(temporary.c_str(), "w");
+    if (file == NULL) {
+        LOGE("Writing result cache %s failed: %s", temporary.c_str(), strerror(errno));
+        pthread_mutex_unlock(&cache.lock);
+        return false;
+    }
+    time_t now = time(NULL);
+    for (std::map<cache_key, cache_entry>::iterator it = cache.entries.begin(); it != cache.entries.end(); ++it) {
+        if (expired(it->second, now))
+            continue;
+        fprintf(file, "%016llx %08x %u %s %x %d %lld\n", (unsigned long long) it->first.fingerprint,
+            it->first.destination, it->first.port, it->first.test.c_str(), it->first.reserved,
+            it->second.result, (long long) it->second.stored);
+    }
+    bool ok = fclose(file) == 0 && rename(temporary.c_str(), cache.path.c_str()) == 0;
+    if (!ok)
+        LOGE("Saving result cache %s failed: %s", cache.path.c_str(), strerror(errno));
+    else
+        cache.dirty = false;
+    pthread_mutex_unlock(&cache.lock);
+    return ok;
+}
+
+void resultCacheClose()
+{
+    resultCacheSave();
+    pthread_mutex_lock(&cache.lock);
+    cache.open = false;
+    cache.entries.clear();
+    pthread_mutex_unlock(&cache.lock);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+
+#include <stdint.h>
+
+#include "testsuite.hpp"
+
+#ifndef RESULT_CACHE
+#define RESULT_CACHE
+
+// Persistent cache of sweep verdicts, so that a run on a network seen
+// before does not have to repeat every handshake. Verdicts are stored by
+// network fingerprint, destination, port, test and the reserved bits the
+// test was defined with; the fingerprint covers
+// the local address, the global address prefix, the MAC address of the
+// default gateway and the TTL and MSS of the reflector's SYNACK.
+//
+// The cache is a text file, one verdict per line:
+//      <fingerprint> <destination> <port> <test> <reserved> <result> <stored at>
+// fingerprint, destination and reserved in hex, the time in seconds since the epoch.
+
+#define CACHE_EXPIRY_S (24 * 3600)
+
+struct network_fingerprint {
+    uint32_t local_address;     // host byte order
+    uint32_t global_prefix;     // /24 of globalAddress(), 0 if unknown
+    uint8_t gateway_mac[6];     // all 0 if unknown
+    uint8_t synack_ttl;
+    uint16_t synack_mss;
+};
+
+// Fill in the local address, the global prefix and the default gateway;
+// the SYNACK signature is left to the caller
+void networkFingerprint(struct network_fingerprint *fingerprint, uint32_t local_address);
+uint64_t fingerprintKey(const struct network_fingerprint *fingerprint);
+
+// Load the cache; entries older than expiry_s are ignored and dropped on
+// the next save
+bool resultCacheOpen(const char *path, uint32_t expiry_s);
+bool resultCacheEnabled();
+
+// return   true and the cached verdict if there is one that has not expired
+bool resultCacheLookup(uint64_t fingerprint, uint32_t destination, uint16_t port, const char *test,
+            uint8_t reserved, test_error *result);
+void resultCacheStore(uint64_t fingerprint, uint32_t destination, uint16_t port, const char *test,
+            uint8_t reserved, test_error result);
+
+// Write the cache out (through a temporary file), if anything changed
+bool resultCacheSave();
+void resultCacheClose();
+
+#endif
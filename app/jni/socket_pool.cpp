@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <vector>
+
+#include <android/log.h>
+#include "socket_pool.hpp"
+#include "testsuite.hpp"
+#include "pacer.hpp"
+
+struct socket_pool {
+    pthread_mutex_t lock;
+    std::vector<int> idle;
+    size_t created;
+};
+
+static struct socket_pool pool = {PTHREAD_MUTEX_INITIALIZER};
+
+static const struct packet_io *packet_io = NULL;
+
+// Offsets are from the IP header on a raw IP socket
+static struct sock_filter accept_code[] = {
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),              // version and ihl
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x45, 0, 3),
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 6),              // frag_off
+    BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x3FFF, 1, 0),
+    BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+    BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+static struct sock_filter drop_code[] = {
+    BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+static bool attachFilter(int sock, struct sock_filter *code, unsigned short length)
+{
+    struct sock_fprog program = {length, code};
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) == -1) {
+        LOGE("setsockopt SO_ATTACH_FILTER failed: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Throw away whatever is queued, packets and TX timestamps alike
+static void drain(int sock)
+{
+    char buffer[BUFLEN];
+    char control[256];
+    while (recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT) >= 0)
+        ;
+    while (true) {
+        struct iovec iov = {buffer, sizeof(buffer)};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+    }
+}
+
+// A new socket for the pool, idle: dropping everything
+static int createSocket()
+{
+    int sock;
+    if (setupSocket(sock) != success)
+        return -1;
+    int size = SOCKET_RCVBUF;
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) == -1)
+        LOGE("setsockopt SO_RCVBUF failed: %s", strerror(errno));
+    size = SOCKET_SNDBUF;
+    if (setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) == -1)
+        LOGE("setsockopt SO_SNDBUF failed: %s", strerror(errno));
+    if (!attachFilter(sock, drop_code, sizeof(drop_code) / sizeof(drop_code[0]))) {
+        close(sock);
+        return -1;
+    }
+    drain(sock);
+    return sock;
+}
+
+void socketPoolInit(size_t count)
+{
+    pthread_mutex_lock(&pool.lock);
+    while (pool.created < count) {
+        int sock = createSocket();
+        if (sock == -1)
+            break;
+        pool.idle.push_back(sock);
+        pool.created++;
+    }
+    LOGD("Socket pool of %zu", pool.created);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+int leaseSocket()
+{
+    if (packet_io != NULL)
+        return packet_io->open();
+    int sock = -1;
+    pthread_mutex_lock(&pool.lock);
+    if (!pool.idle.empty()) {
+        sock = pool.idle.back();
+        pool.idle.pop_back();
+    } else {
+        sock = createSocket();
+        if (sock != -1) {
+            pool.created++;
+            LOGD("Socket pool grown to %zu", pool.created);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    if (sock == -1)
+        return -1;
+    // Pacing may have been configured since the socket was created
+    pacerSetupSocket(sock);
+    if (!attachFilter(sock, accept_code, sizeof(accept_code) / sizeof(accept_code[0]))) {
+        returnSocket(sock);
+        return -1;
+    }
+    return sock;
+}
+
+void returnSocket(int sock)
+{
+    if (sock == -1)
+        return;
+    if (packet_io != NULL) {
+        packet_io->close(sock);
+        return;
+    }
+    // Without timestamping, enabling it again restarts the TX numbering
+    int flags = 0;
+    setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+    if (!attachFilter(sock, drop_code, sizeof(drop_code) / sizeof(drop_code[0]))) {
+        close(sock);
+        pthread_mutex_lock(&pool.lock);
+        pool.created--;
+        pthread_mutex_unlock(&pool.lock);
+        return;
+    }
+    drain(sock);
+    pthread_mutex_lock(&pool.lock);
+    pool.idle.push_back(sock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+size_t socketPoolSize()
+{
+    pthread_mutex_lock(&pool.lock);
+    size_t created = pool.created;
+    pthread_mutex_unlock(&pool.lock);
+    return created;
+}
+
+void setPacketIo(const struct packet_io *io)
+{
+    packet_io = io;
+}
+
+const struct packet_io *packetIo()
+{
+    return packet_io;
+}
+
+void socketPoolClose()
+{
+    pthread_mutex_lock(&pool.lock);
+    for (size_t i = 0; i < pool.idle.size(); i++)
+        close(pool.idle[i]);
+    pool.created -= pool.idle.size();
+    pool.idle.clear();
+    pthread_mutex_unlock(&pool.lock);
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef SOCKET_POOL
+#define SOCKET_POOL
+
+// Raw TCP sockets, set up once and leased to whoever sends probes. Every
+// raw TCP socket gets a copy of every TCP packet the host receives, so a
+// socket per test both leaks if it is not closed and costs a copy per open
+// one. Pooled sockets are created with IP_HDRINCL, the receive timeout and
+// the buffer sizes below; a socket in the pool has a filter that drops
+// everything, a leased one a filter that passes only what the receive
+// paths can read (IPv4 without options, not a fragment). Returning a
+// socket empties its queues and turns timestamping off, so the next lease
+// starts with nothing left over and TX timestamps numbered from 0.
+// Thread safe.
+
+#define SOCKET_POOL_SIZE 2
+#define SOCKET_RCVBUF (1 << 20)
+#define SOCKET_SNDBUF (1 << 20)
+
+// Create count sockets up front, e.g. at daemon start. Not needed: leasing
+// from an empty pool creates a socket, which then stays in the pool.
+void socketPoolInit(size_t count);
+
+// A socket for the caller's use only, until returnSocket
+// return   -1 if no socket can be created
+int leaseSocket();
+void returnSocket(int sock);
+
+// Sockets created so far, leased or not
+size_t socketPoolSize();
+
+// Close the sockets not leased
+void socketPoolClose();
+
+// Where leased sockets come from and where what is sent on them goes: raw
+// sockets, unless a simulator has taken over (see net_sim.hpp). Its sockets
+// are descriptors it writes the packets received to, what is sent on them
+// is handed to send instead of sendto(). Not thread safe, set it while
+// nothing is running; NULL for raw sockets again.
+struct packet_io {
+    int (*open)();
+    void (*close)(int sock);
+    // return   bytes sent or -1 as sendto()
+    int (*send)(int sock, const char *packet, uint16_t length);
+};
+
+void setPacketIo(const struct packet_io *io);
+// return   NULL on raw sockets
+const struct packet_io *packetIo();
+
+#endif
@@ -0,0 +1,380 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <string.h>
+
+#include <android/log.h>
+#include "sweep.hpp"
+#include "probe_engine.hpp"
+#include "port_allocator.hpp"
+#include "result_cache.hpp"
+#include "test_planner.hpp"
+
+struct sweep_state {
+    struct sweep_request *request;
+    sweepCallback fn_result;
+    sweepCompareCallback fn_compare;
+    struct event_loop loop;
+    struct probe_engine engine;
+    size_t probes;              // per destination
+    size_t done;                // on all destinations
+    std::vector<size_t> next_probe;     // by destination
+    std::vector<size_t> in_flight;
+    // Tests of a port in the order they are started, prerequisites (see
+    // test_planner.hpp) first, and the prerequisite of every test, as an
+    // index into the request's tests or -1
+    std::vector<size_t> order;
+    std::vector<int> prerequisite;
+    // Probes finished, by probe and destination, and probes waiting for
+    // their prerequisite to finish, by destination
+    std::vector<bool> finished;
+    std::vector<std::vector<size_t> > blocked;
+    // Verdicts of every probe on every destination, for the comparison
+    std::vector<test_error> verdicts;
+    std::vector<size_t> verdicts_known;
+    // Within startProbes, and whether a probe finished meanwhile
+    bool starting;
+    bool restart;
+};
+
+static void startProbes(struct sweep_state *sweep);
+
+// Verdicts as reported over IPC: pass, fail or not implemented
+static int verdictClass(test_error result)
+{
+    if (result == success || result == test_complete)
+        return 0;
+    if (result == test_not_implemented)
+        return 2;
+    // test_inferred included
+    return 1;
+}
+
+// Compare the verdicts of one probe, verdicts indexed by probe and destination
+static void compareProbe(struct sweep_request *request, const std::vector<test_error> &verdicts, size_t probe,
+            sweepCompareCallback &fn_compare)
+{
+    size_t destinations = request->destinations.size();
+    size_t tests = request->tests.size();
+    struct sweep_comparison comparison;
+    comparison.dst_port = request->ports[probe / tests];
+    comparison.test = probe % tests;
+    comparison.differ = false;
+    for (size_t d = 0; d < destinations; d++) {
+        comparison.results.push_back(verdicts[probe * destinations + d]);
+        if (verdictClass(comparison.results[d]) != verdictClass(comparison.results[0]))
+            comparison.differ = true;
+    }
+    if (comparison.differ)
+        LOGI("Verdicts of %s on port %u differ between destinations", request->tests[comparison.test]->name,
+            comparison.dst_port);
+    fn_compare(comparison);
+}
+
+static void probeDone(struct sweep_state *sweep, size_t probe, struct sweep_result result,
+            test_error probe_result, const struct probe_timing *timing)
+{
+    struct sweep_request *request = sweep->request;
+    if (request->src_port_base == 0)
+        releasePort(result.src_port);
+    result.result = probe_result;
+    result.handshake_rtt_us = timing != NULL ? timing->handshake_rtt_us : -1;
+    result.data_rtt_us = timing != NULL ? timing->data_rtt_us : -1;
+    result.synack_ttl = timing != NULL ? timing->synack_ttl : 0;
+    result.synack_mss = timing != NULL ? timing->synack_mss : 0;
+    sweep->done++;
+    sweep->in_flight[result.destination]--;
+    size_t destinations = request->destinations.size();
+    sweep->finished[probe * destinations + result.destination] = true;
+    sweep->fn_result(result);
+
+    if (destinations > 1 && sweep->fn_compare) {
+        sweep->verdicts[probe * destinations + result.destination] = probe_result;
+        if (++sweep->verdicts_known[probe] == destinations)
+            compareProbe(request, sweep->verdicts, probe, sweep->fn_compare);
+    }
+    if (sweep->done == sweep->probes * destinations)
+        eventLoopStop(&sweep->loop);
+    else
+        startProbes(sweep);
+}
+
+static void startProbe(struct sweep_state *sweep, size_t d, size_t probe)
+{
+    struct sweep_request *request = sweep->request;
+    size_t tests = request->tests.size();
+    struct sweep_result result;
+    result.destination = d;
+    result.port = probe / tests;
+    result.dst_port = request->ports[result.port];
+    result.test = probe % tests;
+    // Destinations differ, so the same source port can serve a probe to each
+    if (request->src_port_base != 0)
+        result.src_port = request->src_port_base + probe % SWEEP_SRC_PORTS;
+    else
+        result.src_port = allocatePort();
+    result.result = test_failed;
+    result.cached = false;
+    sweep->in_flight[d]++;
+    const struct test_entry *entry = request->tests[result.test];
+    if (result.src_port == 0 || !probeStart(&sweep->engine, request->source, result.src_port,
+                request->destinations[d], result.dst_port, entry->define(request->reserved), entry->name,
+                std::bind(probeDone, sweep, probe, result, std::placeholders::_1, std::placeholders::_2)))
+        probeDone(sweep, probe, result, test_failed, NULL);
+}
+
+// The prerequisite of a probe is the same port's prerequisite test
+static bool prerequisiteFinished(struct sweep_state *sweep, size_t d, size_t probe)
+{
+    size_t tests = sweep->request->tests.size();
+    int prerequisite = sweep->prerequisite[probe % tests];
+    if (prerequisite < 0)
+        return true;
+    size_t prerequisite_probe = probe - probe % tests + prerequisite;
+    return sweep->finished[prerequisite_probe * sweep->request->destinations.size() + d];
+}
+
+// One pass of startProbes over the destinations
+static void startPass(struct sweep_state *sweep)
+{
+    struct sweep_request *request = sweep->request;
+    size_t tests = request->tests.size();
+    size_t max_in_flight = request->max_per_destination > 0 ? request->max_per_destination : 1;
+    for (size_t d = 0; d < request->destinations.size(); d++) {
+        // Taken off the list before any is started: starting one can
+        // finish another, which changes the list
+        std::vector<size_t> ready;
+        std::vector<size_t> &blocked = sweep->blocked[d];
+        for (size_t i = 0; i < blocked.size();) {
+            if (prerequisiteFinished(sweep, d, blocked[i])) {
+                ready.push_back(blocked[i]);
+                blocked.erase(blocked.begin() + i);
+            } else {
+                i++;
+            }
+        }
+        for (size_t i = 0; i < ready.size(); i++) {
+            if (sweep->in_flight[d] >= max_in_flight) {
+                sweep->blocked[d].insert(sweep->blocked[d].begin(), ready.begin() + i, ready.end());
+                break;
+            }
+            startProbe(sweep, d, ready[i]);
+        }
+        while (sweep->next_probe[d] < sweep->probes && sweep->in_flight[d] < max_in_flight) {
+            size_t slot = sweep->next_probe[d]++;
+            size_t probe = slot - slot % tests + sweep->order[slot % tests];
+            if (prerequisiteFinished(sweep, d, probe))
+                startProbe(sweep, d, probe);
+            else
+                sweep->blocked[d].push_back(probe);
+        }
+    }
+}
+
+// Keep max_per_destination probes in flight to every destination. Probes
+// are numbered port-major, so all tests of a port run close together, and
+// every destination goes through them in the same order so that the
+// verdicts of a port are compared soon after it is probed. A probe whose
+// prerequisite is still running waits, so that the planner can infer its
+// verdict if the prerequisite's SYN is lost, and the next one is started.
+// A probe that can not be started finishes right away; that only asks for
+// another pass here, so the stack does not grow with every such probe.
+static void startProbes(struct sweep_state *sweep)
+{
+    if (sweep->starting) {
+        sweep->restart = true;
+        return;
+    }
+    sweep->starting = true;
+    do {
+        sweep->restart = false;
+        startPass(sweep);
+    } while (sweep->restart);
+    sweep->starting = false;
+}
+
+// Order the tests of a port so that every prerequisite comes before the
+// tests depending on it
+static void planTests(struct sweep_state *sweep)
+{
+    struct sweep_request *request = sweep->request;
+    size_t tests = request->tests.size();
+    sweep->prerequisite.assign(tests, -1);
+    for (size_t t = 0; t < tests; t++) {
+        const char *prerequisite = plannerPrerequisite(request->tests[t]->name);
+        for (size_t p = 0; prerequisite != NULL && p < tests; p++)
+            if (p != t && strcmp(request->tests[p]->name, prerequisite) == 0)
+                sweep->prerequisite[t] = p;
+    }
+    std::vector<size_t> depth(tests, 0);
+    for (size_t t = 0; t < tests; t++)
+        for (int p = sweep->prerequisite[t]; p >= 0 && depth[t] < tests; p = sweep->prerequisite[p])
+            depth[t]++;
+    sweep->order.clear();
+    for (size_t level = 0; sweep->order.size() < tests; level++)
+        for (size_t t = 0; t < tests; t++)
+            if (depth[t] == level)
+                sweep->order.push_back(t);
+}
+
+size_t runSweep(struct sweep_request *request, sweepCallback fn_result, sweepCompareCallback fn_compare)
+{
+    struct sweep_state sweep;
+    sweep.request = request;
+    sweep.fn_result = fn_result;
+    sweep.fn_compare = fn_compare;
+    sweep.done = 0;
+    sweep.starting = false;
+    sweep.restart = false;
+    sweep.probes = request->ports.size() * request->tests.size();
+    size_t destinations = request->destinations.size();
+    if (sweep.probes == 0 || destinations == 0)
+        return 0;
+    sweep.next_probe.assign(destinations, 0);
+    sweep.in_flight.assign(destinations, 0);
+    sweep.finished.assign(sweep.probes * destinations, false);
+    sweep.blocked.assign(destinations, std::vector<size_t>());
+    planTests(&sweep);
+    if (destinations > 1 && fn_compare) {
+        sweep.verdicts.assign(sweep.probes * destinations, test_failed);
+        sweep.verdicts_known.assign(sweep.probes, 0);
+    }
+    // One engine for all destinations: the socket, demultiplexing and
+    // timers are shared, probes are told apart by the remote address
+    if (!eventLoopInit(&sweep.loop))
+        return 0;
+    if (!probeEngineInit(&sweep.engine, &sweep.loop)) {
+        eventLoopClose(&sweep.loop);
+        return 0;
+    }
+
+    LOGD("Sweep of %zu ports x %zu tests on %zu destinations, %d in flight to each", request->ports.size(),
+        request->tests.size(), destinations, request->max_per_destination);
+    startProbes(&sweep);
+    if (sweep.done < sweep.probes * destinations)
+        eventLoopRun(&sweep.loop);
+    probeEngineClose(&sweep.engine);
+    eventLoopClose(&sweep.loop);
+    return sweep.done;
+}
+
+size_t runCachedSweep(struct sweep_request *request, sweepCallback fn_result, sweepCompareCallback fn_compare)
+{
+    if (!resultCacheEnabled() || request->ports.empty() || request->tests.empty())
+        return runSweep(request, fn_result, fn_compare);
+    size_t destinations = request->destinations.size();
+    size_t tests = request->tests.size();
+    size_t probes = request->ports.size() * tests;
+    // Verdicts of the whole matrix by probe and destination, and which of
+    // them have just been probed
+    std::vector<test_error> verdicts(probes * destinations, test_failed);
+    std::vector<bool> probed(probes * destinations, false);
+    // SYNACK signatures from the sentinels, by destination
+    std::vector<std::pair<uint8_t, uint16_t> > signatures(destinations, std::make_pair(0, 0));
+    size_t done = 0;
+
+    sweepCallback fn_probed = [&](const struct sweep_result &result) {
+        size_t index = (result.port * tests + result.test) * destinations + result.destination;
+        verdicts[index] = result.result;
+        probed[index] = true;
+        if (signatures[result.destination].first == 0 && result.synack_ttl != 0)
+            signatures[result.destination] = std::make_pair(result.synack_ttl, result.synack_mss);
+        fn_result(result);
+    };
+
+    // Sentinels: every test on the first port
+    struct sweep_request sentinels = *request;
+    sentinels.ports.assign(1, request->ports[0]);
+    done += runSweep(&sentinels, fn_probed, NULL);
+
+    // Only now: the sentinels' SYNACKs may have told us the global address
+    std::vector<struct network_fingerprint> fingerprints(destinations);
+    for (size_t d = 0; d < destinations; d++) {
+        networkFingerprint(&fingerprints[d], request->source);
+        fingerprints[d].synack_ttl = signatures[d].first;
+        fingerprints[d].synack_mss = signatures[d].second;
+    }
+
+    std::vector<uint32_t> stale;
+    std::vector<size_t> stale_index;
+    for (size_t d = 0; d < destinations; d++) {
+        uint64_t key = fingerprintKey(&fingerprints[d]);
+        std::vector<test_error> cached(probes, test_failed);
+        bool valid = true;
+        for (size_t probe = 0; probe < probes && valid; probe++) {
+            const char *test = request->tests[probe % tests]->name;
+            if (!resultCacheLookup(key, request->destinations[d], request->ports[probe / tests], test,
+                    request->reserved, &cached[probe]))
+                valid = false;
+            else if (probe < tests && verdictClass(cached[probe]) != verdictClass(verdicts[probe * destinations + d])) {
+                LOGI("Sentinel %s on port %u disagrees with the cache", test, request->ports[0]);
+                valid = false;
+            }
+        }
+        if (!valid) {
+            stale.push_back(request->destinations[d]);
+            stale_index.push_back(d);
+            continue;
+        }
+        LOGD("Sentinels of destination %zu agree with the cache, %zu verdicts cached", d, probes - tests);
+        for (size_t probe = tests; probe < probes; probe++) {
+            struct sweep_result result;
+            result.destination = d;
+            result.port = probe / tests;
+            result.dst_port = request->ports[result.port];
+            result.test = probe % tests;
+            result.src_port = 0;
+            result.result = cached[probe];
+            result.cached = true;
+            result.handshake_rtt_us = result.data_rtt_us = -1;
+            result.synack_ttl = 0;
+            result.synack_mss = 0;
+            verdicts[probe * destinations + d] = cached[probe];
+            done++;
+            fn_result(result);
+        }
+    }
+
+    // The full matrix where the cache does not hold
+    if (!stale.empty() && request->ports.size() > 1) {
+        struct sweep_request full = *request;
+        full.destinations = stale;
+        full.ports.erase(full.ports.begin());
+        done += runSweep(&full, [&](const struct sweep_result &result) {
+            struct sweep_result translated = result;
+            translated.destination = stale_index[result.destination];
+            translated.port = result.port + 1;
+            fn_probed(translated);
+        }, NULL);
+    }
+
+    for (size_t d = 0; d < destinations; d++) {
+        uint64_t key = fingerprintKey(&fingerprints[d]);
+        for (size_t probe = 0; probe < probes; probe++) {
+            if (probed[probe * destinations + d])
+                resultCacheStore(key, request->destinations[d], request->ports[probe / tests],
+                    request->tests[probe % tests]->name, request->reserved, verdicts[probe * destinations + d]);
+        }
+    }
+    resultCacheSave();
+
+    if (destinations > 1 && fn_compare) {
+        for (size_t probe = 0; probe < probes; probe++)
+            compareProbe(request, verdicts, probe, fn_compare);
+    }
+    return done;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <functional>
+#include <vector>
+
+#include "testsuite.hpp"
+
+#ifndef SWEEP
+#define SWEEP
+
+// Port sweep: a set of tests run against every port in a list on one or
+// more destinations, with up to max_per_destination probes in flight to
+// each of them on one probe engine, results reported as each probe
+// finishes. With several destinations (e.g. reflectors on different
+// paths) the verdicts of every port and test are compared across them.
+
+struct sweep_request {
+    uint32_t source;            // host byte order, as runTest takes them
+    uint16_t src_port_base;     // source ports are handed out from here,
+                                // 0 to take them from the port allocator
+    std::vector<uint32_t> destinations;
+    std::vector<uint16_t> ports;
+    std::vector<const struct test_entry*> tests;
+    uint8_t reserved;           // reserved bits for the reserved_* tests
+    int max_per_destination;    // probes in flight to every destination
+};
+
+struct sweep_result {
+    size_t destination;         // index into sweep_request.destinations
+    size_t port;                // index into sweep_request.ports
+    uint16_t dst_port;
+    size_t test;                // index into sweep_request.tests
+    uint16_t src_port;
+    test_error result;
+    bool cached;                // from the result cache, not probed
+    int64_t handshake_rtt_us;   // see probe_timing, -1 if not measured
+    int64_t data_rtt_us;
+    uint8_t synack_ttl;         // 0 if no SYNACK arrived
+    uint16_t synack_mss;
+};
+
+// Verdicts of one port and test on all destinations, reported once the
+// last of them has finished
+struct sweep_comparison {
+    uint16_t dst_port;
+    size_t test;
+    std::vector<test_error> results;    // by destination
+    bool differ;                // not all destinations agree on the verdict
+};
+
+// Called for every finished probe, one call at a time
+typedef std::function<void(const struct sweep_result&)> sweepCallback;
+typedef std::function<void(const struct sweep_comparison&)> sweepCompareCallback;
+
+// Run every test of the request against every port of every destination,
+// at most max_per_destination at a time to each. Returns when all probes
+// are done.
+//      fn_compare  called for every port and test once all destinations
+//                  have a verdict, if there are several; may be NULL
+//
+// return   number of probes run
+size_t runSweep(struct sweep_request *request, sweepCallback fn_result, sweepCompareCallback fn_compare);
+
+// runSweep through the result cache (see result_cache.hpp), if it is
+// open. All tests are run on the first port first, as sentinels. Where
+// the sentinel verdicts of a destination agree with the cache under the
+// fingerprint of the current network, SYNACK signature included, and the
+// rest of its verdicts are cached and have not expired, those are
+// reported from the cache; the full matrix is run on the other
+// destinations and the cache updated. Destinations are compared once
+// everything is known.
+size_t runCachedSweep(struct sweep_request *request, sweepCallback fn_result, sweepCompareCallback fn_compare);
+
+// Source ports cycle through this many ports above src_port_base
+#define SWEEP_SRC_PORTS 16384
+
+#endif
@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <pthread.h>
+#include <unistd.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include <android/log.h>
+#include "util.hpp"
+#include "task_pool.hpp"
+
+struct task_worker {
+    struct task_pool *pool;
+    int index;
+    pthread_t thread;
+    std::mutex lock;
+    std::deque<std::function<void()> > tasks;
+};
+
+struct task_pool {
+    std::vector<task_worker*> workers;
+    // Sleeping workers wait on wake for queued to become non-zero
+    std::mutex lock;
+    std::condition_variable wake;
+    std::atomic<size_t> queued;
+    std::atomic<uint32_t> next;
+    bool stopping;
+};
+
+static __thread struct task_worker *current_worker = NULL;
+
+static bool popOwn(struct task_worker *worker, std::function<void()> &fn)
+{
+    std::lock_guard<std::mutex> guard(worker->lock);
+    if (worker->tasks.empty())
+        return false;
+    fn = std::move(worker->tasks.back());
+    worker->tasks.pop_back();
+    return true;
+}
+
+static bool steal(struct task_worker *victim, std::function<void()> &fn)
+{
+    std::lock_guard<std::mutex> guard(victim->lock);
+    if (victim->tasks.empty())
+        return false;
+    fn = std::move(victim->tasks.front());
+    victim->tasks.pop_front();
+    return true;
+}
+
+// Own deque first, then the others from the next worker on
+static bool takeTask(struct task_pool *pool, std::function<void()> &fn)
+{
+    if (pool->queued.load() == 0)
+        return false;
+    struct task_worker *self = current_worker != NULL && current_worker->pool == pool ? current_worker : NULL;
+    size_t count = pool->workers.size();
+    size_t first = self != NULL ? self->index : pool->next.load() % count;
+    if (self != NULL && popOwn(self, fn)) {
+        pool->queued--;
+        return true;
+    }
+    for (size_t i = 0; i < count; i++) {
+        struct task_worker *victim = pool->workers[(first + i) % count];
+        if (victim != self && steal(victim, fn)) {
+            pool->queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *taskWorker(void *arg)
+{
+    struct task_worker *worker = (struct task_worker*) arg;
+    struct task_pool *pool = worker->pool;
+    current_worker = worker;
+    std::function<void()> fn;
+    while (true) {
+        if (takeTask(pool, fn)) {
+            fn();
+            fn = nullptr;
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(pool->lock);
+        if (pool->queued.load() != 0)
+            continue;
+        if (pool->stopping)
+            break;
+        pool->wake.wait(guard);
+    }
+    current_worker = NULL;
+    return NULL;
+}
+
+struct task_pool *taskPoolCreate(int threads)
+{
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+    struct task_pool *pool = new task_pool;
+    pool->queued = 0;
+    pool->next = 0;
+    pool->stopping = false;
+    for (int i = 0; i < threads; i++) {
+        struct task_worker *worker = new task_worker;
+        worker->pool = pool;
+        worker->index = i;
+        pool->workers.push_back(worker);
+    }
+    for (size_t i = 0; i < pool->workers.size(); i++) {
+        if (pthread_create(&pool->workers[i]->thread, NULL, taskWorker, pool->workers[i]) != 0) {
+            LOGE("Starting task worker %zu failed", i);
+            for (size_t j = i; j < pool->workers.size(); j++)
+                delete pool->workers[j];
+            pool->workers.resize(i);
+            break;
+        }
+    }
+    if (pool->workers.empty()) {
+        delete pool;
+        return NULL;
+    }
+    LOGD("Task pool of %zu workers", pool->workers.size());
+    return pool;
+}
+
+void taskPoolDestroy(struct task_pool *pool)
+{
+    if (pool == NULL)
+        return;
+    {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        pool->stopping = true;
+    }
+    pool->wake.notify_all();
+    for (size_t i = 0; i < pool->workers.size(); i++) {
+        pthread_join(pool->workers[i]->thread, NULL);
+        delete pool->workers[i];
+    }
+    delete pool;
+}
+
+static struct task_pool *default_pool = NULL;
+static pthread_once_t default_pool_once = PTHREAD_ONCE_INIT;
+
+static void createDefaultPool()
+{
+    default_pool = taskPoolCreate(0);
+}
+
+struct task_pool *taskPoolDefault()
+{
+    pthread_once(&default_pool_once, createDefaultPool);
+    return default_pool;
+}
+
+int taskPoolWorkers(const struct task_pool *pool)
+{
+    return pool->workers.size();
+}
+
+int taskPoolCurrentWorker(const struct task_pool *pool)
+{
+    return current_worker != NULL && current_worker->pool == pool ? current_worker->index : TASK_ANY;
+}
+
+void taskPoolPush(struct task_pool *pool, std::function<void()> fn, int affinity)
+{
+    size_t count = pool->workers.size();
+    struct task_worker *worker;
+    if (affinity >= 0)
+        worker = pool->workers[affinity % count];
+    else if (current_worker != NULL && current_worker->pool == pool)
+        worker = current_worker;
+    else
+        worker = pool->workers[pool->next++ % count];
+    // Counted first, so that queued never drops below the tasks in the deques
+    {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        pool->queued++;
+    }
+    {
+        std::lock_guard<std::mutex> guard(worker->lock);
+        worker->tasks.push_back(std::move(fn));
+    }
+    pool->wake.notify_one();
+}
+
+bool taskPoolRunOne(struct task_pool *pool)
+{
+    std::function<void()> fn;
+    if (!takeTask(pool, fn))
+        return false;
+    fn();
+    return true;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stddef.h>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <type_traits>
+
+#ifndef TASK_POOL
+#define TASK_POOL
+
+// Work-stealing pool for everything that does not belong on the probe
+// engine's loop: replay sessions, checker runs, capture writing. Every
+// worker has a deque of its own, takes its newest task first and, once it
+// runs dry, steals the oldest from the others. Tasks submitted from a
+// worker go to its own deque unless an affinity hint names another one, so
+// a task and the ones it spawns tend to stay on the same core.
+//
+// Threads are only created with the pool, never per task. Thread safe.
+
+// No affinity: the submitting worker, round robin from other threads
+#define TASK_ANY -1
+
+struct task_pool;
+
+// param threads    workers, 0 for one per online core
+struct task_pool *taskPoolCreate(int threads);
+// Run everything still queued, then stop and free the pool
+void taskPoolDestroy(struct task_pool *pool);
+// The process wide pool, one worker per core, created on first use
+struct task_pool *taskPoolDefault();
+int taskPoolWorkers(const struct task_pool *pool);
+// Index of the calling worker of pool, TASK_ANY if called from elsewhere
+int taskPoolCurrentWorker(const struct task_pool *pool);
+
+// Queue fn, on worker affinity % workers if given
+void taskPoolPush(struct task_pool *pool, std::function<void()> fn, int affinity = TASK_ANY);
+// Run one queued task on the calling thread, if there is any
+// return   false if nothing was queued
+bool taskPoolRunOne(struct task_pool *pool);
+
+// Queue fn, its result (or exception) is delivered through the future
+template<typename F>
+std::future<typename std::result_of<F()>::type> taskSubmit(struct task_pool *pool, F fn,
+            int affinity = TASK_ANY)
+{
+    typedef typename std::result_of<F()>::type result_type;
+    std::shared_ptr<std::packaged_task<result_type()> > task =
+        std::make_shared<std::packaged_task<result_type()> >(fn);
+    std::future<result_type> future = task->get_future();
+    taskPoolPush(pool, [task]() { (*task)(); }, affinity);
+    return future;
+}
+
+// Wait for a task, running queued ones meanwhile, so that a task may wait
+// for the tasks it submitted without tying up its worker
+template<typename T>
+T taskWait(struct task_pool *pool, std::future<T> &future)
+{
+    while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        if (!taskPoolRunOne(pool))
+            future.wait_for(std::chrono::milliseconds(1));
+    }
+    return future.get();
+}
+
+#endif
@@ -16,6 +16,10 @@
  
 #include <android/log.h>
 #include "tcp_basic.hpp"
+#include "packet_capture.hpp"
+#include "pacer.hpp"
+#include "packet_view.hpp"
+#include "socket_pool.hpp"
 
 using namespace std::placeholders;
 
@@ -60,8 +64,9 @@ test_error receivePacket(int sock, struct iphdr *ip, struct tcphdr *tcp,
 {
     // will timeout if there is no suitable packet even if there are
     // other packets in the receive buffer
-    std::chrono::time_point<std::chrono::system_clock> start, now;
-    start = std::chrono::system_clock::now();
+    std::chrono::time_point<std::chrono::steady_clock> start, now;
+    start = std::chrono::steady_clock::now();
+    struct packet_view view;
     while (true) {
         int length = recv(sock, (char*)ip, BUFLEN, 0);
         // Error reading from socket or reading timed out - failure either way
@@ -71,13 +76,17 @@ test_error receivePacket(int sock, struct iphdr *ip, struct tcphdr *tcp,
             return receive_error;
         }
 
-        if (validPacket(ip, tcp, exp_src, exp_dst)) {
+        // Malformed or with IP options the callers' tcp pointer would miss,
+        // skipped like another connection's packet
+        if (viewPacket((char*) ip, length, &view) && view.tcp == tcp
+                && validPacket(ip, tcp, exp_src, exp_dst)) {
+            capturePacket(capture_inbound, (char*) ip, view.length);
             return success;
         }
         else {
             // Read a packet that belongs to some other connection
             // try again unless we have exceeded receive timeout
-            now = std::chrono::system_clock::now();
+            now = std::chrono::steady_clock::now();
             if (now - start > sock_receive_timeout_sec) {
                 LOGD("Packet reading timed out");
                 return receive_timeout;
@@ -86,12 +95,74 @@ test_error receivePacket(int sock, struct iphdr *ip, struct tcphdr *tcp,
     }
 }
 
-test_error sendPacket(int sock, char buffer[], struct sockaddr_in *dst, uint16_t len) {
-    int bytes = sendto(sock, buffer, len, 0, (struct sockaddr*) dst, sizeof(*dst));
+static test_error packetSent(int bytes, char buffer[], uint16_t len) {
     if (bytes == -1) {
         LOGE("sendto() failed for data packet: %s", strerror(errno));
         return send_error;
     }
+    capturePacket(capture_outbound, buffer, len);
+    return success;
+}
+
+test_error sendPacket(int sock, char buffer[], struct sockaddr_in *dst, uint16_t len) {
+    int bytes;
+    const struct packet_io *io = packetIo();
+    if (io != NULL)
+        bytes = io->send(sock, buffer, len);
+    else if (pacerEnabled())
+        bytes = pacedSend(sock, buffer, len, dst);
+    else
+        bytes = sendto(sock, buffer, len, 0, (struct sockaddr*) dst, sizeof(*dst));
+    return packetSent(bytes, buffer, len);
+}
+
+test_error sendPacketAt(int sock, char buffer[], struct sockaddr_in *dst, uint16_t len, uint64_t departure) {
+    return packetSent(pacerSendAt(sock, buffer, len, dst, departure), buffer, len);
+}
+
+// Segments per sendmmsg() call
+#define SEGMENT_BATCH 64
+
+test_error sendSegments(int sock, const struct tcp_segment *segments, size_t count,
+            struct sockaddr_in *dst, size_t *sent)
+{
+    *sent = 0;
+    if (pacerEnabled() || captureActive() || packetIo() != NULL) {
+        char packet[SEGMENT_HDRLEN + BUFLEN];
+        for (size_t i = 0; i < count; i++) {
+            const struct tcp_segment *segment = &segments[i];
+            memcpy(packet, segment->header, segment->header_length);
+            memcpy(packet + segment->header_length, segment->payload, segment->payload_length);
+            test_error ret = sendPacket(sock, packet, dst, segment->header_length + segment->payload_length);
+            if (ret != success)
+                return ret;
+            (*sent)++;
+        }
+        return success;
+    }
+    struct mmsghdr messages[SEGMENT_BATCH];
+    struct iovec iov[SEGMENT_BATCH][2];
+    while (*sent < count) {
+        size_t batch = count - *sent < SEGMENT_BATCH ? count - *sent : SEGMENT_BATCH;
+        for (size_t i = 0; i < batch; i++) {
+            const struct tcp_segment *segment = &segments[*sent + i];
+            iov[i][0].iov_base = (void*) segment->header;
+            iov[i][0].iov_len = segment->header_length;
+            iov[i][1].iov_base = (void*) segment->payload;
+            iov[i][1].iov_len = segment->payload_length;
+            memset(&messages[i], 0, sizeof(messages[i]));
+            messages[i].msg_hdr.msg_name = dst;
+            messages[i].msg_hdr.msg_namelen = sizeof(*dst);
+            messages[i].msg_hdr.msg_iov = iov[i];
+            messages[i].msg_hdr.msg_iovlen = 2;
+        }
+        int done = sendmmsg(sock, messages, batch, 0);
+        if (done == -1) {
+            LOGE("sendmmsg() failed for %u segments: %s", (unsigned) batch, strerror(errno));
+            return send_error;
+        }
+        *sent += done;
+    }
     return success;
 }
 
@@ -175,8 +246,9 @@ test_error handshake(int socket, struct iphdr *ip, struct tcphdr *tcp, struct tc
         return ret;
     }
     
-    uint16_t received_data = htons(ip->tot_len) - IPHDRLEN - tcp->doff * 4;
-    conn_state->rcv_nxt = ntohl(tcp->seq) + 1 + received_data;
+    struct packet_view view;
+    viewPacket(ip, tcp, &view);
+    conn_state->rcv_nxt = view.seq + 1 + view.payload_length;
     LOGD("SYNACK \tSeq: %zu \tAck: %zu\n", ntohl(tcp->seq), ntohl(tcp->ack_seq));
     
     buildTcpAck(src, dst, ip, tcp, conn_state->snd_nxt, conn_state->rcv_nxt);
@@ -248,11 +320,14 @@ void sackResponseHandler(struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *c
         }
     }
     
-    uint16_t receiveDataLength = ntohs(ip->tot_len) - IPHDRLEN - tcp->doff * 4;
+    struct packet_view view;
+    if (!viewPacket(ip, tcp, &view))
+        return;
+    uint16_t receiveDataLength = view.payload_length;
     // non-continuous block received
-    if (receiveDataLength > 0 && conn_state->rcv_nxt < tcp->seq + receiveDataLength) {
+    if (receiveDataLength > 0 && conn_state->rcv_nxt < view.seq + receiveDataLength) {
         
-        tcp_sack_block newBlock = {ntohl(tcp->seq), ntohl(tcp->seq)+receiveDataLength+1};
+        tcp_sack_block newBlock = {view.seq, view.seq+receiveDataLength+1};
         // Take the current new block and expand it while there are any overlaps with other blocks
         for (int i = 0; i < conn_state->num_sacks; i++) {
             bool overlaps = false;
@@ -20,6 +20,9 @@
 #include "util.hpp"
 #include "packet_builder.hpp"
 
+#ifndef TCP_BASIC
+#define TCP_BASIC
+
 const std::chrono::seconds sock_receive_timeout_sec(10);
 
 #ifndef BUFLEN
@@ -42,8 +45,19 @@ test_error shutdownConnection(struct sockaddr_in *src, struct sockaddr_in *dst,
                 uint32_t &seq_local, uint32_t &seq_remote);
 
 test_error sendPacket(int sock, char buffer[], struct sockaddr_in *dst, uint16_t len);
+// sendPacket for a packet the caller paces: its tokens taken with
+// pacerReserve, sent now or, with SO_TXTIME, at departure
+test_error sendPacketAt(int sock, char buffer[], struct sockaddr_in *dst, uint16_t len, uint64_t departure);
+// Segments from segmentPayload, gathered by the kernel with sendmmsg().
+// Only with pacing or capture on, or on a simulator's sockets, is every one
+// put together first.
+// param sent   number of segments sent, counted even on failure
+test_error sendSegments(int sock, const struct tcp_segment *segments, size_t count,
+            struct sockaddr_in *dst, size_t *sent);
 
 test_error receivePacket(int sock, struct iphdr *ip, struct tcphdr *tcp,
     struct sockaddr_in *exp_src, struct sockaddr_in *exp_dst);
 
-void sackResponseHandler(struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state);
\ No newline at end of file
+void sackResponseHandler(struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state);
+
+#endif
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <android/log.h>
+#include "test_fusion.hpp"
+#include "packet_meta.hpp"
+
+struct fusion_run {
+    uint32_t source, destination;
+    uint16_t dst_port;
+    uint8_t reserved;
+    struct fusion_result *result;
+};
+
+static int countMarkers(uint8_t markers)
+{
+    int count = 0;
+    for (; markers != 0; markers &= markers - 1)
+        count++;
+    return count;
+}
+
+// Whether the echo shows the field of a marker changed on a packet
+static bool markerChanged(const struct header_diff *diff, uint8_t packet, uint8_t marker)
+{
+    static const uint8_t option_kinds[ECHO_MARKERS] = {0, 0, 0, TCPOPT_MAXSEG, TCPOPT_SACK_PERMITTED,
+        TCPOPT_TIMESTAMP, TCPOPT_WINDOW};
+    int index = 0;
+    while ((1 << index) != marker)
+        index++;
+    for (size_t c = 0; c < diff->changes.size(); c++) {
+        const struct header_change &change = diff->changes[c];
+        if (change.packet != packet)
+            continue;
+        if ((marker == ECHO_ACK && change.field == hf_ack) || (marker == ECHO_URG && change.field == hf_urg)
+                || (marker == ECHO_RESERVED && change.field == hf_reserved))
+            return true;
+        if ((change.field == hf_option_removed || change.field == hf_option_changed)
+                && change.option == option_kinds[index] && option_kinds[index] != 0)
+            return true;
+    }
+    return false;
+}
+
+// One SYN with the given markers
+// return   true if the headers were echoed, the markers are sorted then
+static bool sendFused(struct fusion_run *run, uint8_t markers)
+{
+    struct fusion_result *result = run->result;
+    struct header_diff diff;
+    struct fusion_probe probe = {markers, test_failed, false};
+    probe.result = runTest_header_echo(run->source, 0, run->destination, run->dst_port, markers,
+        run->reserved, false, &diff);
+    probe.echoed = diff.echoed;
+    result->probes.push_back(probe);
+    result->connections++;
+    LOGD("Fused SYN %02X: %s", markers, diff.echoed ? "echoed" : diff.synack ? "no echo" : "no SYNACK");
+    if (!diff.echoed)
+        return false;
+    for (uint8_t marker = 1; marker <= ECHO_WSCALE; marker <<= 1) {
+        if (!(markers & marker))
+            continue;
+        if (markerChanged(&diff, hp_syn, marker)) {
+            result->changed |= marker;
+            continue;
+        }
+        result->intact |= marker;
+        // Set on the SYNACK as received, so its way back is tested too
+        if (marker == ECHO_URG || marker == ECHO_RESERVED) {
+            result->down_tested |= marker;
+            if (markerChanged(&diff, hp_synack, marker))
+                result->down_changed |= marker;
+        }
+    }
+    return true;
+}
+
+// A SYN with these markers has not been answered: find the ones it was lost for
+static void splitMarkers(struct fusion_run *run, uint8_t markers)
+{
+    if (countMarkers(markers) == 1) {
+        run->result->blocked |= markers;
+        return;
+    }
+    uint8_t first = 0;
+    int half = (countMarkers(markers) + 1) / 2;
+    for (uint8_t marker = 1; half > 0; marker <<= 1)
+        if (markers & marker) {
+            first |= marker;
+            half--;
+        }
+    uint8_t second = markers & ~first;
+    bool first_through = sendFused(run, first);
+    if (!first_through)
+        splitMarkers(run, first);
+    // Something in the second half is to blame
+    if (first_through && countMarkers(second) == 1) {
+        run->result->blocked |= second;
+        run->result->inferred |= second;
+        return;
+    }
+    if (!sendFused(run, second))
+        splitMarkers(run, second);
+}
+
+test_error runTest_fusion(uint32_t source, uint32_t destination, uint16_t dst_port,
+            uint8_t markers, uint8_t reserved, struct fusion_result *result)
+{
+    uint64_t start = monotonicNanos();
+    result->markers = markers & ECHO_ALL;
+    result->intact = result->changed = result->blocked = result->inferred = 0;
+    result->down_tested = result->down_changed = 0;
+    result->connections = 0;
+    result->probes.clear();
+    struct fusion_run run = {source, destination, dst_port, (uint8_t) (reserved & 0xF ? reserved & 0xF : 0xF), result};
+
+    test_error verdict = success;
+    if (!sendFused(&run, result->markers)) {
+        // Lost for the markers, or for anything
+        if (sendFused(&run, 0)) {
+            splitMarkers(&run, result->markers);
+        } else {
+            verdict = result->probes.back().result;
+            if (verdict == success)
+                verdict = test_failed;
+        }
+    }
+    result->elapsed_us = (monotonicNanos() - start) / 1000;
+    LOGI("Fusion of %02X: intact %02X, changed %02X, blocked %02X (%02X inferred), down %02X of %02X changed, "
+        "%u connections", result->markers, result->intact, result->changed, result->blocked, result->inferred,
+        result->down_changed, result->down_tested, result->connections);
+    if (verdict != success)
+        return verdict;
+    return result->changed || result->blocked || result->down_changed ? test_failed : success;
+}
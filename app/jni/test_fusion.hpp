@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <vector>
+
+#include "header_diff.hpp"
+
+#ifndef TEST_FUSION
+#define TEST_FUSION
+
+// Test fusion: the ACK field, URG pointer, reserved bits and SYN options
+// carry the markers of different tests, but do not get in each other's way,
+// so one header echo (header_diff.hpp) with all of them tests them all at
+// once: a marker changed on the way shows in the echo. Only a SYN that is
+// not answered at all leaves open which marker it was lost for. Then a SYN
+// without any markers is sent, and if it gets through, the markers are
+// split in halves and each half sent on, down to single markers (adaptive
+// group testing): with one marker blocked, about 2 log2(n) + 2 connections
+// instead of n. Where the first half gets through and the second holds a
+// single marker, that one is taken for blocked without sending it.
+// Fusion SYNs are sent regardless of the test planner, which does not tell
+// the options apart.
+
+// Every SYN sent
+struct fusion_probe {
+    uint8_t markers;
+    test_error result;
+    bool echoed;
+};
+
+// Bits are ECHO_* markers
+struct fusion_result {
+    uint8_t markers;            // tested
+    uint8_t intact;             // reached the reflector unchanged
+    uint8_t changed;            // reached it rewritten
+    uint8_t blocked;            // a SYN carrying it alone is not answered
+    uint8_t inferred;           // blocked, without a SYN of its own
+    // URG pointer and reserved bits the reflector set on its SYNACK as it
+    // received them, and those changed on the way back
+    uint8_t down_tested, down_changed;
+    uint8_t connections;
+    uint64_t elapsed_us;
+    std::vector<struct fusion_probe> probes;
+};
+
+// param markers    ECHO_* bits, ECHO_RESERVED sets reserved (all four bits if 0)
+// return   success if every marker got through unchanged both ways,
+//          test_failed if any was changed or blocked, and the error of the
+//          SYN without markers if that is not answered either
+test_error runTest_fusion(uint32_t source, uint32_t destination, uint16_t dst_port,
+            uint8_t markers, uint8_t reserved, struct fusion_result *result);
+
+#endif
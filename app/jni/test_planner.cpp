@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <string.h>
+#include <pthread.h>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <android/log.h>
+#include "util.hpp"
+#include "test_planner.hpp"
+#include "packet_view.hpp"
+#include "event_loop.hpp"
+
+#ifndef TAG
+#define TAG "TCPTester-planner"
+#endif
+
+struct lost_syn {
+    uint16_t features;
+    uint64_t until_ms;
+};
+
+struct planner_state {
+    pthread_mutex_t lock;
+    bool disabled;
+    // (destination, port) -> features of the SYNs lost there
+    std::map<std::pair<uint32_t, uint16_t>, std::vector<struct lost_syn> > lost;
+};
+
+static struct planner_state planner = {PTHREAD_MUTEX_INITIALIZER};
+
+// Everything the tests change in their SYNs beyond the plain SYN, see
+// addSynExtras and the proxy tests' options
+static const struct {
+    const char *test;
+    const char *prerequisite;
+} prerequisites[] = {
+    {"ack_only", "plain_urg"},
+    {"urg_only", "plain_urg"},
+    {"reserved_syn", "plain_urg"},
+    {"reserved_est", "plain_urg"},
+    {"proxy_sack_gap", "plain_urg"},
+    {"proxy_timestamping", "plain_urg"},
+    {"ack_urg", "ack_only"},
+    {"ack_data", "ack_only"},
+    {"ack_checksum_incorrect", "ack_only"},
+    {"ack_checksum", "ack_only"},
+    {"ack_checksum_incorrect_seq", "ack_only"},
+    {"urg_urg", "urg_only"},
+    {"urg_checksum", "urg_only"},
+    {"urg_checksum_incorrect", "urg_only"},
+};
+
+uint16_t synFeatures(const struct iphdr *ip, const struct tcphdr *tcp)
+{
+    uint16_t features = (tcp->res1 & 0xF) << 4;
+    if (tcp->ack_seq != 0)
+        features |= syn_ack_field;
+    if (tcp->urg_ptr != 0)
+        features |= syn_urg_field;
+    struct packet_view view;
+    if (!viewPacket(ip, tcp, &view))
+        return features | syn_option_malformed;
+    struct tcp_option_view option;
+    uint16_t offset = 0;
+    while (nextTcpOption(&view, &offset, &option)) {
+        switch (option.kind) {
+            case TCPOPT_MAXSEG: features |= syn_option_mss; break;
+            case TCPOPT_WINDOW: features |= syn_option_wscale; break;
+            case TCPOPT_SACK_PERMITTED: features |= syn_option_sack; break;
+            case TCPOPT_TIMESTAMP: features |= syn_option_timestamp; break;
+            default: features |= syn_option_other; break;
+        }
+    }
+    return features;
+}
+
+static bool isSubset(uint16_t features, uint16_t of)
+{
+    return (features & of) == features;
+}
+
+void plannerSynLost(uint32_t destination, uint16_t dst_port, uint16_t features)
+{
+    pthread_mutex_lock(&planner.lock);
+    std::vector<struct lost_syn> &lost = planner.lost[std::make_pair(destination, dst_port)];
+    uint64_t until = monotonicMillis() + PLANNER_MEMORY_MS;
+    bool found = false;
+    for (size_t i = 0; i < lost.size(); i++) {
+        if (lost[i].features == features) {
+            lost[i].until_ms = until;
+            found = true;
+        }
+    }
+    if (!found) {
+        struct lost_syn syn = {features, until};
+        lost.push_back(syn);
+    }
+    pthread_mutex_unlock(&planner.lock);
+    LOGD("SYN 0x%04x to port %u lost", features, dst_port);
+}
+
+void plannerSynAnswered(uint32_t destination, uint16_t dst_port, uint16_t features)
+{
+    pthread_mutex_lock(&planner.lock);
+    std::map<std::pair<uint32_t, uint16_t>, std::vector<struct lost_syn> >::iterator it =
+        planner.lost.find(std::make_pair(destination, dst_port));
+    if (it != planner.lost.end()) {
+        std::vector<struct lost_syn> &lost = it->second;
+        for (size_t i = 0; i < lost.size();) {
+            // Whatever was lost with fewer features got through now
+            if (isSubset(lost[i].features, features)) {
+                lost[i] = lost.back();
+                lost.pop_back();
+            } else {
+                i++;
+            }
+        }
+        if (lost.empty())
+            planner.lost.erase(it);
+    }
+    pthread_mutex_unlock(&planner.lock);
+}
+
+bool plannerInferLost(uint32_t destination, uint16_t dst_port, uint16_t features)
+{
+    bool inferred = false;
+    pthread_mutex_lock(&planner.lock);
+    std::map<std::pair<uint32_t, uint16_t>, std::vector<struct lost_syn> >::iterator it =
+        planner.lost.find(std::make_pair(destination, dst_port));
+    if (!planner.disabled && it != planner.lost.end()) {
+        uint64_t now = monotonicMillis();
+        std::vector<struct lost_syn> &lost = it->second;
+        for (size_t i = 0; i < lost.size();) {
+            if (lost[i].until_ms <= now) {
+                lost[i] = lost.back();
+                lost.pop_back();
+                continue;
+            }
+            if (isSubset(lost[i].features, features))
+                inferred = true;
+            i++;
+        }
+        if (lost.empty())
+            planner.lost.erase(it);
+    }
+    pthread_mutex_unlock(&planner.lock);
+    return inferred;
+}
+
+void plannerEnable(bool enabled)
+{
+    pthread_mutex_lock(&planner.lock);
+    planner.disabled = !enabled;
+    pthread_mutex_unlock(&planner.lock);
+}
+
+void plannerReset()
+{
+    pthread_mutex_lock(&planner.lock);
+    planner.lost.clear();
+    pthread_mutex_unlock(&planner.lock);
+}
+
+const char *plannerPrerequisite(const char *test)
+{
+    for (size_t i = 0; i < sizeof(prerequisites) / sizeof(prerequisites[0]); i++)
+        if (strcmp(prerequisites[i].test, test) == 0)
+            return prerequisites[i].prerequisite;
+    return NULL;
+}
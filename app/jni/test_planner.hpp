@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+
+#ifndef TEST_PLANNER
+#define TEST_PLANNER
+
+// Test planner: most tests differ from each other only in what their SYN
+// carries (the ACK field, the URG pointer, reserved bits, options), so once
+// a SYN got no SYNACK on a port, all retransmissions included, any later
+// SYN to that port carrying the same things and more will not get one
+// either. Such tests are not run, but reported as test_inferred right away
+// instead of timing out again. What was lost is remembered per destination
+// and port for PLANNER_MEMORY_MS; a SYNACK to a SYN with the same or more
+// features forgets it again. Thread safe.
+//
+// For schedulers, plannerPrerequisite() names the test whose SYN has a
+// subset of a test's SYN features, so that it can be run first.
+
+#define PLANNER_MEMORY_MS (5 * 60 * 1000)
+
+// What a SYN carries beyond a plain SYN, the reserved bits and the option
+// kinds one by one: SYNs with different options are no subset of each other
+enum syn_feature : uint16_t {
+    syn_ack_field = 0x0001,     // ACK field without the ACK flag
+    syn_urg_field = 0x0002,     // URG pointer without the URG flag
+    syn_reserved = 0x00F0,      // the 4 reserved bits, shifted
+    syn_option_mss = 0x0100,
+    syn_option_wscale = 0x0200,
+    syn_option_sack = 0x0400,   // SACK permitted
+    syn_option_timestamp = 0x0800,
+    syn_option_other = 0x1000,  // any other kind
+    syn_option_malformed = 0x2000
+};
+
+uint16_t synFeatures(const struct iphdr *ip, const struct tcphdr *tcp);
+
+// A SYN with these features to destination and port (host byte order) has
+// not been answered, retransmissions included
+void plannerSynLost(uint32_t destination, uint16_t dst_port, uint16_t features);
+// ... or has been answered with a SYNACK
+void plannerSynAnswered(uint32_t destination, uint16_t dst_port, uint16_t features);
+// return   true if a SYN with these features is known not to get through:
+//          one with a subset of them has been lost
+bool plannerInferLost(uint32_t destination, uint16_t dst_port, uint16_t features);
+
+// Inference is on by default; off, every test is run
+void plannerEnable(bool enabled);
+void plannerReset();
+
+// return   name of the test to run before the named one, NULL if none
+const char *plannerPrerequisite(const char *test);
+
+#endif
@@ -15,8 +15,15 @@
  */
 
 #include <android/log.h>
+#include <algorithm>
 #include <functional>
+#include <pthread.h>
 #include "testsuite.hpp"
+#include "proxy_testsuite.hpp"
+#include "pacer.hpp"
+#include "probe_engine.hpp"
+#include "port_allocator.hpp"
+#include "packet_view.hpp"
 
 using namespace std::placeholders;
 
@@ -24,6 +31,7 @@ using namespace std::placeholders;
 // setsockopt calls for:
 //      - allowing to manipulate full packet down to IP layer (IPPROTO_IP, IP_HDRINCL)
 //      - timeout on recv'ing packets (SOL_SOCKET, SO_RCVTIMEO)
+//      - departure times of paced packets (SOL_SOCKET, SO_TXTIME), if enabled
 // param sock       socket as reference
 test_error setupSocket(int &sock) {
     sock = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
@@ -37,6 +45,8 @@ test_error setupSocket(int &sock) {
     int on = 1;
     if (setsockopt(sock, IPPROTO_IP, IP_HDRINCL, &on, sizeof(on)) == -1) {
         LOGE("setsockopt() failed: %s", strerror(errno));
+        close(sock);
+        sock = -1;
         return test_failed;
     } else {
         LOGD("setsockopt IP_HDRINCL ok");
@@ -51,6 +61,7 @@ test_error setupSocket(int &sock) {
         LOGD("setsockopt timeout ok");
     }
 
+    pacerSetupSocket(sock);
     return success;
 }
 
@@ -94,8 +105,11 @@ test_error checkTcpSynAck(uint16_t synack_urg, uint16_t synack_check, uint8_t sy
             char *synack_payload, uint16_t synack_length, 
             struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state) 
 {
-    if (synack_urg != 0 && ntohs(tcp->urg_ptr) != synack_urg) {
-        LOGE("SYNACK packet expected urg %04X, got: %04X", synack_urg, ntohs(tcp->urg_ptr));
+    struct packet_view view;
+    if (!viewPacket(ip, tcp, &view))
+        return invalid_packet;
+    if (synack_urg != 0 && view.urg_ptr != synack_urg) {
+        LOGE("SYNACK packet expected urg %04X, got: %04X", synack_urg, view.urg_ptr);
         return synack_error_urg;
     }
     if (synack_check != 0) {
@@ -106,20 +120,17 @@ test_error checkTcpSynAck(uint16_t synack_urg, uint16_t synack_check, uint8_t sy
             return synack_error_check;
         }
     }
-    if (synack_res != 0 && synack_res != (tcp->res1 & 0xF) ) {
-        LOGE("SYNACK packet expected res %02X, got: %02X", synack_res, (tcp->res1 & 0xF));
+    if (synack_res != 0 && synack_res != view.res) {
+        LOGE("SYNACK packet expected res %02X, got: %02X", synack_res, view.res);
         return synack_error_res;
     }
 
-    char *data = (char*) ip + IPHDRLEN + tcp->doff * 4;
-    uint16_t datalen = 0;
-    uint16_t data_read = ntohs(ip->tot_len) - IPHDRLEN - tcp->doff * 4;
     if (synack_length > 0) {
-        if (data_read != synack_length) {
+        if (view.payload_length != synack_length) {
             LOGD("SYNACK data_read different than expected");
             return synack_error_data_length;
         }
-        else if (memcmp(data, synack_payload, synack_length) != 0) {
+        else if (memcmp(view.payload, synack_payload, synack_length) != 0) {
             LOGD("SYNACK data different than expected");
             return synack_error_data;
         }
@@ -136,8 +147,11 @@ test_error checkTcpSynAck_np(uint16_t synack_urg, uint16_t synack_check, uint8_t
 test_error checkData(char *expect_payload, uint16_t expect_length, 
             struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state) 
 {
-    int receiveLength = ntohs(ip->tot_len) - IPHDRLEN - tcp->doff*4;
-    char *data = (char *) ip + IPHDRLEN + tcp->doff*4;
+    struct packet_view view;
+    if (!viewPacket(ip, tcp, &view))
+        return invalid_packet;
+    int receiveLength = view.payload_length;
+    char *data = (char*) view.payload;
     if (expect_length != receiveLength) {
         return receive_error_data_length;
     } else if (memcmp(data, expect_payload, expect_length) != 0) {
@@ -153,14 +167,69 @@ test_error checkData(char *expect_payload, uint16_t expect_length,
 }
 
 test_error checkRes(uint8_t res, struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state) {
-    if (tcp->res1 != (res & 0xF)) {
-        LOGE("Data packet reserved field wrong value: %02X, expected %02X", tcp->res1, res & 0xF);
+    struct packet_view view;
+    if (!viewPacket(ip, tcp, &view))
+        return invalid_packet;
+    if (view.res != (res & 0xF)) {
+        LOGE("Data packet reserved field wrong value: %02X, expected %02X", view.res, res & 0xF);
         return receive_error_res_value;
     } else {
         return success;
     }
 }
 
+test_definition makeTestDefinition(packetModifier fn_synExtras, packetChecker fn_checkTcpSynAck,
+            packetModifier fn_makeRequest, packetChecker fn_checkResponse)
+{
+    std::queue<std::pair<packetModifier, packetChecker> > stepSequence;
+    stepSequence.push(std::make_pair(fn_makeRequest, fn_checkResponse));
+    return makeTestDefinition(fn_synExtras, fn_checkTcpSynAck, stepSequence);
+}
+
+test_definition makeTestDefinition(packetModifier fn_synExtras, packetChecker fn_checkTcpSynAck,
+            std::queue<std::pair<packetModifier, packetChecker> > stepSequence)
+{
+    test_definition test;
+    test.fn_synExtras = fn_synExtras;
+    test.fn_checkTcpSynAck = fn_checkTcpSynAck;
+    test.stepSequence = stepSequence;
+    test.infer = true;
+    return test;
+}
+
+static const struct test_entry test_table[] = {
+    {"ack_only", defineTest_ack_only},
+    {"urg_only", defineTest_urg_only},
+    {"ack_urg", defineTest_ack_urg},
+    {"plain_urg", defineTest_plain_urg},
+    {"ack_data", defineTest_ack_data},
+    {"ack_checksum_incorrect", defineTest_ack_checksum_incorrect},
+    {"ack_checksum_incorrect_seq", defineTest_ack_checksum_incorrect_seq},
+    {"ack_checksum", defineTest_ack_checksum},
+    {"urg_urg", defineTest_urg_urg},
+    {"urg_checksum", defineTest_urg_checksum},
+    {"urg_checksum_incorrect", defineTest_urg_checksum_incorrect},
+    {"reserved_syn", defineTest_reserved_syn},
+    {"reserved_est", defineTest_reserved_est},
+    {"proxy_sack_gap", defineTest_sackGap},
+    {"proxy_timestamping", defineTest_timestamping},
+};
+
+const struct test_entry *findTest(const char *name)
+{
+    for (size_t i = 0; i < sizeof(test_table) / sizeof(test_table[0]); i++) {
+        if (strcmp(test_table[i].name, name) == 0)
+            return &test_table[i];
+    }
+    return NULL;
+}
+
+const struct test_entry *allTests(size_t *count)
+{
+    *count = sizeof(test_table) / sizeof(test_table[0]);
+    return test_table;
+}
+
 // Generic function for running any test. Takes all parameters and runs the rest of the functions:
 //      1. Sets up a new socket
 //      2. Performs the parametrised three-way handshake
@@ -168,137 +237,51 @@ test_error checkRes(uint8_t res, struct iphdr *ip, struct tcphdr *tcp, struct tc
 //      4. Expects a specific data response back (returns error code if the result doesn't match)
 //      5. ACKs the received data
 //      6. Cleanly shuts down the connection
+// The test runs as the only probe of a probe engine on its own event loop,
+// see probe_engine.hpp for the timeouts.
 //
 // return   test_failed or test_complete codes depending on the outcome
 test_error runTest(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port,
             packetModifier fn_synExtras, packetChecker fn_checkTcpSynAck, 
             packetModifier fn_makeRequest, packetChecker fn_checkResponse)
 {
-    std::queue<std::pair<packetModifier, packetChecker> > stepSequence;
-    stepSequence.push(std::make_pair(fn_makeRequest, fn_checkResponse));
-    return runTest(source, src_port, destination, dst_port, fn_synExtras, fn_checkTcpSynAck, stepSequence);
+    return runTest(source, src_port, destination, dst_port,
+        makeTestDefinition(fn_synExtras, fn_checkTcpSynAck, fn_makeRequest, fn_checkResponse));
 }
 test_error runTest(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port,
             packetModifier fn_synExtras, packetChecker fn_checkTcpSynAck, 
             std::queue<std::pair<packetModifier, packetChecker> > stepSequence)
 {
-    int sock;
-    char buffer[BUFLEN] = {0};
-    struct iphdr *ip;
-    struct tcphdr *tcp;
-    struct tcp_opt state;
-    struct tcp_opt *conn_state = &state;
-    struct sockaddr_in src, dst;
-    ip = (struct iphdr*) buffer;
-    tcp = (struct tcphdr*) (buffer + IPHDRLEN);
-
-    if (setupSocket(sock) != success) {
-        LOGE("Socket setup failed: %s", strerror(errno));
-        return test_failed;
-    }
-
-    src.sin_family = AF_INET;
-    src.sin_port = htons(src_port);
-    src.sin_addr.s_addr = htonl(source);
-    dst.sin_family = AF_INET;
-    dst.sin_port = htons(dst_port);
-    dst.sin_addr.s_addr = htonl(destination);
-
-    test_error handshake_ret = handshake(sock, ip, tcp, conn_state, &src, &dst, fn_synExtras, fn_checkTcpSynAck);
-
-    if (handshake_ret != success) {
-        LOGE("TCP handshake failed: %s", strerror(errno));
-        return handshake_ret;
-    } else {
-        LOGD("TCP handshake successful");
-    }
-
-    char dataBuffer[BUFLEN] = {0};
-    uint32_t remote_isn = conn_state->rcv_nxt;
-    conn_state->sack_ok = 0;
-    int step = 0;
-    while (!stepSequence.empty()) {
-        std::pair<packetModifier, packetChecker> operations = stepSequence.front();
-        packetModifier f_makeRequest = operations.first;
-        packetChecker f_checkResponse = operations.second;
-    
-        LOGD("STEP %d: Send request", step);
-        buildTcpAck(&src, &dst, ip, tcp, conn_state->snd_nxt, conn_state->rcv_nxt);
-        uint32_t ts_timestamp = std::chrono::duration_cast<std::chrono::milliseconds>
-            (std::chrono::system_clock::now().time_since_epoch()).count();
-        conn_state->rcv_tsval = ts_timestamp;
-        appendTimestamp(ip, tcp, conn_state);
-        f_makeRequest(ip, tcp, conn_state);
-        sendPacket(sock, buffer, &dst, ntohs(ip->tot_len));
-
-        test_error ret = success;
-        uint16_t receiveLength;
-        uint16_t receiveDataLength = 0;
-        uint16_t newDataLength = 0;
-        bool anythingReceived = false;
-        // Receive packets until there is a packet with data or we timeout
-        LOGD("STEP %d: Receive response", step);
-        while ( !(receiveDataLength > 0) ) {
-            test_error ret_receive = receivePacket(sock, ip, tcp, &dst, &src);
-            receiveLength = ntohs(ip->tot_len);
-            if (ret_receive != success){
-                if (!anythingReceived) {
-                    // Absolutely nothing has been received as a response to this packet
-                    // assume failure
-                    LOGD("STEP %d: Failure receiving any response", step);
-                    return ret_receive;
-                } else {
-                    LOGD("STEP %d: Received an empty response", step);
-                    // A packet (presumably an ACK has been received previously, but no data - fail softly)
-                    break;
-                }
-            } 
-            receiveDataLength = receiveLength - IPHDRLEN - tcp->doff * 4;
-            anythingReceived = true;
-            LOGD("STEP %d: check for timestamp option", step);
-            hasTcpOption(TCPOPT_TIMESTAMP, ip, tcp, conn_state);
-            // Advance own acknowledged data
-            if (ntohl(tcp->ack_seq) > conn_state->snd_nxt)
-                conn_state->snd_nxt = ntohl(tcp->ack_seq);
-        }
-        
-        // Continuous block received and adds new data
-        if (ntohl(tcp->seq) <= conn_state->rcv_nxt && conn_state->rcv_nxt < ntohl(tcp->seq) + receiveDataLength + 1)
-            conn_state->rcv_nxt = ntohl(tcp->seq) + receiveDataLength;
-
-        LOGD("STEP %d: Check response", step);
-        // apply any custom checks to the response
-        ret = f_checkResponse(ip, tcp, conn_state);
-        sackResponseHandler(ip, tcp, conn_state);
-        // If response is expected or at least acceptable
-        if (ret == success || ret == response_acceptable) {
-            LOGD("STEP %d: Saving %d bytes of data", step, receiveDataLength);
-            char *payload = (char*) (buffer + IPHDRLEN + tcp->doff * 4);
-            memcpy(payload, dataBuffer + ntohl(tcp->seq) - remote_isn, receiveDataLength);
-        } else {
-            // Test failed - response not acceptable
-            LOGD("STEP %d: Test failed, response not acceptable", step);
-            return ret;
-        }
+    return runTest(source, src_port, destination, dst_port,
+        makeTestDefinition(fn_synExtras, fn_checkTcpSynAck, stepSequence));
+}
+// The whole definition is handed on, flags like infer included
+test_error runTest(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port,
+            test_definition test)
+{
+    struct event_loop loop;
+    struct probe_engine engine;
+    test_error result = test_failed;
 
-        // And if there was any data, ACK
-        if (receiveDataLength > 0) {
-            LOGD("STEP %d: Acknowledging data", step);
-            buildTcpAck(&src, &dst, ip, tcp, conn_state->snd_nxt, conn_state->rcv_nxt);
-            appendSackBlock(ip, tcp, conn_state);
-            appendTimestamp(ip, tcp, conn_state);
-            sendPacket(sock, buffer, &dst, ntohs(ip->tot_len));
-        }
-        stepSequence.pop();
-        step++;
+    if (!eventLoopInit(&loop))
+        return test_failed;
+    if (!probeEngineInit(&engine, &loop)) {
+        eventLoopClose(&loop);
+        return test_failed;
     }
-
-    shutdownConnection(&src, &dst, sock, ip, tcp, conn_state->snd_nxt, conn_state->rcv_nxt);
-
-    return success;
+    probeStart(&engine, source, src_port, destination, dst_port, test, NULL,
+        [&](test_error probe_result, const struct probe_timing *timing) {
+            result = probe_result;
+            eventLoopStop(&loop);
+        });
+    if (probesInFlight(&engine) > 0)
+        eventLoopRun(&loop);
+    probeEngineClose(&engine);
+    eventLoopClose(&loop);
+    return result;
 }
 
-test_error runTest_ack_only(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+test_definition defineTest_ack_only(uint8_t reserved)
 {
     uint32_t syn_ack = 0xbeef0001;
     uint16_t syn_urg = 0;
@@ -307,10 +290,10 @@ test_error runTest_ack_only(uint32_t source, uint16_t src_port, uint32_t destina
     uint16_t synack_check = 0;
     uint8_t synack_res = 0;
     
-    char send_payload[] = "HELLO_0xbeef0001";
+    static char send_payload[] = "HELLO_0xbeef0001";
     int send_length = strlen(send_payload);
     uint16_t expect_length = 4;
-    char expect_payload[] = { (char) ((syn_ack >> 8*3) & 0xFF), (char) ((syn_ack >> 8*2) & 0xFF),
+    static char expect_payload[] = { (char) ((syn_ack >> 8*3) & 0xFF), (char) ((syn_ack >> 8*2) & 0xFF),
         (char) ((syn_ack >> 8*1) & 0xFF), (char) (syn_ack & 0xFF)};
 
     packetModifier fn_synExtras = std::bind(addSynExtras, syn_ack, syn_urg, syn_res, _1, _2, _3);
@@ -318,11 +301,15 @@ test_error runTest_ack_only(uint32_t source, uint16_t src_port, uint32_t destina
     packetModifier fn_appendData = std::bind(appendData, send_payload, send_length, _1, _2);
     packetChecker fn_checkData = std::bind(checkData, expect_payload, expect_length, _1, _2, _3);
     
-    return runTest(source, src_port, destination, dst_port,
-        fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
+    return makeTestDefinition(fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
 }
 
-test_error runTest_urg_only(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+test_error runTest_ack_only(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+{
+    return runTest(source, src_port, destination, dst_port, defineTest_ack_only(0));
+}
+
+test_definition defineTest_urg_only(uint8_t reserved)
 {
     uint32_t syn_ack = 0;
     uint16_t syn_urg = 0xbe02;
@@ -331,21 +318,25 @@ test_error runTest_urg_only(uint32_t source, uint16_t src_port, uint32_t destina
     uint16_t synack_check = 0;
     uint8_t synack_res = 0;
     
-    char send_payload[] = "HELLO_0xbe02";
+    static char send_payload[] = "HELLO_0xbe02";
     int send_length = strlen(send_payload);
     uint16_t expect_length = 2;
-    char expect_payload[] = {(char) ((syn_urg >> 8) & 0xFF), (char) (syn_urg & 0xFF)};
+    static char expect_payload[] = {(char) ((syn_urg >> 8) & 0xFF), (char) (syn_urg & 0xFF)};
 
     packetModifier fn_synExtras = std::bind(addSynExtras, syn_ack, syn_urg, syn_res, _1, _2, _3);
     packetChecker fn_checkTcpSynAck = std::bind(checkTcpSynAck_np, synack_urg, synack_check, synack_res, _1, _2, _3);
     packetModifier fn_appendData = std::bind(appendData, send_payload, send_length, _1, _2);
     packetChecker fn_checkData = std::bind(checkData, expect_payload, expect_length, _1, _2, _3);
     
-    return runTest(source, src_port, destination, dst_port,
-        fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
+    return makeTestDefinition(fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
 }
 
-test_error runTest_ack_urg(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+test_error runTest_urg_only(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+{
+    return runTest(source, src_port, destination, dst_port, defineTest_urg_only(0));
+}
+
+test_definition defineTest_ack_urg(uint8_t reserved)
 {
     uint32_t syn_ack = 0xbeef0003;
     uint16_t syn_urg = 0;
@@ -354,9 +345,9 @@ test_error runTest_ack_urg(uint32_t source, uint16_t src_port, uint32_t destinat
     uint16_t synack_check = 0;
     uint8_t synack_res = 0;
     
-    char send_payload[] = "HELLO_0xbe03";
+    static char send_payload[] = "HELLO_0xbe03";
     int send_length = strlen(send_payload);
-    char expect_payload[] = "OLLEH";
+    static char expect_payload[] = "OLLEH";
     uint16_t expect_length = strlen(expect_payload);
     
     packetModifier fn_synExtras = std::bind(addSynExtras, syn_ack, syn_urg, syn_res, _1, _2, _3);
@@ -364,11 +355,15 @@ test_error runTest_ack_urg(uint32_t source, uint16_t src_port, uint32_t destinat
     packetModifier fn_appendData = std::bind(appendData, send_payload, send_length, _1, _2);
     packetChecker fn_checkData = std::bind(checkData, expect_payload, expect_length, _1, _2, _3);
     
-    return runTest(source, src_port, destination, dst_port,
-        fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
+    return makeTestDefinition(fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
 }
 
-test_error runTest_plain_urg(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+test_error runTest_ack_urg(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+{
+    return runTest(source, src_port, destination, dst_port, defineTest_ack_urg(0));
+}
+
+test_definition defineTest_plain_urg(uint8_t reserved)
 {
     uint32_t syn_ack = 0;
     uint16_t syn_urg = 0;
@@ -377,9 +372,9 @@ test_error runTest_plain_urg(uint32_t source, uint16_t src_port, uint32_t destin
     uint16_t synack_check = 0;
     uint8_t synack_res = 0;
     
-    char send_payload[] = "HELLO_0xbe04";
+    static char send_payload[] = "HELLO_0xbe04";
     int send_length = strlen(send_payload);
-    char expect_payload[] = "OLLEH";
+    static char expect_payload[] = "OLLEH";
     int expect_length = strlen(expect_payload);
     
     packetModifier fn_synExtras = std::bind(addSynExtras, syn_ack, syn_urg, syn_res, _1, _2, _3);
@@ -387,24 +382,28 @@ test_error runTest_plain_urg(uint32_t source, uint16_t src_port, uint32_t destin
     packetModifier fn_appendData = std::bind(appendData, send_payload, send_length, _1, _2);
     packetChecker fn_checkData = std::bind(checkData, expect_payload, expect_length, _1, _2, _3);
     
-    return runTest(source, src_port, destination, dst_port,
-        fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
+    return makeTestDefinition(fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
 }
 
-test_error runTest_ack_data(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+test_error runTest_plain_urg(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+{
+    return runTest(source, src_port, destination, dst_port, defineTest_plain_urg(0));
+}
+
+test_definition defineTest_ack_data(uint8_t reserved)
 {
     uint32_t syn_ack = 0xbeef000B;
     uint16_t syn_urg = 0;
     uint8_t syn_res = 0;
     uint16_t synack_urg = 0;
     uint16_t synack_check = 0;
-    char synack_payload[] = "0B";
+    static char synack_payload[] = "0B";
     int synack_length = 2;
     uint8_t synack_res = 0;
     
-    char send_payload[] = "HELLO_0xbeef000B";
+    static char send_payload[] = "HELLO_0xbeef000B";
     int send_length = strlen(send_payload);
-    char expect_payload[] = "OLLEH";
+    static char expect_payload[] = "OLLEH";
     int expect_length = strlen(expect_payload);
     
     packetModifier fn_synExtras = std::bind(addSynExtras, syn_ack, syn_urg, syn_res, _1, _2, _3);
@@ -412,11 +411,15 @@ test_error runTest_ack_data(uint32_t source, uint16_t src_port, uint32_t destina
     packetModifier fn_appendData = std::bind(appendData, send_payload, send_length, _1, _2);
     packetChecker fn_checkData = std::bind(checkData, expect_payload, expect_length, _1, _2, _3);
     
-    return runTest(source, src_port, destination, dst_port,
-        fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
+    return makeTestDefinition(fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
 }
 
-test_error runTest_ack_checksum_incorrect(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+test_error runTest_ack_data(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+{
+    return runTest(source, src_port, destination, dst_port, defineTest_ack_data(0));
+}
+
+test_definition defineTest_ack_checksum_incorrect(uint8_t reserved)
 {
     uint32_t syn_ack = 0xbeef0005;
     uint16_t syn_urg = 0;
@@ -425,9 +428,9 @@ test_error runTest_ack_checksum_incorrect(uint32_t source, uint16_t src_port, ui
     uint16_t synack_check = 0xbeef;
     uint8_t synack_res = 0;
     
-    char send_payload[] = "HELLO_0xbeef0005";
+    static char send_payload[] = "HELLO_0xbeef0005";
     int send_length = strlen(send_payload);
-    char expect_payload[] = "OLLEH";
+    static char expect_payload[] = "OLLEH";
     int expect_length = strlen(expect_payload);
     
     packetModifier fn_synExtras = std::bind(addSynExtras, syn_ack, syn_urg, syn_res, _1, _2, _3);
@@ -435,11 +438,15 @@ test_error runTest_ack_checksum_incorrect(uint32_t source, uint16_t src_port, ui
     packetModifier fn_appendData = std::bind(appendData, send_payload, send_length, _1, _2);
     packetChecker fn_checkData = std::bind(checkData, expect_payload, expect_length, _1, _2, _3);
     
-    return runTest(source, src_port, destination, dst_port,
-        fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
+    return makeTestDefinition(fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
 }
 
-test_error runTest_ack_checksum_incorrect_seq(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+test_error runTest_ack_checksum_incorrect(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+{
+    return runTest(source, src_port, destination, dst_port, defineTest_ack_checksum_incorrect(0));
+}
+
+test_definition defineTest_ack_checksum_incorrect_seq(uint8_t reserved)
 {
     uint32_t syn_ack = 0xbeef000D;
     uint16_t syn_urg = 0;
@@ -449,9 +456,9 @@ test_error runTest_ack_checksum_incorrect_seq(uint32_t source, uint16_t src_port
     uint16_t synack_check = 0xbeee;
     uint8_t synack_res = 0;
     
-    char send_payload[] = "HELLO_0xbeef000D";
+    static char send_payload[] = "HELLO_0xbeef000D";
     int send_length = strlen(send_payload);
-    char expect_payload[] = "OLLEH";
+    static char expect_payload[] = "OLLEH";
     int expect_length = strlen(expect_payload);
     
     packetModifier fn_synExtras = std::bind(addSynExtras, syn_ack, syn_urg, syn_res, _1, _2, _3);
@@ -459,11 +466,15 @@ test_error runTest_ack_checksum_incorrect_seq(uint32_t source, uint16_t src_port
     packetModifier fn_appendData = std::bind(appendData, send_payload, send_length, _1, _2);
     packetChecker fn_checkData = std::bind(checkData, expect_payload, expect_length, _1, _2, _3);
     
-    return runTest(source, src_port, destination, dst_port,
-        fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
+    return makeTestDefinition(fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
 }
 
-test_error runTest_ack_checksum(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+test_error runTest_ack_checksum_incorrect_seq(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+{
+    return runTest(source, src_port, destination, dst_port, defineTest_ack_checksum_incorrect_seq(0));
+}
+
+test_definition defineTest_ack_checksum(uint8_t reserved)
 {
     uint32_t syn_ack = 0xbeef0006;
     uint16_t syn_urg = 0;
@@ -472,9 +483,9 @@ test_error runTest_ack_checksum(uint32_t source, uint16_t src_port, uint32_t des
     uint16_t synack_check = 0xbeef;
     uint8_t synack_res = 0;
     
-    char send_payload[] = "HELLO_0xbeef0006";
+    static char send_payload[] = "HELLO_0xbeef0006";
     int send_length = strlen(send_payload);
-    char expect_payload[] = "OLLEH";
+    static char expect_payload[] = "OLLEH";
     int expect_length = strlen(expect_payload);
     
     packetModifier fn_synExtras = std::bind(addSynExtras, syn_ack, syn_urg, syn_res, _1, _2, _3);
@@ -482,11 +493,15 @@ test_error runTest_ack_checksum(uint32_t source, uint16_t src_port, uint32_t des
     packetModifier fn_appendData = std::bind(appendData, send_payload, send_length, _1, _2);
     packetChecker fn_checkData = std::bind(checkData, expect_payload, expect_length, _1, _2, _3);
     
-    return runTest(source, src_port, destination, dst_port,
-        fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
+    return makeTestDefinition(fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
 }
 
-test_error runTest_urg_urg(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+test_error runTest_ack_checksum(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+{
+    return runTest(source, src_port, destination, dst_port, defineTest_ack_checksum(0));
+}
+
+test_definition defineTest_urg_urg(uint8_t reserved)
 {
     uint32_t syn_ack = 0;
     uint16_t syn_urg = 0xbe07;
@@ -495,9 +510,9 @@ test_error runTest_urg_urg(uint32_t source, uint16_t src_port, uint32_t destinat
     uint16_t synack_check = 0;
     uint8_t synack_res = 0;
     
-    char send_payload[] = "HELLO_0xbe07";
+    static char send_payload[] = "HELLO_0xbe07";
     int send_length = strlen(send_payload);
-    char expect_payload[] = "OLLEH";
+    static char expect_payload[] = "OLLEH";
     int expect_length = strlen(expect_payload);
     
     packetModifier fn_synExtras = std::bind(addSynExtras, syn_ack, syn_urg, syn_res, _1, _2, _3);
@@ -505,11 +520,15 @@ test_error runTest_urg_urg(uint32_t source, uint16_t src_port, uint32_t destinat
     packetModifier fn_appendData = std::bind(appendData, send_payload, send_length, _1, _2);
     packetChecker fn_checkData = std::bind(checkData, expect_payload, expect_length, _1, _2, _3);
     
-    return runTest(source, src_port, destination, dst_port,
-        fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
+    return makeTestDefinition(fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
 }
 
-test_error runTest_urg_checksum(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+test_error runTest_urg_urg(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+{
+    return runTest(source, src_port, destination, dst_port, defineTest_urg_urg(0));
+}
+
+test_definition defineTest_urg_checksum(uint8_t reserved)
 {
     uint32_t syn_ack = 0;
     uint16_t syn_urg = 0xbe08;
@@ -518,9 +537,9 @@ test_error runTest_urg_checksum(uint32_t source, uint16_t src_port, uint32_t des
     uint16_t synack_check = 0xbeef;
     uint8_t synack_res = 0;
     
-    char send_payload[] = "HELLO_0xbe08";
+    static char send_payload[] = "HELLO_0xbe08";
     int send_length = strlen(send_payload);
-    char expect_payload[] = "OLLEH";
+    static char expect_payload[] = "OLLEH";
     int expect_length = strlen(expect_payload);
     
     packetModifier fn_synExtras = std::bind(addSynExtras, syn_ack, syn_urg, syn_res, _1, _2, _3);
@@ -528,11 +547,15 @@ test_error runTest_urg_checksum(uint32_t source, uint16_t src_port, uint32_t des
     packetModifier fn_appendData = std::bind(appendData, send_payload, send_length, _1, _2);
     packetChecker fn_checkData = std::bind(checkData, expect_payload, expect_length, _1, _2, _3);
     
-    return runTest(source, src_port, destination, dst_port,
-        fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
+    return makeTestDefinition(fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
 }
 
-test_error runTest_urg_checksum_incorrect(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+test_error runTest_urg_checksum(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+{
+    return runTest(source, src_port, destination, dst_port, defineTest_urg_checksum(0));
+}
+
+test_definition defineTest_urg_checksum_incorrect(uint8_t reserved)
 {
     uint32_t syn_ack = 0;
     uint16_t syn_urg = 0xbe09;
@@ -541,9 +564,9 @@ test_error runTest_urg_checksum_incorrect(uint32_t source, uint16_t src_port, ui
     uint16_t synack_check = 0xbeef;
     uint8_t synack_res = 0;
     
-    char send_payload[] = "HELLO_0xbe09";
+    static char send_payload[] = "HELLO_0xbe09";
     int send_length = strlen(send_payload);
-    char expect_payload[] = "OLLEH";
+    static char expect_payload[] = "OLLEH";
     int expect_length = strlen(expect_payload);
     
     packetModifier fn_synExtras = std::bind(addSynExtras, syn_ack, syn_urg, syn_res, _1, _2, _3);
@@ -551,20 +574,24 @@ test_error runTest_urg_checksum_incorrect(uint32_t source, uint16_t src_port, ui
     packetModifier fn_appendData = std::bind(appendData, send_payload, send_length, _1, _2);
     packetChecker fn_checkData = std::bind(checkData, expect_payload, expect_length, _1, _2, _3);
     
-    return runTest(source, src_port, destination, dst_port,
-        fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
+    return makeTestDefinition(fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
 }
 
-test_error runTest_reserved_syn(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port, uint8_t reserved)
+test_error runTest_urg_checksum_incorrect(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+{
+    return runTest(source, src_port, destination, dst_port, defineTest_urg_checksum_incorrect(0));
+}
+
+test_definition defineTest_reserved_syn(uint8_t reserved)
 {
     uint32_t syn_ack = 0;
     uint16_t syn_urg = 0;
     uint16_t synack_urg = 0;
     uint16_t synack_check = 0;
 
-    char send_payload[] = "HELLO_reserved_SYN";
+    static char send_payload[] = "HELLO_reserved_SYN";
     int send_length = strlen(send_payload);
-    char expect_payload[] = "OLLEH";
+    static char expect_payload[] = "OLLEH";
     int expect_length = strlen(expect_payload);
 
     packetModifier fn_synExtras = std::bind(addSynExtras, syn_ack, syn_urg, reserved, _1, _2, _3);
@@ -572,11 +599,15 @@ test_error runTest_reserved_syn(uint32_t source, uint16_t src_port, uint32_t des
     packetModifier fn_appendData = std::bind(appendData, send_payload, send_length, _1, _2);
     packetChecker fn_checkData = std::bind(checkData, expect_payload, expect_length, _1, _2, _3);
     
-    return runTest(source, src_port, destination, dst_port,
-        fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
+    return makeTestDefinition(fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
 }
 
-test_error runTest_reserved_est(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port, uint8_t reserved)
+test_error runTest_reserved_syn(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port, uint8_t reserved)
+{
+    return runTest(source, src_port, destination, dst_port, defineTest_reserved_syn(reserved));
+}
+
+test_definition defineTest_reserved_est(uint8_t reserved)
 {
     uint32_t syn_ack = 0;
     uint16_t syn_urg = 0;
@@ -585,9 +616,9 @@ test_error runTest_reserved_est(uint32_t source, uint16_t src_port, uint32_t des
     uint8_t syn_res = 0;
     uint8_t synack_res = 0;
     
-    char send_payload[] = "HELLO_reserved_EST";
+    static char send_payload[] = "HELLO_reserved_EST";
     int send_length = strlen(send_payload);
-    char expect_payload[] = "OLLEH";
+    static char expect_payload[] = "OLLEH";
     int expect_length = strlen(expect_payload);
 
     packetModifier fn_synExtras = std::bind(addSynExtras, syn_ack, syn_urg, syn_res, _1, _2, _3);
@@ -601,6 +632,206 @@ test_error runTest_reserved_est(uint32_t source, uint16_t src_port, uint32_t des
     packetChecker fn_checkRes = std::bind(checkRes, reserved, _1, _2, _3);
     packetChecker fn_checkResponse = std::bind(concatPacketCheckers, fn_checkData, fn_checkRes, _1, _2, _3);
     
-    return runTest(source, src_port, destination, dst_port,
-        fn_synExtras, fn_checkTcpSynAck, fn_appendData, fn_checkData);
-}
\ No newline at end of file
+    return makeTestDefinition(fn_synExtras, fn_checkTcpSynAck, fn_makeRequest, fn_checkResponse);
+}
+
+test_error runTest_reserved_est(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port, uint8_t reserved)
+{
+    return runTest(source, src_port, destination, dst_port, defineTest_reserved_est(reserved));
+}
+
+// One probe of the reserved bitmap: what came back for the bits it sent
+struct reserved_probe {
+    uint8_t bits;
+    char request[7];            // GETRES and the bits to set on the reply
+    test_error result;
+    bool synack;
+    uint8_t synack_res;
+    bool report;                // the reflector's report arrived
+    uint8_t syn_res_seen;       // by the reflector
+    uint8_t data_res_seen;
+    uint8_t response_res;
+};
+
+// Bits are recorded, never a reason to fail
+static test_error recordSynAckRes(struct reserved_probe *probe, struct iphdr *ip, struct tcphdr *tcp,
+            struct tcp_opt *conn_state)
+{
+    probe->synack = true;
+    probe->synack_res = tcp->res1;
+    return success;
+}
+
+// RES, then the reserved bits of the SYN and of the request as they reached the reflector
+static test_error recordReservedReport(struct reserved_probe *probe, struct iphdr *ip, struct tcphdr *tcp,
+            struct tcp_opt *conn_state)
+{
+    struct packet_view view;
+    if (!viewPacket(ip, tcp, &view))
+        return invalid_packet;
+    const char *data = view.payload;
+    if (view.payload_length != 5 || memcmp(data, "RES", 3) != 0) {
+        LOGE("GETRES response length %u", view.payload_length);
+        return receive_error_data;
+    }
+    probe->report = true;
+    probe->syn_res_seen = data[3] & 0xF;
+    probe->data_res_seen = data[4] & 0xF;
+    probe->response_res = view.res;
+    return success;
+}
+
+static void addReservedProbe(struct reserved_bitmap *bitmap, const struct reserved_probe *probe)
+{
+    uint8_t bits = probe->bits;
+    bitmap->tested |= bits << RESERVED_SYN_UP;
+    if (!probe->synack)
+        return;
+    // Without the report, the bits echoed on the SYNACK got through both ways
+    uint8_t reached = probe->report ? probe->syn_res_seen & bits : probe->synack_res & bits;
+    bitmap->survived |= reached << RESERVED_SYN_UP;
+    bitmap->tested |= reached << RESERVED_SYN_DOWN;
+    bitmap->survived |= (probe->synack_res & reached) << RESERVED_SYN_DOWN;
+    bitmap->tested |= bits << RESERVED_EST_UP;
+    if (!probe->report)
+        return;
+    bitmap->survived |= (probe->data_res_seen & bits) << RESERVED_EST_UP;
+    bitmap->tested |= bits << RESERVED_EST_DOWN;
+    bitmap->survived |= (probe->response_res & bits) << RESERVED_EST_DOWN;
+}
+
+test_error runTest_reserved_bitmap(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port,
+            const std::vector<uint8_t> &combinations, struct reserved_bitmap *bitmap)
+{
+    std::vector<uint8_t> values;
+    for (uint8_t bit = 1; bit <= 8; bit <<= 1)
+        values.push_back(bit);
+    values.push_back(0xF);
+    for (size_t i = 0; i < combinations.size(); i++) {
+        uint8_t value = combinations[i] & 0xF;
+        if (value != 0 && std::find(values.begin(), values.end(), value) == values.end())
+            values.push_back(value);
+    }
+    bitmap->survived = bitmap->tested = 0;
+
+    struct event_loop loop;
+    struct probe_engine engine;
+    if (!eventLoopInit(&loop))
+        return test_failed;
+    if (!probeEngineInit(&engine, &loop)) {
+        eventLoopClose(&loop);
+        return test_failed;
+    }
+    std::vector<struct reserved_probe> probes(values.size());
+    std::vector<uint16_t> allocated;
+    size_t started = 0, done = 0;
+    for (size_t i = 0; i < values.size(); i++) {
+        struct reserved_probe *probe = &probes[i];
+        memset(probe, 0, sizeof(*probe));
+        probe->bits = values[i];
+        probe->result = test_failed;
+        memcpy(probe->request, "GETRES", 6);
+        probe->request[6] = probe->bits;
+        // All in parallel, so every one but the first on a port of its own
+        uint16_t port = src_port;
+        if (i > 0 || src_port == 0) {
+            port = allocatePort();
+            if (port == 0)
+                break;
+            allocated.push_back(port);
+        }
+        packetModifier fn_synExtras = std::bind(addSynExtras, 0, 0, probe->bits, _1, _2, _3);
+        packetChecker fn_checkTcpSynAck = std::bind(recordSynAckRes, probe, _1, _2, _3);
+        packetModifier fn_setRes = std::bind(setRes, probe->bits, _1, _2, _3);
+        packetModifier fn_appendData = std::bind(appendData, probe->request, sizeof(probe->request), _1, _2);
+        packetModifier fn_makeRequest = std::bind(concatPacketModifiers, fn_setRes, fn_appendData, _1, _2, _3);
+        packetChecker fn_checkResponse = std::bind(recordReservedReport, probe, _1, _2, _3);
+        started++;
+        if (!probeStart(&engine, source, port, destination, dst_port,
+                    makeTestDefinition(fn_synExtras, fn_checkTcpSynAck, fn_makeRequest, fn_checkResponse), NULL,
+                    [&, probe](test_error probe_result, const struct probe_timing *timing) {
+                        probe->result = probe_result;
+                        if (++done == started)
+                            eventLoopStop(&loop);
+                    }))
+            done++;
+    }
+    if (done < started)
+        eventLoopRun(&loop);
+    probeEngineClose(&engine);
+    eventLoopClose(&loop);
+    for (size_t i = 0; i < allocated.size(); i++)
+        releasePort(allocated[i]);
+
+    test_error result = started == values.size() ? success : test_failed;
+    for (size_t i = 0; i < started; i++) {
+        addReservedProbe(bitmap, &probes[i]);
+        LOGD("Reserved bits %X: %s", probes[i].bits, probes[i].report ? "reported" :
+            probes[i].synack ? "no report" : "no SYNACK");
+        if (result == success && probes[i].result != success)
+            result = probes[i].result;
+    }
+    LOGI("Reserved bits surviving %04X of %04X", bitmap->survived, bitmap->tested);
+    return result;
+}
+
+static pthread_mutex_t global_address_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t global_address = 0;
+
+uint32_t globalAddress()
+{
+    pthread_mutex_lock(&global_address_lock);
+    uint32_t address = global_address;
+    pthread_mutex_unlock(&global_address_lock);
+    return address;
+}
+
+void learnGlobalAddress(uint32_t address)
+{
+    pthread_mutex_lock(&global_address_lock);
+    if (address != global_address) {
+        struct in_addr in;
+        in.s_addr = htonl(address);
+        LOGI("Global address %s", inet_ntoa(in));
+        global_address = address;
+    }
+    pthread_mutex_unlock(&global_address_lock);
+}
+
+// The probe engine has learnt the address from the echo already, no need
+// to go any further
+static test_error checkAddressEcho(struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state)
+{
+    uint32_t address;
+    uint16_t port;
+    return readAddressEcho(ip, tcp, &address, &port) ? test_complete : success;
+}
+
+static test_error checkMyIp(struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state)
+{
+    struct packet_view view;
+    if (!viewPacket(ip, tcp, &view))
+        return invalid_packet;
+    if (view.payload_length != sizeof(uint32_t)) {
+        LOGE("GETMYIP response length %u", view.payload_length);
+        return receive_error_data_length;
+    }
+    uint32_t address;
+    memcpy(&address, view.payload, sizeof(address));
+    learnGlobalAddress(ntohl(address));
+    return success;
+}
+
+uint32_t getOwnIp(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port)
+{
+    uint32_t address = globalAddress();
+    if (address != 0)
+        return address;
+
+    static char send_payload[] = "GETMYIP";
+    packetModifier fn_synExtras = std::bind(addSynExtras, 0, 0, 0, _1, _2, _3);
+    packetModifier fn_appendData = std::bind(appendData, send_payload, strlen(send_payload), _1, _2);
+    runTest(source, src_port, destination, dst_port,
+        makeTestDefinition(fn_synExtras, checkAddressEcho, fn_appendData, checkMyIp));
+    return globalAddress();
+}
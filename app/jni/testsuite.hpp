@@ -29,6 +29,7 @@
 #include <chrono>
 #include <list>
 #include <queue>
+#include <vector>
 
 #include "tcp_basic.hpp"
 #include "util.hpp"
@@ -46,6 +47,48 @@
 
 test_error setupSocket(int &sock);
 
+// Everything that makes up a test: the SYN modifications, the SYNACK checks
+// and the request/response steps once connected. Payloads bound into the
+// functions are static, so definitions can be kept and evaluated later
+// (e.g. by the replay engine against recorded packets). With infer false
+// the SYN is sent even where the test planner infers it will be lost.
+struct test_definition {
+    packetModifier fn_synExtras;
+    packetChecker fn_checkTcpSynAck;
+    std::queue<std::pair<packetModifier, packetChecker> > stepSequence;
+    bool infer;
+};
+
+test_definition makeTestDefinition(packetModifier fn_synExtras, packetChecker fn_checkTcpSynAck,
+            packetModifier fn_makeRequest, packetChecker fn_checkResponse);
+test_definition makeTestDefinition(packetModifier fn_synExtras, packetChecker fn_checkTcpSynAck,
+            std::queue<std::pair<packetModifier, packetChecker> > stepSequence);
+
+// Test table, names as used in the packet capture comments
+struct test_entry {
+    const char *name;
+    test_definition (*define)(uint8_t reserved);
+};
+
+// return   the test with the given name, NULL if there is none
+const struct test_entry *findTest(const char *name);
+// Every test findTest knows, count of them in count
+const struct test_entry *allTests(size_t *count);
+
+test_definition defineTest_ack_only(uint8_t reserved);
+test_definition defineTest_urg_only(uint8_t reserved);
+test_definition defineTest_ack_urg(uint8_t reserved);
+test_definition defineTest_plain_urg(uint8_t reserved);
+test_definition defineTest_ack_data(uint8_t reserved);
+test_definition defineTest_ack_checksum_incorrect(uint8_t reserved);
+test_definition defineTest_ack_checksum_incorrect_seq(uint8_t reserved);
+test_definition defineTest_ack_checksum(uint8_t reserved);
+test_definition defineTest_urg_urg(uint8_t reserved);
+test_definition defineTest_urg_checksum(uint8_t reserved);
+test_definition defineTest_urg_checksum_incorrect(uint8_t reserved);
+test_definition defineTest_reserved_syn(uint8_t reserved);
+test_definition defineTest_reserved_est(uint8_t reserved);
+
 // Test sending a specific value in the ACK field of a TCP SYN packet, nothing else changed.
 // ACK is set to 0xbeef0001 (opcode), once connection is established, payload contains this value
 // IFF the received SYN had ACK set to 0xbeef0001
@@ -80,14 +123,38 @@ test_error runTest_urg_urg(uint32_t source, uint16_t src_port, uint32_t destinat
 test_error runTest_urg_checksum(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port);
 // URG = 0xbe09
 test_error runTest_urg_checksum_incorrect(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port);
-// Testing whether packets with reserved bits set go through with the bits set during the handshake
-// Currently only successful if setting every one of them individually succeeds
+// Testing whether packets with reserved bits set go through with the bits set during the handshake:
+// successful if the SYNACK echoes exactly the reserved value sent on the SYN
 test_error runTest_reserved_syn(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port, uint8_t reserved);
-// Testing whether packets with reserved bits set go through with the bits set during data transmission/acking
-// Currently only successful if setting every one of them individually succeeds
-// returns test_complete_complex_bits + bitmap of the passed bits
+// Testing whether packets with reserved bits set go through with the bits set during data transmission/acking:
+// successful if the response to a request with the reserved value carries it back
 test_error runTest_reserved_est(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port, uint8_t reserved);
 
+// Reserved bits getting through, one nibble per direction and phase, bit n
+// of a nibble standing for reserved bit n (tcphdr.res1)
+#define RESERVED_SYN_UP 0
+#define RESERVED_SYN_DOWN 4
+#define RESERVED_EST_UP 8
+#define RESERVED_EST_DOWN 12
+
+struct reserved_bitmap {
+    uint16_t survived;
+    uint16_t tested;            // bits there was a packet to tell from
+};
+
+// All reserved bits at once: a probe for every single bit, one with all
+// four and one for each of the given combinations, in parallel on their
+// own source ports (src_port for the first, the rest from the port
+// allocator). Every probe sets its bits on the SYN and on a GETRES
+// request, which the reflector answers with the bits it saw on both and
+// sets the requested bits on the reply itself, so the uplink and downlink
+// of each phase are told apart. A bit survives if it got through on any
+// probe; downlink bits of the handshake are only tested where the uplink
+// let them through, as the SYNACK echoes what reached the reflector.
+// return   success if every probe completed, the bitmap is filled in regardless
+test_error runTest_reserved_bitmap(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port,
+            const std::vector<uint8_t> &combinations, struct reserved_bitmap *bitmap);
+
 test_error checkTcpSynAck_np(uint16_t synack_urg, uint16_t synack_check, uint8_t synack_res,  
             struct iphdr *ip, struct tcphdr *tcp, struct tcp_opt *conn_state);
 test_error checkTcpSynAck(uint16_t synack_urg, uint16_t synack_check, uint8_t synack_res, 
@@ -102,7 +169,19 @@ test_error runTest(uint32_t source, uint16_t src_port, uint32_t destination, uin
             packetModifier fn_synExtras, packetChecker fn_checkTcpSynAck, 
             std::queue<std::pair<packetModifier, packetChecker> > stepSequence);
 
+test_error runTest(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port,
+            test_definition test);
+
+// Global (externally visible) address of this host, host byte order.
+// Learnt for the session from the reflector's address echo on the SYNACK
+// of any test, see TCPOPT_ADDRESS_ECHO; if no test has run yet, a probe
+// is sent: one RTT if the echo gets through, otherwise the GETMYIP request
+// is answered with the address once connected.
+// return   0 if it could not be found
 uint32_t getOwnIp(uint32_t source, uint16_t src_port, uint32_t destination, uint16_t dst_port);
+// The global address known so far, 0 if none
+uint32_t globalAddress();
+void learnGlobalAddress(uint32_t address);
 
 #endif
 
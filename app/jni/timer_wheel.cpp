@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "timer_wheel.hpp"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_MAX_DELTA ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+static inline bool slotEmpty(const struct wheel_timer *head)
+{
+    return head->next == head;
+}
+
+static inline void unlinkTimer(struct wheel_timer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+// Put an unlinked timer in the slot of its expiry time, not earlier than
+// the given tick
+static void placeTimer(struct timer_wheel *wheel, struct wheel_timer *timer, uint64_t earliest)
+{
+    uint64_t expires = timer->expires;
+    if (expires < earliest)
+        expires = earliest;
+    uint64_t delta = expires - wheel->now;
+    if (delta > WHEEL_MAX_DELTA) {
+        delta = WHEEL_MAX_DELTA;
+        expires = wheel->now + delta;
+    }
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1))))
+        level++;
+    struct wheel_timer *head = &wheel->slots[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+void timerWheelInit(struct timer_wheel *wheel, uint64_t now)
+{
+    wheel->now = now;
+    wheel->armed = 0;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+            struct wheel_timer *head = &wheel->slots[level][slot];
+            head->next = head->prev = head;
+        }
+    }
+}
+
+void timerInit(struct wheel_timer *timer, std::function<void()> fn_expired)
+{
+    timer->next = timer->prev = NULL;
+    timer->expires = 0;
+    timer->fn_expired = fn_expired;
+}
+
+void timerArm(struct timer_wheel *wheel, struct wheel_timer *timer, uint64_t expires)
+{
+    if (timer->next != NULL)
+        unlinkTimer(timer);
+    else
+        wheel->armed++;
+    timer->expires = expires;
+    // The current tick has been handled already
+    placeTimer(wheel, timer, wheel->now + 1);
+}
+
+void timerCancel(struct timer_wheel *wheel, struct wheel_timer *timer)
+{
+    if (timer->next == NULL)
+        return;
+    unlinkTimer(timer);
+    wheel->armed--;
+}
+
+bool timerArmed(const struct wheel_timer *timer)
+{
+    return timer->next != NULL;
+}
+
+// Re-place all timers of a slot of an upper level, they all expire within
+// the next turn of the level below
+static void cascade(struct timer_wheel *wheel, int level)
+{
+    struct wheel_timer *head = &wheel->slots[level][(wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    struct wheel_timer pending;
+    if (slotEmpty(head))
+        return;
+    // Detach the list first, placing may put timers back in the same slot
+    pending.next = head->next;
+    pending.prev = head->prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    head->next = head->prev = head;
+    while (!slotEmpty(&pending)) {
+        struct wheel_timer *timer = pending.next;
+        unlinkTimer(timer);
+        // Cascading happens before the current tick is handled
+        placeTimer(wheel, timer, wheel->now);
+    }
+}
+
+void timerWheelAdvance(struct timer_wheel *wheel, uint64_t now)
+{
+    while (wheel->now < now) {
+        if (wheel->armed == 0) {
+            wheel->now = now;
+            break;
+        }
+        wheel->now++;
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if ((wheel->now & ((1ULL << (WHEEL_BITS * level)) - 1)) != 0)
+                break;
+            cascade(wheel, level);
+        }
+        struct wheel_timer *head = &wheel->slots[0][wheel->now & WHEEL_MASK];
+        while (!slotEmpty(head)) {
+            struct wheel_timer *timer = head->next;
+            unlinkTimer(timer);
+            wheel->armed--;
+            timer->fn_expired();
+        }
+    }
+}
+
+int64_t timerWheelTimeout(const struct timer_wheel *wheel)
+{
+    if (wheel->armed == 0)
+        return -1;
+    // Timers due within this turn of the first wheel
+    for (uint64_t tick = wheel->now + 1; ; tick++) {
+        if (!slotEmpty(&wheel->slots[0][tick & WHEEL_MASK]))
+            return tick - wheel->now;
+        // Upper levels are cascaded when the first wheel wraps
+        if ((tick & WHEEL_MASK) == 0)
+            return tick - wheel->now;
+    }
+}
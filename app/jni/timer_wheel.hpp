@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+
+#ifndef TIMER_WHEEL
+#define TIMER_WHEEL
+
+// Hierarchical timer wheel: WHEEL_LEVELS wheels of WHEEL_SLOTS slots, the
+// first one a slot per tick, every next one a slot per full turn of the
+// previous. Timers are kept in intrusive doubly linked lists, so arming and
+// cancelling are O(1); a timer is moved down a level when its slot comes up.
+// Ticks are milliseconds of the monotonic clock (see event_loop.hpp), timers
+// further than WHEEL_SLOTS^WHEEL_LEVELS ticks out (~4.6h) fire at that limit.
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+struct wheel_timer {
+    struct wheel_timer *next;   // NULL while the timer is not armed
+    struct wheel_timer *prev;
+    uint64_t expires;
+    std::function<void()> fn_expired;
+};
+
+struct timer_wheel {
+    uint64_t now;
+    size_t armed;
+    struct wheel_timer slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+void timerWheelInit(struct timer_wheel *wheel, uint64_t now);
+
+// Set the function called when the timer fires. The timer must not be armed
+void timerInit(struct wheel_timer *timer, std::function<void()> fn_expired);
+// (Re)arm the timer to fire at the given tick, or on the next one if that
+// has passed
+void timerArm(struct timer_wheel *wheel, struct wheel_timer *timer, uint64_t expires);
+// Disarm the timer, does nothing if it is not armed
+void timerCancel(struct timer_wheel *wheel, struct wheel_timer *timer);
+bool timerArmed(const struct wheel_timer *timer);
+
+// Move the wheel forward to the given tick, firing every timer that
+// expires on the way. Timers may be armed and cancelled from fn_expired
+void timerWheelAdvance(struct timer_wheel *wheel, uint64_t now);
+// return   ticks until the wheel next has to be advanced, -1 if no timer is
+//          armed. Not later than the first expiry, but may be earlier when
+//          timers have to be moved down a level
+int64_t timerWheelTimeout(const struct timer_wheel *wheel);
+
+#endif
@@ -0,0 +1,387 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <netinet/in.h>
+#include <netinet/ip_icmp.h>
+#include <sys/epoll.h>
+#include <functional>
+#include <map>
+
+#include <android/log.h>
+#include "ttl_locate.hpp"
+#include "event_loop.hpp"
+#include "packet_capture.hpp"
+#include "packet_meta.hpp"
+#include "port_allocator.hpp"
+#include "packet_view.hpp"
+#include "socket_pool.hpp"
+
+struct locate_probe {
+    uint8_t ttl;
+    uint16_t src_port;
+    std::vector<char> syn;
+    uint64_t sent_us;
+};
+
+struct locate_run {
+    struct event_loop loop;
+    int sock;                   // raw TCP, sends the SYNs and sees the SYNACKs
+    int icmp;
+    struct sockaddr_in dst;
+    test_definition test;
+    std::vector<struct locate_probe> probes;   // by TTL - 1
+    std::map<uint16_t, int> by_port;            // source port -> probe
+    std::vector<struct locate_hop> *hops;
+    struct locate_result *result;
+    bool synack_checked;
+    int tries;
+    struct wheel_timer timer;
+    std::vector<char> buffer;
+};
+
+static uint64_t nowMicros()
+{
+    return monotonicNanos() / 1000;
+}
+
+static void sendProbe(struct locate_run *run, struct locate_probe *probe)
+{
+    probe->sent_us = nowMicros();
+    if (sendPacket(run->sock, &probe->syn[0], &run->dst, probe->syn.size()) != success)
+        LOGE("SYN with TTL %u not sent", probe->ttl);
+}
+
+// Fields of the SYN sent that a quote of length bytes of its TCP header
+// covers, and which of them it shows changed
+static void compareQuote(const struct tcphdr *sent, const uint8_t *quote, int length,
+            uint8_t *tested, uint8_t *changed)
+{
+    const uint8_t *syn = (const uint8_t*) sent;
+    int header_length = sent->doff * 4;
+    *tested = 0;
+    *changed = 0;
+    if (length >= 8) {
+        *tested |= LOCATE_SEQ;
+        if (memcmp(syn + 4, quote + 4, 4) != 0)
+            *changed |= LOCATE_SEQ;
+    }
+    if (length >= 12) {
+        *tested |= LOCATE_ACK;
+        if (memcmp(syn + 8, quote + 8, 4) != 0)
+            *changed |= LOCATE_ACK;
+    }
+    if (length >= 14) {
+        // Data offset and reserved bits, then the flags
+        *tested |= LOCATE_RESERVED | LOCATE_FLAGS;
+        if ((syn[12] & 0x0F) != (quote[12] & 0x0F))
+            *changed |= LOCATE_RESERVED;
+        if (syn[13] != quote[13])
+            *changed |= LOCATE_FLAGS;
+    }
+    if (length >= 16) {
+        *tested |= LOCATE_WINDOW;
+        if (memcmp(syn + 14, quote + 14, 2) != 0)
+            *changed |= LOCATE_WINDOW;
+    }
+    if (length >= 20) {
+        *tested |= LOCATE_URG;
+        if (memcmp(syn + 18, quote + 18, 2) != 0)
+            *changed |= LOCATE_URG;
+    }
+    // A different header length is an option rewrite, even where the
+    // quote stops before the options
+    if (length >= 13 && (syn[12] >> 4) != (quote[12] >> 4)) {
+        *tested |= LOCATE_OPTIONS;
+        *changed |= LOCATE_OPTIONS;
+    } else if (length >= header_length) {
+        *tested |= LOCATE_OPTIONS;
+        if (memcmp(syn + TCPHDRLEN, quote + TCPHDRLEN, header_length - TCPHDRLEN) != 0)
+            *changed |= LOCATE_OPTIONS;
+    }
+}
+
+static void receiveIcmp(struct locate_run *run)
+{
+    char *buffer = &run->buffer[0];
+    while (true) {
+        int length = recv(run->icmp, buffer, BUFLEN, MSG_DONTWAIT);
+        if (length == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                LOGE("ICMP recv() failed: %s", strerror(errno));
+            if (errno != EINTR)
+                return;
+            continue;
+        }
+        struct iphdr *ip = (struct iphdr*) buffer;
+        if (length < (int) IPHDRLEN || length < ip->ihl * 4 + ICMP_MINLEN + (int) IPHDRLEN)
+            continue;
+        uint8_t *icmp = (uint8_t*) buffer + ip->ihl * 4;
+        if (icmp[0] != ICMP_TIME_EXCEEDED && icmp[0] != ICMP_DEST_UNREACH)
+            continue;
+        // The quoted datagram, cut short where RFC 4884 extensions follow it
+        struct iphdr *quoted_ip = (struct iphdr*) (icmp + ICMP_MINLEN);
+        int quoted = length - ip->ihl * 4 - ICMP_MINLEN;
+        if (icmp[5] != 0 && icmp[5] * 4 < quoted)
+            quoted = icmp[5] * 4;
+        if (ntohs(quoted_ip->tot_len) < quoted)
+            quoted = ntohs(quoted_ip->tot_len);
+        quoted -= quoted_ip->ihl * 4;
+        const uint8_t *quote = (const uint8_t*) quoted_ip + quoted_ip->ihl * 4;
+        const struct tcphdr *quoted_tcp = (const struct tcphdr*) quote;
+        if (quoted < 4 || quoted_ip->protocol != IPPROTO_TCP
+                || quoted_ip->daddr != run->dst.sin_addr.s_addr || quoted_tcp->dest != run->dst.sin_port)
+            continue;
+        std::map<uint16_t, int>::iterator it = run->by_port.find(ntohs(quoted_tcp->source));
+        if (it == run->by_port.end())
+            continue;
+        struct locate_probe *probe = &run->probes[it->second];
+        struct locate_hop *hop = &(*run->hops)[it->second];
+        if (hop->address != 0)
+            continue;
+        capturePacket(capture_inbound, buffer, length);
+        hop->address = ntohl(ip->saddr);
+        hop->icmp_type = icmp[0];
+        hop->icmp_code = icmp[1];
+        hop->quoted = quoted;
+        hop->rtt_us = nowMicros() - probe->sent_us;
+        compareQuote((const struct tcphdr*) (&probe->syn[0] + IPHDRLEN), quote, quoted,
+            &hop->tested, &hop->changed);
+        LOGD("TTL %u: %08x, ICMP %u/%u, %d bytes of TCP quoted, changed 0x%02x of 0x%02x", hop->ttl,
+            hop->address, hop->icmp_type, hop->icmp_code, quoted, hop->changed, hop->tested);
+    }
+}
+
+// SYNACKs and RSTs of the reflector: the TTL reached it. The first SYNACK
+// is checked like the test would, then reset.
+static void receiveTcp(struct locate_run *run)
+{
+    char *buffer = &run->buffer[0];
+    struct packet_view view;
+    while (true) {
+        int length = recv(run->sock, buffer, BUFLEN - PHDRLEN - 1, MSG_DONTWAIT);
+        if (length == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                LOGE("recv() failed: %s", strerror(errno));
+            if (errno != EINTR)
+                return;
+            continue;
+        }
+        struct iphdr *ip = (struct iphdr*) buffer;
+        struct tcphdr *tcp = (struct tcphdr*) (buffer + IPHDRLEN);
+        if (!viewPacket(buffer, length, &view) || view.ip_header_length != IPHDRLEN
+                || ip->saddr != run->dst.sin_addr.s_addr || tcp->source != run->dst.sin_port)
+            continue;
+        std::map<uint16_t, int>::iterator it = run->by_port.find(view.dest);
+        if (it == run->by_port.end() || !(tcp->rst || (tcp->syn && tcp->ack)))
+            continue;
+        capturePacket(capture_inbound, buffer, view.length);
+        struct locate_probe *probe = &run->probes[it->second];
+        struct locate_hop *hop = &(*run->hops)[it->second];
+        if (!hop->reflector) {
+            hop->reflector = true;
+            hop->rtt_us = nowMicros() - probe->sent_us;
+        }
+        if (run->result->path_length == 0 || probe->ttl < run->result->path_length)
+            run->result->path_length = probe->ttl;
+        if (tcp->rst)
+            continue;
+
+        struct iphdr *syn_ip = (struct iphdr*) &probe->syn[0];
+        struct tcphdr *syn_tcp = (struct tcphdr*) (&probe->syn[0] + IPHDRLEN);
+        struct tcp_opt conn_state;
+        memset(&conn_state, 0, sizeof(conn_state));
+        conn_state.snd_nxt = ntohl(syn_tcp->seq) + 1;
+        conn_state.rcv_nxt = view.seq + 1;
+        if (!run->synack_checked) {
+            run->synack_checked = true;
+            if (view.ack_seq != conn_state.snd_nxt)
+                run->result->verdict = ack_error;
+            else
+                run->result->verdict = run->test.fn_checkTcpSynAck(ip, tcp, &conn_state);
+        }
+        struct sockaddr_in src;
+        memset(&src, 0, sizeof(src));
+        src.sin_family = AF_INET;
+        src.sin_addr.s_addr = syn_ip->saddr;
+        src.sin_port = syn_tcp->source;
+        buildTcpRst(&src, &run->dst, ip, tcp, conn_state.snd_nxt, conn_state.rcv_nxt, 0, 0);
+        sendPacket(run->sock, buffer, &run->dst, ntohs(ip->tot_len));
+    }
+}
+
+// Still waiting for: every TTL short of the reflector, all of them as
+// long as it has not been reached
+static bool waiting(struct locate_run *run, int index)
+{
+    const struct locate_hop *hop = &(*run->hops)[index];
+    uint8_t path_length = run->result->path_length;
+    return hop->address == 0 && !hop->reflector && (path_length == 0 || hop->ttl < path_length);
+}
+
+static void roundExpired(struct locate_run *run)
+{
+    int silent = 0;
+    for (size_t i = 0; i < run->probes.size(); i++)
+        silent += waiting(run, i);
+    if (silent == 0 || ++run->tries >= LOCATE_TRIES) {
+        eventLoopStop(&run->loop);
+        return;
+    }
+    LOGD("Sending %d SYNs nothing came back for again", silent);
+    for (size_t i = 0; i < run->probes.size(); i++)
+        if (waiting(run, i))
+            sendProbe(run, &run->probes[i]);
+    eventLoopTimer(&run->loop, &run->timer, LOCATE_WAIT_MS);
+}
+
+static void locateEvents(struct locate_run *run, int fd, uint32_t events)
+{
+    if (fd == run->icmp)
+        receiveIcmp(run);
+    else
+        receiveTcp(run);
+    // Done early once every hop short of the reflector has answered
+    if (run->result->path_length == 0)
+        return;
+    for (size_t i = 0; i < run->probes.size(); i++)
+        if (waiting(run, i))
+            return;
+    eventLoopStop(&run->loop);
+}
+
+// First change and last intact quote of every field, in TTL order
+static void summarise(struct locate_result *result, const std::vector<struct locate_hop> &hops)
+{
+    for (size_t i = 0; i < hops.size(); i++) {
+        const struct locate_hop *hop = &hops[i];
+        if (hop->address == 0)
+            continue;
+        result->answered++;
+        result->changed |= hop->changed;
+        for (int f = 0; f < LOCATE_FIELDS; f++) {
+            uint8_t field = 1 << f;
+            if (!(hop->tested & field) || result->first_changed[f] != 0)
+                continue;
+            if (hop->changed & field) {
+                result->first_changed[f] = hop->ttl;
+                result->changed_at[f] = hop->address;
+            } else
+                result->last_intact[f] = hop->ttl;
+        }
+    }
+}
+
+test_error runTest_locate(uint32_t source, uint32_t destination, uint16_t dst_port,
+            const struct test_entry *test, uint8_t reserved, uint8_t max_ttl,
+            struct locate_result *result, std::vector<struct locate_hop> &hops)
+{
+    memset(result, 0, sizeof(*result));
+    result->verdict = syn_error;
+    hops.clear();
+    if (max_ttl == 0 || max_ttl > LOCATE_MAX_TTL)
+        max_ttl = LOCATE_MAX_TTL;
+    uint64_t started_us = nowMicros();
+
+    struct locate_run run;
+    run.test = test->define(reserved);
+    run.hops = &hops;
+    run.result = result;
+    run.synack_checked = false;
+    run.tries = 0;
+    run.buffer.assign(BUFLEN, 0);
+    memset(&run.dst, 0, sizeof(run.dst));
+    run.dst.sin_family = AF_INET;
+    run.dst.sin_addr.s_addr = htonl(destination);
+    run.dst.sin_port = htons(dst_port);
+    if (!eventLoopInit(&run.loop))
+        return test_failed;
+    run.sock = leaseSocket();
+    if (run.sock == -1) {
+        LOGE("Socket setup failed: %s", strerror(errno));
+        eventLoopClose(&run.loop);
+        return test_failed;
+    }
+    run.icmp = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+    if (run.icmp == -1) {
+        LOGE("ICMP socket failed: %s", strerror(errno));
+        returnSocket(run.sock);
+        eventLoopClose(&run.loop);
+        return test_failed;
+    }
+    eventLoopAdd(&run.loop, run.sock, EPOLLIN, std::bind(locateEvents, &run, run.sock, std::placeholders::_1));
+    eventLoopAdd(&run.loop, run.icmp, EPOLLIN, std::bind(locateEvents, &run, run.icmp, std::placeholders::_1));
+    timerInit(&run.timer, std::bind(roundExpired, &run));
+
+    // Every TTL at once, each on its own source port
+    char *buffer = &run.buffer[0];
+    struct iphdr *ip = (struct iphdr*) buffer;
+    struct tcphdr *tcp = (struct tcphdr*) (buffer + IPHDRLEN);
+    for (uint8_t ttl = 1; ttl <= max_ttl; ttl++) {
+        struct locate_probe probe = {};
+        probe.ttl = ttl;
+        probe.src_port = allocatePort();
+        if (probe.src_port == 0) {
+            LOGE("No source port for TTL %u", ttl);
+            break;
+        }
+        struct sockaddr_in src;
+        memset(&src, 0, sizeof(src));
+        src.sin_family = AF_INET;
+        src.sin_addr.s_addr = htonl(source);
+        src.sin_port = htons(probe.src_port);
+        struct tcp_opt conn_state;
+        memset(&conn_state, 0, sizeof(conn_state));
+        memset(buffer, 0, BUFLEN);
+        buildTcpSyn(&src, &run.dst, ip, tcp);
+        run.test.fn_synExtras(ip, tcp, &conn_state);
+        ip->ttl = ttl;
+        probe.syn.assign(buffer, buffer + ntohs(ip->tot_len));
+        run.by_port[probe.src_port] = run.probes.size();
+        run.probes.push_back(probe);
+        struct locate_hop hop;
+        memset(&hop, 0, sizeof(hop));
+        hop.ttl = ttl;
+        hop.rtt_us = -1;
+        hops.push_back(hop);
+    }
+    for (size_t i = 0; i < run.probes.size(); i++)
+        sendProbe(&run, &run.probes[i]);
+    eventLoopTimer(&run.loop, &run.timer, LOCATE_WAIT_MS);
+    eventLoopRun(&run.loop);
+
+    eventLoopCancel(&run.loop, &run.timer);
+    eventLoopRemove(&run.loop, run.sock);
+    eventLoopRemove(&run.loop, run.icmp);
+    returnSocket(run.sock);
+    close(run.icmp);
+    eventLoopClose(&run.loop);
+    for (size_t i = 0; i < run.probes.size(); i++)
+        releasePort(run.probes[i].src_port);
+
+    summarise(result, hops);
+    result->elapsed_us = nowMicros() - started_us;
+    for (int f = 0; f < LOCATE_FIELDS; f++)
+        if (result->first_changed[f] != 0)
+            LOGI("Field 0x%02x rewritten between TTL %u and %u (%08x)", 1 << f, result->last_intact[f],
+                result->first_changed[f], result->changed_at[f]);
+    LOGI("Located %s to port %u: path of %u hops, %u answered, fields changed 0x%02x, SYNACK %d, %llu ms",
+        test->name, dst_port, result->path_length, result->answered, result->changed, result->verdict,
+        (unsigned long long) result->elapsed_us / 1000);
+    if (result->path_length == 0 || result->changed != 0 || result->verdict != success)
+        return test_failed;
+    return success;
+}
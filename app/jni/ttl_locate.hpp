@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2014 Andrius Aucinas <andrius.aucinas@cl.cam.ac.uk>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <vector>
+
+#include "testsuite.hpp"
+
+#ifndef TTL_LOCATE
+#define TTL_LOCATE
+
+// Which hop rewrites a SYN: the SYN of a test is sent once for every TTL
+// from 1 to max_ttl, all at once, each on its own source port. The router
+// where a copy expires quotes it in its ICMP time exceeded (RFC 792 only
+// asks for 8 bytes of TCP, RFC 1812 routers quote up to 576 bytes in all),
+// which is compared with what was sent field by field. A field changed in
+// the quote of hop n but not of hop m < n was rewritten between the two.
+// Copies that reach the reflector are answered with a SYNACK (reset right
+// away), the smallest such TTL is the length of the path. TTLs nothing
+// came back for are sent once more after LOCATE_WAIT_MS.
+
+#define LOCATE_MAX_TTL 30
+#define LOCATE_WAIT_MS 2000
+#define LOCATE_TRIES 2
+
+// Fields of the quoted TCP header, bits of tested and changed
+#define LOCATE_SEQ 0x01
+#define LOCATE_ACK 0x02         // the ACK field, set without the ACK flag
+#define LOCATE_RESERVED 0x04
+#define LOCATE_FLAGS 0x08
+#define LOCATE_WINDOW 0x10
+#define LOCATE_URG 0x20         // the URG pointer
+#define LOCATE_OPTIONS 0x40     // header length, options and their order
+#define LOCATE_FIELDS 7
+
+// One TTL
+struct locate_hop {
+    uint8_t ttl;
+    uint32_t address;           // of the router answering, host order, 0 - none
+    uint8_t icmp_type, icmp_code;
+    uint16_t quoted;            // bytes of TCP header quoted
+    uint8_t tested;             // fields the quote covers
+    uint8_t changed;            // fields different from the SYN sent
+    bool reflector;             // reached the reflector (SYNACK or RST)
+    int64_t rtt_us;
+};
+
+struct locate_result {
+    test_error verdict;         // of the test's SYNACK checks on the full path
+    uint8_t path_length;        // TTL the reflector was reached with, 0 - never
+    uint8_t answered;           // hops that sent a quote
+    uint8_t changed;            // fields changed anywhere on the path
+    // By field: TTL of the first quote showing it changed, 0 - none, and
+    // of the last quote before it showing it intact, 0 - none; the rewrite
+    // is between the two. Address of the router at first_changed.
+    uint8_t first_changed[LOCATE_FIELDS];
+    uint8_t last_intact[LOCATE_FIELDS];
+    uint32_t changed_at[LOCATE_FIELDS];
+    uint64_t elapsed_us;
+};
+
+// param test       test whose SYN is sent, from findTest
+// param reserved   reserved bits for the test definition
+// param hops       every TTL sent, in TTL order
+// return   success if the reflector was reached, no quote showed a field
+//          changed and the SYNACK passed the test's checks
+test_error runTest_locate(uint32_t source, uint32_t destination, uint16_t dst_port,
+            const struct test_entry *test, uint8_t reserved, uint8_t max_ttl,
+            struct locate_result *result, std::vector<struct locate_hop> &hops);
+
+#endif
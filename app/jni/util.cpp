@@ -25,13 +25,15 @@ void printPacketInfo(struct iphdr *ip, struct tcphdr *tcp) {
 
 void printBufferHex(char *buffer, int length) {
     int i;
-    char *buf_str = (char*) malloc(2 * length + 1);
+    // "XX " per byte
+    char *buf_str = (char*) malloc(3 * length + 1);
     char *buf_ptr = buf_str;
+    *buf_ptr = '\0';
     for (i = 0; i < length; i++) {
-        buf_ptr += sprintf(buf_ptr, "%02X ", buffer[i]);
+        buf_ptr += sprintf(buf_ptr, "%02X ", (uint8_t) buffer[i]);
     }
-    *(buf_ptr+1) = '\0';
     LOGD("%s", buf_str);
+    free(buf_str);
 }
 
 uint16_t comp_chksum(uint16_t *addr, int len) {
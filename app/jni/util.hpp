@@ -31,8 +31,12 @@
 #define TAG "TCPTester-bin"
 #endif
 
-// #define LOGD(...)
+// Debug logging compiled out for measurements (see packet_bench.cpp)
+#ifdef TCPTESTER_NO_DEBUG_LOG
+#define LOGD(...) ((void) 0)
+#else
 #define LOGD(...) __android_log_print(ANDROID_LOG_DEBUG, TAG, __VA_ARGS__)
+#endif
 // #define LOGE(...)
 #define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
 #define LOGI(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
@@ -62,7 +66,8 @@ enum test_error {
     protocol_error,
     test_failed,
     test_complete,
-    test_not_implemented
+    test_not_implemented,
+    test_inferred               // not run, the outcome follows from earlier tests
 };
 
 void printPacketInfo(struct iphdr *ip, struct tcphdr *tcp);
@@ -37,6 +37,8 @@ import java.io.IOException;
 import java.net.InetAddress;
 import java.net.UnknownHostException;
 import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.HashSet;
 import java.util.concurrent.TimeoutException;
 import java.util.Random;
 
@@ -132,6 +134,20 @@ public class RawSocketTester implements Runnable
         int testNo = 0;
         boolean iptablesAdded = preventRst(mServerAddress);
 
+        // The SYN markers of all tests at once, one fused SYN per port
+        HashMap<Integer, int[]> fused = new HashMap<Integer, int[]>();
+        if (iptablesAdded) {
+            for (int port : mServerPorts) {
+                int[] markers = mTesterServer.runFusedSyn(mLocalAddress, mServerAddress, port, 0, 0);
+                if (markers == null)
+                    continue;
+                fused.put(port, markers);
+                mResults.add(new TCPTest("Fused-SYN", TCPTest.FUSED_SYN, mServerAddress, port, mLocalAddress, 0,
+                    markers[0] == 0, String.format("intact=0x%02x changed=0x%02x blocked=0x%02x down_changed=0x%02x"
+                    + " connections=%d", markers[1], markers[2], markers[3], markers[6], markers[7])));
+            }
+        }
+
         for (TCPTest test : tests) {
             // Exit immediately if iptables command has not been successful
             if (!iptablesAdded)
@@ -140,15 +156,88 @@ public class RawSocketTester implements Runnable
             sendResponseMessage(TestEngine.TEST_COMPLETED);
             Log.d(TAG, "Running test " + test.name);
 
+            // Decided by the fused SYN of the port already
+            Boolean covered = fusedResult(fused.get(test.dstPort), test);
+            if (covered != null) {
+                mResults.add(new TCPTest(test, covered, "fused=true"));
+                continue;
+            }
+
             try {
                 // Try runnig the test regardless
                 boolean res = mTesterServer.runTest(test.opcode, test.src, test.srcPort, 
                     test.dst, test.dstPort, test.inputExtras);
-                mResults.add(new TCPTest(test, res));
+                // Not run: implied by an earlier test on the port
+                if (mTesterServer.lastResultInferred())
+                    mResults.add(new TCPTest(test, res, "inferred=true"));
+                else
+                    mResults.add(new TCPTest(test, res));
             } catch (Exception e) {
                 Log.d(TAG, "Exception caught when running test: ", e);
             }
         } 
+
+        // Where on the path the SYN of a failed test is rewritten, once per
+        // test; only tests whose SYN carries something to rewrite
+        if (iptablesAdded) {
+            HashSet<Integer> located = new HashSet<Integer>();
+            for (TCPTest test : new ArrayList<TCPTest>(mResults)) {
+                if (test.result || test.opcode < TCPTest.ACK_ONLY || test.opcode > TCPTest.ACK_DATA
+                        || test.opcode == TCPTest.PLAIN_URG || test.opcode == TCPTest.RESERVED_EST
+                        || !located.add((int) test.opcode))
+                    continue;
+                TCPTest location = mTesterServer.runLocateHops(mLocalAddress, mServerAddress, test.dstPort,
+                    test.opcode, test.inputExtras, 0);
+                if (location != null)
+                    mResults.add(location);
+            }
+        }
+
+        // Every header field the path rewrites, from one connection
+        if (iptablesAdded) {
+            TCPTest echo = mTesterServer.runHeaderEcho(mLocalAddress, 0, mServerAddress, mServerPorts[0], 0);
+            if (echo != null)
+                mResults.add(echo);
+        }
+
+        // Every reserved bit in both directions and phases, in one request
+        if (iptablesAdded) {
+            int[] bitmap = mTesterServer.runReservedBitmap(mLocalAddress, 0, mServerAddress,
+                mServerPorts[0], new byte[0]);
+            mResults.add(new TCPTest("Reserved-bitmap", TCPTest.RESERVED_BITMAP, mServerAddress, mServerPorts[0],
+                mLocalAddress, 0, bitmap != null && bitmap[0] == bitmap[1], bitmap != null ?
+                String.format("survived=0x%04x tested=0x%04x", bitmap[0], bitmap[1]) : null));
+        }
+
+        // Connection table of a proxy or NAT on the path
+        if (iptablesAdded) {
+            int[] handshakes = mTesterServer.runHandshakes(mLocalAddress, 0, mServerAddress,
+                mServerPorts[0], 256, 32, 1);
+            mResults.add(new TCPTest("Proxy-handshakes", TCPTest.PROXY_HANDSHAKES, mServerAddress, mServerPorts[0],
+                mLocalAddress, 0, handshakes != null && handshakes[5] == 0, handshakes != null ?
+                String.format("established=%d capacity=%d delayed_from=%d rate=%d/s", handshakes[0],
+                    handshakes[5], handshakes[6], handshakes[7]) : null));
+        }
+
+        // Throughput of 1 MB each way on every port, shaped ports show up as slow;
+        // then MSS clamping and path MTU of every port at once
+        if (iptablesAdded && mServerPorts.length > 0) {
+            int[] extraPorts = new int[mServerPorts.length - 1];
+            for (int i = 0; i < extraPorts.length; i++)
+                extraPorts[i] = mServerPorts[i + 1];
+            mResults.addAll(mTesterServer.runBulkTransfer(mLocalAddress, mServerAddress, mServerPorts[0],
+                extraPorts, true, true, 1024));
+            mResults.addAll(mTesterServer.runPathMtu(mLocalAddress, mServerAddress, mServerPorts[0],
+                extraPorts));
+        }
+
+        // Learnt by the tester during the tests, no extra connection needed
+        if (iptablesAdded && !tests.isEmpty()) {
+            InetAddress global = mTesterServer.getGlobalAddress(mLocalAddress, 0,
+                mServerAddress, mServerPorts[0]);
+            mResults.add(new TCPTest("Global-IP", TCPTest.GET_GLOBAL_IP, mServerAddress, mServerPorts[0],
+                mLocalAddress, 0, global != null, global != null ? global.getHostAddress() : null));
+        }
        
         boolean iptablesFailed = false;
         if (iptablesAdded) {
@@ -187,6 +276,36 @@ public class RawSocketTester implements Runnable
         }
     }
 
+    // Result of a test that only checks markers its SYN and the SYNACK
+    // carry, from the fused SYN of its port; null if it has to be run
+    private static Boolean fusedResult(int[] fused, TCPTest test) {
+        if (fused == null)
+            return null;
+        int intact = fused[1], known = fused[1] | fused[2] | fused[3];
+        int downTested = fused[5], downChanged = fused[6];
+        switch (test.opcode) {
+            case TCPTest.ACK_ONLY:
+                return (known & TCPTest.FUSED_ACK) != 0 ? (intact & TCPTest.FUSED_ACK) != 0 : null;
+            case TCPTest.URG_ONLY:
+                return (known & TCPTest.FUSED_URG) != 0 ? (intact & TCPTest.FUSED_URG) != 0 : null;
+            case TCPTest.PLAIN_URG:
+                return (downTested & TCPTest.FUSED_URG) != 0 ? (downChanged & TCPTest.FUSED_URG) == 0 : null;
+            case TCPTest.ACK_URG:
+                if ((known & TCPTest.FUSED_ACK) != 0 && (intact & TCPTest.FUSED_ACK) == 0)
+                    return false;
+                if ((intact & TCPTest.FUSED_ACK) == 0 || (downTested & TCPTest.FUSED_URG) == 0)
+                    return null;
+                return (downChanged & TCPTest.FUSED_URG) == 0;
+            case TCPTest.RESERVED_SYN:
+                // All four bits were sent: only a pass says something about some of them
+                if ((downTested & TCPTest.FUSED_RESERVED) != 0 && (downChanged & TCPTest.FUSED_RESERVED) == 0)
+                    return true;
+                return null;
+            default:
+                return null;
+        }
+    }
+
     private ArrayList<TCPTest> buildTests(InetAddress serverAddress, Integer[] serverPorts) {
         ArrayList<TCPTest> basicTests = new ArrayList<TCPTest>();
         // basicTests.add(new TCPTest("ACK-only", TCPTest.ACK_ONLY));
@@ -26,7 +26,10 @@ import java.util.concurrent.locks.Condition;
 import java.util.concurrent.locks.Lock;
 import java.io.IOException;
 import java.net.InetAddress;
+import java.net.UnknownHostException;
 import java.nio.ByteBuffer;
+import java.util.ArrayList;
+import java.util.List;
 
 public class SocketTesterServer extends Thread {
     public static final String TAG = "TCPTester";
@@ -44,6 +47,7 @@ public class SocketTesterServer extends Thread {
     private DataInputStream socketReader;
     private DataOutputStream socketWriter;
     private boolean clientConnected = false;
+    private boolean lastResultInferred = false;
 
     final Lock lock = new ReentrantLock();
     final Condition connected  = lock.newCondition(); 
@@ -151,6 +155,7 @@ public class SocketTesterServer extends Thread {
         this.send(command.array());    
         // Wait for response
         byte[] response = this.receiveCommand();
+        lastResultInferred = response[1] == TCPTest.RESULT_INFERRED;
         // Magic opcode from IPC "protocol"
         if (response[1] == 0) { 
             Log.d(TAG, "Test successful");
@@ -161,6 +166,570 @@ public class SocketTesterServer extends Thread {
         }
     }
 
+    // Whether the last runTest failed without being run, see RESULT_INFERRED
+    public boolean lastResultInferred() {
+        return lastResultInferred;
+    }
+
+    // Global address as seen by the reflector, null if unknown. The tester
+    // usually knows it from the handshake of an earlier test already and
+    // answers straight away; srcPort 0 lets it pick a port otherwise.
+    public InetAddress getGlobalAddress(InetAddress src, int srcPort, InetAddress dst, int dstPort) {
+        byte commandLength = 1+1+4+2+4+2;
+        ByteBuffer command = ByteBuffer.allocate(commandLength);
+        command.put(commandLength);
+        command.put((byte) TCPTest.GET_GLOBAL_IP);
+        command.put(src.getAddress());
+        command.putShort((short) srcPort);
+        command.put(dst.getAddress());
+        command.putShort((short) dstPort);
+        if (!this.send(command.array()))
+            return null;
+        byte[] response = this.receiveCommand();
+        if (response == null || response[0] < 6 || response[1] != TCPTest.RET_GLOBAL_IP)
+            return null;
+        byte[] address = new byte[4];
+        System.arraycopy(response, 2, address, 0, 4);
+        if (address[0] == 0 && address[1] == 0 && address[2] == 0 && address[3] == 0)
+            return null;
+        try {
+            return InetAddress.getByAddress(address);
+        } catch (UnknownHostException e) {
+            return null;
+        }
+    }
+
+    // All reserved bits in one request, probed in parallel by the tester,
+    // with the given extra combinations. Returns {survived, tested}, one
+    // nibble per direction and phase (SYN up, SYN down, established up,
+    // established down, from the low nibble), null on failure.
+    public int[] runReservedBitmap(InetAddress src, int srcPort, InetAddress dst, int dstPort,
+            byte[] combinations) {
+        byte commandLength = (byte) (1+1+4+2+4+2 + combinations.length);
+        ByteBuffer command = ByteBuffer.allocate(commandLength);
+        command.put(commandLength);
+        command.put((byte) TCPTest.RESERVED_BITMAP);
+        command.put(src.getAddress());
+        command.putShort((short) srcPort);
+        command.put(dst.getAddress());
+        command.putShort((short) dstPort);
+        command.put(combinations);
+        if (!this.send(command.array()))
+            return null;
+        byte[] response = this.receiveCommand();
+        if (response == null || response[0] < 6 || response[1] != TCPTest.RET_RESERVED_BITMAP)
+            return null;
+        ByteBuffer values = ByteBuffer.wrap(response, 2, 4);
+        return new int[] {values.getShort() & 0xFFFF, values.getShort() & 0xFFFF};
+    }
+
+    // The markers of several tests (TCPTest.FUSED_* bits, 0 for all) on
+    // one SYN, split up only where a SYN is not answered. Returns {result
+    // (0 passed), intact, changed, blocked, blocked without a SYN of their
+    // own, tested and changed on the SYNACK, connections}, null on failure.
+    public int[] runFusedSyn(InetAddress src, InetAddress dst, int dstPort, int markers, int reserved) {
+        byte commandLength = (byte) (1+1+4+2+4+2 + 1+1);
+        ByteBuffer command = ByteBuffer.allocate(commandLength);
+        command.put(commandLength);
+        command.put((byte) TCPTest.FUSED_SYN);
+        command.put(src.getAddress());
+        command.putShort((short) 0);
+        command.put(dst.getAddress());
+        command.putShort((short) dstPort);
+        command.put((byte) markers);
+        command.put((byte) reserved);
+        if (!this.send(command.array()))
+            return null;
+        lock.lock();
+        try {
+            while (true) {
+                int length = socketReader.readUnsignedByte();
+                byte[] message = new byte[length];
+                message[0] = (byte) length;
+                socketReader.readFully(message, 1, length - 1);
+                // Every SYN sent, only logged
+                if (message[1] == TCPTest.RET_FUSED_PROBE && length >= 5) {
+                    Log.d(TAG, String.format("Fused SYN 0x%02x: %s", message[2], message[4] != 0 ? "echoed" : "lost"));
+                    continue;
+                }
+                if (message[1] != TCPTest.RET_FUSED || length < 15)
+                    return null;
+                int[] values = new int[8];
+                values[0] = message[2] & 0xFF;
+                for (int v = 1; v < values.length; v++)
+                    values[v] = message[3 + v] & 0xFF;
+                return values;
+            }
+        } catch (IOException e) {
+            Log.e(TAG, "Exception when reading fused SYN results", e);
+        } finally {
+            lock.unlock();
+        }
+        return null;
+    }
+
+    // Up to the given number of concurrent handshakes, inFlight at a time,
+    // held for holdSeconds once all have been tried. Returns {established,
+    // held at once, refused, timed out, reset, capacity, delayed from,
+    // handshakes/s}, capacity 0 if no limit was found, null on failure.
+    public int[] runHandshakes(InetAddress src, int srcPort, InetAddress dst, int dstPort,
+            int connections, int inFlight, int holdSeconds) {
+        byte commandLength = (byte) (1+1+4+2+4+2 + 2+1+1);
+        ByteBuffer command = ByteBuffer.allocate(commandLength);
+        command.put(commandLength);
+        command.put((byte) TCPTest.PROXY_HANDSHAKES);
+        command.put(src.getAddress());
+        command.putShort((short) srcPort);
+        command.put(dst.getAddress());
+        command.putShort((short) dstPort);
+        command.putShort((short) connections);
+        command.put((byte) inFlight);
+        command.put((byte) holdSeconds);
+        if (!this.send(command.array()))
+            return null;
+        byte[] response = this.receiveCommand();
+        if (response == null || response[0] < 18 || response[1] != TCPTest.RET_PROXY_HANDSHAKES)
+            return null;
+        ByteBuffer values = ByteBuffer.wrap(response, 2, 16);
+        int[] result = new int[8];
+        for (int i = 0; i < result.length; i++)
+            result[i] = values.getShort() & 0xFFFF;
+        return result;
+    }
+
+    // Bulk transfers of kbytes each, upload and/or download, to dstPort and
+    // every port in extraPorts, one after the other. One result per port
+    // and direction, with goodput, loss and whether it was slow compared
+    // with the other ports.
+    public List<TCPTest> runBulkTransfer(InetAddress src, InetAddress dst, int dstPort, int[] extraPorts,
+            boolean upload, boolean download, int kbytes) {
+        // Bulk command: the usual header (source port 0, the tester picks
+        // one per transfer), directions (0x01 upload, 0x02 download),
+        // 2 for the length in KB, 2 for every further destination port
+        List<TCPTest> results = new ArrayList<TCPTest>();
+        int commandLength = 1+1+4+2+4+2 + 1+2 + 2*extraPorts.length;
+        if (commandLength > Byte.MAX_VALUE) {
+            Log.e(TAG, "Too many ports for one bulk transfer");
+            return results;
+        }
+        ByteBuffer command = ByteBuffer.allocate(commandLength);
+        command.put((byte) commandLength);
+        command.put((byte) TCPTest.BULK_TRANSFER);
+        command.put(src.getAddress());
+        command.putShort((short) 0);
+        command.put(dst.getAddress());
+        command.putShort((short) dstPort);
+        command.put((byte) ((upload ? 0x01 : 0) | (download ? 0x02 : 0)));
+        command.putShort((short) kbytes);
+        for (int port : extraPorts)
+            command.putShort((short) port);
+        if (!this.send(command.array()))
+            return results;
+        lock.lock();
+        try {
+            while (true) {
+                int length = socketReader.readUnsignedByte();
+                byte[] message = new byte[length];
+                message[0] = (byte) length;
+                socketReader.readFully(message, 1, length - 1);
+                if (message[1] != TCPTest.RET_BULK_TRANSFER)
+                    break;
+                if (length < 39)
+                    continue;
+                ByteBuffer values = ByteBuffer.wrap(message, 2, 37);
+                int port = values.getShort() & 0xFFFF;
+                boolean isUpload = values.get() == 0;
+                boolean passed = values.get() == 0;
+                long goodput = values.getInt() & 0xFFFFFFFFL;
+                long bytes = values.getInt() & 0xFFFFFFFFL;
+                long segments = values.getInt() & 0xFFFFFFFFL;
+                long retransmits = values.getInt() & 0xFFFFFFFFL;
+                long outOfOrder = values.getInt() & 0xFFFFFFFFL;
+                int timeouts = values.getShort() & 0xFFFF;
+                long srtt = values.getInt() & 0xFFFFFFFFL;
+                int cwnd = values.getShort() & 0xFFFF;
+                long peerWindow = values.getInt() & 0xFFFFFFFFL;
+                byte flags = values.get();
+                String extras = String.format("goodput_kbps=%d bytes=%d segments=%d retransmits=%d"
+                    + " out_of_order=%d timeouts=%d srtt_us=%d max_cwnd=%d peer_window=%d wscale=%b slow=%b",
+                    goodput, bytes, segments, retransmits, outOfOrder, timeouts, srtt, cwnd, peerWindow,
+                    (flags & 0x01) != 0, (flags & 0x02) != 0);
+                results.add(new TCPTest((isUpload ? "bulk-upload-" : "bulk-download-") + port,
+                            TCPTest.BULK_TRANSFER, dst, port, src, 0, passed, extras));
+            }
+        } catch (IOException e) {
+            Log.e(TAG, "Exception when reading bulk transfer results", e);
+        } finally {
+            lock.unlock();
+        }
+        return results;
+    }
+
+    // MSS clamping and path MTU of dstPort and every port in extraPorts, all
+    // at once. One result per port with the clamp, the path MTU and the MSS
+    // seen for every MSS sent.
+    public List<TCPTest> runPathMtu(InetAddress src, InetAddress dst, int dstPort, int[] extraPorts) {
+        // Path MTU command: the usual header (source port 0, the tester
+        // picks them), 2 for every further destination port
+        List<TCPTest> results = new ArrayList<TCPTest>();
+        int commandLength = 1+1+4+2+4+2 + 2*extraPorts.length;
+        if (commandLength > Byte.MAX_VALUE) {
+            Log.e(TAG, "Too many ports for one path MTU probe");
+            return results;
+        }
+        ByteBuffer command = ByteBuffer.allocate(commandLength);
+        command.put((byte) commandLength);
+        command.put((byte) TCPTest.PMTU_PROBE);
+        command.put(src.getAddress());
+        command.putShort((short) 0);
+        command.put(dst.getAddress());
+        command.putShort((short) dstPort);
+        for (int port : extraPorts)
+            command.putShort((short) port);
+        if (!this.send(command.array()))
+            return results;
+        lock.lock();
+        try {
+            while (true) {
+                int length = socketReader.readUnsignedByte();
+                byte[] message = new byte[length];
+                message[0] = (byte) length;
+                socketReader.readFully(message, 1, length - 1);
+                if (message[1] != TCPTest.RET_PMTU)
+                    break;
+                if (length < 17)
+                    continue;
+                ByteBuffer values = ByteBuffer.wrap(message, 2, length - 2);
+                int port = values.getShort() & 0xFFFF;
+                boolean passed = values.get() == 0;
+                int clamp = values.getShort() & 0xFFFF;
+                int pathMtu = values.getShort() & 0xFFFF;
+                int localMtu = values.getShort() & 0xFFFF;
+                byte flags = values.get();
+                int rounds = values.get() & 0xFF;
+                long elapsed = values.getInt() & 0xFFFFFFFFL;
+                StringBuilder extras = new StringBuilder(String.format("clamp=%d path_mtu=%d local_mtu=%d"
+                    + " raised=%b blackhole=%b rounds=%d elapsed_us=%d", clamp, pathMtu, localMtu,
+                    (flags & 0x01) != 0, (flags & 0x02) != 0, rounds, elapsed));
+                while (values.remaining() >= 4) {
+                    int sent = values.getShort() & 0xFFFF;
+                    int seen = values.getShort() & 0xFFFF;
+                    extras.append(" mss_").append(sent).append('=').append(seen);
+                }
+                results.add(new TCPTest("pmtu-" + port, TCPTest.PMTU_PROBE, dst, port, src, 0, passed,
+                            extras.toString()));
+            }
+        } catch (IOException e) {
+            Log.e(TAG, "Exception when reading path MTU results", e);
+        } finally {
+            lock.unlock();
+        }
+        return results;
+    }
+
+    // Names of the fields in RET_LOCATE_HOP and RET_LOCATE, by bit
+    private static final String[] LOCATE_FIELDS = {"seq", "ack", "reserved", "flags", "window", "urg", "options"};
+
+    private static String locateFields(int fields) {
+        StringBuilder names = new StringBuilder();
+        for (int f = 0; f < LOCATE_FIELDS.length; f++)
+            if ((fields & (1 << f)) != 0)
+                names.append(names.length() > 0 ? "," : "").append(LOCATE_FIELDS[f]);
+        return names.length() > 0 ? names.toString() : "none";
+    }
+
+    // The SYN of test testOpcode sent with every TTL up to maxTtl (0 for
+    // the tester's default) at once, the quotes of the ICMP time exceeded
+    // errors compared with it. The result names the hops between which
+    // every changed field was rewritten and lists the routers answering;
+    // null on failure.
+    public TCPTest runLocateHops(InetAddress src, InetAddress dst, int dstPort, int testOpcode,
+            int reserved, int maxTtl) {
+        // Localization command: the usual header (source port 0, the tester
+        // picks one per TTL), test opcode, reserved bits, largest TTL
+        byte commandLength = (byte) (1+1+4+2+4+2 + 1+1+1);
+        ByteBuffer command = ByteBuffer.allocate(commandLength);
+        command.put(commandLength);
+        command.put((byte) TCPTest.LOCATE_HOPS);
+        command.put(src.getAddress());
+        command.putShort((short) 0);
+        command.put(dst.getAddress());
+        command.putShort((short) dstPort);
+        command.put((byte) testOpcode);
+        command.put((byte) reserved);
+        command.put((byte) maxTtl);
+        if (!this.send(command.array()))
+            return null;
+        StringBuilder hops = new StringBuilder();
+        lock.lock();
+        try {
+            while (true) {
+                int length = socketReader.readUnsignedByte();
+                byte[] message = new byte[length];
+                message[0] = (byte) length;
+                socketReader.readFully(message, 1, length - 1);
+                if (message[1] == TCPTest.RET_LOCATE_HOP && length >= 18) {
+                    ByteBuffer values = ByteBuffer.wrap(message, 2, 16);
+                    int ttl = values.get() & 0xFF;
+                    byte[] address = new byte[4];
+                    values.get(address);
+                    values.getShort();      // ICMP type and code
+                    values.getShort();      // TCP bytes quoted
+                    values.get();           // fields tested
+                    int changed = values.get() & 0xFF;
+                    boolean reflector = (values.get() & 0x01) != 0;
+                    if (reflector)
+                        hops.append(String.format(" %d=reflector", ttl));
+                    else if (address[0] != 0 || address[1] != 0 || address[2] != 0 || address[3] != 0)
+                        hops.append(String.format(" %d=%s:%s", ttl, InetAddress.getByAddress(address).getHostAddress(),
+                            locateFields(changed)));
+                    continue;
+                }
+                if (message[1] != TCPTest.RET_LOCATE || length < 10 + 6 * LOCATE_FIELDS.length)
+                    return null;
+                ByteBuffer values = ByteBuffer.wrap(message, 2, length - 2);
+                boolean passed = values.get() == 0;
+                int pathLength = values.get() & 0xFF;
+                int answered = values.get() & 0xFF;
+                int changed = values.get() & 0xFF;
+                long elapsed = values.getInt() & 0xFFFFFFFFL;
+                StringBuilder extras = new StringBuilder(String.format("path=%d answered=%d changed=%s elapsed_us=%d",
+                    pathLength, answered, locateFields(changed), elapsed));
+                for (int f = 0; f < LOCATE_FIELDS.length; f++) {
+                    int firstChanged = values.get() & 0xFF;
+                    int lastIntact = values.get() & 0xFF;
+                    byte[] router = new byte[4];
+                    values.get(router);
+                    if (firstChanged != 0)
+                        extras.append(String.format(" %s=%d-%d@%s", LOCATE_FIELDS[f], lastIntact, firstChanged,
+                            InetAddress.getByAddress(router).getHostAddress()));
+                }
+                extras.append(" hops=").append(hops.toString().trim().replace(' ', ';'));
+                return new TCPTest("locate-" + testOpcode, TCPTest.LOCATE_HOPS, dst, dstPort, src, 0, passed,
+                    extras.toString());
+            }
+        } catch (IOException e) {
+            Log.e(TAG, "Exception when reading localization results", e);
+        } finally {
+            lock.unlock();
+        }
+        return null;
+    }
+
+    private static final String[] HEADER_PACKETS = {"syn", "synack", "request"};
+    private static final String[] HEADER_FIELDS = {"tos", "ip_id", "fragment", "ip_options", "source",
+        "destination", "src_port", "dst_port", "seq", "ack", "reserved", "flags", "window", "checksum", "urg",
+        "option_removed", "option_added", "option_changed", "option_order"};
+
+    // One connection whose SYN, SYNACK and request the reflector echoes,
+    // compared with what was sent. The result lists every field changed
+    // as packet.field[option]=sent>seen (hex), and passes when only the
+    // addresses and ports were (NAT); null on failure.
+    public TCPTest runHeaderEcho(InetAddress src, int srcPort, InetAddress dst, int dstPort, int reserved) {
+        // Header echo command: the usual header, reserved bits
+        byte commandLength = (byte) (1+1+4+2+4+2 + 1);
+        ByteBuffer command = ByteBuffer.allocate(commandLength);
+        command.put(commandLength);
+        command.put((byte) TCPTest.HEADER_ECHO);
+        command.put(src.getAddress());
+        command.putShort((short) srcPort);
+        command.put(dst.getAddress());
+        command.putShort((short) dstPort);
+        command.put((byte) reserved);
+        if (!this.send(command.array()))
+            return null;
+        StringBuilder changes = new StringBuilder();
+        lock.lock();
+        try {
+            while (true) {
+                int length = socketReader.readUnsignedByte();
+                byte[] message = new byte[length];
+                message[0] = (byte) length;
+                socketReader.readFully(message, 1, length - 1);
+                if (message[1] == TCPTest.RET_HEADER_CHANGE && length >= 13) {
+                    ByteBuffer values = ByteBuffer.wrap(message, 2, 11);
+                    int packet = values.get() & 0xFF;
+                    int field = values.get() & 0xFF;
+                    int option = values.get() & 0xFF;
+                    long sent = values.getInt() & 0xFFFFFFFFL;
+                    long seen = values.getInt() & 0xFFFFFFFFL;
+                    changes.append(String.format(";%s.%s", packet < HEADER_PACKETS.length ? HEADER_PACKETS[packet] : "?",
+                        field < HEADER_FIELDS.length ? HEADER_FIELDS[field] : "?"));
+                    if (option != 0)
+                        changes.append(String.format("[%d]", option));
+                    changes.append(String.format("=%x>%x", sent, seen));
+                    continue;
+                }
+                if (message[1] != TCPTest.RET_HEADER_ECHO || length < 12)
+                    return null;
+                ByteBuffer values = ByteBuffer.wrap(message, 2, length - 2);
+                boolean passed = values.get() == 0;
+                int flags = values.get() & 0xFF;
+                int hopsUp = values.get();
+                int hopsDown = values.get();
+                values.getShort();      // changes, as listed
+                values.getInt();        // fields changed
+                String extras = String.format("synack=%b echoed=%b hops_up=%d hops_down=%d changes=%s",
+                    (flags & 0x01) != 0, (flags & 0x02) != 0, hopsUp, hopsDown,
+                    changes.length() > 0 ? changes.substring(1) : "none");
+                return new TCPTest("Header-echo", TCPTest.HEADER_ECHO, dst, dstPort, src, srcPort, passed, extras);
+            }
+        } catch (IOException e) {
+            Log.e(TAG, "Exception when reading header changes", e);
+        } finally {
+            lock.unlock();
+        }
+        return null;
+    }
+
+    public static class PortRange {
+        public int first;
+        public int last;
+
+        public PortRange(int first, int last) {
+            this.first = first;
+            this.last = last;
+        }
+    }
+
+    public List<TCPTest> runPortSweep(int[] opcodes, InetAddress src, int srcPortBase, InetAddress dst,
+            List<PortRange> ports, int maxConcurrent, byte reserved) {
+        // Sweep command:
+        // - 1 for length, 1 for opcode
+        // - 4 for source ip address, 2 for the first source port
+        // - 4 for destination ip address
+        // - 1 for concurrent probes, 1 for reserved bits
+        // - 8 for the bitmap of test opcodes
+        // - 4 for every port range (first and last port)
+        List<TCPTest> results = new ArrayList<TCPTest>();
+        int commandLength = 1+1+4+2+4+1+1+8+4*ports.size();
+        if (commandLength > Byte.MAX_VALUE) {
+            Log.e(TAG, "Too many port ranges for one sweep");
+            return results;
+        }
+        long testMask = 0;
+        for (int opcode : opcodes)
+            testMask |= 1L << opcode;
+        ByteBuffer command = ByteBuffer.allocate(commandLength);
+        command.put((byte) commandLength);
+        command.put((byte) TCPTest.PORT_SWEEP);
+        command.put(src.getAddress());
+        command.putShort((short) srcPortBase);
+        command.put(dst.getAddress());
+        command.put((byte) maxConcurrent);
+        command.put(reserved);
+        command.putLong(testMask);
+        for (PortRange range : ports) {
+            command.putShort((short) range.first);
+            command.putShort((short) range.last);
+        }
+        if (!this.send(command.array()))
+            return results;
+        List<InetAddress> dsts = new ArrayList<InetAddress>();
+        dsts.add(dst);
+        readSweepResults(results, src, srcPortBase, dsts);
+        return results;
+    }
+
+    public List<TCPTest> runPathSweep(int[] opcodes, InetAddress src, int srcPortBase, List<InetAddress> dsts,
+            List<PortRange> ports, int maxConcurrent, byte reserved) {
+        // Sweep of several destinations at once, verdicts compared per port:
+        // - 1 for length, 1 for opcode
+        // - 4 for source ip address, 2 for the first source port
+        // - 1 for concurrent probes per destination, 1 for reserved bits
+        // - 8 for the bitmap of test opcodes
+        // - 1 for the number of destinations, 4 for every destination
+        // - 4 for every port range (first and last port)
+        List<TCPTest> results = new ArrayList<TCPTest>();
+        int commandLength = 1+1+4+2+1+1+8+1+4*dsts.size()+4*ports.size();
+        if (commandLength > Byte.MAX_VALUE) {
+            Log.e(TAG, "Too many destinations and port ranges for one sweep");
+            return results;
+        }
+        long testMask = 0;
+        for (int opcode : opcodes)
+            testMask |= 1L << opcode;
+        ByteBuffer command = ByteBuffer.allocate(commandLength);
+        command.put((byte) commandLength);
+        command.put((byte) TCPTest.PATH_SWEEP);
+        command.put(src.getAddress());
+        command.putShort((short) srcPortBase);
+        command.put((byte) maxConcurrent);
+        command.put(reserved);
+        command.putLong(testMask);
+        command.put((byte) dsts.size());
+        for (InetAddress dst : dsts)
+            command.put(dst.getAddress());
+        for (PortRange range : ports) {
+            command.putShort((short) range.first);
+            command.putShort((short) range.last);
+        }
+        if (!this.send(command.array()))
+            return results;
+        readSweepResults(results, src, srcPortBase, dsts);
+        return results;
+    }
+
+    // Results are streamed back as the probes finish. Ports and tests on
+    // which the destinations disagree come back as "pathdiff" entries,
+    // with the verdict of every destination in the result extras.
+    private void readSweepResults(List<TCPTest> results, InetAddress src, int srcPortBase,
+            List<InetAddress> dsts) {
+        lock.lock();
+        try {
+            while (true) {
+                int length = socketReader.readUnsignedByte();
+                byte[] message = new byte[length];
+                message[0] = (byte) length;
+                socketReader.readFully(message, 1, length - 1);
+                if (message[1] == TCPTest.SWEEP_DONE)
+                    break;
+                if (message[1] == TCPTest.PATH_DIFF) {
+                    int dstPort = ((message[2] & 0xFF) << 8) | (message[3] & 0xFF);
+                    int opcode = message[4] & 0xFF;
+                    StringBuilder verdicts = new StringBuilder();
+                    for (int d = 0; d < length - 5 && d < dsts.size(); d++) {
+                        if (d > 0)
+                            verdicts.append(' ');
+                        verdicts.append(dsts.get(d).getHostAddress()).append('=')
+                            .append(message[5 + d] == 0 ? "pass" : "fail");
+                    }
+                    results.add(new TCPTest("pathdiff-" + opcode + "-" + dstPort, opcode,
+                                null, dstPort, src, srcPortBase, false, verdicts.toString()));
+                    continue;
+                }
+                if (message[1] != TCPTest.SWEEP_RESULT)
+                    continue;
+                int dstPort = ((message[2] & 0xFF) << 8) | (message[3] & 0xFF);
+                int opcode = message[4] & 0xFF;
+                String rtts = null;
+                if (length >= 14) {
+                    ByteBuffer values = ByteBuffer.wrap(message, 6, 8);
+                    rtts = "handshake_rtt_us=" + rttString(values.getInt())
+                        + " data_rtt_us=" + rttString(values.getInt());
+                }
+                // Verdict taken from the tester's result cache
+                if (length >= 16 && (message[15] & 0x01) != 0)
+                    rtts = (rtts == null ? "" : rtts + " ") + "cached=true";
+                if (message[5] == TCPTest.RESULT_INFERRED)
+                    rtts = (rtts == null ? "" : rtts + " ") + "inferred=true";
+                int destination = length >= 15 ? message[14] & 0xFF : 0;
+                InetAddress dst = destination < dsts.size() ? dsts.get(destination) : dsts.get(0);
+                results.add(new TCPTest("sweep-" + opcode + "-" + dstPort, opcode,
+                            dst, dstPort, src, srcPortBase, message[5] == 0, rtts));
+            }
+        } catch (IOException e) {
+            Log.e(TAG, "Exception when reading sweep results", e);
+        } finally {
+            lock.unlock();
+        }
+        Log.d(TAG, "Port sweep finished with " + results.size() + " results");
+    }
+
+    private static String rttString(int rtt) {
+        return rtt == -1 ? "unknown" : Long.toString(rtt & 0xFFFFFFFFL);
+    }
+
     private boolean send(byte[] msg) {
         boolean result = false;
         lock.lock();
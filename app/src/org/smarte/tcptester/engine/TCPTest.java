@@ -39,12 +39,49 @@ public class TCPTest implements Parcelable {
     public static final int RESERVED_SYN = 11;
     public static final int RESERVED_EST = 12;
     public static final int ACK_CHECKSUM_INCORRECT_SEQ = 13;
+    public static final int RESERVED_BITMAP = 16;
+    public static final int RET_RESERVED_BITMAP = 17;
+    public static final int HEADER_ECHO = 18;
+    public static final int RET_HEADER_CHANGE = 19;
+    public static final int RET_HEADER_ECHO = 20;
+    public static final int GET_GLOBAL_IP = 21;
+    public static final int RET_GLOBAL_IP = 22;
+    public static final int LOCATE_HOPS = 23;
+    public static final int RET_LOCATE_HOP = 24;
+    public static final int RET_LOCATE = 25;
+    public static final int FUSED_SYN = 26;
+    public static final int RET_FUSED_PROBE = 27;
+    public static final int RET_FUSED = 28;
+    // Markers of a fused SYN, a bitmap
+    public static final int FUSED_ACK = 0x01;
+    public static final int FUSED_URG = 0x02;
+    public static final int FUSED_RESERVED = 0x04;
+    public static final int FUSED_MSS = 0x08;
+    public static final int FUSED_SACK_PERMITTED = 0x10;
+    public static final int FUSED_TIMESTAMP = 0x20;
+    public static final int FUSED_WSCALE = 0x40;
+    // Result of a test the tester did not run, as an earlier one on the
+    // same port implies it fails
+    public static final int RESULT_INFERRED = 52;
 
     //RawSocketTester Proxy tests
 
     public static final int PROXY_DOUBLE_SYN = 41;
     public static final int PROXY_SACK_GAP = 42;
     public static final int PROXY_TIMESTAMPING = 43;
+    public static final int PROXY_HANDSHAKES = 44;
+    public static final int RET_PROXY_HANDSHAKES = 45;
+    public static final int BULK_TRANSFER = 46;
+    public static final int RET_BULK_TRANSFER = 47;
+    public static final int PMTU_PROBE = 48;
+    public static final int RET_PMTU = 49;
+
+    //Port sweep over the tests above
+    public static final int PORT_SWEEP = 61;
+    public static final int SWEEP_RESULT = 62;
+    public static final int SWEEP_DONE = 63;
+    public static final int PATH_SWEEP = 64;
+    public static final int PATH_DIFF = 65;
 
     //Netalyzr tests
     public static final int CHECK_LOCAL_ADDRESS = 31;
@@ -20,6 +20,22 @@ import Queue
 
 connectionInfo = {}
 connectionTest = {}
+connectionReserved = {}
+# Bulk transfers (app/jni/bulk_transfer.hpp): window scale offered on the SYN
+# and the transfer state of every connection that asked for one
+connectionWscale = {}
+connectionBulk = {}
+# Header echo (app/jni/header_diff.hpp): IP and TCP headers of the SYN as
+# received and of the SYNACK as sent, returned on GETHDR
+connectionHeaders = {}
+
+HEADER_ECHO_ACK = 0xbeef0010
+HEADER_ECHO_URG = 0xbe10
+
+BULK_WSCALE = 7
+BULK_MSS = 1460
+BULK_IW = 10
+SEQ_MASK = 0xFFFFFFFF
 
 def hexdump(x):
   x = str(x)
@@ -63,6 +79,89 @@ def longToStr(val):
 def shortToStr(val):
   return chr( (val>>(8*1)) & 0xFF ) + chr( (val>>(8*0)) & 0xFF )
 
+# Client address and port as seen by the server, echoed on every SYNACK in an
+# experimental option (RFC 6994, ExID 0x5450) so the client learns its
+# global address from any handshake
+def address_echo(addr, port):
+  return [(253, shortToStr(0x5450) + longToStr(ip2int(addr)) + shortToStr(port))]
+
+# IP and TCP headers of a packet, options included
+def headers(pkt):
+  raw = str(pkt[IP])
+  return raw[:pkt[IP].ihl * 4 + pkt[TCP].dataofs * 4]
+
+def seq_before(a, b):
+  return ((a - b) & SEQ_MASK) > 0x7FFFFFFF
+
+def bulk_segment(ip, sport, dport, bulk, seq):
+  length = min(BULK_MSS, (bulk['end'] - seq) & SEQ_MASK)
+  data = ''.join(chr((seq + i - bulk['base']) & 0xFF) for i in range(length))
+  return ip/TCP(sport=sport, dport=dport, flags="PA", seq=seq, ack=bulk['rcv_nxt'])/data
+
+# Download: new segments clocked by the ACKs, two per ACK within the client's
+# window, the first unacknowledged one again on every third duplicate ACK and
+# on partial ACKs after that
+def bulk_send(ip, sport, dport, bulk, ack, window):
+  paks = []
+  if seq_before(bulk['una'], ack) and not seq_before(bulk['nxt'], ack):
+    bulk['una'] = ack
+    bulk['dupacks'] = 0
+    if seq_before(ack, bulk['recover']):
+      paks.append(bulk_segment(ip, sport, dport, bulk, ack))
+  elif ack == bulk['una'] and bulk['una'] != bulk['nxt']:
+    bulk['dupacks'] += 1
+    if bulk['dupacks'] % 3 == 0:
+      bulk['recover'] = bulk['nxt']
+      paks.append(bulk_segment(ip, sport, dport, bulk, bulk['una']))
+    return paks
+  budget = BULK_IW if bulk['nxt'] == bulk['base'] else 2
+  while budget > 0 and seq_before(bulk['nxt'], bulk['end']):
+    length = min(BULK_MSS, (bulk['end'] - bulk['nxt']) & SEQ_MASK)
+    if ((bulk['nxt'] - bulk['una']) & SEQ_MASK) + length > window:
+      break
+    paks.append(bulk_segment(ip, sport, dport, bulk, bulk['nxt']))
+    bulk['nxt'] = (bulk['nxt'] + length) & SEQ_MASK
+    budget -= 1
+  return paks
+
+# "BULK", 'U' or 'D' and the length: data to the server is acknowledged
+# cumulatively, with what arrived past a hole kept as ranges; data from the
+# server is sent with bulk_send. Returns a list of packets.
+def process_bulk(pkt_in, ip, connID, sport, dport):
+  tcp = pkt_in[TCP]
+  load = pkt_in[Raw].load if Raw in pkt_in else ""
+  window = tcp.window << (connectionWscale.get(connID) or 0)
+  bulk = connectionBulk.get(connID)
+  if bulk is None:
+    rcv_nxt = (tcp.seq + len(load)) & SEQ_MASK
+    bulk = {'dir': load[4], 'rcv_nxt': rcv_nxt, 'rcv_base': rcv_nxt, 'ranges': {}}
+    if bulk['dir'] == 'D':
+      bulk['base'] = bulk['una'] = bulk['nxt'] = bulk['recover'] = tcp.ack
+      bulk['end'] = (tcp.ack + struct.unpack("!I", load[5:9])[0]) & SEQ_MASK
+      bulk['dupacks'] = 0
+    connectionBulk[connID] = bulk
+  elif bulk['dir'] == 'D' and load and bulk['una'] == bulk['base']:
+    # The request again, nothing of the data arrived
+    bulk['nxt'] = bulk['base']
+
+  if bulk['dir'] == 'D':
+    return bulk_send(ip, sport, dport, bulk, tcp.ack, window)
+  if not load:
+    return []
+  end = (tcp.seq + len(load)) & SEQ_MASK
+  if seq_before(bulk['rcv_nxt'], end):
+    start = bulk['rcv_nxt'] if seq_before(tcp.seq, bulk['rcv_nxt']) else tcp.seq
+    ranges = bulk['ranges']
+    offset = (start - bulk['rcv_base']) & SEQ_MASK
+    ranges[offset] = max(ranges.get(offset, 0), (end - bulk['rcv_base']) & SEQ_MASK)
+    received = (bulk['rcv_nxt'] - bulk['rcv_base']) & SEQ_MASK
+    for offset in sorted(ranges):
+      if offset > received:
+        break
+      received = max(received, ranges.pop(offset))
+    bulk['rcv_nxt'] = (bulk['rcv_base'] + received) & SEQ_MASK
+  return [ip/TCP(sport=sport, dport=dport, flags="A", seq=tcp.ack, ack=bulk['rcv_nxt'])]
+
 def process_packet(pkt_in):
   dst = pkt_in[IP].src
   src = pkt_in[IP].dst
@@ -72,6 +171,10 @@ def process_packet(pkt_in):
 
   connID = dst + str(dport)
   connStatus = connectionInfo.get(connID, TCPCState.CLOSED)
+  if (not pkt_in[TCP].flags & 0x07 and (connID in connectionBulk
+      or (Raw in pkt_in and len(pkt_in[Raw].load) >= 9 and pkt_in[Raw].load[:4] == "BULK"))):
+    # Not logged packet by packet
+    return process_bulk(pkt_in, ip, connID, sport, dport)
   logfile = open(dst+".log", "a")
   if (connStatus != TCPCState.CLOSED):
     logfile.write("<---- Packet received from " + dst + ":" + str(dport) + " to " + src + ":" + str(sport) + "\n")
@@ -81,24 +184,28 @@ def process_packet(pkt_in):
     if (connStatus != TCPCState.CLOSED):
     	logfile.write("\tConnection already exists!" + "\n")
     connectionInfo[connID] = TCPCState.SYN_RECEIVED
+    connectionReserved[connID] = pkt_in[TCP].reserved
+    connectionBulk.pop(connID, None)
+    wscale = [value for (kind, value) in pkt_in[TCP].options if kind == 'WScale']
+    connectionWscale[connID] = wscale[0] if wscale else None
     pak = None
 
     if (pkt_in[TCP].ack == 0xbeef0001):
       logfile.write("\n\n--- TESTCASE 0xbeef0001 ---" + "\n")
       connectionTest[connID] = 1
-      SYNACK=TCP(sport=sport, dport=dport, flags="SA", seq=12345, ack=pkt_in[TCP].seq+1)
+      SYNACK=TCP(sport=sport, dport=dport, flags="SA", options=address_echo(dst, dport), seq=12345, ack=pkt_in[TCP].seq+1)
       pak=ip/SYNACK
 
     elif (pkt_in[TCP].urgptr == 0xbe02):
       logfile.write("\n\n--- TESTCASE 0xbe02 ---" + "\n")
       connectionTest[connID] = 2
-      SYNACK=TCP(sport=sport, dport=dport, flags="SA", seq=12345, ack=pkt_in[TCP].seq+1)
+      SYNACK=TCP(sport=sport, dport=dport, flags="SA", options=address_echo(dst, dport), seq=12345, ack=pkt_in[TCP].seq+1)
       pak=ip/SYNACK
 
     elif (pkt_in[TCP].ack == 0xbeef0003):
       logfile.write("\n\n--- TESTCASE 0xbeef0003 ---" + "\n")
       connectionTest[connID] = 3
-      SYNACK=TCP(sport=sport, dport=dport, flags="SA", seq=12345, ack=pkt_in[TCP].seq+1, urgptr=0xbe03)
+      SYNACK=TCP(sport=sport, dport=dport, flags="SA", options=address_echo(dst, dport), seq=12345, ack=pkt_in[TCP].seq+1, urgptr=0xbe03)
       pak=ip/SYNACK
 
     elif (pkt_in[TCP].ack == 0xbeef0005 or pkt_in[TCP].urgptr == 0xbe09):
@@ -107,7 +214,7 @@ def process_packet(pkt_in):
       elif (pkt_in[TCP].urgptr == 0xbe09):
         logfile.write("\n\n--- TESTCASE 0xbe09 ---" + "\n")
       connectionTest[connID] = 9
-      SYNACK=TCP(sport=sport, dport=dport, flags="SA", seq=12345, ack=pkt_in[TCP].seq+1)
+      SYNACK=TCP(sport=sport, dport=dport, flags="SA", options=address_echo(dst, dport), seq=12345, ack=pkt_in[TCP].seq+1)
       pak=ip/SYNACK
       checksum = 0xbeef
       checksum = checksum_sub_32(checksum, ip2int(dst))
@@ -120,7 +227,7 @@ def process_packet(pkt_in):
     elif (pkt_in[TCP].ack == 0xbeef000D):
       logfile.write("\n\n--- TESTCASE 0xbeef000D ---" + "\n")
       connectionTest[connID] = 8
-      SYNACK=TCP(sport=sport, dport=dport, flags="SA", seq=12345, ack=pkt_in[TCP].seq+1)
+      SYNACK=TCP(sport=sport, dport=dport, flags="SA", options=address_echo(dst, dport), seq=12345, ack=pkt_in[TCP].seq+1)
       pak=ip/SYNACK
       # Different checksum to differentiate when which type of rewriting happens
       checksum = 0xbeee
@@ -140,7 +247,7 @@ def process_packet(pkt_in):
       elif (pkt_in[TCP].urgptr == 0xbe08):
         logfile.write("\n\n--- TESTCASE 0xbe05 ---" + "\n")
       connectionTest[connID] = 6
-      SYNACK=TCP(sport=sport, dport=dport, flags="SA", seq=12345, ack=pkt_in[TCP].seq+1)
+      SYNACK=TCP(sport=sport, dport=dport, flags="SA", options=address_echo(dst, dport), seq=12345, ack=pkt_in[TCP].seq+1)
       pak=ip/SYNACK
       checksum = 0xbeef
       checksum = checksum_sub_32(checksum, ip2int(dst))
@@ -157,27 +264,50 @@ def process_packet(pkt_in):
     elif (pkt_in[TCP].urgptr == 0xbe07):
       logfile.write("\n\n--- TESTCASE 0xbe07 ---" + "\n")
       connectionTest[connID] = 7
-      SYNACK=TCP(sport=sport, dport=dport, flags="SA", seq=12345, ack=pkt_in[TCP].seq+1, urgptr=0xbe07)
+      SYNACK=TCP(sport=sport, dport=dport, flags="SA", options=address_echo(dst, dport), seq=12345, ack=pkt_in[TCP].seq+1, urgptr=0xbe07)
       pak=ip/SYNACK
 
     elif (pkt_in[TCP].ack == 0xbeef000B):
       logfile.write("\n\n--- TESTCASE 0xbeef000B ---" + "\n")
       connectionTest[connID] = 11
-      SYNACK=TCP(sport=sport, dport=dport, flags="SA", seq=12345, ack=pkt_in[TCP].seq+1)
+      SYNACK=TCP(sport=sport, dport=dport, flags="SA", options=address_echo(dst, dport), seq=12345, ack=pkt_in[TCP].seq+1)
       pak=ip/SYNACK/"0B"
 
+    elif (pkt_in[TCP].ack == HEADER_ECHO_ACK or pkt_in[TCP].urgptr == HEADER_ECHO_URG):
+      logfile.write("\n\n--- TESTCASE HEADER ECHO ---" + "\n")
+      connectionTest[connID] = 16
+      options = address_echo(dst, dport)
+      if (connectionWscale[connID] is not None):
+        options += [('WScale', BULK_WSCALE)]
+      mss = [value for (kind, value) in pkt_in[TCP].options if kind == 'MSS']
+      if (mss):
+        options += [('MSS', mss[0])]
+      # Markers on the SYNACK too, the client compares it with GETHDR's copy
+      SYNACK=TCP(sport=sport, dport=dport, flags="SA", options=options, seq=12345, ack=pkt_in[TCP].seq+1, urgptr=HEADER_ECHO_URG, reserved=pkt_in[TCP].reserved)
+      pak=ip/SYNACK
+
     elif(pkt_in[TCP].reserved > 0):
       logfile.write("\n\n--- TESTCASE SYN RESERVED ---" + "\n")
       logfile.write("SYN packet with reserved " + str(pkt_in[TCP].reserved) + "\n")
-      SYNACK=TCP(sport=sport, dport=dport, flags="SA", seq=12345, ack=pkt_in[TCP].seq+1, reserved=pkt_in[TCP].reserved)
+      SYNACK=TCP(sport=sport, dport=dport, flags="SA", options=address_echo(dst, dport), seq=12345, ack=pkt_in[TCP].seq+1, reserved=pkt_in[TCP].reserved)
       pak=ip/SYNACK
 
     else:
       logfile.write("\n\n--- TESTCASE 0xbe04 ---" + "\n")
       logfile.write("Default SYNACK, for packet with ACK = " + hex(pkt_in[TCP].ack) + "\n")
-      SYNACK=TCP(sport=sport, dport=dport, flags="SA", seq=12345, ack=pkt_in[TCP].seq+1, urgptr=0xbe04)
+      options = address_echo(dst, dport)
+      if (connectionWscale[connID] is not None):
+        # Window scaling only if offered, for bulk transfers
+        options += [('WScale', BULK_WSCALE)]
+      mss = [value for (kind, value) in pkt_in[TCP].options if kind == 'MSS']
+      if (mss):
+        # As received, the client sees the MSS clamps of both directions
+        options += [('MSS', mss[0])]
+      SYNACK=TCP(sport=sport, dport=dport, flags="SA", options=options, seq=12345, ack=pkt_in[TCP].seq+1, urgptr=0xbe04)
       pak=ip/SYNACK
     
+    # Rebuilt from its bytes, so the copy has the checksums and lengths sent
+    connectionHeaders[connID] = (headers(pkt_in), headers(IP(str(pak))))
     logfile.write("\t(SYN packet)" + "\n")
     logfile.write("<---- Packet received from " + dst + ":" + str(dport) + " to " + src + ":" + str(sport) + "\n")
     logfile.write(hexdump(pkt_in))
@@ -185,6 +315,12 @@ def process_packet(pkt_in):
     logfile.write(hexdump(pak))
     return pak
 
+  elif (pkt_in[TCP].flags & 0x04):
+    logfile.write("Connection reset" + "\n")
+    connectionInfo.pop(connID, None)
+    connectionBulk.pop(connID, None)
+    return None
+
   elif (pkt_in[TCP].flags & 0x01):
     logfile.write("Closing, FIN" + "\n")
     logfile.write("----------------" + "\n")
@@ -216,12 +352,22 @@ def process_packet(pkt_in):
     ACK=TCP(sport=sport, dport=dport, flags="A", seq=pkt_in[TCP].ack, ack=pkt_in[TCP].seq+len(pkt_in[Raw].load), reserved=pkt_in[TCP].reserved)
     payload = ""
     currentTest = connectionTest.get(connID, 0)
-    if (currentTest == 1):
+    if (pkt_in[Raw].load == "GETHDR"):
+      # The SYN as received, the SYNACK as sent and this request as
+      # received, each behind its length
+      syn, synack = connectionHeaders.get(connID, ("", ""))
+      payload = "HDR" + "".join(chr(len(h)) + h for h in (syn, synack, headers(pkt_in)))
+    elif (currentTest == 1):
       payload = longToStr(0xbeef0001)
     elif (currentTest == 2):
       payload = shortToStr(0xbe02)
     elif (pkt_in[Raw].load == "GETMYIP"):
       payload = longToStr(ip2int(ip.dst))
+    elif (len(pkt_in[Raw].load) == 7 and pkt_in[Raw].load[:6] == "GETRES"):
+      # Reserved bits of the SYN and of this request as seen here; the reply
+      # carries the bits asked for, to test the downlink on its own
+      payload = "RES" + chr(connectionReserved.get(connID, 0)) + chr(pkt_in[TCP].reserved)
+      ACK.reserved = ord(pkt_in[Raw].load[6]) & 0xF
     else:
       payload = "OLLEH"
     pak=ip/ACK/payload
@@ -245,7 +391,11 @@ class PacketProcessor(threading.Thread):
       # print "Waiting for packet"
       packet = self.__queue.get()
       reply = process_packet(packet)
-      if reply is not None:
+      if isinstance(reply, list):
+        # Bulk transfers answer with any number of segments
+        for pak in reply:
+          self.__send_queue.put(pak)
+      elif reply is not None:
         self.__send_queue.put(reply)
 
 class PacketSender(threading.Thread):